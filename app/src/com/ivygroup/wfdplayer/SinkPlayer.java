@@ -1,18 +1,44 @@
 package com.ivygroup.wfdplayer;
 
+import android.os.Handler;
+import android.os.Looper;
 import android.view.Surface;
 import android.view.SurfaceHolder;
 
+import java.lang.ref.WeakReference;
+import java.nio.ByteBuffer;
+
 public class SinkPlayer {
     private SurfaceHolder mSurfaceHolder;
 
     private int mNativeSinkPlayer;  //accessed by native methods
     private int mNativeSurfaceTexture;  // accessed by native methods
 
+    private SinkStats mStats;
+    private OnStatsThresholdListener mOnStatsThresholdListener;
+    private Handler mEventHandler;
+
+    /**
+     * Called when a field of {@link SinkStats} crosses the threshold set by
+     * {@link #setStatsThreshold}, on the thread that created the player
+     * (or the main thread if it has no looper).
+     */
+    public interface OnStatsThresholdListener {
+        void onStatsThreshold(SinkPlayer player, int field, long value, boolean above);
+    }
+
     public SinkPlayer() {
+        Looper looper = Looper.myLooper();
+        if (looper == null) {
+            looper = Looper.getMainLooper();
+        }
+        mEventHandler = new Handler(looper);
     }
 
     public void release() {
+        // The stats live in memory owned by the native player.
+        mStats = null;
+        mOnStatsThresholdListener = null;
         _release();
     }
 
@@ -28,16 +54,64 @@ public class SinkPlayer {
         updateSurfaceScreenOn();
     }
 
+    /**
+     * Link quality, kept up to date by the native sink. Must not be used
+     * after {@link #release}.
+     */
+    public SinkStats getStats() {
+        if (mStats == null) {
+            mStats = new SinkStats(_getStatsBuffer());
+        }
+        return mStats;
+    }
+
+    /**
+     * Asks for {@link OnStatsThresholdListener#onStatsThreshold} to be
+     * called whenever "field" goes above or back below "threshold". A
+     * negative threshold stops notifications for the field.
+     */
+    public void setStatsThreshold(int field, long threshold) {
+        _setStatsThreshold(field, threshold);
+    }
+
+    public void setOnStatsThresholdListener(OnStatsThresholdListener listener) {
+        if (mOnStatsThresholdListener == null && listener != null) {
+            _enableStatsEvents(new WeakReference<SinkPlayer>(this));
+        }
+        mOnStatsThresholdListener = listener;
+    }
+
     private void updateSurfaceScreenOn() {
         if (mSurfaceHolder != null) {
             mSurfaceHolder.setKeepScreenOn(true);   // TODO;
         }
     }
 
+    @SuppressWarnings("unchecked")
+    private static void postStatsEventFromNative(
+            Object playerRef, final int field, final long value, final boolean above) {
+        final SinkPlayer player = ((WeakReference<SinkPlayer>) playerRef).get();
+        if (player == null) {
+            return;
+        }
+
+        player.mEventHandler.post(new Runnable() {
+            public void run() {
+                OnStatsThresholdListener listener = player.mOnStatsThresholdListener;
+                if (listener != null) {
+                    listener.onStatsThreshold(player, field, value, above);
+                }
+            }
+        });
+    }
+
     private native static void native_init();
     private native void _release();
     private native void _setVideoSurface(Surface surface);
     public native void native_startSink(String host, int port);
+    private native ByteBuffer _getStatsBuffer();
+    private native void _enableStatsEvents(Object weakThis);
+    private native void _setStatsThreshold(int field, long threshold);
 
     static {
         System.loadLibrary("wfd");
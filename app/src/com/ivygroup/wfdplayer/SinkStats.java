@@ -0,0 +1,95 @@
+package com.ivygroup.wfdplayer;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Link quality of a {@link SinkPlayer}, read straight from the memory the
+ * native sink updates, so polling it costs no JNI calls.
+ *
+ * The layout mirrors SinkStats.h: a 32-bit sequence number, a 32-bit
+ * version and one 64-bit value per field, in native byte order.
+ */
+public class SinkStats {
+    public static final int BITRATE_BPS = 0;
+    public static final int PACKETS_RECEIVED = 1;
+    public static final int PACKETS_LOST = 2;
+    /** RTCP fraction lost over the last receiver report interval, in 1/256. */
+    public static final int FRACTION_LOST = 3;
+    public static final int JITTER_US = 4;
+    /** Source time spanned by what's queued in the jitter buffer. */
+    public static final int LATENCY_US = 5;
+    public static final int QUEUED_BYTES = 6;
+    public static final int QUEUED_PACKETS = 7;
+    /** Video frames handed to the decoder per second, times 100. */
+    public static final int FRAME_RATE_X100 = 8;
+    public static final int NUM_FIELDS = 9;
+
+    private static final int VERSION = 1;
+    private static final int SEQUENCE_OFFSET = 0;
+    private static final int VERSION_OFFSET = 4;
+    private static final int VALUES_OFFSET = 8;
+
+    private final ByteBuffer mBuffer;
+
+    // Volatile accesses keep the reads of the values between the two reads
+    // of the sequence number.
+    private volatile int mFence;
+
+    SinkStats(ByteBuffer buffer) {
+        mBuffer = buffer.order(ByteOrder.nativeOrder());
+
+        if (mBuffer.getInt(VERSION_OFFSET) != VERSION) {
+            throw new IllegalStateException("unexpected stats layout");
+        }
+    }
+
+    /**
+     * Fills "values" (at least NUM_FIELDS long) with a consistent snapshot
+     * of all fields.
+     */
+    public void read(long[] values) {
+        for (;;) {
+            int seq = mBuffer.getInt(SEQUENCE_OFFSET);
+            int fence = mFence;
+
+            if ((seq & 1) != 0) {
+                // An update is in progress.
+                continue;
+            }
+
+            for (int i = 0; i < NUM_FIELDS; ++i) {
+                values[i] = mBuffer.getLong(VALUES_OFFSET + 8 * i);
+            }
+
+            mFence = fence;
+
+            if (mBuffer.getInt(SEQUENCE_OFFSET) == seq) {
+                return;
+            }
+        }
+    }
+
+    public long get(int field) {
+        if (field < 0 || field >= NUM_FIELDS) {
+            throw new IllegalArgumentException("no such field " + field);
+        }
+
+        for (;;) {
+            int seq = mBuffer.getInt(SEQUENCE_OFFSET);
+            int fence = mFence;
+
+            if ((seq & 1) != 0) {
+                continue;
+            }
+
+            long value = mBuffer.getLong(VALUES_OFFSET + 8 * field);
+
+            mFence = fence;
+
+            if (mBuffer.getInt(SEQUENCE_OFFSET) == seq) {
+                return value;
+            }
+        }
+    }
+}
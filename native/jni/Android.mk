@@ -16,6 +16,7 @@ LOCAL_C_INCLUDES:= \
 
 LOCAL_SHARED_LIBRARIES:= \
         libandroid_runtime \
+        libcutils                       \
         libwfd                          \
         libstagefright_foundation       \
         libutils                        \
@@ -4,25 +4,62 @@
 #include "SinkPlayer.h"
 
 #include "ANetworkSession.h"
-#include "WifiDisplaySink.h"
+#include "sink/SinkStats.h"
+#include "sink/WifiDisplaySink.h"
+#include <cutils/properties.h>
 #include <gui/ISurfaceTexture.h>
 #include <gui/Surface.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <utils/threads.h>
 
 namespace android {
 
-SinkPlayer::SinkPlayer() {
+// RTSP traffic is light, all players of the process share one network
+// session for it. Their media paths are spread by the SinkThreadPool.
+static Mutex gNetSessionLock;
+static sp<ANetworkSession> gNetSession;
+
+static sp<ANetworkSession> GetSharedNetSession() {
+    Mutex::Autolock autoLock(gNetSessionLock);
+
+    if (gNetSession == NULL) {
+        gNetSession = new ANetworkSession;
+        gNetSession->start();
+    }
+
+    return gNetSession;
+}
+
+SinkPlayer::SinkPlayer()
+    : mStats(new SinkStats) {
 }
 
 SinkPlayer::~SinkPlayer() {
+    mStats->setNotify(NULL);
+
+    if (mStatsLooper != NULL) {
+        mStatsLooper->unregisterHandler(mStatsHandler->id());
+        mStatsLooper->stop();
+    }
 }
 
 status_t SinkPlayer::start(const char *host, int32_t port) {
     mLooper = new ALooper;
-    mNetSession = new ANetworkSession;
-    mSink = new WifiDisplaySink(mNetSession, mSurfaceTexture);
+    mNetSession = GetSharedNetSession();
+
+    uint32_t sinkFlags = 0;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.direct-render", val, NULL)
+            && (!strcmp(val, "1") || !strcasecmp(val, "true"))) {
+        ALOGI("using direct rendering");
+        sinkFlags |= WifiDisplaySink::FLAG_DIRECT_RENDERING;
+    }
+
+    mSink = new WifiDisplaySink(mNetSession, mSurfaceTexture, sinkFlags);
+    mSink->setStats(mStats);
 
-	//磬ʼܵļmPipe
-    mNetSession->start();
     mLooper->setName("sink_player");
     mLooper->registerHandler(mSink);
 
@@ -42,6 +79,38 @@ status_t SinkPlayer::setSurfaceTexture(const sp<ISurfaceTexture> &surfaceTexture
     return OK;
 }
 
+sp<SinkStats> SinkPlayer::stats() const {
+    return mStats;
+}
+
+status_t SinkPlayer::setStatsHandler(const sp<AHandler> &handler) {
+    if (mStatsLooper == NULL) {
+        mStatsLooper = new ALooper;
+        mStatsLooper->setName("sink_stats_events");
+
+        status_t err = mStatsLooper->start(
+                false /* runOnCallingThread */,
+                true /* canCallJava */);
+
+        if (err != OK) {
+            mStatsLooper.clear();
+            return err;
+        }
+    }
+
+    if (mStatsHandler != NULL) {
+        mStatsLooper->unregisterHandler(mStatsHandler->id());
+    }
+
+    // Loopers only keep weak references to their handlers.
+    mStatsHandler = handler;
+    mStatsLooper->registerHandler(mStatsHandler);
+
+    mStats->setNotify(new AMessage(0, mStatsHandler->id()));
+
+    return OK;
+}
+
 status_t SinkPlayer::dispose() {
     /*mSink->stop();
 
@@ -8,11 +8,13 @@
 
 namespace android {
 
+struct AHandler;
 struct ALooper;
 struct ANetworkSession;
 struct IRemoteDisplayClient;
 struct WifiDisplaySink;
 struct ISurfaceTexture;
+struct SinkStats;
 
 class SinkPlayer : public RefBase  {
 public:
@@ -24,6 +26,13 @@ public:
     status_t start(const char *host, int32_t port);
     status_t dispose();
 
+    // Link quality, updated by the sink for as long as we're alive.
+    sp<SinkStats> stats() const;
+
+    // Threshold crossings of stats() are delivered to "handler" on a
+    // thread that's attached to the Java VM.
+    status_t setStatsHandler(const sp<AHandler> &handler);
+
 protected:
     virtual ~SinkPlayer();
 
@@ -37,6 +46,9 @@ private:
     sp<ANetworkSession> mNetSession;
     sp<WifiDisplaySink> mSink;
     sp<ISurfaceTexture> mSurfaceTexture;
+    sp<SinkStats> mStats;
+    sp<ALooper> mStatsLooper;
+    sp<AHandler> mStatsHandler;
 
     DISALLOW_EVIL_CONSTRUCTORS(SinkPlayer);
 };
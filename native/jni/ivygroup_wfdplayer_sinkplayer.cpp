@@ -23,11 +23,15 @@
 #include "utils/KeyedVector.h"
 #include "utils/String8.h"
 #include "foundation/AString.h"
+#include "foundation/AHandler.h"
+#include "foundation/AMessage.h"
+#include "foundation/ADebug.h"
 
 #include <gui/ISurfaceTexture.h>
 #include <gui/Surface.h>
 
 #include "SinkPlayer.h"
+#include "sink/SinkStats.h"
 
 
 using namespace android;
@@ -36,6 +40,7 @@ using namespace android;
 struct fields_t {
     jfieldID    native_sinkplayer;
     jfieldID    native_surfacetexture;
+    jmethodID   post_stats_event;
 };
 static fields_t fields;
 static Mutex sLock;
@@ -90,8 +95,65 @@ ivygroup_wfdplayer_sinkplayer_native_init(JNIEnv *env) {
     if (fields.native_surfacetexture == NULL) {
         return;
     }
+
+    fields.post_stats_event = env->GetStaticMethodID(
+            clazz, "postStatsEventFromNative", "(Ljava/lang/Object;IJZ)V");
+    if (fields.post_stats_event == NULL) {
+        return;
+    }
 }
 
+// Hands threshold crossings of the SinkStats on to the Java object, which
+// is only weakly referenced so it can still be garbage collected.
+struct JNISinkStatsListener : public AHandler {
+    JNISinkStatsListener(JNIEnv *env, jobject thiz, jobject weak_thiz) {
+        jclass clazz = env->GetObjectClass(thiz);
+        mClass = (jclass)env->NewGlobalRef(clazz);
+        mObject = env->NewGlobalRef(weak_thiz);
+    }
+
+protected:
+    virtual ~JNISinkStatsListener() {
+        // Released along with the SinkPlayer, i.e. from a Java thread.
+        JNIEnv *env = AndroidRuntime::getJNIEnv();
+        if (env != NULL) {
+            env->DeleteGlobalRef(mObject);
+            env->DeleteGlobalRef(mClass);
+        }
+    }
+
+    virtual void onMessageReceived(const sp<AMessage> &msg) {
+        int32_t what;
+        CHECK(msg->findInt32("what", &what));
+        CHECK_EQ(what, (int32_t)SinkStats::kWhatThresholdCrossed);
+
+        int32_t field;
+        CHECK(msg->findInt32("field", &field));
+
+        int64_t value;
+        CHECK(msg->findInt64("value", &value));
+
+        int32_t above;
+        CHECK(msg->findInt32("above", &above));
+
+        JNIEnv *env = AndroidRuntime::getJNIEnv();
+        env->CallStaticVoidMethod(
+                mClass, fields.post_stats_event, mObject,
+                field, (jlong)value, (jboolean)(above != 0));
+
+        if (env->ExceptionCheck()) {
+            ALOGW("An exception occurred while notifying a stats event.");
+            env->ExceptionClear();
+        }
+    }
+
+private:
+    jclass mClass;
+    jobject mObject;
+
+    DISALLOW_EVIL_CONSTRUCTORS(JNISinkStatsListener);
+};
+
 static void
 ivygroup_wfdplayer_sinkplayer_release(JNIEnv *env, jobject thiz) {
     setPlayer(env, thiz, 0);
@@ -186,12 +248,48 @@ ivygroup_wfdplayer_sinkplayer_startSink(JNIEnv* env, jobject thiz, jstring host,
     p->start(hostStr.c_str(), port);
 }
 
+static jobject
+ivygroup_wfdplayer_sinkplayer_getStatsBuffer(JNIEnv *env, jobject thiz) {
+    sp<SinkPlayer> p = getPlayer(env, thiz);
+    sp<SinkStats> stats = p->stats();
+
+    // The block belongs to the player, SinkPlayer.java drops the buffer
+    // when it's released.
+    return env->NewDirectByteBuffer(stats->data(), stats->size());
+}
+
+static void
+ivygroup_wfdplayer_sinkplayer_enableStatsEvents(
+        JNIEnv *env, jobject thiz, jobject weak_this) {
+    sp<SinkPlayer> p = getPlayer(env, thiz);
+
+    if (p->setStatsHandler(
+                new JNISinkStatsListener(env, thiz, weak_this)) != OK) {
+        jniThrowException(env, "java/lang/IllegalStateException", NULL);
+    }
+}
+
+static void
+ivygroup_wfdplayer_sinkplayer_setStatsThreshold(
+        JNIEnv *env, jobject thiz, jint field, jlong threshold) {
+    if (field < 0 || field >= SinkStats::kNumFields) {
+        jniThrowException(env, "java/lang/IllegalArgumentException", NULL);
+        return;
+    }
+
+    sp<SinkPlayer> p = getPlayer(env, thiz);
+    p->stats()->setThreshold((SinkStats::Field)field, threshold);
+}
+
 static JNINativeMethod nativeMethods[] = {
     // {"native_possibleEncoding", "([B)Ljava/lang/String;", (void*)possibleEncoding}
     {"native_init", "()V", (void *)ivygroup_wfdplayer_sinkplayer_native_init},
     {"_release", "()V", (void *)ivygroup_wfdplayer_sinkplayer_release},
     {"_setVideoSurface", "(Landroid/view/Surface;)V", (void *)android_media_MediaPlayer_setVideoSurface},
-    {"native_startSink", "(Ljava/lang/String;I)V", (void*)ivygroup_wfdplayer_sinkplayer_startSink}
+    {"native_startSink", "(Ljava/lang/String;I)V", (void*)ivygroup_wfdplayer_sinkplayer_startSink},
+    {"_getStatsBuffer", "()Ljava/nio/ByteBuffer;", (void *)ivygroup_wfdplayer_sinkplayer_getStatsBuffer},
+    {"_enableStatsEvents", "(Ljava/lang/Object;)V", (void *)ivygroup_wfdplayer_sinkplayer_enableStatsEvents},
+    {"_setStatsThreshold", "(IJ)V", (void *)ivygroup_wfdplayer_sinkplayer_setStatsThreshold}
 };
 
 
@@ -4,6 +4,8 @@
 #include <utils/Log.h>
 
 #include "ANetworkSession.h"
+#include "DatagramPool.h"
+#include "LatencyTrace.h"
 #include "ParsedMessage.h"
 
 #include <arpa/inet.h>
@@ -12,6 +14,15 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define USE_EPOLL       1
+
+#if USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
@@ -23,6 +34,78 @@ namespace android {
 
 static const size_t kMaxUDPSize = 1500;
 
+// Stream sockets are read in chunks of at least this size and written with
+// up to kMaxIOVecs pieces per writev().
+static const size_t kMinStreamReadSize = 16384;
+static const size_t kMaxIOVecs = 64;
+
+#if ENABLE_LATENCY_TRACE
+static void TraceArrival(const sp<ABuffer> &buf) {
+    const uint8_t *data = buf->data();
+
+    // Only RTP packets are traced, by sequence number. RTCP packet types
+    // 200..204 overlap with the RTP marker bit and payload type.
+    if (buf->size() < 12 || (data[0] >> 6) != 2
+            || (data[1] >= 200 && data[1] <= 204)) {
+        return;
+    }
+
+    int32_t cookie = U16_AT(&data[2]);
+
+    LatencyTrace::Mark(LatencyTrace::kStageArrival, cookie, -1ll);
+    LatencyTrace::Stamp(cookie, buf);
+}
+#endif
+
+// Maximum number of datagrams drained by a single recvmmsg() or
+// transmitted by a single sendmmsg() call.
+static const size_t kMaxDatagramsPerBatch = 16;
+
+#ifndef SO_TIMESTAMPNS
+#define SO_TIMESTAMPNS  35
+#endif
+
+#ifndef SCM_TIMESTAMPNS
+#define SCM_TIMESTAMPNS SO_TIMESTAMPNS
+#endif
+
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE  33
+#endif
+
+// Layout of the kernel's struct mmsghdr, bionic provides neither recvmmsg()
+// nor sendmmsg().
+struct MMsgHdr {
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+
+static int RecvMMsg(int s, MMsgHdr *msgs, unsigned count) {
+#ifdef __NR_recvmmsg
+    return syscall(__NR_recvmmsg, s, msgs, count, 0 /* flags */, NULL);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int SendMMsg(int s, MMsgHdr *msgs, unsigned count) {
+#ifdef __NR_sendmmsg
+    return syscall(__NR_sendmmsg, s, msgs, count, 0 /* flags */);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#if USE_EPOLL
+// Number of events fetched from the kernel per epoll_wait().
+static const int kMaxEpollEvents = 32;
+
+// Session IDs start at 1, the interrupt pipe is registered under 0.
+static const int32_t kPipeSessionID = 0;
+#endif
+
 struct ANetworkSession::NetworkThread : public Thread {
     NetworkThread(ANetworkSession *session);
 
@@ -32,6 +115,7 @@ protected:
 private:
     ANetworkSession *mSession;
 
+    virtual status_t readyToRun();
     virtual bool threadLoop();
 
     DISALLOW_EVIL_CONSTRUCTORS(NetworkThread);
@@ -61,10 +145,26 @@ struct ANetworkSession::Session : public RefBase {
     bool wantsToRead();
     bool wantsToWrite();
 
+#if USE_EPOLL
+    // Interest set derived from wantsToRead()/wantsToWrite(), the set
+    // currently registered with the kernel is tracked in mEventMask.
+    uint32_t desiredEventMask();
+    uint32_t eventMask() const;
+    void setEventMask(uint32_t mask);
+#endif
+
     status_t readMore();
     status_t writeMore();
 
+    status_t setBatchedReceive(bool enable);
+    status_t setReceivePool(const sp<DatagramPool> &pool);
+
     status_t sendRequest(const void *data, ssize_t size);
+    status_t sendDatagrams(
+            const sp<ABuffer> &datagrams, size_t datagramSize,
+            const sp<ABuffer> &headers, size_t headerSize);
+    status_t sendInterleaved(
+            int channel, const sp<ABuffer> &packets, size_t packetSize);
 
     void setIsRTSPConnection(bool yesno);
 
@@ -78,14 +178,58 @@ private:
     int mSocket;
     sp<AMessage> mNotify;
     bool mSawReceiveFailure, mSawSendFailure;
+    uint32_t mEventMask;
+
+    // for TCP / stream data, each entry holds either plain bytes or, if
+    // its int32Data is non-zero, RTP packets of that size back to back that
+    // are framed for RTSP interleaving on the fly ('$', channel, length).
+    List<sp<ABuffer> > mOutChunks;
 
-    // for TCP / stream data
-    AString mOutBuffer;
+    // Bytes of the (framed) first entry of mOutChunks already sent.
+    size_t mOutChunkOffset;
 
-    // for UDP / datagrams
+    // for UDP / datagrams, each entry holds one or more datagrams back to
+    // back, of the size given by its int32Data (0 for a single datagram).
+    // Entries with a "headers" buffer in their meta data get the first
+    // "headerSize" bytes of each datagram from there.
     List<sp<ABuffer> > mOutDatagrams;
 
-    AString mInBuffer;
+    bool mBatchedSend;
+    bool mBatchedReceive;
+    bool mKernelTimestamps;
+    sp<DatagramPool> mReceivePool;
+
+    // Receive buffers not consumed by the previous recvmmsg() call.
+    sp<ABuffer> mBatchBuffers[kMaxDatagramsPerBatch];
+
+    // Received stream data not parsed yet, covered by the buffer's range.
+    sp<ABuffer> mInBuffer;
+
+    // Bytes at the front of mInBuffer already searched for the end of the
+    // headers of the next RTSP message, not to be searched again.
+    size_t mInScanOffset;
+
+    // Once its headers are in, the size the next RTSP message has
+    // including its content, 0 if unknown. Nothing is parsed before
+    // mInBuffer holds that much.
+    size_t mInMessageLength;
+
+    sp<ABuffer> allocDatagram();
+    status_t readMoreBatched();
+
+    status_t writeMoreBatched();
+    status_t writeOneDatagram();
+    void consumeOutDatagrams(size_t count);
+
+    void reserveInBuffer(size_t size);
+    void consumeInBuffer(size_t size);
+
+    size_t fillOutIOVecs(struct iovec *iov, size_t maxCount) const;
+    void consumeOutChunks(size_t size);
+    static size_t FramedSize(const sp<ABuffer> &chunk);
+    void notifyDatagramBatch(
+            const sp<DatagramBatch> &batch,
+            const struct sockaddr_in &remoteAddr);
 
     void notifyError(bool send, status_t err, const char *detail);
     void notify(NotificationReason reason);
@@ -101,6 +245,13 @@ ANetworkSession::NetworkThread::NetworkThread(ANetworkSession *session)
 ANetworkSession::NetworkThread::~NetworkThread() {
 }
 
+status_t ANetworkSession::NetworkThread::readyToRun() {
+    // Not being able to raise our priority is no reason not to run at all.
+    mSession->mThreadConfig.applyToCurrentThread("ANetworkSession");
+
+    return OK;
+}
+
 bool ANetworkSession::NetworkThread::threadLoop() {
     mSession->threadLoop();
 
@@ -121,7 +272,14 @@ ANetworkSession::Session::Session(
       mSocket(s),
       mNotify(notify),
       mSawReceiveFailure(false),
-      mSawSendFailure(false) {
+      mSawSendFailure(false),
+      mEventMask(0),
+      mOutChunkOffset(0),
+      mBatchedSend(true),
+      mBatchedReceive(false),
+      mKernelTimestamps(false),
+      mInScanOffset(0),
+      mInMessageLength(0) {
     if (mState == CONNECTED) {
         struct sockaddr_in localAddr;
         socklen_t localAddrLen = sizeof(localAddr);
@@ -202,16 +360,44 @@ bool ANetworkSession::Session::wantsToRead() {
 bool ANetworkSession::Session::wantsToWrite() {
     return !mSawSendFailure
         && (mState == CONNECTING
-            || (mState == CONNECTED && !mOutBuffer.empty())
+            || (mState == CONNECTED && !mOutChunks.empty())
             || (mState == DATAGRAM && !mOutDatagrams.empty()));
 }
 
+#if USE_EPOLL
+uint32_t ANetworkSession::Session::desiredEventMask() {
+    uint32_t mask = EPOLLET;
+
+    if (wantsToRead()) {
+        mask |= EPOLLIN;
+    }
+
+    if (wantsToWrite()) {
+        mask |= EPOLLOUT;
+    }
+
+    return mask;
+}
+
+uint32_t ANetworkSession::Session::eventMask() const {
+    return mEventMask;
+}
+
+void ANetworkSession::Session::setEventMask(uint32_t mask) {
+    mEventMask = mask;
+}
+#endif
+
 //ȡӽ
 status_t ANetworkSession::Session::readMore() {
+    if (mState == DATAGRAM && mBatchedReceive) {
+        return readMoreBatched();
+    }
+
     if (mState == DATAGRAM) {
         status_t err;
         do {
-            sp<ABuffer> buf = new ABuffer(kMaxUDPSize); //kMaxUDPSize = 1500
+            sp<ABuffer> buf = allocDatagram();
 
             struct sockaddr_in remoteAddr;
             socklen_t remoteAddrLen = sizeof(remoteAddr);
@@ -234,6 +420,10 @@ status_t ANetworkSession::Session::readMore() {
                 int64_t nowUs = ALooper::GetNowUs();
                 buf->meta()->setInt64("arrivalTimeUs", nowUs);
 
+#if ENABLE_LATENCY_TRACE
+                TraceArrival(buf);
+#endif
+
                 sp<AMessage> notify = mNotify->dup();
                 notify->setInt32("sessionID", mSessionID);
                 notify->setInt32("reason", kWhatDatagram);
@@ -267,41 +457,61 @@ status_t ANetworkSession::Session::readMore() {
         return err;
     }
 
-    char tmp[512];
+    // Drain the socket, we may not be told about the remaining data again.
+    status_t err = OK;
     ssize_t n;
-    do {
-        n = recv(mSocket, tmp, sizeof(tmp), 0);
-    } while (n < 0 && errno == EINTR);
+    for (;;) {
+        reserveInBuffer(kMinStreamReadSize);
 
-    status_t err = OK;
+        uint8_t *dst = mInBuffer->data() + mInBuffer->size();
+        size_t room =
+            mInBuffer->capacity() - mInBuffer->offset() - mInBuffer->size();
 
-    if (n > 0) {
-        mInBuffer.append(tmp, n);
+        do {
+            n = recv(mSocket, dst, room, 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+            mInBuffer->setRange(mInBuffer->offset(), mInBuffer->size() + n);
 
 #if 0
-        ALOGI("in:");
-        hexdump(tmp, n);
+            ALOGI("in:");
+            hexdump(dst, n);
 #endif
-    } else if (n < 0) {
-        err = -errno;
-    } else {
-        err = -ECONNRESET;
+            continue;
+        }
+
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                err = -errno;
+            }
+        } else {
+            err = -ECONNRESET;
+        }
+        break;
     }
 
-    ALOGD("000   receive %ld %u:\n%s\n", n, mInBuffer.size(), mInBuffer.c_str());
+#if 0
+    ALOGD("000   receive %ld %u:\n%s\n",
+          n, mInBuffer->size(), (const char *)mInBuffer->data());
+#endif
+
+    // Frames are parsed in place, the buffer is only compacted when more
+    // room is needed.
 
     if (!mIsRTSPConnection) {
         // TCP stream carrying 16-bit length-prefixed datagrams.
 
-        while (mInBuffer.size() >= 2) {
-            size_t packetSize = U16_AT((const uint8_t *)mInBuffer.c_str());
+        while (mInBuffer->size() >= 2) {
+            const uint8_t *in = mInBuffer->data();
+            size_t packetSize = U16_AT(in);
 
-            if (mInBuffer.size() < packetSize + 2) {
+            if (mInBuffer->size() < packetSize + 2) {
                 break;
             }
 
             sp<ABuffer> packet = new ABuffer(packetSize);
-            memcpy(packet->data(), mInBuffer.c_str() + 2, packetSize);
+            memcpy(packet->data(), in + 2, packetSize);
 
             sp<AMessage> notify = mNotify->dup();
             notify->setInt32("sessionID", mSessionID);
@@ -309,31 +519,34 @@ status_t ANetworkSession::Session::readMore() {
             notify->setBuffer("data", packet);
             notify->post();
 
-            mInBuffer.erase(0, packetSize + 2);
+            consumeInBuffer(packetSize + 2);
         }
     } else {
         for (;;) {
             size_t length;
 
-            if (mInBuffer.size() > 0 && mInBuffer.c_str()[0] == '$') {
+            const uint8_t *in = mInBuffer->data();
+            size_t inSize = mInBuffer->size();
+
+            if (inSize > 0 && in[0] == '$') {
 				//յΪPlaybackSession::kWhatBinaryDataͷϢΪ'$'Żж 
-                if (mInBuffer.size() < 4) {
+                if (inSize < 4) {
                     break;
                 }
 
-                length = U16_AT((const uint8_t *)mInBuffer.c_str() + 2);
+                length = U16_AT(in + 2);
 
-                if (mInBuffer.size() < 4 + length) {
+                if (inSize < 4 + length) {
                     break;
                 }
 
                 sp<AMessage> notify = mNotify->dup();
                 notify->setInt32("sessionID", mSessionID);
                 notify->setInt32("reason", kWhatBinaryData);
-                notify->setInt32("channel", mInBuffer.c_str()[1]);
+                notify->setInt32("channel", in[1]);
 
                 sp<ABuffer> data = new ABuffer(length);
-                memcpy(data->data(), mInBuffer.c_str() + 4, length);
+                memcpy(data->data(), in + 4, length);
 
                 int64_t nowUs = ALooper::GetNowUs();
                 data->meta()->setInt64("arrivalTimeUs", nowUs);
@@ -341,15 +554,26 @@ status_t ANetworkSession::Session::readMore() {
                 notify->setBuffer("data", data);
                 notify->post();
 
-                mInBuffer.erase(0, 4 + length);
+                consumeInBuffer(4 + length);
                 continue;
             }
 
+            ssize_t headersLength =
+                ParsedMessage::FindEndOfHeaders(
+                        (const char *)in, inSize, &mInScanOffset);
+
+            if (headersLength < 0 || inSize < mInMessageLength) {
+                break;
+            }
+
             sp<ParsedMessage> msg =
                 ParsedMessage::Parse(
-                        mInBuffer.c_str(), mInBuffer.size(), err != OK, &length);//RTSPϢ  
+                        (const char *)in, inSize, err != OK, &length,
+                        headersLength);//RTSPϢ  
 
             if (msg == NULL) {
+                // The content is still incomplete.
+                mInMessageLength = length;
                 break;
             }
 
@@ -367,13 +591,14 @@ status_t ANetworkSession::Session::readMore() {
             if (content
                     && !memcmp(content, "wfd_idr_request\r\n", 17)
                     && length >= 19
-                    && mInBuffer.c_str()[length] == '\r'
-                    && mInBuffer.c_str()[length + 1] == '\n') {
+                    && inSize >= length + 2
+                    && in[length] == '\r'
+                    && in[length + 1] == '\n') {
                 length += 2;
             }
 #endif
 
-            mInBuffer.erase(0, length);
+            consumeInBuffer(length);
 
             if (err != OK) {
                 break;
@@ -389,52 +614,411 @@ status_t ANetworkSession::Session::readMore() {
     return err;
 }
 
-//ӵĶ˿д
-status_t ANetworkSession::Session::writeMore() {
-    if (mState == DATAGRAM) {
-        CHECK(!mOutDatagrams.empty());
+status_t ANetworkSession::Session::setBatchedReceive(bool enable) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
 
-        status_t err;
+    mBatchedReceive = enable;
+
+    if (enable && !mKernelTimestamps) {
+        const int yes = 1;
+        if (setsockopt(
+                    mSocket, SOL_SOCKET, SO_TIMESTAMPNS,
+                    &yes, sizeof(yes)) == 0) {
+            mKernelTimestamps = true;
+        } else {
+            ALOGW("SO_TIMESTAMPNS unavailable (%s), using receive time.",
+                  strerror(errno));
+        }
+    }
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::setReceivePool(
+        const sp<DatagramPool> &pool) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
+    }
+
+    if (pool != NULL && pool->bufferSize() < kMaxUDPSize) {
+        return -EINVAL;
+    }
+
+    mReceivePool = pool;
+
+    return OK;
+}
+
+sp<ABuffer> ANetworkSession::Session::allocDatagram() {
+    if (mReceivePool != NULL) {
+        return mReceivePool->acquire();
+    }
+
+    return new ABuffer(kMaxUDPSize);
+}
+
+static int64_t GetArrivalTimeUs(
+        struct msghdr *hdr, int64_t nowUs, int64_t realTimeNowUs) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET
+                || cmsg->cmsg_type != SCM_TIMESTAMPNS) {
+            continue;
+        }
+
+        const struct timespec *ts = (const struct timespec *)CMSG_DATA(cmsg);
+        int64_t stampUs = ts->tv_sec * 1000000ll + ts->tv_nsec / 1000;
+
+        // Kernel timestamps are CLOCK_REALTIME, translate them into the
+        // ALooper::GetNowUs() timebase used by everybody else.
+        int64_t arrivalTimeUs = nowUs - (realTimeNowUs - stampUs);
+
+        return (arrivalTimeUs > nowUs) ? nowUs : arrivalTimeUs;
+    }
+
+    return nowUs;
+}
+
+status_t ANetworkSession::Session::readMoreBatched() {
+    MMsgHdr msgs[kMaxDatagramsPerBatch];
+    struct iovec iov[kMaxDatagramsPerBatch];
+    struct sockaddr_in remoteAddrs[kMaxDatagramsPerBatch];
+    uint8_t control[kMaxDatagramsPerBatch][CMSG_SPACE(sizeof(struct timespec))];
+
+    status_t err = OK;
+    for (;;) {
+        for (size_t i = 0; i < kMaxDatagramsPerBatch; ++i) {
+            if (mBatchBuffers[i] == NULL) {
+                mBatchBuffers[i] = allocDatagram();
+            }
+
+            iov[i].iov_base = mBatchBuffers[i]->base();
+            iov[i].iov_len = mBatchBuffers[i]->capacity();
+
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &remoteAddrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(remoteAddrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = control[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        int n;
         do {
-            const sp<ABuffer> &datagram = *mOutDatagrams.begin();
+            n = RecvMMsg(mSocket, msgs, kMaxDatagramsPerBatch);
+        } while (n < 0 && errno == EINTR);
 
-            uint8_t *data = datagram->data();
-            if (data[0] == 0x80 && (data[1] & 0x7f) == 33) {
-                int64_t nowUs = ALooper::GetNowUs();
+        if (n < 0) {
+            if (errno == ENOSYS) {
+                ALOGW("recvmmsg unsupported, reverting to recvfrom.");
+                mBatchedReceive = false;
+                return readMore();
+            }
 
-                uint32_t prevRtpTime = U32_AT(&data[4]);
+            err = -errno;
+            break;
+        }
 
-                // 90kHz time scale
-                uint32_t rtpTime = (nowUs * 9ll) / 100ll;
-                int32_t diffTime = (int32_t)rtpTime - (int32_t)prevRtpTime;
+        int64_t nowUs = ALooper::GetNowUs();
 
-                ALOGV("correcting rtpTime by %.0f ms", diffTime / 90.0);
+        struct timespec realTime;
+        clock_gettime(CLOCK_REALTIME, &realTime);
+        int64_t realTimeNowUs =
+            realTime.tv_sec * 1000000ll + realTime.tv_nsec / 1000;
 
-                data[4] = rtpTime >> 24;
-                data[5] = (rtpTime >> 16) & 0xff;
-                data[6] = (rtpTime >> 8) & 0xff;
-                data[7] = rtpTime & 0xff;
+        sp<DatagramBatch> batch;
+        int batchStart = 0;
+
+        for (int i = 0; i < n; ++i) {
+            sp<ABuffer> buf = mBatchBuffers[i];
+            mBatchBuffers[i].clear();
+
+            buf->setRange(0, msgs[i].msg_len);
+            buf->meta()->setInt64(
+                    "arrivalTimeUs",
+                    mKernelTimestamps
+                        ? GetArrivalTimeUs(
+                            &msgs[i].msg_hdr, nowUs, realTimeNowUs)
+                        : nowUs);
+
+#if ENABLE_LATENCY_TRACE
+            TraceArrival(buf);
+#endif
+
+            if (batch != NULL
+                    && (remoteAddrs[i].sin_addr.s_addr
+                            != remoteAddrs[batchStart].sin_addr.s_addr
+                        || remoteAddrs[i].sin_port
+                            != remoteAddrs[batchStart].sin_port)) {
+                notifyDatagramBatch(batch, remoteAddrs[batchStart]);
+                batch.clear();
             }
 
-            int n;
-            do {
-                n = send(mSocket, datagram->data(), datagram->size(), 0);
-            } while (n < 0 && errno == EINTR);
+            if (batch == NULL) {
+                batch = new DatagramBatch;
+                batchStart = i;
+            }
 
-            err = OK;
+            batch->mDatagrams.push(buf);
+        }
 
-            if (n > 0) {
-                mOutDatagrams.erase(mOutDatagrams.begin());
-            } else if (n < 0) {
-                err = -errno;
-            } else if (n == 0) {
-                err = -ECONNRESET;
+        if (batch != NULL) {
+            notifyDatagramBatch(batch, remoteAddrs[batchStart]);
+        }
+
+        if (n < (int)kMaxDatagramsPerBatch) {
+            // The receive queue was drained, new arrivals will trigger
+            // another wakeup.
+            break;
+        }
+    }
+
+    if (err == -EAGAIN || err == -EWOULDBLOCK) {
+        err = OK;
+    }
+
+    if (err != OK) {
+        notifyError(false /* send */, err, "Recvmmsg failed.");
+        mSawReceiveFailure = true;
+    }
+
+    return err;
+}
+
+void ANetworkSession::Session::notifyDatagramBatch(
+        const sp<DatagramBatch> &batch,
+        const struct sockaddr_in &remoteAddr) {
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("sessionID", mSessionID);
+    notify->setInt32("reason", kWhatDatagramBatch);
+
+    uint32_t ip = ntohl(remoteAddr.sin_addr.s_addr);
+    notify->setString(
+            "fromAddr",
+            StringPrintf(
+                "%u.%u.%u.%u",
+                ip >> 24,
+                (ip >> 16) & 0xff,
+                (ip >> 8) & 0xff,
+                ip & 0xff).c_str());
+
+    notify->setInt32("fromPort", ntohs(remoteAddr.sin_port));
+
+    notify->setObject("batch", batch);
+    notify->post();
+}
+
+//ӵĶ˿д
+static size_t NextDatagramSize(const sp<ABuffer> &datagrams) {
+    size_t datagramSize = datagrams->int32Data();
+
+    if (datagramSize == 0 || datagramSize > datagrams->size()) {
+        return datagrams->size();
+    }
+
+    return datagramSize;
+}
+
+// Returns the number of iovecs (1 or 2) needed for the datagram at
+// "offset" (a multiple of the datagram size) of "datagrams".
+static size_t FillDatagramIOVecs(
+        const sp<ABuffer> &datagrams,
+        size_t offset,
+        size_t size,
+        const sp<ABuffer> &headers,
+        size_t headerSize,
+        struct iovec *iov) {
+    uint8_t *data = datagrams->data() + offset;
+
+    if (headers == NULL) {
+        iov[0].iov_base = data;
+        iov[0].iov_len = size;
+        return 1;
+    }
+
+    size_t datagramSize = NextDatagramSize(datagrams);
+
+    iov[0].iov_base = headers->data() + (offset / datagramSize) * headerSize;
+    iov[0].iov_len = headerSize;
+    iov[1].iov_base = data + headerSize;
+    iov[1].iov_len = size - headerSize;
+
+    return 2;
+}
+
+static void FindDatagramHeaders(
+        const sp<ABuffer> &datagrams,
+        sp<ABuffer> *headers,
+        size_t *headerSize) {
+    headers->clear();
+    *headerSize = 0;
+
+    if (datagrams->meta()->findBuffer("headers", headers)) {
+        int32_t size;
+        CHECK(datagrams->meta()->findInt32("headerSize", &size));
+        *headerSize = size;
+    }
+}
+
+static void CorrectRTPTime(uint8_t *data, size_t size) {
+    if (size < 12 || data[0] != 0x80 || (data[1] & 0x7f) != 33) {
+        return;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    uint32_t prevRtpTime = U32_AT(&data[4]);
+
+    // 90kHz time scale
+    uint32_t rtpTime = (nowUs * 9ll) / 100ll;
+    int32_t diffTime = (int32_t)rtpTime - (int32_t)prevRtpTime;
+
+    ALOGV("correcting rtpTime by %.0f ms", diffTime / 90.0);
+
+    data[4] = rtpTime >> 24;
+    data[5] = (rtpTime >> 16) & 0xff;
+    data[6] = (rtpTime >> 8) & 0xff;
+    data[7] = rtpTime & 0xff;
+}
+
+void ANetworkSession::Session::consumeOutDatagrams(size_t count) {
+    while (count > 0) {
+        CHECK(!mOutDatagrams.empty());
+
+        const sp<ABuffer> &datagrams = *mOutDatagrams.begin();
+        size_t datagramSize = NextDatagramSize(datagrams);
+
+        datagrams->setRange(
+                datagrams->offset() + datagramSize,
+                datagrams->size() - datagramSize);
+
+        sp<ABuffer> headers;
+        size_t headerSize;
+        FindDatagramHeaders(datagrams, &headers, &headerSize);
+
+        if (headers != NULL) {
+            headers->setRange(
+                    headers->offset() + headerSize,
+                    headers->size() - headerSize);
+        }
+
+        if (datagrams->size() == 0) {
+            mOutDatagrams.erase(mOutDatagrams.begin());
+        }
+
+        --count;
+    }
+}
+
+status_t ANetworkSession::Session::writeOneDatagram() {
+    const sp<ABuffer> &datagrams = *mOutDatagrams.begin();
+
+    sp<ABuffer> headers;
+    size_t headerSize;
+    FindDatagramHeaders(datagrams, &headers, &headerSize);
+
+    struct iovec iov[2];
+    size_t iovCount = FillDatagramIOVecs(
+            datagrams, 0, NextDatagramSize(datagrams), headers, headerSize,
+            iov);
+
+    CorrectRTPTime((uint8_t *)iov[0].iov_base, iov[0].iov_len);
+
+    ssize_t n;
+    do {
+        n = writev(mSocket, iov, iovCount);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        return -errno;
+    } else if (n == 0) {
+        return -ECONNRESET;
+    }
+
+    consumeOutDatagrams(1);
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::writeMoreBatched() {
+    MMsgHdr msgs[kMaxDatagramsPerBatch];
+    struct iovec iov[2 * kMaxDatagramsPerBatch];
+
+    size_t count = 0;
+    size_t iovCount = 0;
+    for (List<sp<ABuffer> >::iterator it = mOutDatagrams.begin();
+            it != mOutDatagrams.end() && count < kMaxDatagramsPerBatch;
+            ++it) {
+        const sp<ABuffer> &datagrams = *it;
+
+        size_t datagramSize = NextDatagramSize(datagrams);
+
+        sp<ABuffer> headers;
+        size_t headerSize;
+        FindDatagramHeaders(datagrams, &headers, &headerSize);
+
+        size_t offset = 0;
+        while (offset < datagrams->size() && count < kMaxDatagramsPerBatch) {
+            size_t size = datagrams->size() - offset;
+            if (size > datagramSize) {
+                size = datagramSize;
             }
+
+            size_t n = FillDatagramIOVecs(
+                    datagrams, offset, size, headers, headerSize,
+                    &iov[iovCount]);
+
+            CorrectRTPTime(
+                    (uint8_t *)iov[iovCount].iov_base,
+                    iov[iovCount].iov_len);
+
+            memset(&msgs[count], 0, sizeof(msgs[count]));
+            msgs[count].msg_hdr.msg_iov = &iov[iovCount];
+            msgs[count].msg_hdr.msg_iovlen = n;
+
+            ++count;
+            iovCount += n;
+            offset += size;
+        }
+    }
+
+    int n;
+    do {
+        n = SendMMsg(mSocket, msgs, count);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        if (errno == ENOSYS) {
+            ALOGW("sendmmsg unsupported, reverting to send.");
+            mBatchedSend = false;
+            return OK;
+        }
+
+        return -errno;
+    } else if (n == 0) {
+        return -ECONNRESET;
+    }
+
+    consumeOutDatagrams(n);
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::writeMore() {
+    if (mState == DATAGRAM) {
+        CHECK(!mOutDatagrams.empty());
+
+        status_t err;
+        do {
+            err = mBatchedSend ? writeMoreBatched() : writeOneDatagram();
         } while (err == OK && !mOutDatagrams.empty());
 
         if (err == -EAGAIN) {
             if (!mOutDatagrams.empty()) {
-                ALOGI("%d datagrams remain queued.", mOutDatagrams.size());
+                ALOGV("%zu datagrams remain queued.", mOutDatagrams.size());
             }
             err = OK;
         }
@@ -467,64 +1051,294 @@ status_t ANetworkSession::Session::writeMore() {
     }
 
     CHECK_EQ(mState, CONNECTED);
-    CHECK(!mOutBuffer.empty());
+    CHECK(!mOutChunks.empty());
 
-    ssize_t n;
-    do {
-        n = send(mSocket, mOutBuffer.c_str(), mOutBuffer.size(), 0);//ͻ˷OPTIONS  
-    } while (n < 0 && errno == EINTR);
+    status_t err = OK;
+
+    while (err == OK && !mOutChunks.empty()) {
+        struct iovec iov[kMaxIOVecs];
+        size_t iovCount = fillOutIOVecs(iov, kMaxIOVecs);
+
+        ssize_t n;
+        do {
+            n = writev(mSocket, iov, iovCount);
+        } while (n < 0 && errno == EINTR);
+
+#if 0
+        ALOGD("111  send %ld bytes in %d pieces", n, iovCount);
+#endif
+
+        if (n > 0) {
+#if 0
+            ALOGI("out:");
+            hexdump(iov[0].iov_base, iov[0].iov_len);
+#endif
+
+            consumeOutChunks(n);
+        } else if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Socket buffer is full, wait to become writable again.
+                break;
+            }
+            err = -errno;
+        } else if (n == 0) {
+            err = -ECONNRESET;
+        }
+    }
+
+    if (err != OK) {
+        notifyError(true /* send */, err, "Send failed.");
+        mSawSendFailure = true;
+    }
+
+    return err;
+}
+
+status_t ANetworkSession::Session::sendRequest(const void *data, ssize_t size) {
+    CHECK(mState == CONNECTED || mState == DATAGRAM);
+
+    if (mState == DATAGRAM) {
+        CHECK_GE(size, 0);
+
+        sp<ABuffer> datagram = new ABuffer(size);
+        memcpy(datagram->data(), data, size);
+
+        mOutDatagrams.push_back(datagram);
+        return OK;
+    }
+
+    if (size < 0) {
+        size = strlen((const char *)data);
+    }
+
+    size_t prefixSize = 0;
+    if (mState == CONNECTED && !mIsRTSPConnection) {
+        CHECK_LE(size, 65535);
+        prefixSize = 2;
+    }
+
+    sp<ABuffer> chunk = new ABuffer(prefixSize + size);
+
+    if (prefixSize > 0) {
+        chunk->data()[0] = size >> 8;
+        chunk->data()[1] = size & 0xff;
+    }
+
+    memcpy(chunk->data() + prefixSize, data, size);
+
+    mOutChunks.push_back(chunk);
+
+    return OK;
+}
+
+status_t ANetworkSession::Session::sendInterleaved(
+        int channel, const sp<ABuffer> &packets, size_t packetSize) {
+    if (mState != CONNECTED || !mIsRTSPConnection) {
+        return INVALID_OPERATION;
+    }
+
+    if (channel < 0 || channel > 0xff
+            || packets->size() == 0 || packetSize == 0
+            || packetSize > 0xffff) {
+        return -EINVAL;
+    }
+
+    // The interleaving headers are kept aside in the chunk's meta data and
+    // gathered together with the payloads by writev().
+    size_t numPackets = (packets->size() + packetSize - 1) / packetSize;
+    sp<ABuffer> headers = new ABuffer(4 * numPackets);
+
+    for (size_t i = 0; i < numPackets; ++i) {
+        size_t size = packets->size() - i * packetSize;
+        if (size > packetSize) {
+            size = packetSize;
+        }
+
+        uint8_t *header = headers->data() + 4 * i;
+        header[0] = '$';
+        header[1] = channel;
+        header[2] = size >> 8;
+        header[3] = size & 0xff;
+    }
+
+    packets->setInt32Data(packetSize);
+    packets->meta()->setBuffer("headers", headers);
+
+    mOutChunks.push_back(packets);
+
+    return OK;
+}
+
+// static
+size_t ANetworkSession::Session::FramedSize(const sp<ABuffer> &chunk) {
+    size_t packetSize = chunk->int32Data();
+
+    if (packetSize == 0) {
+        return chunk->size();
+    }
+
+    size_t numPackets = (chunk->size() + packetSize - 1) / packetSize;
+
+    return chunk->size() + 4 * numPackets;
+}
+
+size_t ANetworkSession::Session::fillOutIOVecs(
+        struct iovec *iov, size_t maxCount) const {
+    size_t count = 0;
+    size_t skip = mOutChunkOffset;
+
+    for (List<sp<ABuffer> >::const_iterator it = mOutChunks.begin();
+            it != mOutChunks.end() && count < maxCount; ++it) {
+        const sp<ABuffer> &chunk = *it;
+        size_t packetSize = chunk->int32Data();
+
+        if (packetSize == 0) {
+            iov[count].iov_base = chunk->data() + skip;
+            iov[count].iov_len = chunk->size() - skip;
+            ++count;
+
+            skip = 0;
+            continue;
+        }
+
+        sp<ABuffer> headers;
+        CHECK(chunk->meta()->findBuffer("headers", &headers));
+
+        size_t numPackets = headers->size() / 4;
+
+        size_t framedPacketSize = 4 + packetSize;
+        size_t i = skip / framedPacketSize;
+        size_t offset = skip % framedPacketSize;
+
+        for (; i < numPackets && count + 2 <= maxCount; ++i) {
+            size_t size = chunk->size() - i * packetSize;
+            if (size > packetSize) {
+                size = packetSize;
+            }
+
+            if (offset < 4) {
+                iov[count].iov_base = headers->data() + 4 * i + offset;
+                iov[count].iov_len = 4 - offset;
+                ++count;
+
+                offset = 0;
+            } else {
+                offset -= 4;
+            }
+
+            iov[count].iov_base = chunk->data() + i * packetSize + offset;
+            iov[count].iov_len = size - offset;
+            ++count;
+
+            offset = 0;
+        }
+
+        if (i < numPackets) {
+            // Out of iovecs.
+            break;
+        }
+
+        skip = 0;
+    }
+
+    return count;
+}
+
+void ANetworkSession::Session::consumeOutChunks(size_t size) {
+    while (size > 0) {
+        CHECK(!mOutChunks.empty());
+
+        size_t left = FramedSize(*mOutChunks.begin()) - mOutChunkOffset;
+
+        if (size < left) {
+            mOutChunkOffset += size;
+            break;
+        }
+
+        size -= left;
+
+        mOutChunks.erase(mOutChunks.begin());
+        mOutChunkOffset = 0;
+    }
+}
 
-    ALOGD("111  send %ld %u:\n%s\n", n, mOutBuffer.size(), mOutBuffer.c_str());
+void ANetworkSession::Session::reserveInBuffer(size_t size) {
+    if (mInBuffer == NULL) {
+        mInBuffer = new ABuffer(kMinStreamReadSize * 4);
+        mInBuffer->setRange(0, 0);
+    }
 
-    status_t err = OK;
+    size_t used = mInBuffer->size();
+    size_t room = mInBuffer->capacity() - mInBuffer->offset() - used;
 
-    if (n > 0) {
-#if 0
-        ALOGI("out:");
-        hexdump(mOutBuffer.c_str(), n);
-#endif
+    if (room >= size) {
+        return;
+    }
 
-        mOutBuffer.erase(0, n);
-    } else if (n < 0) {
-        err = -errno;
-    } else if (n == 0) {
-        err = -ECONNRESET;
+    if (mInBuffer->capacity() - used >= size
+            && used <= mInBuffer->capacity() / 2) {
+        // Move the unparsed tail to the front, cheap since it's small.
+        memmove(mInBuffer->base(), mInBuffer->data(), used);
+        mInBuffer->setRange(0, used);
+        return;
     }
 
-    if (err != OK) {
-        notifyError(true /* send */, err, "Send failed.");
-        mSawSendFailure = true;
+    size_t capacity = mInBuffer->capacity() * 2;
+    while (capacity - used < size) {
+        capacity *= 2;
     }
 
-    return err;
+    sp<ABuffer> buffer = new ABuffer(capacity);
+    memcpy(buffer->data(), mInBuffer->data(), used);
+    buffer->setRange(0, used);
+
+    mInBuffer = buffer;
 }
 
-status_t ANetworkSession::Session::sendRequest(const void *data, ssize_t size) {
-    CHECK(mState == CONNECTED || mState == DATAGRAM);
+void ANetworkSession::Session::consumeInBuffer(size_t size) {
+    CHECK_LE(size, mInBuffer->size());
 
-    if (mState == DATAGRAM) {
-        CHECK_GE(size, 0);
+    mInScanOffset = 0;
+    mInMessageLength = 0;
 
-        sp<ABuffer> datagram = new ABuffer(size);
-        memcpy(datagram->data(), data, size);
+    if (size == mInBuffer->size()) {
+        mInBuffer->setRange(0, 0);
+    } else {
+        mInBuffer->setRange(mInBuffer->offset() + size, mInBuffer->size() - size);
+    }
+}
 
-        mOutDatagrams.push_back(datagram);
-        return OK;
+status_t ANetworkSession::Session::sendDatagrams(
+        const sp<ABuffer> &datagrams, size_t datagramSize,
+        const sp<ABuffer> &headers, size_t headerSize) {
+    if (mState != DATAGRAM) {
+        return INVALID_OPERATION;
     }
 
-    if (mState == CONNECTED && !mIsRTSPConnection) {
-        CHECK_LE(size, 65535);
+    if (datagrams->size() == 0 || datagramSize == 0
+            || datagramSize > kMaxUDPSize) {
+        return -EINVAL;
+    }
+
+    if (headers != NULL) {
+        size_t numDatagrams =
+            (datagrams->size() + datagramSize - 1) / datagramSize;
 
-        uint8_t prefix[2];
-        prefix[0] = size >> 8;
-        prefix[1] = size & 0xff;
+        // Every datagram, the last one included, has to be at least as
+        // large as its header.
+        size_t lastSize = datagrams->size() - (numDatagrams - 1) * datagramSize;
 
-        mOutBuffer.append((const char *)prefix, sizeof(prefix));
+        if (headerSize == 0 || lastSize < headerSize
+                || headers->size() != numDatagrams * headerSize) {
+            return -EINVAL;
+        }
+
+        datagrams->meta()->setBuffer("headers", headers);
+        datagrams->meta()->setInt32("headerSize", headerSize);
     }
 
-    mOutBuffer.append(
-            (const char *)data,
-            (size >= 0) ? size : strlen((const char *)data));
+    datagrams->setInt32Data(datagramSize);
+    mOutDatagrams.push_back(datagrams);
 
     return OK;
 }
@@ -550,7 +1364,8 @@ void ANetworkSession::Session::notify(NotificationReason reason) {
 ////////////////////////////////////////////////////////////////////////////////
 
 ANetworkSession::ANetworkSession()
-    : mNextSessionID(1) {
+    : mNextSessionID(1),
+      mEpollFd(-1) {
     mPipeFd[0] = mPipeFd[1] = -1;
 }
 
@@ -559,9 +1374,15 @@ ANetworkSession::~ANetworkSession() {
 }
 
 status_t ANetworkSession::start() {
+    return start(ThreadConfig());
+}
+
+status_t ANetworkSession::start(const ThreadConfig &threadConfig) {
     if (mThread != NULL) {
         return INVALID_OPERATION;
     }
+
+    mThreadConfig = threadConfig;
 	
 	//ANetworkSessionϵselectѭҪʱʹselect
     int res = pipe(mPipeFd);  //дܵthreadLoopִ 
@@ -570,6 +1391,34 @@ status_t ANetworkSession::start() {
         return -errno;
     }
 
+#if USE_EPOLL
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        mEpollFd = epoll_create(kMaxEpollEvents);
+
+        if (mEpollFd < 0) {
+            ALOGW("epoll_create failed (%s), falling back to select().",
+                  strerror(errno));
+        } else {
+            MakeSocketNonBlocking(mPipeFd[0]);
+
+            // The interrupt pipe stays level-triggered, it's only used
+            // to get the thread to exit.
+            struct epoll_event event;
+            memset(&event, 0, sizeof(event));
+            event.events = EPOLLIN;
+            event.data.u32 = kPipeSessionID;
+            CHECK_EQ(epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mPipeFd[0], &event), 0);
+
+            // Pick up any sessions created before the thread was started.
+            for (size_t i = 0; i < mSessions.size(); ++i) {
+                registerSession_l(mSessions.valueAt(i));
+            }
+        }
+    }
+#endif
+
 	//һNetworkThreadNetworkThreadҲǼ̳ThreadʵthreadLoop
 	//threadLoopֻǼ򵥵ĵANetworkSessionthreadLoop
     mThread = new NetworkThread(this);  //ANetworkSessionڲṹ߳
@@ -585,6 +1434,8 @@ status_t ANetworkSession::start() {
         close(mPipeFd[1]);
         mPipeFd[0] = mPipeFd[1] = -1;
 
+        closeEpoll();
+
         return err;
     }
 
@@ -606,9 +1457,26 @@ status_t ANetworkSession::stop() {
     close(mPipeFd[1]);
     mPipeFd[0] = mPipeFd[1] = -1;
 
+    closeEpoll();
+
     return OK;
 }
 
+void ANetworkSession::closeEpoll() {
+#if USE_EPOLL
+    Mutex::Autolock autoLock(mLock);
+
+    if (mEpollFd >= 0) {
+        close(mEpollFd);
+        mEpollFd = -1;
+    }
+
+    for (size_t i = 0; i < mSessions.size(); ++i) {
+        mSessions.valueAt(i)->setEventMask(0);
+    }
+#endif
+}
+
 status_t ANetworkSession::createRTSPClient(
         const char *host, unsigned port, const sp<AMessage> &notify,
         int32_t *sessionID) {
@@ -694,6 +1562,7 @@ status_t ANetworkSession::destroySession(int32_t sessionID) {
         return -ENOENT;
     }
 
+    unregisterSession_l(mSessions.valueAt(index));
     mSessions.removeItemsAt(index);
 
     interrupt();
@@ -701,6 +1570,88 @@ status_t ANetworkSession::destroySession(int32_t sessionID) {
     return OK;
 }
 
+status_t ANetworkSession::setBatchedReceive(int32_t sessionID, bool enable) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    return mSessions.valueAt(index)->setBatchedReceive(enable);
+}
+
+status_t ANetworkSession::setReceivePool(
+        int32_t sessionID, const sp<DatagramPool> &pool) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    return mSessions.valueAt(index)->setReceivePool(pool);
+}
+
+status_t ANetworkSession::setSocketReceiveBufferSize(
+        int32_t sessionID, int size) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    int s = mSessions.valueAt(index)->socket();
+
+    // SO_RCVBUFFORCE requires CAP_NET_ADMIN, fall back to SO_RCVBUF which
+    // is capped at net.core.rmem_max.
+    if (setsockopt(s, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0
+            && setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        return -errno;
+    }
+
+    int actualSize;
+    socklen_t optLen = sizeof(actualSize);
+    if (getsockopt(s, SOL_SOCKET, SO_RCVBUF, &actualSize, &optLen) == 0) {
+        // The kernel doubles the requested value to account for overhead.
+        ALOGI("session %d: requested a %d byte receive buffer, got %d",
+              sessionID, size, actualSize / 2);
+    }
+
+    return OK;
+}
+
+status_t ANetworkSession::setMulticastOptions(
+        int32_t sessionID, const struct in_addr &interfaceAddr, int ttl) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    int s = mSessions.valueAt(index)->socket();
+
+    unsigned char ttlValue = ttl;
+    unsigned char loop = 0;
+
+    if (setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF,
+                &interfaceAddr, sizeof(interfaceAddr)) < 0
+            || setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL,
+                &ttlValue, sizeof(ttlValue)) < 0
+            || setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP,
+                &loop, sizeof(loop)) < 0) {
+        return -errno;
+    }
+
+    return OK;
+}
+
 // static
 status_t ANetworkSession::MakeSocketNonBlocking(int s) {
     int flags = fcntl(s, F_GETFL, 0);
@@ -902,6 +1853,7 @@ status_t ANetworkSession::createClientOrServer(
 
 	//sessionỰmSessionsṹб
     mSessions.add(session->sessionID(), session);
+    registerSession_l(session);
 
 	// ANetworkSessionNetworkThread߳select䣬¼readFdwriteFdselectļ
     interrupt();//ANetworkSession::interrupt(),ܵдд 
@@ -970,11 +1922,78 @@ status_t ANetworkSession::sendRequest(
 
     status_t err = session->sendRequest(data, size);
 
-    interrupt();
+    if (mEpollFd >= 0) {
+        // Arming EPOLLOUT is enough to get the network thread going.
+        updateEventMask_l(session);
+    } else {
+        interrupt();
+    }
 
     return err;
 }
 
+status_t ANetworkSession::sendDatagrams(
+        int32_t sessionID,
+        const sp<ABuffer> &datagrams,
+        size_t datagramSize,
+        const sp<ABuffer> &headers,
+        size_t headerSize) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    const sp<Session> session = mSessions.valueAt(index);
+
+    status_t err = session->sendDatagrams(
+            datagrams, datagramSize, headers, headerSize);
+
+    if (err != OK) {
+        return err;
+    }
+
+    if (mEpollFd >= 0) {
+        updateEventMask_l(session);
+    } else {
+        interrupt();
+    }
+
+    return OK;
+}
+
+status_t ANetworkSession::sendInterleaved(
+        int32_t sessionID,
+        int channel,
+        const sp<ABuffer> &packets,
+        size_t packetSize) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mSessions.indexOfKey(sessionID);
+
+    if (index < 0) {
+        return -ENOENT;
+    }
+
+    const sp<Session> session = mSessions.valueAt(index);
+
+    status_t err = session->sendInterleaved(channel, packets, packetSize);
+
+    if (err != OK) {
+        return err;
+    }
+
+    if (mEpollFd >= 0) {
+        updateEventMask_l(session);
+    } else {
+        interrupt();
+    }
+
+    return OK;
+}
+
 // pipeдһϢѸոմsocket뵽readFd
 void ANetworkSession::interrupt() {
     static const char dummy = 0;
@@ -990,6 +2009,17 @@ void ANetworkSession::interrupt() {
 }
 
 void ANetworkSession::threadLoop() {
+#if USE_EPOLL
+    if (mEpollFd >= 0) {
+        threadLoopEpoll();
+        return;
+    }
+#endif
+
+    threadLoopSelect();
+}
+
+void ANetworkSession::threadLoopSelect() {
     fd_set rs, ws;
     FD_ZERO(&rs);
     FD_ZERO(&ws);
@@ -1074,64 +2104,7 @@ void ANetworkSession::threadLoop() {
             }
 
             if (FD_ISSET(s, &rs)) {
-                if (session->isRTSPServer() || session->isTCPDatagramServer()) {
-					//ǰ״̬Session״̬ΪLISTENING_RTSPLISTENING_TCP_DGRAMSִв
-                    struct sockaddr_in remoteAddr;
-                    socklen_t remoteAddrLen = sizeof(remoteAddr);
-
-					//Ӵlisten״̬׽sĿͻȡǰһͻµsocketͨ  
-                    int clientSocket = accept(
-                            s, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
-
-                    if (clientSocket >= 0) {
-                        status_t err = MakeSocketNonBlocking(clientSocket);
-
-                        if (err != OK) {
-                            ALOGE("Unable to make client socket non blocking, "
-                                  "failed w/ error %d (%s)",
-                                  err, strerror(-err));
-
-                            close(clientSocket);
-                            clientSocket = -1;
-                        } else {
-                            in_addr_t addr = ntohl(remoteAddr.sin_addr.s_addr);
-
-                            ALOGI("incoming connection from %d.%d.%d.%d:%d "
-                                  "(socket %d)",
-                                  (addr >> 24),
-                                  (addr >> 16) & 0xff,
-                                  (addr >> 8) & 0xff,
-                                  addr & 0xff,
-                                  ntohs(remoteAddr.sin_port),
-                                  clientSocket);
-
-                            sp<Session> clientSession =
-                                // using socket sd as sessionID
-                                new Session(
-                                        mNextSessionID++,
-                                        Session::CONNECTED,
-                                        clientSocket,
-										//RTSPӵıصַͻַԼ˿ڵϢͨAMessage͵Source
-                                        session->getNotificationMessage());
-
-                            clientSession->setIsRTSPConnection(
-                                    session->isRTSPServer());//mIsRTSPConnectionΪfalse  
-
-                            sessionsToAdd.push_back(clientSession);//Session뵽 sessionsToAddβ
-                        }
-                    } else {
-                        ALOGE("accept returned error %d (%s)",
-                              errno, strerror(errno));
-                    }
-                } else {
-					//ڽUDPӻRTSPѽ״ҸsocketɶӦsocketϢ
-					//ͬʱͨAMessageʽSourceSinkݽ֪ͨӦ  
-                    status_t err = session->readMore();
-                    if (err != OK) {
-                        ALOGE("readMore on socket %d failed w/ error %d (%s)",
-                              s, err, strerror(-err));
-                    }
-                }
+                onSessionReadable_l(session, &sessionsToAdd);
             }
 
             if (FD_ISSET(s, &ws)) {
@@ -1144,17 +2117,230 @@ void ANetworkSession::threadLoop() {
             }
         }
 
-        while (!sessionsToAdd.empty()) {
-            sp<Session> session = *sessionsToAdd.begin();
-            sessionsToAdd.erase(sessionsToAdd.begin());
+        addSessions_l(&sessionsToAdd);
+    }
+}
+
+#if USE_EPOLL
+void ANetworkSession::threadLoopEpoll() {
+    struct epoll_event events[kMaxEpollEvents];
+
+    int n = epoll_wait(mEpollFd, events, kMaxEpollEvents, -1 /* timeout */);
+
+    if (n <= 0) {
+        if (n < 0 && errno != EINTR) {
+            ALOGE("epoll_wait failed w/ error %d (%s)", errno, strerror(errno));
+        }
+        return;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    List<sp<Session> > sessionsToAdd;
+
+    for (int i = 0; i < n; ++i) {
+        int32_t sessionID = (int32_t)events[i].data.u32;
+        uint32_t what = events[i].events;
+
+        if (sessionID == kPipeSessionID) {
+            char tmp[64];
+            ssize_t nRead;
+            do {
+                nRead = read(mPipeFd[0], tmp, sizeof(tmp));
+            } while (nRead < 0 && errno == EINTR);
+
+            if (nRead < 0 && errno != EAGAIN) {
+                ALOGW("Error reading from pipe (%s)", strerror(errno));
+            }
+            continue;
+        }
+
+        ssize_t index = mSessions.indexOfKey(sessionID);
+
+        if (index < 0) {
+            // Destroyed after epoll_wait returned.
+            continue;
+        }
+
+        sp<Session> session = mSessions.valueAt(index);
+
+        // Errors and hangups are surfaced through the regular read/write
+        // paths, which report them to the session's owner.
+        bool failed = (what & (EPOLLERR | EPOLLHUP)) != 0;
+
+        if ((what & EPOLLIN || failed) && session->wantsToRead()) {
+            onSessionReadable_l(session, &sessionsToAdd);
+        }
+
+        if ((what & EPOLLOUT || failed) && session->wantsToWrite()) {
+            status_t err = session->writeMore();
+            if (err != OK) {
+                ALOGE("writeMore on socket %d failed w/ error %d (%s)",
+                      session->socket(), err, strerror(-err));
+            }
+        }
+
+        updateEventMask_l(session);
+    }
+
+    addSessions_l(&sessionsToAdd);
+}
+#endif
+
+void ANetworkSession::onSessionReadable_l(
+        const sp<Session> &session, List<sp<Session> > *sessionsToAdd) {
+    int s = session->socket();
+
+    if (!session->isRTSPServer() && !session->isTCPDatagramServer()) {
+		//ڽUDPӻRTSPѽ״ҸsocketɶӦsocketϢ
+		//ͬʱͨAMessageʽSourceSinkݽ֪ͨӦ  
+        status_t err = session->readMore();
+        if (err != OK) {
+            ALOGE("readMore on socket %d failed w/ error %d (%s)",
+                  s, err, strerror(-err));
+        }
+        return;
+    }
+
+	//ǰ״̬Session״̬ΪLISTENING_RTSPLISTENING_TCP_DGRAMSִв
+    // The listening socket is non-blocking, drain all pending connections
+    // since an edge-triggered engine won't tell us about them again.
+    for (;;) {
+        struct sockaddr_in remoteAddr;
+        socklen_t remoteAddrLen = sizeof(remoteAddr);
+
+		//Ӵlisten״̬׽sĿͻȡǰһͻµsocketͨ  
+        int clientSocket = accept(
+                s, (struct sockaddr *)&remoteAddr, &remoteAddrLen);
+
+        if (clientSocket < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ALOGE("accept returned error %d (%s)",
+                      errno, strerror(errno));
+            }
+            break;
+        }
+
+        status_t err = MakeSocketNonBlocking(clientSocket);
 
-			//˳Sessionvectorṹб  
-            mSessions.add(session->sessionID(), session);
+        if (err != OK) {
+            ALOGE("Unable to make client socket non blocking, "
+                  "failed w/ error %d (%s)",
+                  err, strerror(-err));
 
-            ALOGI("added clientSession %d", session->sessionID());
+            close(clientSocket);
+            clientSocket = -1;
+            continue;
         }
+
+        in_addr_t addr = ntohl(remoteAddr.sin_addr.s_addr);
+
+        ALOGI("incoming connection from %d.%d.%d.%d:%d "
+              "(socket %d)",
+              (addr >> 24),
+              (addr >> 16) & 0xff,
+              (addr >> 8) & 0xff,
+              addr & 0xff,
+              ntohs(remoteAddr.sin_port),
+              clientSocket);
+
+        sp<Session> clientSession =
+            // using socket sd as sessionID
+            new Session(
+                    mNextSessionID++,
+                    Session::CONNECTED,
+                    clientSocket,
+					//RTSPӵıصַͻַԼ˿ڵϢͨAMessage͵Source
+                    session->getNotificationMessage());
+
+        clientSession->setIsRTSPConnection(
+                session->isRTSPServer());//mIsRTSPConnectionΪfalse  
+
+        sessionsToAdd->push_back(clientSession);//Session뵽 sessionsToAddβ
+    }
+}
+
+void ANetworkSession::addSessions_l(List<sp<Session> > *sessionsToAdd) {
+    while (!sessionsToAdd->empty()) {
+        sp<Session> session = *sessionsToAdd->begin();
+        sessionsToAdd->erase(sessionsToAdd->begin());
+
+		//˳Sessionvectorṹб  
+        mSessions.add(session->sessionID(), session);
+        registerSession_l(session);
+
+        ALOGI("added clientSession %d", session->sessionID());
     }
 }
 
+void ANetworkSession::registerSession_l(const sp<Session> &session) {
+#if USE_EPOLL
+    if (mEpollFd < 0) {
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = session->desiredEventMask();
+    event.data.u32 = session->sessionID();
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, session->socket(), &event) < 0) {
+        ALOGE("Unable to add socket %d to epoll set (%s)",
+              session->socket(), strerror(errno));
+        return;
+    }
+
+    session->setEventMask(event.events);
+#endif
+}
+
+void ANetworkSession::unregisterSession_l(const sp<Session> &session) {
+#if USE_EPOLL
+    if (mEpollFd < 0) {
+        return;
+    }
+
+    // The kernel insists on a non-NULL event pointer on older versions.
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, session->socket(), &event) < 0) {
+        ALOGW("Unable to remove socket %d from epoll set (%s)",
+              session->socket(), strerror(errno));
+    }
+#endif
+}
+
+void ANetworkSession::updateEventMask_l(const sp<Session> &session) {
+#if USE_EPOLL
+    if (mEpollFd < 0) {
+        return;
+    }
+
+    uint32_t mask = session->desiredEventMask();
+
+    if (mask == session->eventMask()) {
+        return;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = mask;
+    event.data.u32 = session->sessionID();
+
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, session->socket(), &event) < 0) {
+        ALOGE("Unable to update epoll interest of socket %d (%s)",
+              session->socket(), strerror(errno));
+        return;
+    }
+
+    session->setEventMask(mask);
+#endif
+}
+
 }  // namespace android
 
@@ -4,15 +4,21 @@
 #define A_NETWORK_SESSION_H_
 
 #include <media/stagefright/foundation/ABase.h>
+#include <media/stagefright/foundation/ABuffer.h>
 #include <utils/KeyedVector.h>
+#include <utils/List.h>
 #include <utils/RefBase.h> //spwpʵһͨüķƶڵĻ
 #include <utils/Thread.h>
+#include <utils/Vector.h>
+
+#include "ThreadConfig.h"
 
 #include <netinet/in.h>
 
 namespace android {
 
 struct AMessage;
+struct DatagramPool;
 
 // Helper class to manage a number of live sockets (datagram and stream-based)
 // on a single thread. Clients are notified about activity through AMessages.
@@ -22,6 +28,11 @@ struct ANetworkSession : public RefBase {
     ANetworkSession();
 
     status_t start();
+
+    // The network thread applies "threadConfig" to itself before
+    // servicing any sessions.
+    status_t start(const ThreadConfig &threadConfig);
+
     status_t stop();
 
     status_t createRTSPClient(
@@ -60,9 +71,58 @@ struct ANetworkSession : public RefBase {
 
     status_t destroySession(int32_t sessionID);
 
+    // Drain incoming datagrams of a UDP session with recvmmsg() and deliver
+    // them as kWhatDatagramBatch notifications, arrival times are taken
+    // from kernel timestamps if available.
+    status_t setBatchedReceive(int32_t sessionID, bool enable);
+
+    // Incoming datagrams of a UDP session are received into buffers taken
+    // from "pool" instead of freshly allocated ones.
+    status_t setReceivePool(
+            int32_t sessionID, const sp<DatagramPool> &pool);
+
+    // Resizes the kernel receive buffer of a session's socket, bypassing
+    // the rmem_max limit if the process is allowed to. The size actually
+    // granted is logged.
+    status_t setSocketReceiveBufferSize(int32_t sessionID, int size);
+
+    // Datagrams a UDP session sends to a multicast group leave through the
+    // interface "interfaceAddr" and cross at most "ttl" routers, they're
+    // not looped back to this host.
+    status_t setMulticastOptions(
+            int32_t sessionID, const struct in_addr &interfaceAddr, int ttl);
+
     status_t sendRequest(
             int32_t sessionID, const void *data, ssize_t size = -1);
 
+    // Queues the datagrams stored back to back in "datagrams" on a UDP
+    // session without copying them, all but the last one "datagramSize"
+    // bytes long. The buffer must not be touched by the caller afterwards.
+    // Queued datagrams are transmitted with sendmmsg() where available.
+    // If "headers" is given, the first "headerSize" bytes of every datagram
+    // are taken from it instead, one after another, the datagrams' own are
+    // never looked at. That way the same payloads may be queued on several
+    // sessions (each through an ABuffer of its own) with headers of their
+    // own and be sent without being copied. Neither buffer may be touched
+    // by the caller afterwards.
+    status_t sendDatagrams(
+            int32_t sessionID,
+            const sp<ABuffer> &datagrams,
+            size_t datagramSize,
+            const sp<ABuffer> &headers = NULL,
+            size_t headerSize = 0);
+
+    // Queues the RTP packets stored back to back in "packets" (all but the
+    // last one "packetSize" bytes long) on an RTSP session, interleaved on
+    // "channel" as described in RFC 2326, 10.12. The framing headers are
+    // gathered with the payloads by writev(), the packets are not copied.
+    // The buffer must not be touched by the caller afterwards.
+    status_t sendInterleaved(
+            int32_t sessionID,
+            int channel,
+            const sp<ABuffer> &packets,
+            size_t packetSize);
+
     enum NotificationReason {
         kWhatError,
         kWhatConnected,
@@ -70,6 +130,13 @@ struct ANetworkSession : public RefBase {
         kWhatData,
         kWhatDatagram,
         kWhatBinaryData,
+        kWhatDatagramBatch,
+    };
+
+    // Carried as "batch" by kWhatDatagramBatch notifications, all datagrams
+    // of a batch originate from the same "fromAddr"/"fromPort".
+    struct DatagramBatch : public RefBase {
+        Vector<sp<ABuffer> > mDatagrams;
     };
 
 protected:
@@ -81,11 +148,15 @@ private:
 
     Mutex mLock;
     sp<Thread> mThread;
+    ThreadConfig mThreadConfig;
 
     int32_t mNextSessionID;
 
     int mPipeFd[2];
 
+    // epoll instance driving the network thread, -1 if select() is used.
+    int mEpollFd;
+
     KeyedVector<int32_t, sp<Session> > mSessions;
 
     enum Mode {
@@ -105,8 +176,19 @@ private:
             int32_t *sessionID);
 
     void threadLoop();
+    void threadLoopSelect();
+    void threadLoopEpoll();
     void interrupt();
 
+    void onSessionReadable_l(
+            const sp<Session> &session, List<sp<Session> > *sessionsToAdd);
+    void addSessions_l(List<sp<Session> > *sessionsToAdd);
+
+    void registerSession_l(const sp<Session> &session);
+    void unregisterSession_l(const sp<Session> &session);
+    void updateEventMask_l(const sp<Session> &session);
+    void closeEpoll();
+
     static status_t MakeSocketNonBlocking(int s);
 
     DISALLOW_EVIL_CONSTRUCTORS(ANetworkSession);
@@ -4,19 +4,39 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
         ANetworkSession.cpp             \
+        DatagramPool.cpp                \
+        LatencyTrace.cpp                \
+        Metrics.cpp                     \
         Parameters.cpp                  \
         ParsedMessage.cpp               \
+        sink/ClockSkewEstimator.cpp     \
+        sink/DirectRenderer.cpp         \
+        sink/FECDecoder.cpp             \
+        sink/JitterBuffer.cpp           \
         sink/LinearRegression.cpp       \
+        sink/NackTracker.cpp            \
+        sink/PacketRing.cpp             \
+        sink/PlayoutDelayEstimator.cpp  \
+        sink/RTPCapture.cpp             \
         sink/RTPSink.cpp                \
+        sink/SinkCapabilities.cpp       \
+        sink/SinkStats.cpp              \
+        sink/SinkThreadPool.cpp         \
+        sink/TimestampSlewer.cpp        \
         sink/TunnelRenderer.cpp         \
         sink/WifiDisplaySink.cpp        \
+        source/BitrateController.cpp    \
+        source/CRCKernels.cpp           \
         source/Converter.cpp            \
+        source/FECEncoder.cpp           \
         source/MediaPuller.cpp          \
+        source/PCMKernels.cpp           \
         source/PlaybackSession.cpp      \
         source/RepeaterSource.cpp       \
         source/Sender.cpp               \
         source/TSPacketizer.cpp         \
         source/WifiDisplaySource.cpp    \
+        ThreadConfig.cpp                \
         TimeSeries.cpp                  \
 
 LOCAL_C_INCLUDES:= \
@@ -83,3 +103,61 @@ LOCAL_MODULE:= udptest
 LOCAL_MODULE_TAGS := debug
 
 # include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        wfdreplay.cpp               \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libbinder                       \
+        libgui                          \
+        libmedia                        \
+        libstagefright                  \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= wfdreplay
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        rtsptest.cpp                \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= rtsptest
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
+
+################################################################################
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+        crctest.cpp                 \
+
+LOCAL_SHARED_LIBRARIES:= \
+        libstagefright_foundation       \
+        libstagefright_wfd              \
+        libutils                        \
+
+LOCAL_MODULE:= crctest
+
+LOCAL_MODULE_TAGS := debug
+
+# include $(BUILD_EXECUTABLE)
@@ -0,0 +1,80 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DatagramPool"
+#include <utils/Log.h>
+
+#include "DatagramPool.h"
+
+#include <cutils/atomic.h>
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+namespace android {
+
+DatagramPool::DatagramPool(size_t numBuffers, size_t bufferSize)
+    : mBufferSize(bufferSize),
+      mNextIndex(0),
+      mNumOverflows(0) {
+    CHECK_GT(numBuffers, 0u);
+
+    mBuffers.setCapacity(numBuffers);
+    for (size_t i = 0; i < numBuffers; ++i) {
+        mBuffers.push(new ABuffer(bufferSize));
+    }
+}
+
+DatagramPool::~DatagramPool() {
+}
+
+size_t DatagramPool::bufferSize() const {
+    return mBufferSize;
+}
+
+sp<ABuffer> DatagramPool::acquire() {
+    // Buffers are usually released in the order they were handed out,
+    // so the slot following the last one is almost always free.
+    size_t n = mBuffers.size();
+    for (size_t i = 0; i < n; ++i) {
+        const sp<ABuffer> &buffer = mBuffers.itemAt(mNextIndex);
+
+        if (++mNextIndex == n) {
+            mNextIndex = 0;
+        }
+
+        if (buffer->getStrongCount() == 1) {
+            // Nobody but us holds on to this one anymore.
+            buffer->setRange(0, buffer->capacity());
+            buffer->setInt32Data(0);
+            buffer->meta()->clear();
+
+            return buffer;
+        }
+    }
+
+    if (android_atomic_inc(&mNumOverflows) == 0) {
+        ALOGW("pool of %d buffers exhausted, allocating from the heap.", n);
+    }
+
+    return new ABuffer(mBufferSize);
+}
+
+size_t DatagramPool::numBuffers() const {
+    return mBuffers.size();
+}
+
+size_t DatagramPool::numBuffersInUse() const {
+    size_t inUse = 0;
+    for (size_t i = 0; i < mBuffers.size(); ++i) {
+        if (mBuffers.itemAt(i)->getStrongCount() > 1) {
+            ++inUse;
+        }
+    }
+
+    return inUse;
+}
+
+size_t DatagramPool::numOverflows() const {
+    return android_atomic_acquire_load(&mNumOverflows);
+}
+
+}  // namespace android
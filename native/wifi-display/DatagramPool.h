@@ -0,0 +1,50 @@
+#ifndef DATAGRAM_POOL_H_
+
+#define DATAGRAM_POOL_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+#include <utils/Vector.h>
+
+namespace android {
+
+struct ABuffer;
+
+// A fixed set of equally sized receive buffers that are allocated once and
+// then recycled. A buffer is back in the pool as soon as everybody else has
+// dropped their reference to it, there is no explicit release.
+// acquire() must only ever be called from a single thread, the buffers
+// themselves may be released on any thread.
+struct DatagramPool : public RefBase {
+    DatagramPool(size_t numBuffers, size_t bufferSize);
+
+    size_t bufferSize() const;
+
+    // Returns a buffer with its range covering the full capacity and empty
+    // meta data. If all pooled buffers are in flight a temporary buffer
+    // is allocated from the heap instead.
+    sp<ABuffer> acquire();
+
+    size_t numBuffers() const;
+
+    // Number of pooled buffers currently referenced outside of the pool.
+    size_t numBuffersInUse() const;
+
+    // Number of acquire() calls that couldn't be satisfied from the pool.
+    size_t numOverflows() const;
+
+protected:
+    virtual ~DatagramPool();
+
+private:
+    size_t mBufferSize;
+    Vector<sp<ABuffer> > mBuffers;
+    size_t mNextIndex;
+    volatile int32_t mNumOverflows;
+
+    DISALLOW_EVIL_CONSTRUCTORS(DatagramPool);
+};
+
+}  // namespace android
+
+#endif  // DATAGRAM_POOL_H_
@@ -0,0 +1,131 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "LatencyTrace"
+#include <utils/Log.h>
+
+#define ATRACE_TAG ATRACE_TAG_VIDEO
+#include <utils/Trace.h>
+
+#include "LatencyTrace.h"
+
+#if ENABLE_LATENCY_TRACE
+
+#include "Metrics.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+namespace android {
+
+static const char *kStageNames[LatencyTrace::kNumStages] = {
+    "capture",
+    "encode",
+    "packetize",
+    "send",
+    "arrival",
+    "parse",
+    "jitter_buffer",
+    "player_queue",
+};
+
+static pthread_once_t gInitOnce = PTHREAD_ONCE_INIT;
+static int gTraceFd = -1;
+static MetricsRegistry::Histogram *gHistograms[LatencyTrace::kNumStages];
+
+// static
+void LatencyTrace::Init() {
+    gTraceFd = open(
+            "/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+
+    sp<MetricsRegistry> metrics = MetricsRegistry::Get();
+
+    for (size_t i = 0; i < kNumStages; ++i) {
+        if (i == kStageCapture || i == kStageArrival) {
+            // Nothing precedes these.
+            gHistograms[i] = NULL;
+            continue;
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "latency.%s_us", kStageNames[i]);
+        gHistograms[i] = metrics->histogram(name);
+    }
+}
+
+// static
+void LatencyTrace::WriteAsyncEvent(char type, Stage stage, int32_t cookie) {
+    char buf[64];
+    int len = snprintf(
+            buf, sizeof(buf), "%c|%d|wfd.%s|%d",
+            type, getpid(), kStageNames[stage], cookie);
+
+    write(gTraceFd, buf, len);
+}
+
+// static
+void LatencyTrace::Mark(Stage stage, int32_t cookie, int64_t prevTimeUs) {
+    pthread_once(&gInitOnce, Init);
+
+    bool first = (stage == kStageCapture || stage == kStageArrival);
+
+    if (!first && prevTimeUs >= 0ll) {
+        gHistograms[stage]->record(ALooper::GetNowUs() - prevTimeUs);
+    }
+
+    if (gTraceFd < 0 || !Tracer::isTagEnabled(ATRACE_TAG)) {
+        return;
+    }
+
+    // The slice named after a stage covers the time it takes to get there.
+    if (!first) {
+        WriteAsyncEvent('F', stage, cookie);
+    }
+
+    if (stage + 1 < kNumStages && stage != kStageSent) {
+        WriteAsyncEvent('S', (Stage)(stage + 1), cookie);
+    }
+}
+
+// static
+void LatencyTrace::Mark(Stage stage, const sp<ABuffer> &buffer) {
+    sp<AMessage> meta = buffer->meta();
+
+    int32_t cookie;
+    int64_t prevTimeUs;
+    if (!meta->findInt32("trace-cookie", &cookie)
+            || !meta->findInt64("trace-time-us", &prevTimeUs)) {
+        return;
+    }
+
+    Mark(stage, cookie, prevTimeUs);
+
+    meta->setInt64("trace-time-us", ALooper::GetNowUs());
+}
+
+// static
+void LatencyTrace::Stamp(int32_t cookie, const sp<ABuffer> &buffer) {
+    sp<AMessage> meta = buffer->meta();
+    meta->setInt32("trace-cookie", cookie);
+    meta->setInt64("trace-time-us", ALooper::GetNowUs());
+}
+
+// static
+void LatencyTrace::Carry(const sp<ABuffer> &from, const sp<ABuffer> &to) {
+    int32_t cookie;
+    int64_t timeUs;
+    if (from->meta()->findInt32("trace-cookie", &cookie)
+            && from->meta()->findInt64("trace-time-us", &timeUs)) {
+        to->meta()->setInt32("trace-cookie", cookie);
+        to->meta()->setInt64("trace-time-us", timeUs);
+    }
+}
+
+}  // namespace android
+
+#endif  // ENABLE_LATENCY_TRACE
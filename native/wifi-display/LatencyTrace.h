@@ -0,0 +1,65 @@
+#ifndef LATENCY_TRACE_H_
+
+#define LATENCY_TRACE_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+
+// If disabled, no stage is timed or traced, all call sites compile away.
+// Off by default, tracing costs a meta lookup per packet in the sink and
+// bookkeeping per buffer queued to the player.
+#define ENABLE_LATENCY_TRACE    0
+
+namespace android {
+
+struct ABuffer;
+
+// Follows access units through the source and RTP packets through the
+// sink. Every stage reached records the time spent since the previous one
+// in a per-stage MetricsRegistry histogram ("latency.<stage>_us") and,
+// while video tracing is enabled in systrace, closes the async slice of
+// the previous stage and opens one for the next.
+// Items are identified by a cookie, the capture time on the source and
+// the RTP sequence number on the sink.
+struct LatencyTrace {
+    enum Stage {
+        // source
+        kStageCapture,
+        kStageEncoded,
+        kStagePacketized,
+        kStageSent,
+
+        // sink
+        kStageArrival,
+        kStageParsed,
+        kStageDequeued,
+        kStageQueuedToPlayer,
+
+        kNumStages
+    };
+
+    // Item "cookie" reached "stage" now, it reached the previous stage at
+    // "prevTimeUs" (ignored for the first stage of source and sink).
+    static void Mark(Stage stage, int32_t cookie, int64_t prevTimeUs);
+
+    // Same, for an item that carries its cookie and the time it reached
+    // the previous stage in its meta data. Both are updated.
+    static void Mark(Stage stage, const sp<ABuffer> &buffer);
+
+    // Stamps "buffer" with "cookie" as having reached a stage now, for use
+    // by the buffer based Mark() later on.
+    static void Stamp(int32_t cookie, const sp<ABuffer> &buffer);
+
+    // "to" was derived from "from" and continues its trace.
+    static void Carry(const sp<ABuffer> &from, const sp<ABuffer> &to);
+
+private:
+    static void Init();
+    static void WriteAsyncEvent(char type, Stage stage, int32_t cookie);
+
+    DISALLOW_EVIL_CONSTRUCTORS(LatencyTrace);
+};
+
+}  // namespace android
+
+#endif  // LATENCY_TRACE_H_
@@ -0,0 +1,305 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "Metrics"
+#include <utils/Log.h>
+
+#include "Metrics.h"
+
+#include <cutils/atomic.h>
+#include <cutils/properties.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace android {
+
+MetricsRegistry::Counter::Counter()
+    : mValue(0),
+      mLastValue(0) {
+}
+
+void MetricsRegistry::Counter::increment(int32_t amount) {
+    android_atomic_add(amount, &mValue);
+}
+
+int32_t MetricsRegistry::Counter::value() const {
+    return android_atomic_acquire_load(&mValue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+MetricsRegistry::Gauge::Gauge()
+    : mValue(0) {
+}
+
+void MetricsRegistry::Gauge::set(int32_t value) {
+    android_atomic_release_store(value, &mValue);
+}
+
+int32_t MetricsRegistry::Gauge::value() const {
+    return android_atomic_acquire_load(&mValue);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+MetricsRegistry::Histogram::Histogram()
+    : mCount(0),
+      mMax(0) {
+    memset((void *)mBuckets, 0, sizeof(mBuckets));
+}
+
+// static
+size_t MetricsRegistry::Histogram::BucketIndex(int64_t value) {
+    if (value < kNumLinearBuckets) {
+        return value < 0 ? 0 : value;
+    }
+
+    // kNumLinearBuckets is 2^4, 2 bits of mantissa select the sub bucket.
+    size_t exponent = 63 - __builtin_clzll(value);
+    size_t index = kNumLinearBuckets
+        + (exponent - 4) * kNumSubBuckets
+        + ((value >> (exponent - 2)) & (kNumSubBuckets - 1));
+
+    return index < kNumBuckets ? index : kNumBuckets - 1;
+}
+
+// static
+int64_t MetricsRegistry::Histogram::BucketUpperBound(size_t index) {
+    if (index < kNumLinearBuckets) {
+        return index + 1;
+    }
+
+    size_t exponent = 4 + (index - kNumLinearBuckets) / kNumSubBuckets;
+    size_t sub = (index - kNumLinearBuckets) % kNumSubBuckets;
+
+    return (1ll << exponent) + (sub + 1) * (1ll << (exponent - 2));
+}
+
+void MetricsRegistry::Histogram::record(int64_t value) {
+    android_atomic_inc(&mBuckets[BucketIndex(value)]);
+    android_atomic_inc(&mCount);
+
+    if (value > 0x7fffffffll) {
+        value = 0x7fffffffll;
+    }
+
+    int32_t prevMax;
+    do {
+        prevMax = android_atomic_acquire_load(&mMax);
+        if (value <= prevMax) {
+            break;
+        }
+    } while (android_atomic_cmpxchg(prevMax, (int32_t)value, &mMax));
+}
+
+int32_t MetricsRegistry::Histogram::count() const {
+    return android_atomic_acquire_load(&mCount);
+}
+
+int32_t MetricsRegistry::Histogram::max() const {
+    return android_atomic_acquire_load(&mMax);
+}
+
+int64_t MetricsRegistry::Histogram::percentile(size_t percentile) const {
+    // Concurrent updates may make the buckets and the total disagree
+    // slightly, which doesn't matter here.
+    uint32_t counts[kNumBuckets];
+    uint64_t total = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+        counts[i] = android_atomic_acquire_load(&mBuckets[i]);
+        total += counts[i];
+    }
+
+    if (total == 0) {
+        return 0ll;
+    }
+
+    uint64_t threshold = (total * percentile + 99) / 100;
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+        sum += counts[i];
+        if (sum >= threshold) {
+            return BucketUpperBound(i);
+        }
+    }
+
+    return BucketUpperBound(kNumBuckets - 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static Mutex gRegistryLock;
+static sp<MetricsRegistry> gRegistry;
+
+// static
+sp<MetricsRegistry> MetricsRegistry::Get() {
+    Mutex::Autolock autoLock(gRegistryLock);
+
+    if (gRegistry == NULL) {
+        gRegistry = new MetricsRegistry;
+    }
+
+    return gRegistry;
+}
+
+MetricsRegistry::MetricsRegistry()
+    : mLastSnapshotUs(-1ll),
+      mLastDumpUs(-1ll) {
+}
+
+MetricsRegistry::~MetricsRegistry() {
+    // Never reached, the registry lives as long as the process.
+    for (size_t i = 0; i < mCounters.size(); ++i) {
+        delete mCounters.valueAt(i);
+    }
+    for (size_t i = 0; i < mGauges.size(); ++i) {
+        delete mGauges.valueAt(i);
+    }
+    for (size_t i = 0; i < mHistograms.size(); ++i) {
+        delete mHistograms.valueAt(i);
+    }
+}
+
+MetricsRegistry::Counter *MetricsRegistry::counter(const char *name) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mCounters.indexOfKey(AString(name));
+    if (index >= 0) {
+        return mCounters.valueAt(index);
+    }
+
+    Counter *counter = new Counter;
+    mCounters.add(AString(name), counter);
+
+    return counter;
+}
+
+MetricsRegistry::Gauge *MetricsRegistry::gauge(const char *name) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mGauges.indexOfKey(AString(name));
+    if (index >= 0) {
+        return mGauges.valueAt(index);
+    }
+
+    Gauge *gauge = new Gauge;
+    mGauges.add(AString(name), gauge);
+
+    return gauge;
+}
+
+MetricsRegistry::Histogram *MetricsRegistry::histogram(const char *name) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t index = mHistograms.indexOfKey(AString(name));
+    if (index >= 0) {
+        return mHistograms.valueAt(index);
+    }
+
+    Histogram *histogram = new Histogram;
+    mHistograms.add(AString(name), histogram);
+
+    return histogram;
+}
+
+void MetricsRegistry::snapshot(AString *out) {
+    Mutex::Autolock autoLock(mLock);
+
+    int64_t nowUs = ALooper::GetNowUs();
+    int64_t elapsedUs =
+        (mLastSnapshotUs < 0ll) ? 0ll : nowUs - mLastSnapshotUs;
+    mLastSnapshotUs = nowUs;
+
+    for (size_t i = 0; i < mCounters.size(); ++i) {
+        Counter *counter = mCounters.valueAt(i);
+
+        int32_t value = counter->value();
+        int32_t delta =
+            (int32_t)((uint32_t)value - (uint32_t)counter->mLastValue);
+        counter->mLastValue = value;
+
+        if (elapsedUs > 0ll) {
+            counter->mRates.add(delta * 1E6 / elapsedUs);
+        }
+
+        out->append(StringPrintf(
+                    "%s: %d (%.1f/s, avg %.1f/s +/- %.1f)\n",
+                    mCounters.keyAt(i).c_str(),
+                    value,
+                    elapsedUs > 0ll ? delta * 1E6 / elapsedUs : 0.0,
+                    counter->mRates.mean(),
+                    counter->mRates.sdev()));
+    }
+
+    for (size_t i = 0; i < mGauges.size(); ++i) {
+        out->append(StringPrintf(
+                    "%s: %d\n",
+                    mGauges.keyAt(i).c_str(),
+                    mGauges.valueAt(i)->value()));
+    }
+
+    for (size_t i = 0; i < mHistograms.size(); ++i) {
+        const Histogram *histogram = mHistograms.valueAt(i);
+
+        out->append(StringPrintf(
+                    "%s: n=%d p50=%lld p95=%lld p99=%lld max=%d\n",
+                    mHistograms.keyAt(i).c_str(),
+                    histogram->count(),
+                    histogram->percentile(50),
+                    histogram->percentile(95),
+                    histogram->percentile(99),
+                    histogram->max()));
+    }
+}
+
+void MetricsRegistry::dump() {
+    AString out;
+    snapshot(&out);
+
+    size_t start = 0;
+    while (start < out.size()) {
+        ssize_t end = out.find("\n", start);
+        if (end < 0) {
+            end = out.size();
+        }
+
+        AString line(out, start, end - start);
+        ALOGI("%s", line.c_str());
+
+        start = end + 1;
+    }
+}
+
+void MetricsRegistry::dumpIfRequested() {
+    char val[PROPERTY_VALUE_MAX];
+    if (!property_get("media.wfd.metrics-dump-secs", val, NULL)) {
+        return;
+    }
+
+    char *end;
+    unsigned long intervalSecs = strtoul(val, &end, 10);
+
+    if (*end != '\0' || end == val || intervalSecs == 0) {
+        ALOGW("ignoring malformed media.wfd.metrics-dump-secs '%s'", val);
+        return;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        if (mLastDumpUs >= 0ll
+                && nowUs < mLastDumpUs + intervalSecs * 1000000ll) {
+            return;
+        }
+
+        mLastDumpUs = nowUs;
+    }
+
+    dump();
+}
+
+}  // namespace android
@@ -0,0 +1,125 @@
+#ifndef METRICS_H_
+
+#define METRICS_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <media/stagefright/foundation/AString.h>
+#include <utils/KeyedVector.h>
+#include <utils/RefBase.h>
+#include <utils/threads.h>
+
+#include "TimeSeries.h"
+
+namespace android {
+
+// Process wide registry of named counters, gauges and latency histograms.
+// Looking a metric up by name takes a lock and is meant to happen once at
+// setup, the returned pointer stays valid for the lifetime of the process.
+// Recording through it is a single atomic operation and safe from any
+// thread, so it can stay enabled on the packet paths.
+struct MetricsRegistry : public RefBase {
+    static sp<MetricsRegistry> Get();
+
+    struct Counter {
+        Counter();
+
+        void increment(int32_t amount = 1);
+
+        // Wraps around at 2^32, consumers look at differences.
+        int32_t value() const;
+
+    private:
+        friend struct MetricsRegistry;
+
+        volatile int32_t mValue;
+
+        // Snapshot state, protected by the registry's lock.
+        int32_t mLastValue;
+        TimeSeries mRates;
+
+        DISALLOW_EVIL_CONSTRUCTORS(Counter);
+    };
+
+    struct Gauge {
+        Gauge();
+
+        void set(int32_t value);
+        int32_t value() const;
+
+    private:
+        volatile int32_t mValue;
+
+        DISALLOW_EVIL_CONSTRUCTORS(Gauge);
+    };
+
+    // Log-linear buckets, exact below 16 and with 4 buckets per power of
+    // two above, i.e. a relative error of at most 25%.
+    struct Histogram {
+        Histogram();
+
+        // Negative values are recorded as 0.
+        void record(int64_t value);
+
+        // Value below which "percentile" percent of the samples recorded
+        // so far fall (upper bound of the bucket), 0 if there are none.
+        int64_t percentile(size_t percentile) const;
+
+        int32_t count() const;
+        int32_t max() const;
+
+    private:
+        enum {
+            kNumLinearBuckets = 16,
+            kNumSubBuckets = 4,
+            kNumBuckets = kNumLinearBuckets + 28 * kNumSubBuckets,
+        };
+
+        volatile int32_t mBuckets[kNumBuckets];
+        volatile int32_t mCount;
+        volatile int32_t mMax;
+
+        static size_t BucketIndex(int64_t value);
+        static int64_t BucketUpperBound(size_t index);
+
+        DISALLOW_EVIL_CONSTRUCTORS(Histogram);
+    };
+
+    // Returns the metric of that name, creating it if necessary. Sessions
+    // recreated later on share the existing metric.
+    Counter *counter(const char *name);
+    Gauge *gauge(const char *name);
+    Histogram *histogram(const char *name);
+
+    // Appends one line per metric to "out". Counters also report their
+    // rate since the previous snapshot and its mean over recent ones.
+    void snapshot(AString *out);
+
+    // Logs a snapshot.
+    void dump();
+
+    // Logs a snapshot every "media.wfd.metrics-dump-secs" seconds while
+    // that property is set, does nothing otherwise. Meant to be called
+    // periodically, e.g. along with RTCP reports, from any thread.
+    void dumpIfRequested();
+
+protected:
+    virtual ~MetricsRegistry();
+
+private:
+    Mutex mLock;
+
+    KeyedVector<AString, Counter *> mCounters;
+    KeyedVector<AString, Gauge *> mGauges;
+    KeyedVector<AString, Histogram *> mHistograms;
+
+    int64_t mLastSnapshotUs;
+    int64_t mLastDumpUs;
+
+    MetricsRegistry();
+
+    DISALLOW_EVIL_CONSTRUCTORS(MetricsRegistry);
+};
+
+}  // namespace android
+
+#endif  // METRICS_H_
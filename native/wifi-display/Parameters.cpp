@@ -3,6 +3,9 @@
 
 #include <media/stagefright/MediaErrors.h>
 
+#include <ctype.h>
+#include <strings.h>
+
 namespace android {
 
 // static
@@ -56,6 +59,73 @@ status_t Parameters::parse(const char *data, size_t size) {
     return OK;
 }
 
+// static
+bool Parameters::FindParameter(
+        const char *data, size_t size, const char *name,
+        const char **value, size_t *length) {
+    size_t nameLength = strlen(name);
+    bool found = false;
+
+    size_t i = 0;
+    while (i < size) {
+        size_t lineStart = i;
+
+        const char *lineEnd = NULL;
+        for (size_t j = i; j + 1 < size; ++j) {
+            if (data[j] == '\r' && data[j + 1] == '\n') {
+                lineEnd = &data[j];
+                break;
+            }
+        }
+
+        size_t lineLength =
+            (lineEnd == NULL) ? size - lineStart : lineEnd - &data[lineStart];
+
+        i = lineStart + lineLength + 2;
+
+        const char *colonPos =
+            (const char *)memchr(&data[lineStart], ':', lineLength);
+
+        if (colonPos == NULL) {
+            continue;
+        }
+
+        const char *s = &data[lineStart];
+        const char *e = colonPos;
+
+        while (s < e && isspace(*s)) {
+            ++s;
+        }
+
+        while (e > s && isspace(e[-1])) {
+            --e;
+        }
+
+        if ((size_t)(e - s) != nameLength || strncasecmp(s, name, nameLength)) {
+            continue;
+        }
+
+        s = colonPos + 1;
+        e = &data[lineStart + lineLength];
+
+        while (s < e && isspace(*s)) {
+            ++s;
+        }
+
+        while (e > s && isspace(e[-1])) {
+            --e;
+        }
+
+        // Keep looking, later lines override earlier ones just like they
+        // do in the dictionary.
+        *value = s;
+        *length = e - s;
+        found = true;
+    }
+
+    return found;
+}
+
 bool Parameters::findParameter(const char *name, AString *value) const {
     AString key = name;
     key.tolower();
@@ -11,6 +11,14 @@ struct Parameters : public RefBase {
 
     bool findParameter(const char *name, AString *value) const;
 
+    // Looks up a single parameter in the "name: value" lines at "data"
+    // without parsing them into a dictionary or copying anything, "*value"
+    // then points into "data" and is "*length" bytes long. Lines that
+    // aren't well formed are skipped.
+    static bool FindParameter(
+            const char *data, size_t size, const char *name,
+            const char **value, size_t *length);
+
 protected:
     virtual ~Parameters();
 
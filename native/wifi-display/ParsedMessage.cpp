@@ -3,6 +3,7 @@
 #include "ParsedMessage.h"
 
 #include <ctype.h>
+#include <strings.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 
@@ -10,12 +11,16 @@ namespace android {
 
 // static
 sp<ParsedMessage> ParsedMessage::Parse(
-        const char *data, size_t size, bool noMoreData, size_t *length) {
+        const char *data, size_t size, bool noMoreData, size_t *length,
+        ssize_t headersLength) {
     sp<ParsedMessage> msg = new ParsedMessage;
-    ssize_t res = msg->parse(data, size, noMoreData);
+
+    size_t neededLength = 0;
+    ssize_t res =
+        msg->parse(data, size, noMoreData, headersLength, &neededLength);
 
     if (res < 0) {
-        *length = 0;
+        *length = neededLength;
         return NULL;
     }
 
@@ -23,76 +28,221 @@ sp<ParsedMessage> ParsedMessage::Parse(
     return msg;
 }
 
-ParsedMessage::ParsedMessage() {
+// static
+ssize_t ParsedMessage::FindEndOfHeaders(
+        const char *data, size_t size, size_t *scanOffset) {
+    size_t offset = *scanOffset;
+
+    while (offset + 3 < size) {
+        const char *cr =
+            (const char *)memchr(&data[offset], '\r', size - 3 - offset);
+
+        if (cr == NULL) {
+            offset = size - 3;
+            break;
+        }
+
+        offset = cr - data;
+
+        if (data[offset + 1] == '\n'
+                && data[offset + 2] == '\r'
+                && data[offset + 3] == '\n') {
+            *scanOffset = offset;
+            return offset + 4;
+        }
+
+        ++offset;
+    }
+
+    *scanOffset = offset;
+
+    return -1;
+}
+
+ParsedMessage::ParsedMessage()
+    : mData(NULL) {
+    mRequestLine.mOffset = mRequestLine.mLength = 0;
+    mContent.mOffset = mContent.mLength = 0;
 }
 
 ParsedMessage::~ParsedMessage() {
+    delete[] mData;
+    mData = NULL;
 }
 
-bool ParsedMessage::findString(const char *name, AString *value) const {
-    AString key = name;
-    key.tolower();
+ssize_t ParsedMessage::indexOfHeader(
+        const char *base, const char *name) const {
+    size_t nameLength = strlen(name);
 
-    ssize_t index = mDict.indexOfKey(key);
+    // Later headers override earlier ones of the same name.
+    for (size_t i = mHeaders.size(); i-- > 0;) {
+        const Span &span = mHeaders.itemAt(i).mName;
+
+        if (span.mLength == nameLength
+                && !strncasecmp(&base[span.mOffset], name, nameLength)) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+bool ParsedMessage::findField(
+        const char *name, const char **value, size_t *length) const {
+    if (!strcmp(name, "_")) {
+        *value = &mData[mRequestLine.mOffset];
+        *length = mRequestLine.mLength;
+        return true;
+    }
+
+    ssize_t index = indexOfHeader(mData, name);
 
     if (index < 0) {
+        return false;
+    }
+
+    const Span &span = mHeaders.itemAt(index).mValue;
+    *value = &mData[span.mOffset];
+    *length = span.mLength;
+
+    return true;
+}
+
+bool ParsedMessage::findString(const char *name, AString *value) const {
+    const char *s;
+    size_t length;
+    if (!findField(name, &s, &length)) {
         value->clear();
 
         return false;
     }
 
-    *value = mDict.valueAt(index);
+    value->setTo(s, length);
     return true;
 }
 
 bool ParsedMessage::findInt32(const char *name, int32_t *value) const {
-    AString stringValue;
+    const char *s;
+    size_t length;
+    if (!findField(name, &s, &length)) {
+        return false;
+    }
 
-    if (!findString(name, &stringValue)) {
+    if (!ParseInt32(s, length, value)) {
+        *value = 0;
         return false;
     }
 
-    char *end;
-    *value = strtol(stringValue.c_str(), &end, 10);
+    return true;
+}
 
-    if (end == stringValue.c_str() || *end != '\0') {
-        *value = 0;
+// static
+bool ParsedMessage::ParseInt32(const char *s, size_t length, int32_t *value) {
+    while (length > 0 && isspace(*s)) {
+        ++s;
+        --length;
+    }
+
+    while (length > 0 && isspace(s[length - 1])) {
+        --length;
+    }
+
+    bool negative = false;
+    if (length > 0 && (*s == '-' || *s == '+')) {
+        negative = (*s == '-');
+        ++s;
+        --length;
+    }
+
+    if (length == 0) {
         return false;
     }
 
+    // Saturates like strtol() does.
+    int64_t x = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (!isdigit(s[i])) {
+            return false;
+        }
+
+        if (x <= 0x7fffffffll) {
+            x = x * 10 + (s[i] - '0');
+        }
+    }
+
+    if (negative) {
+        x = -x;
+    }
+
+    if (x > 0x7fffffffll) {
+        x = 0x7fffffffll;
+    } else if (x < -0x80000000ll) {
+        x = -0x80000000ll;
+    }
+
+    *value = (int32_t)x;
+
     return true;
 }
 
 const char *ParsedMessage::getContent() const {
-    return mContent.c_str();
+    return &mData[mContent.mOffset];
+}
+
+size_t ParsedMessage::getContentLength() const {
+    return mContent.mLength;
+}
+
+static void TrimSpan(const char *base, size_t *offset, size_t *length) {
+    while (*length > 0 && isspace(base[*offset])) {
+        ++*offset;
+        --*length;
+    }
+
+    while (*length > 0 && isspace(base[*offset + *length - 1])) {
+        --*length;
+    }
 }
 
-ssize_t ParsedMessage::parse(const char *data, size_t size, bool noMoreData) {
+ssize_t ParsedMessage::parse(
+        const char *data, size_t size, bool noMoreData,
+        ssize_t headersLength, size_t *neededLength) {
     if (size == 0) {
         return -1;
     }
 
-    ssize_t lastDictIndex = -1;
+    if (headersLength < 0) {
+        size_t scanOffset = 0;
+        headersLength = FindEndOfHeaders(data, size, &scanOffset);
+
+        if (headersLength < 0) {
+            return -1;
+        }
+    }
+
+    CHECK_LE((size_t)headersLength, size);
+
+    // Lines are located on the input first, the message is only copied
+    // once it's known to be complete. Offsets carry over to the copy.
+
+    mHeaders.setCapacity(16);
+
+    ssize_t lastHeaderIndex = -1;
+    bool folded = false;
 
     size_t offset = 0;
-    while (offset < size) {
+    for (;;) {
+        // Guaranteed to terminate by the empty line found above.
         size_t lineEndOffset = offset;
-        while (lineEndOffset + 1 < size
-                && (data[lineEndOffset] != '\r'
-                        || data[lineEndOffset + 1] != '\n')) {
+        while (data[lineEndOffset] != '\r' || data[lineEndOffset + 1] != '\n') {
             ++lineEndOffset;
         }
 
-        if (lineEndOffset + 1 >= size) {
-            return -1;
-        }
-
-        AString line(&data[offset], lineEndOffset - offset);
-
         if (offset == 0) {
             // Special handling for the request/status line.
 
-            mDict.add(AString("_"), line);
+            mRequestLine.mOffset = 0;
+            mRequestLine.mLength = lineEndOffset;
             offset = lineEndOffset + 2;
 
             continue;
@@ -103,75 +253,132 @@ ssize_t ParsedMessage::parse(const char *data, size_t size, bool noMoreData) {
             break;
         }
 
-        if (line.c_str()[0] == ' ' || line.c_str()[0] == '\t') {
-            // Support for folded header values.
+        if (data[offset] == ' ' || data[offset] == '\t') {
+            // Support for folded header values, the value is extended over
+            // the continuation line and the line break removed later.
 
-            if (lastDictIndex >= 0) {
+            if (lastHeaderIndex >= 0) {
                 // Otherwise it's malformed since the first header line
                 // cannot continue anything...
 
-                AString &value = mDict.editValueAt(lastDictIndex);
-                value.append(line);
+                Span &value = mHeaders.editItemAt(lastHeaderIndex).mValue;
+                value.mLength = lineEndOffset - value.mOffset;
+                folded = true;
             }
 
             offset = lineEndOffset + 2;
             continue;
         }
 
-        ssize_t colonPos = line.find(":");
-        if (colonPos >= 0) {
-            AString key(line, 0, colonPos);
-            key.trim();
-            key.tolower();
+        const char *colonPos =
+            (const char *)memchr(&data[offset], ':', lineEndOffset - offset);
+
+        if (colonPos != NULL) {
+            size_t colonOffset = colonPos - data;
 
-            line.erase(0, colonPos + 1);
+            Header header;
+            header.mName.mOffset = offset;
+            header.mName.mLength = colonOffset - offset;
+            TrimSpan(data, &header.mName.mOffset, &header.mName.mLength);
 
-            lastDictIndex = mDict.add(key, line);
+            header.mValue.mOffset = colonOffset + 1;
+            header.mValue.mLength = lineEndOffset - colonOffset - 1;
+
+            lastHeaderIndex = mHeaders.add(header);
+        } else {
+            // Nothing to continue.
+            lastHeaderIndex = -1;
         }
 
         offset = lineEndOffset + 2;
     }
 
-    for (size_t i = 0; i < mDict.size(); ++i) {
-        mDict.editValueAt(i).trim();
-    }
+    CHECK_EQ(offset, (size_t)headersLength);
 
     // Found the end of headers.
 
-    int32_t contentLength;
-    if (!findInt32("content-length", &contentLength) || contentLength < 0) {
-        contentLength = 0;
+    int32_t contentLength = 0;
+    ssize_t index = indexOfHeader(data, "content-length");
+    if (index >= 0) {
+        const Span &span = mHeaders.itemAt(index).mValue;
+
+        if (!ParseInt32(&data[span.mOffset], span.mLength, &contentLength)
+                || contentLength < 0) {
+            contentLength = 0;
+        }
     }
 
     size_t totalLength = offset + contentLength;
 
     if (size < totalLength) {
+        *neededLength = totalLength;
         return -1;
     }
 
-    mContent.setTo(&data[offset], contentLength);
+    mData = new char[totalLength + 1];
+    memcpy(mData, data, totalLength);
+    mData[totalLength] = '\0';
+
+    for (size_t i = 0; i < mHeaders.size(); ++i) {
+        Span *value = &mHeaders.editItemAt(i).mValue;
+
+        if (folded) {
+            unfold(value);
+        }
+
+        TrimSpan(mData, &value->mOffset, &value->mLength);
+    }
+
+    TrimSpan(mData, &mRequestLine.mOffset, &mRequestLine.mLength);
+
+    mContent.mOffset = offset;
+    mContent.mLength = contentLength;
 
     return totalLength;
 }
 
+void ParsedMessage::unfold(Span *value) {
+    // Continuation lines are appended to the value including their leading
+    // whitespace, only the line breaks go. Done in place, the value only
+    // ever shrinks.
+    char *s = &mData[value->mOffset];
+
+    size_t length = 0;
+    for (size_t i = 0; i < value->mLength; ++i) {
+        if (i + 1 < value->mLength && s[i] == '\r' && s[i + 1] == '\n') {
+            ++i;
+            continue;
+        }
+
+        s[length++] = s[i];
+    }
+
+    value->mLength = length;
+}
+
 void ParsedMessage::getRequestField(size_t index, AString *field) const {
-    AString line;
-    CHECK(findString("_", &line));
+    const char *line = &mData[mRequestLine.mOffset];
+    size_t size = mRequestLine.mLength;
 
-    size_t prevOffset = 0;
     size_t offset = 0;
-    for (size_t i = 0; i <= index; ++i) {
-        ssize_t spacePos = line.find(" ", offset);
+    for (size_t i = 0; i < index; ++i) {
+        const char *spacePos =
+            (const char *)memchr(&line[offset], ' ', size - offset);
 
-        if (spacePos < 0) {
-            spacePos = line.size();
+        if (spacePos == NULL) {
+            field->clear();
+            return;
         }
 
-        prevOffset = offset;
-        offset = spacePos + 1;
+        offset = spacePos - line + 1;
     }
 
-    field->setTo(line, prevOffset, offset - prevOffset - 1);
+    const char *spacePos =
+        (const char *)memchr(&line[offset], ' ', size - offset);
+
+    size_t end = (spacePos == NULL) ? size : spacePos - line;
+
+    field->setTo(&line[offset], end - offset);
 }
 
 bool ParsedMessage::getStatusCode(int32_t *statusCode) const {
@@ -191,27 +398,21 @@ bool ParsedMessage::getStatusCode(int32_t *statusCode) const {
 }
 
 AString ParsedMessage::debugString() const {
-    AString line;
-    CHECK(findString("_", &line));
+    AString line(&mData[mRequestLine.mOffset], mRequestLine.mLength);
 
     line.append("\n");
 
-    for (size_t i = 0; i < mDict.size(); ++i) {
-        const AString &key = mDict.keyAt(i);
-        const AString &value = mDict.valueAt(i);
-
-        if (key == AString("_")) {
-            continue;
-        }
+    for (size_t i = 0; i < mHeaders.size(); ++i) {
+        const Header &header = mHeaders.itemAt(i);
 
-        line.append(key);
+        line.append(&mData[header.mName.mOffset], header.mName.mLength);
         line.append(": ");
-        line.append(value);
+        line.append(&mData[header.mValue.mOffset], header.mValue.mLength);
         line.append("\n");
     }
 
     line.append("\n");
-    line.append(mContent);
+    line.append(getContent(), getContentLength());
 
     return line;
 }
@@ -1,21 +1,43 @@
 
 #include <media/stagefright/foundation/ABase.h>
 #include <media/stagefright/foundation/AString.h>
-#include <utils/KeyedVector.h>
 #include <utils/RefBase.h>
+#include <utils/Vector.h>
 
 namespace android {
 
 // Encapsulates an "HTTP/RTSP style" response, i.e. a status line,
 // key/value pairs making up the headers and an optional body/content.
+// The message is held in a single buffer, headers are located by offsets
+// into it instead of being copied out.
 struct ParsedMessage : public RefBase {
+    // "headersLength" is what FindEndOfHeaders() returned for "data" if the
+    // caller already knows, saving another scan for the end of the headers.
+    // If NULL is returned because the content hasn't been received in full,
+    // "*length" is the size "data" needs to reach before trying again,
+    // otherwise 0.
     static sp<ParsedMessage> Parse(
-            const char *data, size_t size, bool noMoreData, size_t *length);
+            const char *data, size_t size, bool noMoreData, size_t *length,
+            ssize_t headersLength = -1);
+
+    // Searches "data" for the empty line terminating the headers, starting
+    // at "*scanOffset" which is updated to where the search may resume
+    // once more data has arrived, so that a growing buffer is only scanned
+    // once. Returns the length of the headers including the empty line or
+    // -1 if it hasn't been received yet.
+    static ssize_t FindEndOfHeaders(
+            const char *data, size_t size, size_t *scanOffset);
 
     bool findString(const char *name, AString *value) const;
     bool findInt32(const char *name, int32_t *value) const;
 
+    // Like findString() but without copying, "*value" points into the
+    // message and is "*length" bytes long, it is NOT NUL-terminated.
+    bool findField(const char *name, const char **value, size_t *length) const;
+
+    // NUL-terminated.
     const char *getContent() const;
+    size_t getContentLength() const;
 
     void getRequestField(size_t index, AString *field) const;
     bool getStatusCode(int32_t *statusCode) const;
@@ -32,12 +54,33 @@ protected:
     virtual ~ParsedMessage();
 
 private:
-    KeyedVector<AString, AString> mDict;
-    AString mContent;
+    struct Span {
+        size_t mOffset;
+        size_t mLength;
+    };
+
+    struct Header {
+        Span mName;
+        Span mValue;
+    };
+
+    // The message as received with folded header lines joined,
+    // followed by a NUL.
+    char *mData;
+
+    Span mRequestLine;
+    Vector<Header> mHeaders;
+    Span mContent;
 
     ParsedMessage();
 
-    ssize_t parse(const char *data, size_t size, bool noMoreData);
+    ssize_t parse(
+            const char *data, size_t size, bool noMoreData,
+            ssize_t headersLength, size_t *neededLength);
+    ssize_t indexOfHeader(const char *base, const char *name) const;
+    void unfold(Span *value);
+
+    static bool ParseInt32(const char *s, size_t length, int32_t *value);
 
     DISALLOW_EVIL_CONSTRUCTORS(ParsedMessage);
 };
@@ -0,0 +1,164 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ThreadConfig"
+#include <utils/Log.h>
+
+#include "ThreadConfig.h"
+
+#include <cutils/properties.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/foundation/AString.h>
+#include <utils/threads.h>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace android {
+
+// Runs ThreadConfig::applyToCurrentThread() on whatever looper it is
+// registered with.
+struct ApplyThreadConfigHandler : public AHandler {
+    ApplyThreadConfigHandler(const ThreadConfig &config, const char *name)
+        : mConfig(config),
+          mName(name) {
+    }
+
+    enum {
+        kWhatApply,
+    };
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &msg) {
+        CHECK_EQ(msg->what(), (uint32_t)kWhatApply);
+
+        uint32_t replyID;
+        CHECK(msg->senderAwaitsResponse(&replyID));
+
+        sp<AMessage> response = new AMessage;
+        response->setInt32("err", mConfig.applyToCurrentThread(mName.c_str()));
+        response->postReply(replyID);
+    }
+
+    virtual ~ApplyThreadConfigHandler() {}
+
+private:
+    ThreadConfig mConfig;
+    AString mName;
+
+    DISALLOW_EVIL_CONSTRUCTORS(ApplyThreadConfigHandler);
+};
+
+static bool GetInt32Property(
+        const char *prefix, const char *key, int32_t *value) {
+    AString name = StringPrintf("%s.%s", prefix, key);
+
+    char val[PROPERTY_VALUE_MAX];
+    if (!property_get(name.c_str(), val, NULL)) {
+        return false;
+    }
+
+    char *end;
+    long x = strtol(val, &end, 10);
+
+    if (*end != '\0' || end == val) {
+        ALOGW("ignoring malformed property %s='%s'", name.c_str(), val);
+        return false;
+    }
+
+    *value = x;
+
+    return true;
+}
+
+ThreadConfig::ThreadConfig()
+    : mNice(ANDROID_PRIORITY_AUDIO),
+      mFifoPriority(0),
+      mCPU(-1) {
+}
+
+// static
+ThreadConfig ThreadConfig::FromProperties(const char *prefix) {
+    ThreadConfig config;
+
+    GetInt32Property(prefix, "nice", &config.mNice);
+    GetInt32Property(prefix, "fifo", &config.mFifoPriority);
+    GetInt32Property(prefix, "cpu", &config.mCPU);
+
+    return config;
+}
+
+status_t ThreadConfig::applyToCurrentThread(const char *name) const {
+    pid_t tid = gettid();
+
+    status_t err = OK;
+    bool isFifo = false;
+
+    if (mFifoPriority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = mFifoPriority;
+
+        if (sched_setscheduler(tid, SCHED_FIFO, &param) < 0) {
+            err = -errno;
+
+            ALOGW("%s: unable to switch to SCHED_FIFO priority %d (%s)",
+                  name, mFifoPriority, strerror(errno));
+        } else {
+            isFifo = true;
+        }
+    }
+
+    if (!isFifo && setpriority(PRIO_PROCESS, tid, mNice) < 0) {
+        err = -errno;
+
+        ALOGW("%s: unable to set nice value %d (%s)",
+              name, mNice, strerror(errno));
+    }
+
+    if (mCPU >= 0) {
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(mCPU, &cpuSet);
+
+        if (sched_setaffinity(tid, sizeof(cpuSet), &cpuSet) < 0) {
+            err = -errno;
+
+            ALOGW("%s: unable to pin thread to cpu %d (%s)",
+                  name, mCPU, strerror(errno));
+        }
+    }
+
+    ALOGI("%s: running with %s %d, cpu %d",
+          name,
+          isFifo ? "SCHED_FIFO priority" : "nice",
+          isFifo ? mFifoPriority : mNice,
+          mCPU);
+
+    return err;
+}
+
+status_t ThreadConfig::applyToLooper(
+        const sp<ALooper> &looper, const char *name) const {
+    sp<ApplyThreadConfigHandler> handler =
+        new ApplyThreadConfigHandler(*this, name);
+
+    looper->registerHandler(handler);
+
+    sp<AMessage> response;
+    status_t err = (new AMessage(
+                ApplyThreadConfigHandler::kWhatApply,
+                handler->id()))->postAndAwaitResponse(&response);
+
+    looper->unregisterHandler(handler->id());
+
+    if (err == OK) {
+        CHECK(response->findInt32("err", &err));
+    }
+
+    return err;
+}
+
+}  // namespace android
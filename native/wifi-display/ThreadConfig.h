@@ -0,0 +1,41 @@
+#ifndef THREAD_CONFIG_H_
+
+#define THREAD_CONFIG_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/Errors.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ALooper;
+
+// Scheduling parameters for a thread on the media data path. Nothing here
+// is fatal, settings the process isn't permitted to make are logged and
+// skipped.
+struct ThreadConfig {
+    ThreadConfig();
+
+    // Reads "<prefix>.nice", "<prefix>.fifo" and "<prefix>.cpu", any
+    // property that isn't set keeps its default.
+    static ThreadConfig FromProperties(const char *prefix);
+
+    // Used unless the thread is switched to SCHED_FIFO.
+    int32_t mNice;
+
+    // SCHED_FIFO priority 1..99, 0 to stay with SCHED_OTHER.
+    int32_t mFifoPriority;
+
+    // Pins the thread to this CPU, -1 for no affinity.
+    int32_t mCPU;
+
+    status_t applyToCurrentThread(const char *name) const;
+
+    // Applies the configuration on the looper's thread and waits for
+    // that to complete.
+    status_t applyToLooper(const sp<ALooper> &looper, const char *name) const;
+};
+
+}  // namespace android
+
+#endif  // THREAD_CONFIG_H_
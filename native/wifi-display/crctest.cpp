@@ -0,0 +1,193 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "crctest"
+#include <utils/Log.h>
+
+#include "source/CRCKernels.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+
+#include <stdlib.h>
+
+namespace android {
+
+// Every available implementation must agree with the bytewise one for all
+// lengths and alignments.
+static void Verify(size_t numIterations, uint32_t seed) {
+    static const size_t kMaxSize = 4096;
+
+    srand(seed);
+
+    uint8_t *data = new uint8_t[kMaxSize + 16];
+
+    size_t numCompared = 0;
+    for (size_t i = 0; i < numIterations; ++i) {
+        size_t offset = rand() % 16;
+        size_t size = (i < 256) ? i : rand() % (kMaxSize + 1);
+
+        for (size_t j = 0; j < size; ++j) {
+            data[offset + j] = rand() & 0xff;
+        }
+
+        uint32_t expected;
+        CHECK(CRCKernels::MPEG2With(
+                    CRCKernels::kImplBytewise, &data[offset], size,
+                    &expected));
+
+        CHECK_EQ(CRCKernels::MPEG2(&data[offset], size), expected);
+
+        for (size_t impl = 0; impl < CRCKernels::kNumImplementations;
+                ++impl) {
+            uint32_t crc;
+            if (!CRCKernels::MPEG2With(
+                        (CRCKernels::Implementation)impl, &data[offset], size,
+                        &crc)) {
+                continue;
+            }
+
+            if (crc != expected) {
+                fprintf(stderr,
+                        "%s: CRC 0x%08x instead of 0x%08x for %d bytes at "
+                        "offset %d (seed %u)\n",
+                        CRCKernels::NameOf((CRCKernels::Implementation)impl),
+                        crc, expected, size, offset, seed);
+                exit(1);
+            }
+
+            ++numCompared;
+        }
+    }
+
+    delete[] data;
+    data = NULL;
+
+    printf("verified %d iterations (seed %u), %d comparisons, "
+           "no mismatches\n",
+           numIterations, seed, numCompared);
+}
+
+static void Benchmark(size_t count) {
+    // A PAT and PMT section, a whole TS packet, an RTP payload's worth of
+    // them and something large enough to tell the kernels apart.
+    static const size_t kSizes[] = { 12, 30, 184, 1316, 65536 };
+    static const size_t kNumSizes = sizeof(kSizes) / sizeof(kSizes[0]);
+
+    uint8_t *data = new uint8_t[kSizes[kNumSizes - 1]];
+    for (size_t i = 0; i < kSizes[kNumSizes - 1]; ++i) {
+        data[i] = rand() & 0xff;
+    }
+
+    for (size_t impl = 0; impl < CRCKernels::kNumImplementations; ++impl) {
+        const char *name =
+            CRCKernels::NameOf((CRCKernels::Implementation)impl);
+
+        uint32_t crc;
+        if (!CRCKernels::MPEG2With(
+                    (CRCKernels::Implementation)impl, data, 0, &crc)) {
+            printf("%s: not available\n", name);
+            continue;
+        }
+
+        for (size_t i = 0; i < kNumSizes; ++i) {
+            size_t size = kSizes[i];
+
+            // About the same number of bytes for every size.
+            size_t numCalls = count * kSizes[kNumSizes - 1] / 4 / size;
+            if (numCalls == 0) {
+                numCalls = 1;
+            }
+
+            int64_t startUs = ALooper::GetNowUs();
+
+            uint32_t sum = 0;
+            for (size_t j = 0; j < numCalls; ++j) {
+                CHECK(CRCKernels::MPEG2With(
+                            (CRCKernels::Implementation)impl, data, size,
+                            &crc));
+
+                sum += crc;
+            }
+
+            double durationSecs = (ALooper::GetNowUs() - startUs) / 1E6;
+
+            printf("%s: %d bytes, %.1f ns per call, %.1f MB/sec "
+                   "(checksum %08x)\n",
+                   name,
+                   size,
+                   durationSecs * 1E9 / numCalls,
+                   numCalls * size / durationSecs / 1E6,
+                   sum);
+        }
+    }
+
+    delete[] data;
+    data = NULL;
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s [-v iterations] [-s seed] [-n count]\n"
+            "           -v iterations\tcompare all implementations with the "
+            "bytewise one\n"
+            "           -s seed      \tseed for the random data\n"
+            "           -n count     \ttime each implementation over this "
+            "many rounds of input sizes\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    size_t numIterations = 0;
+    uint32_t seed = 1;
+    size_t count = 0;
+
+    int res;
+    while ((res = getopt(argc, argv, "hv:s:n:")) >= 0) {
+        switch (res) {
+            case 'v':
+            case 's':
+            case 'n':
+            {
+                char *end;
+                unsigned long x = strtoul(optarg, &end, 10);
+
+                if (*end != '\0' || end == optarg) {
+                    fprintf(stderr, "Illegal number specified.\n");
+                    exit(1);
+                }
+
+                if (res == 'v') {
+                    numIterations = x;
+                } else if (res == 's') {
+                    seed = x;
+                } else {
+                    count = x;
+                }
+                break;
+            }
+
+            case '?':
+            case 'h':
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (numIterations == 0 && count == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (numIterations > 0) {
+        Verify(numIterations, seed);
+    }
+
+    if (count > 0) {
+        Benchmark(count);
+    }
+
+    return 0;
+}
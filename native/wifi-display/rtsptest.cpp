@@ -0,0 +1,434 @@
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "rtsptest"
+#include <utils/Log.h>
+
+#include "Parameters.h"
+#include "ParsedMessage.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AString.h>
+
+namespace android {
+
+// Messages as exchanged with the sources seen so far, the corpus for both
+// the fuzzer and the benchmark.
+static const char *kCorpus[] = {
+    "OPTIONS * RTSP/1.0\r\n"
+    "Date: Thu, 01 Jan 1970 00:00:00 +0000\r\n"
+    "CSeq: 1\r\n"
+    "Require: org.wfa.wfd1.0\r\n"
+    "\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "CSeq: 1\r\n"
+    "Public: org.wfa.wfd1.0, GET_PARAMETER, SET_PARAMETER\r\n"
+    "\r\n",
+
+    "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 59\r\n"
+    "CSeq: 2\r\n"
+    "\r\n"
+    "wfd_video_formats\r\n"
+    "wfd_audio_codecs\r\n"
+    "wfd_client_rtp_ports\r\n",
+
+    "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "CSeq: 3\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 275\r\n"
+    "\r\n"
+    "wfd_video_formats: 28 00 02 02 00000020 00000000 00000000 00 0000 0000 "
+    "00 none none\r\n"
+    "wfd_audio_codecs: AAC 00000001 00\r\n"
+    "wfd_presentation_URL: rtsp://192.168.42.1/wfd1.0/streamid=0 none\r\n"
+    "wfd_client_rtp_ports: RTP/AVP/UDP;unicast 15550 0 mode=play\r\n"
+    "wfd_fec: XOR cols=8;rows=1\r\n",
+
+    "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "CSeq: 4\r\n"
+    "Content-Type: text/parameters\r\n"
+    "Content-Length: 27\r\n"
+    "\r\n"
+    "wfd_trigger_method: SETUP\r\n",
+
+    "RTSP/1.0 200 OK\r\n"
+    "CSeq: 5\r\n"
+    "Session: 1745584664;timeout=30\r\n"
+    "Transport: RTP/AVP/UDP;unicast;client_port=15550-15551;\r\n"
+    "  server_port=15550-15551\r\n"
+    "\r\n",
+
+    // The keep-alive.
+    "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n"
+    "Session: 1745584664\r\n"
+    "CSeq: 6\r\n"
+    "\r\n",
+};
+
+static const size_t kNumCorpusEntries = sizeof(kCorpus) / sizeof(kCorpus[0]);
+
+// Parameters the fuzzer compares between the dictionary and the
+// allocation-free lookup.
+static const char *kParameterNames[] = {
+    "wfd_video_formats",
+    "wfd_audio_codecs",
+    "wfd_presentation_URL",
+    "wfd_client_rtp_ports",
+    "wfd_fec",
+    "wfd_trigger_method",
+};
+
+struct Random {
+    Random(uint32_t seed)
+        : mState(seed != 0 ? seed : 1) {
+    }
+
+    uint32_t next() {
+        mState ^= mState << 13;
+        mState ^= mState >> 17;
+        mState ^= mState << 5;
+        return mState;
+    }
+
+    uint32_t next(uint32_t n) {
+        return next() % n;
+    }
+
+private:
+    uint32_t mState;
+};
+
+struct MessageInfo {
+    size_t mLength;
+    AString mDebugString;
+};
+
+// Splits "data" into messages in one go.
+static void ParseAll(
+        const char *data, size_t size, Vector<MessageInfo> *messages) {
+    size_t offset = 0;
+    for (;;) {
+        size_t length;
+        sp<ParsedMessage> msg =
+            ParsedMessage::Parse(&data[offset], size - offset, false, &length);
+
+        if (msg == NULL) {
+            break;
+        }
+
+        CHECK_GT(length, 0u);
+        CHECK_LE(length, size - offset);
+        CHECK_EQ(msg->getContent()[msg->getContentLength()], '\0');
+
+        MessageInfo info;
+        info.mLength = length;
+        info.mDebugString = msg->debugString();
+        messages->push(info);
+
+        offset += length;
+    }
+}
+
+// Splits "data" into messages the way ANetworkSession receives them,
+// as chunks of random size arriving one after the other.
+static void ParseIncrementally(
+        const char *data, size_t size, Random *random,
+        Vector<MessageInfo> *messages) {
+    size_t start = 0;
+    size_t received = 0;
+    size_t scanOffset = 0;
+
+    while (received < size) {
+        received += 1 + random->next(64);
+        if (received > size) {
+            received = size;
+        }
+
+        for (;;) {
+            ssize_t headersLength =
+                ParsedMessage::FindEndOfHeaders(
+                        &data[start], received - start, &scanOffset);
+
+            if (headersLength < 0) {
+                break;
+            }
+
+            size_t length;
+            sp<ParsedMessage> msg =
+                ParsedMessage::Parse(
+                        &data[start], received - start, false, &length,
+                        headersLength);
+
+            if (msg == NULL) {
+                CHECK_GT(length, received - start);
+                break;
+            }
+
+            MessageInfo info;
+            info.mLength = length;
+            info.mDebugString = msg->debugString();
+            messages->push(info);
+
+            start += length;
+            scanOffset = 0;
+        }
+    }
+}
+
+static void Mutate(AString *s, Random *random) {
+    static const char kInteresting[] = "\r\n:; \t0123456789-";
+
+    size_t numMutations = random->next(4);
+    for (size_t i = 0; i < numMutations && s->size() > 0; ++i) {
+        size_t offset = random->next(s->size());
+
+        char c;
+        if (random->next(2)) {
+            c = kInteresting[random->next(sizeof(kInteresting) - 1)];
+        } else {
+            c = random->next(256);
+        }
+
+        switch (random->next(3)) {
+            case 0:
+            {
+                // Replace.
+                AString tmp(*s, 0, offset);
+                tmp.append(c);
+                tmp.append(s->c_str() + offset + 1, s->size() - offset - 1);
+                *s = tmp;
+                break;
+            }
+
+            case 1:
+            {
+                // Insert.
+                AString tmp(*s, 0, offset);
+                tmp.append(c);
+                tmp.append(s->c_str() + offset, s->size() - offset);
+                *s = tmp;
+                break;
+            }
+
+            default:
+            {
+                s->erase(offset, 1);
+                break;
+            }
+        }
+    }
+}
+
+static void CheckParameters(const char *content, size_t size, bool exact) {
+    sp<Parameters> params = exact ? Parameters::Parse(content, size) : NULL;
+
+    for (size_t i = 0;
+            i < sizeof(kParameterNames) / sizeof(kParameterNames[0]); ++i) {
+        const char *value;
+        size_t length;
+        bool found = Parameters::FindParameter(
+                content, size, kParameterNames[i], &value, &length);
+
+        if (found) {
+            CHECK(value >= content && value + length <= content + size);
+        }
+
+        if (params == NULL) {
+            continue;
+        }
+
+        AString expected;
+        bool expectedFound =
+            params->findParameter(kParameterNames[i], &expected);
+
+        CHECK_EQ(found, expectedFound);
+        if (found) {
+            CHECK(AString(value, length) == expected);
+        }
+    }
+}
+
+static void Fuzz(size_t numIterations, uint32_t seed) {
+    Random random(seed);
+
+    // The unmodified corpus must parse the same via the dictionary and
+    // via the lookup.
+    for (size_t i = 0; i < kNumCorpusEntries; ++i) {
+        size_t length;
+        sp<ParsedMessage> msg =
+            ParsedMessage::Parse(
+                    kCorpus[i], strlen(kCorpus[i]), false, &length);
+
+        CHECK(msg != NULL);
+        CHECK_EQ(length, strlen(kCorpus[i]));
+
+        CheckParameters(msg->getContent(), msg->getContentLength(), true);
+    }
+
+    size_t numMessages = 0;
+    for (size_t i = 0; i < numIterations; ++i) {
+        AString stream;
+        size_t n = 1 + random.next(8);
+        for (size_t j = 0; j < n; ++j) {
+            AString entry = kCorpus[random.next(kNumCorpusEntries)];
+            Mutate(&entry, &random);
+            stream.append(entry);
+        }
+
+        Vector<MessageInfo> expected;
+        ParseAll(stream.c_str(), stream.size(), &expected);
+
+        Vector<MessageInfo> actual;
+        ParseIncrementally(stream.c_str(), stream.size(), &random, &actual);
+
+        if (actual.size() != expected.size()) {
+            fprintf(stderr,
+                    "iteration %d: %d messages parsed incrementally, "
+                    "%d expected\n",
+                    i, actual.size(), expected.size());
+            TRESPASS();
+        }
+
+        for (size_t j = 0; j < expected.size(); ++j) {
+            CHECK_EQ(actual.itemAt(j).mLength, expected.itemAt(j).mLength);
+            CHECK(actual.itemAt(j).mDebugString
+                    == expected.itemAt(j).mDebugString);
+        }
+
+        // Robustness only, mutations easily produce input the dictionary
+        // rejects or splits differently.
+        CheckParameters(stream.c_str(), stream.size(), false);
+
+        numMessages += expected.size();
+    }
+
+    printf("fuzzed %d iterations (seed %u), %d messages, no mismatches\n",
+           numIterations, seed, numMessages);
+}
+
+static void Benchmark(size_t count) {
+    // A keep-alive and an M4 back to back, as if they arrived at once.
+    AString stream = kCorpus[6];
+    stream.append(kCorpus[3]);
+
+    const char *data = stream.c_str();
+    size_t size = stream.size();
+
+    int64_t startUs = ALooper::GetNowUs();
+
+    size_t numParameters = 0;
+    for (size_t i = 0; i < count; ++i) {
+        size_t offset = 0;
+        while (offset < size) {
+            size_t scanOffset = 0;
+            ssize_t headersLength =
+                ParsedMessage::FindEndOfHeaders(
+                        &data[offset], size - offset, &scanOffset);
+            CHECK_GE(headersLength, 0);
+
+            size_t length;
+            sp<ParsedMessage> msg =
+                ParsedMessage::Parse(
+                        &data[offset], size - offset, false, &length,
+                        headersLength);
+            CHECK(msg != NULL);
+
+            int32_t cseq;
+            CHECK(msg->findInt32("cseq", &cseq));
+
+            const char *value;
+            size_t valueLength;
+            if (Parameters::FindParameter(
+                        msg->getContent(), msg->getContentLength(),
+                        "wfd_presentation_URL", &value, &valueLength)) {
+                ++numParameters;
+            }
+
+            offset += length;
+        }
+    }
+
+    double durationSecs = (ALooper::GetNowUs() - startUs) / 1E6;
+    size_t numMessages = 2 * count;
+
+    CHECK_EQ(numParameters, count);
+
+    printf("parsed %d messages in %.2f secs, %.0f messages/sec, "
+           "%.1f ns per message, %.1f MB/sec\n",
+           numMessages,
+           durationSecs,
+           numMessages / durationSecs,
+           durationSecs * 1E9 / numMessages,
+           count * size / durationSecs / 1E6);
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s [-f iterations] [-s seed] [-n count]\n"
+            "           -f iterations\tfuzz the parser, comparing one-shot "
+            "with incremental parsing\n"
+            "           -s seed      \tseed for the fuzzer\n"
+            "           -n count     \tparse a keep-alive and an M4 request "
+            "this many times\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    size_t numIterations = 0;
+    uint32_t seed = 1;
+    size_t count = 0;
+
+    int res;
+    while ((res = getopt(argc, argv, "hf:s:n:")) >= 0) {
+        switch (res) {
+            case 'f':
+            case 's':
+            case 'n':
+            {
+                char *end;
+                unsigned long x = strtoul(optarg, &end, 10);
+
+                if (*end != '\0' || end == optarg) {
+                    fprintf(stderr, "Illegal number specified.\n");
+                    exit(1);
+                }
+
+                if (res == 'f') {
+                    numIterations = x;
+                } else if (res == 's') {
+                    seed = x;
+                } else {
+                    count = x;
+                }
+                break;
+            }
+
+            case '?':
+            case 'h':
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (numIterations == 0 && count == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (numIterations > 0) {
+        Fuzz(numIterations, seed);
+    }
+
+    if (count > 0) {
+        Benchmark(count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "ClockSkewEstimator"
+#include <utils/Log.h>
+
+#include "ClockSkewEstimator.h"
+
+#include <math.h>
+
+namespace android {
+
+// static
+const double ClockSkewEstimator::kMaxSkew = 1E-3;
+
+// static
+const double ClockSkewEstimator::kMinRateChange = 2E-6;
+
+ClockSkewEstimator::ClockSkewEstimator()
+    : mRegression(kNumIntervals),
+      mHaveInterval(false),
+      mIntervalStartTime(0ll),
+      mBestRTPTime(0ll),
+      mBestArrivalTime(0ll),
+      mHaveNewPoint(false),
+      mRate(1.0) {
+}
+
+void ClockSkewEstimator::addPacket(int64_t rtpTime, int64_t arrivalTime) {
+    if (mHaveInterval && rtpTime - mIntervalStartTime >= kIntervalDuration) {
+        finishInterval();
+    }
+
+    if (!mHaveInterval) {
+        mHaveInterval = true;
+        mIntervalStartTime = rtpTime;
+        mBestRTPTime = rtpTime;
+        mBestArrivalTime = arrivalTime;
+        return;
+    }
+
+    if (arrivalTime - rtpTime < mBestArrivalTime - mBestRTPTime) {
+        mBestRTPTime = rtpTime;
+        mBestArrivalTime = arrivalTime;
+    }
+}
+
+void ClockSkewEstimator::finishInterval() {
+    mRegression.addPoint((double)mBestRTPTime, (double)mBestArrivalTime);
+
+    mHaveInterval = false;
+    mHaveNewPoint = true;
+}
+
+bool ClockSkewEstimator::update(double *rate) {
+    *rate = mRate;
+
+    if (!mHaveNewPoint || mRegression.count() < kMinIntervals) {
+        return false;
+    }
+
+    mHaveNewPoint = false;
+
+    double slope;
+    if (!mRegression.getSlope(&slope)) {
+        return false;
+    }
+
+    if (fabs(slope - 1.0) > kMaxSkew) {
+        ALOGW("ignoring implausible clock skew of %.1f ppm",
+              (slope - 1.0) * 1E6);
+        return false;
+    }
+
+    if (fabs(slope - mRate) < kMinRateChange) {
+        return false;
+    }
+
+    double rms;
+    if (mRegression.getRMSResidual(&rms)) {
+        ALOGV("clock skew %.1f ppm, residual %.2f ms",
+              (slope - 1.0) * 1E6, rms / 90.0);
+    }
+
+    mRate = slope;
+    *rate = mRate;
+
+    return true;
+}
+
+}  // namespace android
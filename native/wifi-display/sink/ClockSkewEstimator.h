@@ -0,0 +1,60 @@
+#ifndef CLOCK_SKEW_ESTIMATOR_H_
+
+#define CLOCK_SKEW_ESTIMATOR_H_
+
+#include <sys/types.h>
+#include <media/stagefright/foundation/ABase.h>
+
+#include "LinearRegression.h"
+
+namespace android {
+
+// Tracks the rate of the source's clock relative to ours over a long
+// window. Of every second worth of RTP packets only the one that made it
+// across fastest is fitted, which filters out queueing delays and leaves
+// the slowly changing clock drift.
+struct ClockSkewEstimator {
+    ClockSkewEstimator();
+
+    // "rtpTime" is the extended RTP timestamp of a media packet and
+    // "arrivalTime" its local arrival time, both in 90kHz units.
+    void addPacket(int64_t rtpTime, int64_t arrivalTime);
+
+    // Returns true if the estimated rate changed since the last call.
+    // "rate" is the duration of one of the source's seconds in seconds on
+    // our clock, 1.0 until enough history has been gathered.
+    bool update(double *rate);
+
+    double rate() const { return mRate; }
+
+private:
+    enum {
+        kIntervalDuration = 90000,  // 1 sec, in 90kHz units
+        kNumIntervals = 600,
+        kMinIntervals = 60,
+    };
+
+    // Clocks drifting more than this are considered broken.
+    static const double kMaxSkew;
+
+    // Smaller changes of the estimate are not reported.
+    static const double kMinRateChange;
+
+    LinearRegression mRegression;
+
+    bool mHaveInterval;
+    int64_t mIntervalStartTime;
+    int64_t mBestRTPTime;
+    int64_t mBestArrivalTime;
+
+    bool mHaveNewPoint;
+    double mRate;
+
+    void finishInterval();
+
+    DISALLOW_EVIL_CONSTRUCTORS(ClockSkewEstimator);
+};
+
+}  // namespace android
+
+#endif  // CLOCK_SKEW_ESTIMATOR_H_
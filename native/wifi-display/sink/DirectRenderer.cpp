@@ -0,0 +1,533 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "DirectRenderer"
+#include <utils/Log.h>
+
+#include "DirectRenderer.h"
+
+#include "AnotherPacketSource.h"
+#include "ATSParser.h"
+
+#include <gui/SurfaceTextureClient.h>
+#include <media/AudioTrack.h>
+#include <media/ICrypto.h>
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaCodec.h>
+#include <media/stagefright/MediaDefs.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/MetaData.h>
+#include <media/stagefright/Utils.h>
+
+namespace android {
+
+// Plays out decoded (or raw) PCM on its own looper, AudioTrack::write()
+// blocks until the data has been consumed.
+struct DirectRenderer::AudioRenderer : public AHandler {
+    AudioRenderer(int32_t sampleRate, int32_t channelCount);
+
+    status_t initCheck() const;
+
+    bool matches(int32_t sampleRate, int32_t channelCount) const;
+
+    void queueInputBuffer(const sp<ABuffer> &buffer);
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+    virtual ~AudioRenderer();
+
+private:
+    enum {
+        kWhatQueueInputBuffer,
+        kWhatPushAudio,
+    };
+
+    // Audio we cannot play out in time is dropped instead of letting
+    // latency build up.
+    static const size_t kMaxPendingBuffers = 8;
+
+    int32_t mSampleRate;
+    int32_t mChannelCount;
+
+    sp<AudioTrack> mAudioTrack;
+
+    List<sp<ABuffer> > mInputBuffers;
+    bool mPushPending;
+
+    size_t mNumBuffersDropped;
+
+    void onPushAudio();
+
+    DISALLOW_EVIL_CONSTRUCTORS(AudioRenderer);
+};
+
+DirectRenderer::AudioRenderer::AudioRenderer(
+        int32_t sampleRate, int32_t channelCount)
+    : mSampleRate(sampleRate),
+      mChannelCount(channelCount),
+      mPushPending(false),
+      mNumBuffersDropped(0) {
+    mAudioTrack = new AudioTrack(
+            AUDIO_STREAM_MUSIC,
+            sampleRate,
+            AUDIO_FORMAT_PCM_16_BIT,
+            audio_channel_out_mask_from_count(channelCount),
+            0 /* frameCount */);
+
+    if (mAudioTrack->initCheck() == OK) {
+        mAudioTrack->start();
+    }
+}
+
+DirectRenderer::AudioRenderer::~AudioRenderer() {
+    if (mAudioTrack->initCheck() == OK) {
+        mAudioTrack->stop();
+    }
+}
+
+status_t DirectRenderer::AudioRenderer::initCheck() const {
+    return mAudioTrack->initCheck();
+}
+
+bool DirectRenderer::AudioRenderer::matches(
+        int32_t sampleRate, int32_t channelCount) const {
+    return sampleRate == mSampleRate && channelCount == mChannelCount;
+}
+
+void DirectRenderer::AudioRenderer::queueInputBuffer(
+        const sp<ABuffer> &buffer) {
+    sp<AMessage> msg = new AMessage(kWhatQueueInputBuffer, id());
+    msg->setBuffer("buffer", buffer);
+    msg->post();
+}
+
+void DirectRenderer::AudioRenderer::onMessageReceived(
+        const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatQueueInputBuffer:
+        {
+            sp<ABuffer> buffer;
+            CHECK(msg->findBuffer("buffer", &buffer));
+
+            mInputBuffers.push_back(buffer);
+
+            if (mInputBuffers.size() > kMaxPendingBuffers) {
+                mInputBuffers.erase(mInputBuffers.begin());
+
+                if ((++mNumBuffersDropped % 50) == 1) {
+                    ALOGI("audio output is falling behind, dropped %d "
+                          "buffers so far",
+                          mNumBuffersDropped);
+                }
+            }
+
+            if (!mPushPending) {
+                mPushPending = true;
+                (new AMessage(kWhatPushAudio, id()))->post();
+            }
+            break;
+        }
+
+        case kWhatPushAudio:
+        {
+            mPushPending = false;
+
+            onPushAudio();
+
+            if (!mInputBuffers.empty()) {
+                mPushPending = true;
+                (new AMessage(kWhatPushAudio, id()))->post();
+            }
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+void DirectRenderer::AudioRenderer::onPushAudio() {
+    if (mInputBuffers.empty()) {
+        return;
+    }
+
+    sp<ABuffer> buffer = *mInputBuffers.begin();
+    mInputBuffers.erase(mInputBuffers.begin());
+
+    ssize_t n = mAudioTrack->write(buffer->data(), buffer->size());
+
+    if (n < 0) {
+        ALOGE("AudioTrack::write returned %d", n);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+DirectRenderer::DecoderContext::DecoderContext()
+    : mIsRawAudio(false),
+      mNotifyPending(false) {
+}
+
+DirectRenderer::DirectRenderer(const sp<ISurfaceTexture> &surfaceTex)
+    : mSurfaceTex(surfaceTex),
+      mTSParser(new ATSParser(ATSParser::ALIGNED_VIDEO_DATA)),
+      mNumFramesRendered(0ll) {
+    mCodecLooper = new ALooper;
+    mCodecLooper->setName("direct_codec_looper");
+
+    mCodecLooper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+}
+
+DirectRenderer::~DirectRenderer() {
+    for (size_t i = 0; i < kNumTracks; ++i) {
+        DecoderContext *ctx = &mDecoders[i];
+
+        if (ctx->mCodec != NULL) {
+            ctx->mCodec->release();
+            ctx->mCodec.clear();
+        }
+    }
+
+    mCodecLooper->stop();
+
+    if (mAudioRenderer != NULL) {
+        mAudioLooper->unregisterHandler(mAudioRenderer->id());
+        mAudioRenderer.clear();
+    }
+
+    if (mAudioLooper != NULL) {
+        mAudioLooper->stop();
+    }
+}
+
+void DirectRenderer::queueTSPackets(const sp<ABuffer> &buffer) {
+    sp<AMessage> msg = new AMessage(kWhatQueueTSPackets, id());
+    msg->setBuffer("buffer", buffer);
+    msg->post();
+}
+
+void DirectRenderer::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatQueueTSPackets:
+        {
+            sp<ABuffer> buffer;
+            CHECK(msg->findBuffer("buffer", &buffer));
+
+            onQueueTSPackets(buffer);
+            break;
+        }
+
+        case kWhatDecoderNotify:
+        {
+            int32_t trackIndex;
+            CHECK(msg->findInt32("trackIndex", &trackIndex));
+
+            mDecoders[trackIndex].mNotifyPending = false;
+
+            doMoreWork(trackIndex);
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+void DirectRenderer::onQueueTSPackets(const sp<ABuffer> &buffer) {
+    CHECK_EQ((buffer->size() % 188), 0u);
+
+    for (size_t offset = 0; offset < buffer->size(); offset += 188) {
+        status_t err = mTSParser->feedTSPacket(buffer->data() + offset, 188);
+
+        if (err != OK) {
+            ALOGW("failed to parse TS packet (err %d)", err);
+        }
+    }
+
+    for (size_t i = 0; i < kNumTracks; ++i) {
+        DecoderContext *ctx = &mDecoders[i];
+
+        if (ctx->mSource == NULL) {
+            sp<MediaSource> source = mTSParser->getSource(
+                    i == kTrackVideo ? ATSParser::VIDEO : ATSParser::AUDIO);
+
+            if (source == NULL) {
+                continue;
+            }
+
+            ctx->mSource = static_cast<AnotherPacketSource *>(source.get());
+
+            status_t err = initDecoder(i);
+
+            if (err != OK) {
+                ALOGE("unable to instantiate %s decoder (err %d), "
+                      "discarding its access units",
+                      i == kTrackVideo ? "video" : "audio", err);
+            }
+        }
+
+        doMoreWork(i);
+    }
+}
+
+status_t DirectRenderer::initDecoder(size_t trackIndex) {
+    DecoderContext *ctx = &mDecoders[trackIndex];
+
+    sp<AMessage> format;
+    status_t err = convertMetaDataToMessage(ctx->mSource->getFormat(), &format);
+
+    if (err != OK) {
+        return err;
+    }
+
+    AString mime;
+    CHECK(format->findString("mime", &mime));
+
+    if (trackIndex == kTrackAudio
+            && !strcasecmp(mime.c_str(), MEDIA_MIMETYPE_AUDIO_RAW)) {
+        // LPCM goes straight to the audio output.
+        ctx->mIsRawAudio = true;
+        initAudioRenderer(format);
+
+        return OK;
+    }
+
+    sp<MediaCodec> codec =
+        MediaCodec::CreateByType(mCodecLooper, mime.c_str(), false /* encoder */);
+
+    if (codec == NULL) {
+        return ERROR_UNSUPPORTED;
+    }
+
+    sp<SurfaceTextureClient> client;
+    if (trackIndex == kTrackVideo) {
+        client = new SurfaceTextureClient(mSurfaceTex);
+    }
+
+    err = codec->configure(format, client, NULL /* crypto */, 0 /* flags */);
+
+    if (err == OK) {
+        err = codec->start();
+    }
+
+    if (err == OK) {
+        err = codec->getInputBuffers(&ctx->mInputBuffers);
+    }
+
+    if (err == OK) {
+        err = codec->getOutputBuffers(&ctx->mOutputBuffers);
+    }
+
+    if (err != OK) {
+        codec->release();
+        return err;
+    }
+
+    ALOGI("instantiated %s decoder", mime.c_str());
+
+    ctx->mCodec = codec;
+
+    return OK;
+}
+
+void DirectRenderer::initAudioRenderer(const sp<AMessage> &format) {
+    int32_t sampleRate, channelCount;
+    if (!format->findInt32("sample-rate", &sampleRate)
+            || !format->findInt32("channel-count", &channelCount)) {
+        ALOGE("audio format lacks sample rate or channel count");
+        return;
+    }
+
+    if (mAudioRenderer != NULL) {
+        if (mAudioRenderer->matches(sampleRate, channelCount)) {
+            return;
+        }
+
+        mAudioLooper->unregisterHandler(mAudioRenderer->id());
+        mAudioRenderer.clear();
+    }
+
+    sp<AudioRenderer> renderer = new AudioRenderer(sampleRate, channelCount);
+
+    if (renderer->initCheck() != OK) {
+        ALOGE("unable to open audio output (%d Hz, %d channels)",
+              sampleRate, channelCount);
+        return;
+    }
+
+    if (mAudioLooper == NULL) {
+        mAudioLooper = new ALooper;
+        mAudioLooper->setName("direct_audio_looper");
+
+        mAudioLooper->start(
+                false /* runOnCallingThread */,
+                false /* canCallJava */,
+                PRIORITY_AUDIO);
+    }
+
+    mAudioLooper->registerHandler(renderer);
+    mAudioRenderer = renderer;
+
+    ALOGI("playing audio at %d Hz, %d channels", sampleRate, channelCount);
+}
+
+void DirectRenderer::doMoreWork(size_t trackIndex) {
+    DecoderContext *ctx = &mDecoders[trackIndex];
+
+    if (ctx->mSource == NULL) {
+        return;
+    }
+
+    feedDecoderInput(trackIndex);
+
+    if (ctx->mCodec != NULL) {
+        drainDecoderOutput(trackIndex);
+        scheduleDecoderNotify(trackIndex);
+    }
+}
+
+void DirectRenderer::feedDecoderInput(size_t trackIndex) {
+    DecoderContext *ctx = &mDecoders[trackIndex];
+
+    if (ctx->mCodec != NULL) {
+        for (;;) {
+            size_t index;
+            status_t err = ctx->mCodec->dequeueInputBuffer(&index);
+
+            if (err != OK) {
+                break;
+            }
+
+            ctx->mInputIndicesAvailable.push_back(index);
+        }
+    }
+
+    status_t finalResult;
+    while (ctx->mSource->hasBufferAvailable(&finalResult)) {
+        if (ctx->mCodec != NULL && ctx->mInputIndicesAvailable.empty()) {
+            break;
+        }
+
+        sp<ABuffer> accessUnit;
+        status_t err = ctx->mSource->dequeueAccessUnit(&accessUnit);
+
+        if (err == INFO_DISCONTINUITY) {
+            ALOGI("discontinuity on %s track",
+                  trackIndex == kTrackVideo ? "video" : "audio");
+            continue;
+        } else if (err != OK) {
+            break;
+        }
+
+        if (ctx->mIsRawAudio) {
+            if (mAudioRenderer != NULL) {
+                mAudioRenderer->queueInputBuffer(accessUnit);
+            }
+            continue;
+        }
+
+        if (ctx->mCodec == NULL) {
+            continue;
+        }
+
+        size_t index = *ctx->mInputIndicesAvailable.begin();
+
+        const sp<ABuffer> &dst = ctx->mInputBuffers.itemAt(index);
+
+        if (accessUnit->size() > dst->capacity()) {
+            ALOGE("dropping access unit of size %d, decoder input buffers "
+                  "only hold %d bytes",
+                  accessUnit->size(), dst->capacity());
+            continue;
+        }
+
+        ctx->mInputIndicesAvailable.erase(ctx->mInputIndicesAvailable.begin());
+
+        int64_t timeUs;
+        CHECK(accessUnit->meta()->findInt64("timeUs", &timeUs));
+
+        memcpy(dst->data(), accessUnit->data(), accessUnit->size());
+
+        err = ctx->mCodec->queueInputBuffer(
+                index, 0, accessUnit->size(), timeUs, 0 /* flags */);
+
+        if (err != OK) {
+            ALOGE("queueInputBuffer returned %d", err);
+        }
+    }
+}
+
+void DirectRenderer::drainDecoderOutput(size_t trackIndex) {
+    DecoderContext *ctx = &mDecoders[trackIndex];
+
+    for (;;) {
+        size_t index, offset, size;
+        int64_t timeUs;
+        uint32_t flags;
+        status_t err = ctx->mCodec->dequeueOutputBuffer(
+                &index, &offset, &size, &timeUs, &flags);
+
+        if (err == -EAGAIN) {
+            break;
+        } else if (err == INFO_OUTPUT_BUFFERS_CHANGED) {
+            CHECK_EQ(ctx->mCodec->getOutputBuffers(&ctx->mOutputBuffers),
+                     (status_t)OK);
+            continue;
+        } else if (err == INFO_FORMAT_CHANGED) {
+            if (trackIndex == kTrackAudio) {
+                sp<AMessage> format;
+                CHECK_EQ(ctx->mCodec->getOutputFormat(&format), (status_t)OK);
+
+                initAudioRenderer(format);
+            }
+            continue;
+        } else if (err != OK) {
+            ALOGE("%s decoder returned error %d",
+                  trackIndex == kTrackVideo ? "video" : "audio", err);
+            break;
+        }
+
+        if (trackIndex == kTrackVideo) {
+            // Frames are displayed as soon as they are decoded, presentation
+            // timestamps are ignored.
+            ctx->mCodec->renderOutputBufferAndRelease(index);
+
+            if ((++mNumFramesRendered % 300) == 0) {
+                ALOGV("rendered %lld video frames", mNumFramesRendered);
+            }
+            continue;
+        }
+
+        if (mAudioRenderer != NULL && size > 0) {
+            sp<ABuffer> buffer = new ABuffer(size);
+            memcpy(buffer->data(),
+                   ctx->mOutputBuffers.itemAt(index)->base() + offset,
+                   size);
+
+            buffer->meta()->setInt64("timeUs", timeUs);
+
+            mAudioRenderer->queueInputBuffer(buffer);
+        }
+
+        ctx->mCodec->releaseOutputBuffer(index);
+    }
+}
+
+void DirectRenderer::scheduleDecoderNotify(size_t trackIndex) {
+    DecoderContext *ctx = &mDecoders[trackIndex];
+
+    if (ctx->mNotifyPending) {
+        return;
+    }
+
+    ctx->mNotifyPending = true;
+
+    sp<AMessage> notify = new AMessage(kWhatDecoderNotify, id());
+    notify->setInt32("trackIndex", trackIndex);
+    ctx->mCodec->requestActivityNotification(notify);
+}
+
+}  // namespace android
@@ -0,0 +1,88 @@
+#ifndef DIRECT_RENDERER_H_
+
+#define DIRECT_RENDERER_H_
+
+#include <gui/Surface.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <utils/List.h>
+#include <utils/Vector.h>
+
+namespace android {
+
+struct ABuffer;
+struct AnotherPacketSource;
+struct ATSParser;
+struct MediaCodec;
+
+// A low-latency alternative to handing the transport stream to a
+// mediaplayer: TS packets are demuxed in-process, access units are fed
+// straight into MediaCodec decoders and decoded video frames are rendered
+// to the surface as soon as they come out of the decoder, without any
+// attempt at A/V synchronization.
+struct DirectRenderer : public AHandler {
+    DirectRenderer(const sp<ISurfaceTexture> &surfaceTex);
+
+    // "buffer" holds an integral number of 188 byte TS packets.
+    void queueTSPackets(const sp<ABuffer> &buffer);
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+    virtual ~DirectRenderer();
+
+private:
+    struct AudioRenderer;
+
+    enum {
+        kWhatQueueTSPackets,
+        kWhatDecoderNotify,
+    };
+
+    enum {
+        kTrackVideo,
+        kTrackAudio,
+        kNumTracks,
+    };
+
+    struct DecoderContext {
+        DecoderContext();
+
+        sp<AnotherPacketSource> mSource;
+
+        // Raw PCM audio bypasses the decoder, mCodec stays NULL.
+        bool mIsRawAudio;
+
+        sp<MediaCodec> mCodec;
+        Vector<sp<ABuffer> > mInputBuffers;
+        Vector<sp<ABuffer> > mOutputBuffers;
+        List<size_t> mInputIndicesAvailable;
+
+        bool mNotifyPending;
+    };
+
+    sp<ISurfaceTexture> mSurfaceTex;
+
+    sp<ATSParser> mTSParser;
+    sp<ALooper> mCodecLooper;
+    DecoderContext mDecoders[kNumTracks];
+
+    sp<ALooper> mAudioLooper;
+    sp<AudioRenderer> mAudioRenderer;
+
+    int64_t mNumFramesRendered;
+
+    void onQueueTSPackets(const sp<ABuffer> &buffer);
+
+    status_t initDecoder(size_t trackIndex);
+    void initAudioRenderer(const sp<AMessage> &format);
+
+    void doMoreWork(size_t trackIndex);
+    void feedDecoderInput(size_t trackIndex);
+    void drainDecoderOutput(size_t trackIndex);
+    void scheduleDecoderNotify(size_t trackIndex);
+
+    DISALLOW_EVIL_CONSTRUCTORS(DirectRenderer);
+};
+
+}  // namespace android
+
+#endif  // DIRECT_RENDERER_H_
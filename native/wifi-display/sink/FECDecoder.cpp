@@ -0,0 +1,255 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "FECDecoder"
+#include <utils/Log.h>
+
+#include "FECDecoder.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/Utils.h>
+
+namespace android {
+
+FECDecoder::FECDecoder(
+        size_t numColumns, size_t numRows, size_t maxPayloadSize)
+    : mHistorySize(kMinHistorySize),
+      mMaxPayloadSize(maxPayloadSize),
+      mHistory(NULL),
+      mPayloads(NULL),
+      mHaveLatestSeqNo(false),
+      mLatestSeqNo(0),
+      mNumRecovered(0),
+      mNumUnrecoverable(0) {
+    while (mHistorySize < kHistoryMatrices * numColumns * numRows) {
+        mHistorySize <<= 1;
+    }
+
+    // Sequence numbers wrap at 65536, the history must stay well short.
+    CHECK_LE(mHistorySize, 0x4000u);
+
+    mMaxPendingAge = mHistorySize / 2;
+
+    mHistory = new HistoryEntry[mHistorySize];
+    for (size_t i = 0; i < mHistorySize; ++i) {
+        mHistory[i].mValid = false;
+    }
+
+    mPayloads = new uint8_t[mHistorySize * mMaxPayloadSize];
+
+    ALOGV("keeping the last %d payloads of up to %d bytes",
+          mHistorySize, mMaxPayloadSize);
+}
+
+FECDecoder::~FECDecoder() {
+    delete[] mPayloads;
+    mPayloads = NULL;
+
+    delete[] mHistory;
+    mHistory = NULL;
+}
+
+void FECDecoder::addMediaPacket(
+        uint16_t seqNo, const sp<ABuffer> &payload,
+        List<sp<ABuffer> > *recovered) {
+    storePacket(seqNo, payload->data(), payload->size());
+
+    if (!mHaveLatestSeqNo || (int16_t)(seqNo - mLatestSeqNo) > 0) {
+        mLatestSeqNo = seqNo;
+        mHaveLatestSeqNo = true;
+    }
+
+    if (mPending.empty()) {
+        return;
+    }
+
+    // This may be a retransmission completing an FEC block.
+    processPending(recovered);
+    dropStalePending();
+}
+
+status_t FECDecoder::addFECPacket(
+        const sp<ABuffer> &packet, List<sp<ABuffer> > *recovered) {
+    const uint8_t *data = packet->data();
+    size_t size = packet->size();
+
+    size_t headerLength = 12 + 4 * (data[0] & 0x0f);
+
+    if (size < headerLength + 16) {
+        return ERROR_MALFORMED;
+    }
+
+    const uint8_t *fecHeader = &data[headerLength];
+
+    FECPacket fec;
+    fec.mSNBase = U16_AT(&fecHeader[0]);
+    fec.mLengthRecovery = U16_AT(&fecHeader[2]);
+    fec.mOffset = fecHeader[13];
+    fec.mNumPackets = fecHeader[14];
+
+    if ((fecHeader[12] & 0x38) != 0) {
+        // Only XOR is supported.
+        return ERROR_UNSUPPORTED;
+    }
+
+    if (fec.mOffset == 0 || fec.mNumPackets == 0) {
+        return ERROR_MALFORMED;
+    }
+
+    fec.mPayload = new ABuffer(size - headerLength - 16);
+    memcpy(fec.mPayload->data(),
+           &fecHeader[16],
+           fec.mPayload->size());
+
+    mPending.push_back(fec);
+
+    processPending(recovered);
+    dropStalePending();
+
+    while (mPending.size() > kMaxPendingFECPackets) {
+        mPending.erase(mPending.begin());
+        ++mNumUnrecoverable;
+    }
+
+    return OK;
+}
+
+bool FECDecoder::havePacket(uint16_t seqNo) const {
+    const HistoryEntry &entry = mHistory[seqNo & (mHistorySize - 1)];
+
+    return entry.mValid && entry.mSeqNo == seqNo;
+}
+
+void FECDecoder::storePacket(
+        uint16_t seqNo, const uint8_t *data, size_t size) {
+    size_t index = seqNo & (mHistorySize - 1);
+    HistoryEntry *entry = &mHistory[index];
+
+    if (size > mMaxPayloadSize) {
+        // Can't take part in recovery, make sure the slot's previous
+        // occupant doesn't either.
+        entry->mValid = false;
+        return;
+    }
+
+    memcpy(&mPayloads[index * mMaxPayloadSize], data, size);
+
+    entry->mValid = true;
+    entry->mSeqNo = seqNo;
+    entry->mSize = size;
+}
+
+FECDecoder::RecoveryResult FECDecoder::recover(
+        const FECPacket &fec, List<sp<ABuffer> > *recovered) {
+    size_t numMissing = 0;
+    uint16_t missingSeqNo = 0;
+
+    for (size_t i = 0; i < fec.mNumPackets; ++i) {
+        uint16_t seqNo = fec.mSNBase + i * fec.mOffset;
+
+        if (!havePacket(seqNo)) {
+            if (++numMissing > 1) {
+                return TOO_MANY_MISSING;
+            }
+
+            missingSeqNo = seqNo;
+        }
+    }
+
+    if (numMissing == 0) {
+        return NOTHING_MISSING;
+    }
+
+    size_t maxSize = fec.mPayload->size();
+
+    sp<ABuffer> buffer = new ABuffer(maxSize);
+    memcpy(buffer->data(), fec.mPayload->data(), maxSize);
+
+    uint8_t *out = buffer->data();
+    uint16_t length = fec.mLengthRecovery;
+
+    for (size_t i = 0; i < fec.mNumPackets; ++i) {
+        uint16_t seqNo = fec.mSNBase + i * fec.mOffset;
+
+        if (seqNo == missingSeqNo) {
+            continue;
+        }
+
+        size_t index = seqNo & (mHistorySize - 1);
+        const HistoryEntry &entry = mHistory[index];
+
+        if (entry.mSize > maxSize) {
+            return FAILED;
+        }
+
+        const uint8_t *in = &mPayloads[index * mMaxPayloadSize];
+        for (size_t j = 0; j < entry.mSize; ++j) {
+            out[j] ^= in[j];
+        }
+
+        length ^= entry.mSize;
+    }
+
+    if (length > maxSize) {
+        return FAILED;
+    }
+
+    buffer->setRange(0, length);
+    buffer->setInt32Data(missingSeqNo);
+
+    ALOGV("recovered packet %u", missingSeqNo);
+
+    // Recovered packets may in turn help other FEC packets out.
+    storePacket(missingSeqNo, buffer->data(), length);
+    recovered->push_back(buffer);
+
+    ++mNumRecovered;
+
+    return RECOVERED;
+}
+
+void FECDecoder::processPending(List<sp<ABuffer> > *recovered) {
+    bool recoveredAny;
+    do {
+        recoveredAny = false;
+
+        List<FECPacket>::iterator it = mPending.begin();
+        while (it != mPending.end()) {
+            RecoveryResult result = recover(*it, recovered);
+
+            if (result == TOO_MANY_MISSING) {
+                ++it;
+                continue;
+            }
+
+            if (result == RECOVERED) {
+                recoveredAny = true;
+            } else if (result == FAILED) {
+                ALOGW("inconsistent FEC packet (SNBase %u)", (*it).mSNBase);
+                ++mNumUnrecoverable;
+            }
+
+            it = mPending.erase(it);
+        }
+    } while (recoveredAny && !mPending.empty());
+}
+
+void FECDecoder::dropStalePending() {
+    if (!mHaveLatestSeqNo) {
+        return;
+    }
+
+    List<FECPacket>::iterator it = mPending.begin();
+    while (it != mPending.end()) {
+        uint16_t age = mLatestSeqNo - (*it).mSNBase;
+
+        if (age > mMaxPendingAge && age < 0x8000) {
+            ++mNumUnrecoverable;
+            it = mPending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}  // namespace android
@@ -0,0 +1,113 @@
+#ifndef FEC_DECODER_H_
+
+#define FEC_DECODER_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/List.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Rebuilds lost media packets from the XOR parity packets generated by the
+// source's FECEncoder (SMPTE 2022-1 header, offset/NA addressing). Any FEC
+// packet covering exactly one missing packet recovers it, FEC packets
+// covering more than one are kept around in case other recoveries or
+// retransmissions fill the remaining holes.
+// Not thread-safe, the owner is expected to serialize access.
+struct FECDecoder : public RefBase {
+    enum {
+        kPayloadType = 96,
+    };
+
+    // Sized for the numColumns x numRows matrix the source announced,
+    // payloads of up to "maxPayloadSize" bytes can be recovered.
+    FECDecoder(size_t numColumns, size_t numRows, size_t maxPayloadSize);
+
+    // "payload" holds the payload of the media packet "seqNo", it's copied
+    // so that the (pooled) buffer can be released and modified freely.
+    // Packets recovered as a consequence are appended to "recovered".
+    void addMediaPacket(
+            uint16_t seqNo, const sp<ABuffer> &payload,
+            List<sp<ABuffer> > *recovered);
+
+    // "packet" is a complete FEC RTP packet. Recovered payloads are
+    // appended to "recovered", each carrying its 16 bit RTP sequence
+    // number as int32Data.
+    status_t addFECPacket(
+            const sp<ABuffer> &packet, List<sp<ABuffer> > *recovered);
+
+    size_t numRecovered() const { return mNumRecovered; }
+
+    // FEC packets given up on because they still covered more than one
+    // missing packet.
+    size_t numUnrecoverable() const { return mNumUnrecoverable; }
+
+protected:
+    virtual ~FECDecoder();
+
+private:
+    // The history covers this many FEC matrices, retransmissions of the
+    // packets of a matrix may well arrive after its last FEC packet.
+    static const size_t kHistoryMatrices = 2;
+    static const size_t kMinHistorySize = 64;
+
+    static const size_t kMaxPendingFECPackets = 64;
+
+    // Payloads live in mPayloads, at index * mMaxPayloadSize.
+    struct HistoryEntry {
+        bool mValid;
+        uint16_t mSeqNo;
+        size_t mSize;
+    };
+
+    struct FECPacket {
+        uint16_t mSNBase;
+        uint16_t mLengthRecovery;
+        uint8_t mOffset;
+        uint8_t mNumPackets;
+        sp<ABuffer> mPayload;
+    };
+
+    enum RecoveryResult {
+        RECOVERED,
+        NOTHING_MISSING,
+        TOO_MANY_MISSING,
+        FAILED,
+    };
+
+    // Power of two.
+    size_t mHistorySize;
+    size_t mMaxPayloadSize;
+
+    // Pending FEC packets older than this (in media packets) are dropped.
+    uint16_t mMaxPendingAge;
+
+    HistoryEntry *mHistory;
+    uint8_t *mPayloads;
+
+    bool mHaveLatestSeqNo;
+    uint16_t mLatestSeqNo;
+
+    List<FECPacket> mPending;
+
+    size_t mNumRecovered;
+    size_t mNumUnrecoverable;
+
+    bool havePacket(uint16_t seqNo) const;
+
+    void storePacket(uint16_t seqNo, const uint8_t *data, size_t size);
+
+    RecoveryResult recover(
+            const FECPacket &fec, List<sp<ABuffer> > *recovered);
+
+    void processPending(List<sp<ABuffer> > *recovered);
+    void dropStalePending();
+
+    DISALLOW_EVIL_CONSTRUCTORS(FECDecoder);
+};
+
+}  // namespace android
+
+#endif  // FEC_DECODER_H_
@@ -0,0 +1,225 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "JitterBuffer"
+#include <utils/Log.h>
+
+#include "JitterBuffer.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+
+namespace android {
+
+// Distance from "b" to "a" in sequence number space, robust against the
+// extended sequence number wrapping.
+static int32_t SeqDiff(int32_t a, int32_t b) {
+    return (int32_t)((uint32_t)a - (uint32_t)b);
+}
+
+JitterBuffer::JitterBuffer(size_t capacity)
+    : mSlots(NULL),
+      mCapacity(1),
+      mStarted(false),
+      mDequeuedAny(false),
+      mNextExtSeqNo(-1),
+      mMaxExtSeqNo(-1),
+      mNumPackets(0),
+      mNumBytes(0),
+      mNumOverflowDrops(0) {
+    while (mCapacity < capacity) {
+        mCapacity <<= 1;
+    }
+    mMask = mCapacity - 1;
+
+    mSlots = new sp<ABuffer>[mCapacity];
+}
+
+JitterBuffer::~JitterBuffer() {
+    delete[] mSlots;
+    mSlots = NULL;
+}
+
+void JitterBuffer::clear() {
+    for (size_t i = 0; i < mCapacity; ++i) {
+        mSlots[i].clear();
+    }
+
+    mStarted = false;
+    mDequeuedAny = false;
+    mNextExtSeqNo = -1;
+    mMaxExtSeqNo = -1;
+    mNumPackets = 0;
+    mNumBytes = 0;
+}
+
+bool JitterBuffer::queue(
+        const sp<ABuffer> &buffer, size_t *numDropped, size_t *numSkipped) {
+    int32_t extSeqNo = buffer->int32Data();
+
+    if (numDropped != NULL) {
+        *numDropped = 0;
+    }
+
+    if (numSkipped != NULL) {
+        *numSkipped = 0;
+    }
+
+    if (!mStarted) {
+        mStarted = true;
+        mNextExtSeqNo = extSeqNo;
+        mMaxExtSeqNo = extSeqNo;
+    } else if (SeqDiff(extSeqNo, mNextExtSeqNo) < 0) {
+        if (mDequeuedAny
+                || SeqDiff(mMaxExtSeqNo, extSeqNo) >= (int32_t)mCapacity) {
+            // Either a retransmission of something we've already returned
+            // (or given up on) or hopelessly late.
+            return false;
+        }
+
+        // Nothing was returned yet, this one simply came in out of order
+        // ahead of the ones queued so far.
+        mNextExtSeqNo = extSeqNo;
+    } else if (SeqDiff(extSeqNo, mNextExtSeqNo) >= (int32_t)mCapacity) {
+        // Doesn't fit into the window, move it forward.
+        int32_t newNextExtSeqNo = extSeqNo - (int32_t)mCapacity + 1;
+
+        size_t dropped = 0;
+        size_t skipped = 0;
+
+        while (mNumPackets > 0 && SeqDiff(newNextExtSeqNo, mNextExtSeqNo) > 0) {
+            if (take(mNextExtSeqNo) != NULL) {
+                ++dropped;
+            } else {
+                ++skipped;
+            }
+            ++mNextExtSeqNo;
+        }
+
+        mNumOverflowDrops += dropped;
+
+        if (numDropped != NULL) {
+            *numDropped = dropped;
+        }
+
+        if (numSkipped != NULL) {
+            *numSkipped = skipped;
+        }
+
+        mNextExtSeqNo = newNextExtSeqNo;
+        mDequeuedAny = true;
+    }
+
+    sp<ABuffer> &slot = mSlots[extSeqNo & mMask];
+
+    if (slot != NULL) {
+        // Within the window the slot can only ever hold this very packet.
+        return false;
+    }
+
+    slot = buffer;
+    ++mNumPackets;
+    mNumBytes += buffer->size();
+
+    if (SeqDiff(extSeqNo, mMaxExtSeqNo) > 0) {
+        mMaxExtSeqNo = extSeqNo;
+    }
+
+    return true;
+}
+
+sp<ABuffer> JitterBuffer::take(int32_t extSeqNo) {
+    sp<ABuffer> buffer = mSlots[extSeqNo & mMask];
+
+    if (buffer != NULL) {
+        mSlots[extSeqNo & mMask].clear();
+
+        --mNumPackets;
+        mNumBytes -= buffer->size();
+    }
+
+    return buffer;
+}
+
+sp<ABuffer> JitterBuffer::dequeue() {
+    if (mNumPackets == 0) {
+        return NULL;
+    }
+
+    sp<ABuffer> buffer = take(mNextExtSeqNo);
+
+    if (buffer != NULL) {
+        ++mNextExtSeqNo;
+        mDequeuedAny = true;
+    }
+
+    return buffer;
+}
+
+sp<ABuffer> JitterBuffer::dequeueFirstAvailable(size_t *numSkipped) {
+    *numSkipped = 0;
+
+    if (mNumPackets == 0) {
+        return NULL;
+    }
+
+    // There's at least one packet within the window, so this terminates
+    // after at most mCapacity steps.
+    while (mSlots[mNextExtSeqNo & mMask] == NULL) {
+        ++mNextExtSeqNo;
+        ++*numSkipped;
+    }
+
+    return dequeue();
+}
+
+sp<ABuffer> JitterBuffer::peekFirstAvailable() const {
+    if (mNumPackets == 0) {
+        return NULL;
+    }
+
+    int32_t extSeqNo = mNextExtSeqNo;
+    while (mSlots[extSeqNo & mMask] == NULL) {
+        ++extSeqNo;
+    }
+
+    return mSlots[extSeqNo & mMask];
+}
+
+int32_t JitterBuffer::nextExtSeqNo() const {
+    return mNextExtSeqNo;
+}
+
+int32_t JitterBuffer::maxExtSeqNo() const {
+    return mMaxExtSeqNo;
+}
+
+bool JitterBuffer::contains(int32_t extSeqNo) const {
+    if (!mStarted
+            || SeqDiff(extSeqNo, mNextExtSeqNo) < 0
+            || SeqDiff(extSeqNo, mNextExtSeqNo) >= (int32_t)mCapacity) {
+        return false;
+    }
+
+    return mSlots[extSeqNo & mMask] != NULL;
+}
+
+bool JitterBuffer::empty() const {
+    return mNumPackets == 0;
+}
+
+size_t JitterBuffer::numPackets() const {
+    return mNumPackets;
+}
+
+size_t JitterBuffer::numBytes() const {
+    return mNumBytes;
+}
+
+size_t JitterBuffer::capacity() const {
+    return mCapacity;
+}
+
+size_t JitterBuffer::numOverflowDrops() const {
+    return mNumOverflowDrops;
+}
+
+}  // namespace android
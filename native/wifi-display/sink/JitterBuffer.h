@@ -0,0 +1,89 @@
+#ifndef JITTER_BUFFER_H_
+
+#define JITTER_BUFFER_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Fixed capacity reorder queue for RTP payloads. Packets are identified by
+// their extended sequence number (as stored in ABuffer::int32Data()) which
+// directly maps to a slot in a circular array, insertion, duplicate
+// detection and in-order removal are therefore O(1).
+// Not thread-safe, the owner is expected to serialize access.
+struct JitterBuffer {
+    // "capacity" is rounded up to the next power of 2.
+    JitterBuffer(size_t capacity);
+    ~JitterBuffer();
+
+    // Returns false if the packet was dropped because it duplicates one
+    // that's already queued or lies before the dequeue position.
+    // Packets too far ahead of the dequeue position push it forward,
+    // discarding whatever was queued in between. The number of packets
+    // discarded that way and of the missing ones passed over among them
+    // are returned in "numDropped" and "numSkipped" (0 if the window
+    // didn't move), so that the owner can treat it as an overflow.
+    bool queue(
+            const sp<ABuffer> &buffer,
+            size_t *numDropped = NULL,
+            size_t *numSkipped = NULL);
+
+    // Returns the packet at the dequeue position if it has arrived,
+    // NULL otherwise.
+    sp<ABuffer> dequeue();
+
+    // Skips over any missing packets at the dequeue position and returns
+    // the first one that's available, NULL if the queue is empty.
+    sp<ABuffer> dequeueFirstAvailable(size_t *numSkipped);
+
+    // The packet dequeueFirstAvailable() would return, NULL if the queue
+    // is empty.
+    sp<ABuffer> peekFirstAvailable() const;
+
+    // Drops everything queued, the next packet queued starts a new
+    // sequence number space.
+    void clear();
+
+    // Extended sequence number expected next by dequeue(), -1 if nothing
+    // was ever queued.
+    int32_t nextExtSeqNo() const;
+
+    // Highest extended sequence number queued so far, -1 if none.
+    int32_t maxExtSeqNo() const;
+
+    // Whether the packet is currently queued.
+    bool contains(int32_t extSeqNo) const;
+
+    bool empty() const;
+    size_t numPackets() const;
+    size_t numBytes() const;
+    size_t capacity() const;
+
+    // Number of packets discarded because the window had to move forward.
+    size_t numOverflowDrops() const;
+
+private:
+    sp<ABuffer> *mSlots;
+    size_t mCapacity;
+    size_t mMask;
+
+    bool mStarted;
+    bool mDequeuedAny;
+    int32_t mNextExtSeqNo;
+    int32_t mMaxExtSeqNo;
+
+    size_t mNumPackets;
+    size_t mNumBytes;
+    size_t mNumOverflowDrops;
+
+    sp<ABuffer> take(int32_t extSeqNo);
+
+    DISALLOW_EVIL_CONSTRUCTORS(JitterBuffer);
+};
+
+}  // namespace android
+
+#endif  // JITTER_BUFFER_H_
@@ -1,4 +1,3 @@
-
 //#define LOG_NDEBUG 0
 #define LOG_TAG "LinearRegression"
 #include <utils/Log.h>
@@ -8,14 +7,24 @@
 #include <math.h>
 #include <string.h>
 
+#include <media/stagefright/foundation/ADebug.h>
+
 namespace android {
 
 LinearRegression::LinearRegression(size_t historySize)
     : mHistorySize(historySize),
       mCount(0),
+      mFirstIndex(0),
       mHistory(new Point[mHistorySize]),
+      mNumAddedSinceRebase(0),
+      mOriginX(0.0),
+      mOriginY(0.0),
       mSumX(0.0),
-      mSumY(0.0) {
+      mSumY(0.0),
+      mSumXX(0.0),
+      mSumYY(0.0),
+      mSumXY(0.0) {
+    CHECK_GT(historySize, 0u);
 }
 
 LinearRegression::~LinearRegression() {
@@ -23,61 +32,113 @@ LinearRegression::~LinearRegression() {
     mHistory = NULL;
 }
 
-void LinearRegression::addPoint(float x, float y) {
+void LinearRegression::addPoint(double x, double y) {
+    if (mCount == 0) {
+        mOriginX = x;
+        mOriginY = y;
+    }
+
+    x -= mOriginX;
+    y -= mOriginY;
+
     if (mCount == mHistorySize) {
-        const Point &oldest = mHistory[0];
+        const Point &oldest = mHistory[mFirstIndex];
 
         mSumX -= oldest.mX;
         mSumY -= oldest.mY;
+        mSumXX -= oldest.mX * oldest.mX;
+        mSumYY -= oldest.mY * oldest.mY;
+        mSumXY -= oldest.mX * oldest.mY;
 
-        memmove(&mHistory[0], &mHistory[1], (mHistorySize - 1) * sizeof(Point));
+        mFirstIndex = (mFirstIndex + 1) % mHistorySize;
         --mCount;
     }
 
-    Point *newest = &mHistory[mCount++];
+    Point *newest = &mHistory[(mFirstIndex + mCount) % mHistorySize];
     newest->mX = x;
     newest->mY = y;
+    ++mCount;
 
     mSumX += x;
     mSumY += y;
+    mSumXX += x * x;
+    mSumYY += y * y;
+    mSumXY += x * y;
+
+    if (++mNumAddedSinceRebase >= mHistorySize) {
+        // Once per history worth of points, which keeps this amortized
+        // O(1) while bounding both the magnitude of the coordinates and
+        // the error accumulated by the running sums.
+        rebase();
+    }
 }
 
-bool LinearRegression::approxLine(float *n1, float *n2, float *b) const {
-    static const float kEpsilon = 1.0E-4;
+void LinearRegression::rebase() {
+    const Point &oldest = mHistory[mFirstIndex];
+    double dx = oldest.mX;
+    double dy = oldest.mY;
 
-    if (mCount < 2) {
-        return false;
+    mOriginX += dx;
+    mOriginY += dy;
+
+    mSumX = mSumY = 0.0;
+    mSumXX = mSumYY = mSumXY = 0.0;
+
+    for (size_t i = 0; i < mCount; ++i) {
+        Point *p = &mHistory[(mFirstIndex + i) % mHistorySize];
+
+        p->mX -= dx;
+        p->mY -= dy;
+
+        mSumX += p->mX;
+        mSumY += p->mY;
+        mSumXX += p->mX * p->mX;
+        mSumYY += p->mY * p->mY;
+        mSumXY += p->mX * p->mY;
     }
 
-    float sumX2 = 0.0f;
-    float sumY2 = 0.0f;
-    float sumXY = 0.0f;
+    mNumAddedSinceRebase = 0;
+}
 
-    float meanX = mSumX / (float)mCount;
-    float meanY = mSumY / (float)mCount;
+void LinearRegression::getMoments(
+        double *sxx, double *syy, double *sxy) const {
+    double meanX = mSumX / mCount;
+    double meanY = mSumY / mCount;
 
-    for (size_t i = 0; i < mCount; ++i) {
-        const Point &p = mHistory[i];
+    *sxx = mSumXX - meanX * mSumX;
+    *syy = mSumYY - meanY * mSumY;
+    *sxy = mSumXY - meanX * mSumY;
 
-        float x = p.mX - meanX;
-        float y = p.mY - meanY;
+    // Cancellation may leave tiny negative variances.
+    if (*sxx < 0.0) {
+        *sxx = 0.0;
+    }
+    if (*syy < 0.0) {
+        *syy = 0.0;
+    }
+}
+
+bool LinearRegression::approxLine(double *n1, double *n2, double *b) const {
+    static const double kEpsilon = 1.0E-4;
 
-        sumX2 += x * x;
-        sumY2 += y * y;
-        sumXY += x * y;
+    if (mCount < 2) {
+        return false;
     }
 
-    float T = sumX2 + sumY2;
-    float D = sumX2 * sumY2 - sumXY * sumXY;
-    float root = sqrt(T * T * 0.25 - D);
+    double sumX2, sumY2, sumXY;
+    getMoments(&sumX2, &sumY2, &sumXY);
+
+    double T = sumX2 + sumY2;
+    double D = sumX2 * sumY2 - sumXY * sumXY;
+    double root = sqrt(T * T * 0.25 - D);
 
-    float L1 = T * 0.5 - root;
+    double L1 = T * 0.5 - root;
 
     if (fabs(sumXY) > kEpsilon) {
         *n1 = 1.0;
         *n2 = (2.0 * L1 - sumX2) / sumXY;
 
-        float mag = sqrt((*n1) * (*n1) + (*n2) * (*n2));
+        double mag = sqrt((*n1) * (*n1) + (*n2) * (*n2));
 
         *n1 /= mag;
         *n2 /= mag;
@@ -86,10 +147,66 @@ bool LinearRegression::approxLine(float *n1, float *n2, float *b) const {
         *n2 = 1.0;
     }
 
+    double meanX = mOriginX + mSumX / mCount;
+    double meanY = mOriginY + mSumY / mCount;
+
     *b = (*n1) * meanX + (*n2) * meanY;
 
     return true;
 }
 
-}  // namespace android
+bool LinearRegression::getSlope(double *slope) const {
+    if (mCount < 2) {
+        return false;
+    }
+
+    double sxx, syy, sxy;
+    getMoments(&sxx, &syy, &sxy);
+
+    if (sxx <= 0.0) {
+        return false;
+    }
+
+    *slope = sxy / sxx;
+
+    return true;
+}
 
+bool LinearRegression::getResidual(
+        double x, double y, double *residual) const {
+    double slope;
+    if (!getSlope(&slope)) {
+        return false;
+    }
+
+    double meanX = mSumX / mCount;
+    double meanY = mSumY / mCount;
+
+    *residual = (y - mOriginY - meanY) - slope * (x - mOriginX - meanX);
+
+    return true;
+}
+
+bool LinearRegression::getRMSResidual(double *rms) const {
+    if (mCount < 2) {
+        return false;
+    }
+
+    double sxx, syy, sxy;
+    getMoments(&sxx, &syy, &sxy);
+
+    if (sxx <= 0.0) {
+        return false;
+    }
+
+    double sse = syy - sxy * sxy / sxx;
+    if (sse < 0.0) {
+        sse = 0.0;
+    }
+
+    *rms = sqrt(sse / mCount);
+
+    return true;
+}
+
+}  // namespace android
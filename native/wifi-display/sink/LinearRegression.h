@@ -1,4 +1,3 @@
-
 #ifndef LINEAR_REGRESSION_H_
 
 #define LINEAR_REGRESSION_H_
@@ -8,26 +7,56 @@
 
 namespace android {
 
-// Helper class to fit a line to a set of points minimizing the sum of
-// squared (orthogonal) distances from line to individual points.
+// Helper class to fit a line to the most recent "historySize" points.
+// Running sums are updated incrementally, adding a point and querying the
+// fit are both O(1). Points are kept relative to an origin that follows
+// the oldest point, so large coordinates (i.e. extended RTP timestamps)
+// don't lose precision.
 struct LinearRegression {
     LinearRegression(size_t historySize);
     ~LinearRegression();
 
-    void addPoint(float x, float y);
+    void addPoint(double x, double y);
+
+    // The line minimizing the sum of squared (orthogonal) distances from
+    // line to individual points, as n1 * x + n2 * y = b.
+    bool approxLine(double *n1, double *n2, double *b) const;
+
+    // Least squares fit of y as a function of x, i.e. the rate of the y
+    // clock relative to the x clock.
+    bool getSlope(double *slope) const;
+
+    // Signed distance of "y" from the least squares fit at "x".
+    bool getResidual(double x, double y, double *residual) const;
+
+    // Root mean square of the residuals of all points in the history.
+    bool getRMSResidual(double *rms) const;
 
-    bool approxLine(float *n1, float *n2, float *b) const;
+    size_t count() const { return mCount; }
 
 private:
     struct Point {
-        float mX, mY;
+        double mX, mY;
     };
 
     size_t mHistorySize;
     size_t mCount;
+    size_t mFirstIndex;
     Point *mHistory;
 
-    float mSumX, mSumY;
+    // Points added since the origin was last moved.
+    size_t mNumAddedSinceRebase;
+
+    double mOriginX, mOriginY;
+
+    // Relative to the origin.
+    double mSumX, mSumY;
+    double mSumXX, mSumYY, mSumXY;
+
+    void rebase();
+
+    // Centered second moments.
+    void getMoments(double *sxx, double *syy, double *sxy) const;
 
     DISALLOW_EVIL_CONSTRUCTORS(LinearRegression);
 };
@@ -0,0 +1,196 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "NackTracker"
+#include <utils/Log.h>
+
+#include "NackTracker.h"
+
+#include "JitterBuffer.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+
+namespace android {
+
+// A packet counts as lost once this many later ones have been received,
+// which keeps plain reordering from triggering requests.
+static const int32_t kReorderTolerance = 2;
+
+// The source keeps around half a second worth of packets for
+// retransmission, at most Sender::kMaxHistoryLength of them whatever the
+// bitrate. Requests for anything older are pointless.
+static const int32_t kMaxNackDistance = 4096;
+
+static const int32_t kMaxRequestsPerPacket = 3;
+
+// Keeps a single RTCP packet well below the path MTU.
+static const size_t kMaxFCIsPerPacket = 64;
+
+static const int64_t kInitialRttUs = 20000ll;
+static const int64_t kMinRttUs = 2000ll;
+static const int64_t kMaxRttUs = 500000ll;
+
+NackTracker::NackTracker()
+    : mScanned(false),
+      mScannedUpTo(0),
+      mRttUs(kInitialRttUs) {
+}
+
+void NackTracker::reset() {
+    mMissing.clear();
+    mScanned = false;
+    mScannedUpTo = 0;
+}
+
+void NackTracker::onPacketQueued(int32_t extSeqNo, int64_t nowUs) {
+    if (mMissing.isEmpty()) {
+        return;
+    }
+
+    ssize_t index = mMissing.indexOfKey(extSeqNo);
+
+    if (index < 0) {
+        return;
+    }
+
+    const Entry &entry = mMissing.valueAt(index);
+
+    if (entry.mNumRequests > 0) {
+        int64_t sampleUs = nowUs - entry.mLastRequestUs;
+
+        if (sampleUs < kMinRttUs) {
+            sampleUs = kMinRttUs;
+        } else if (sampleUs > kMaxRttUs) {
+            sampleUs = kMaxRttUs;
+        }
+
+        mRttUs = (7 * mRttUs + sampleUs) / 8;
+
+        ALOGV("recovered extSeqNo %d after %lld us, rtt now %lld us",
+              extSeqNo, nowUs - entry.mLastRequestUs, mRttUs);
+    }
+
+    mMissing.removeItemsAt(index);
+}
+
+void NackTracker::scanForGaps(const JitterBuffer &packets) {
+    if (packets.maxExtSeqNo() < 0) {
+        return;
+    }
+
+    int32_t nextExtSeqNo = packets.nextExtSeqNo();
+
+    // The renderer has moved past these, no point in asking any longer.
+    while (!mMissing.isEmpty() && mMissing.keyAt(0) < nextExtSeqNo) {
+        mMissing.removeItemsAt(0);
+    }
+
+    int32_t from = mScanned ? mScannedUpTo + 1 : nextExtSeqNo;
+    if (from < nextExtSeqNo) {
+        from = nextExtSeqNo;
+    }
+
+    int32_t to = packets.maxExtSeqNo() - kReorderTolerance;
+
+    if (to < from) {
+        return;
+    }
+
+    if (to - from >= kMaxNackDistance) {
+        from = to - kMaxNackDistance + 1;
+    }
+
+    for (int32_t extSeqNo = from; extSeqNo <= to; ++extSeqNo) {
+        if (!packets.contains(extSeqNo)) {
+            Entry entry;
+            entry.mLastRequestUs = -1ll;
+            entry.mNumRequests = 0;
+
+            mMissing.add(extSeqNo, entry);
+        }
+    }
+
+    mScanned = true;
+    mScannedUpTo = to;
+}
+
+sp<ABuffer> NackTracker::collectNACKs(int64_t nowUs) {
+    if (mMissing.isEmpty()) {
+        return NULL;
+    }
+
+    int64_t retryIntervalUs = mRttUs + mRttUs / 2;
+
+    sp<ABuffer> fci = new ABuffer(4 * kMaxFCIsPerPacket);
+    uint8_t *ptr = fci->data();
+    size_t numFCIs = 0;
+
+    int32_t pid = -1;
+    uint16_t blp = 0;
+
+    for (size_t i = 0; i < mMissing.size(); ++i) {
+        Entry *entry = &mMissing.editValueAt(i);
+
+        if (entry->mNumRequests >= kMaxRequestsPerPacket
+                || (entry->mNumRequests > 0
+                    && nowUs < entry->mLastRequestUs + retryIntervalUs)) {
+            continue;
+        }
+
+        int32_t extSeqNo = mMissing.keyAt(i);
+
+        if (pid >= 0 && extSeqNo - pid <= 16) {
+            blp |= 1 << (extSeqNo - pid - 1);
+        } else {
+            if (pid >= 0) {
+                ptr[0] = (pid >> 8) & 0xff;
+                ptr[1] = pid & 0xff;
+                ptr[2] = blp >> 8;
+                ptr[3] = blp & 0xff;
+                ptr += 4;
+
+                ++numFCIs;
+            }
+
+            if (numFCIs == kMaxFCIsPerPacket) {
+                // The remainder goes out with the next batch.
+                pid = -1;
+                break;
+            }
+
+            pid = extSeqNo;
+            blp = 0;
+        }
+
+        entry->mLastRequestUs = nowUs;
+        ++entry->mNumRequests;
+    }
+
+    if (pid >= 0) {
+        ptr[0] = (pid >> 8) & 0xff;
+        ptr[1] = pid & 0xff;
+        ptr[2] = blp >> 8;
+        ptr[3] = blp & 0xff;
+
+        ++numFCIs;
+    }
+
+    if (numFCIs == 0) {
+        return NULL;
+    }
+
+    fci->setRange(0, 4 * numFCIs);
+
+    return fci;
+}
+
+int64_t NackTracker::rttUs() const {
+    return mRttUs;
+}
+
+bool NackTracker::wasRequested(int32_t extSeqNo) const {
+    ssize_t index = mMissing.indexOfKey(extSeqNo);
+
+    return index >= 0 && mMissing.valueAt(index).mNumRequests > 0;
+}
+
+}  // namespace android
@@ -0,0 +1,61 @@
+#ifndef NACK_TRACKER_H_
+
+#define NACK_TRACKER_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/KeyedVector.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ABuffer;
+struct JitterBuffer;
+
+// Keeps track of packets missing from the jitter buffer and decides when
+// to ask for their retransmission. Gaps are requested as soon as they are
+// detected and re-requested at most once per estimated round trip, the
+// round trip time itself is estimated from how long it takes requested
+// packets to show up.
+// Not thread-safe, the owner is expected to serialize access.
+struct NackTracker {
+    NackTracker();
+
+    // To be called for every packet newly queued.
+    void onPacketQueued(int32_t extSeqNo, int64_t nowUs);
+
+    // Registers all packets missing from "packets" beyond what was
+    // inspected by the previous call.
+    void scanForGaps(const JitterBuffer &packets);
+
+    // Returns the Generic NACK FCI entries (PID + BLP, RFC 4585 6.2.1) of
+    // all packets due for a (repeated) request, NULL if none are.
+    sp<ABuffer> collectNACKs(int64_t nowUs);
+
+    // Forgets about all missing packets, to be called along with
+    // JitterBuffer::clear(). The round trip estimate is kept.
+    void reset();
+
+    int64_t rttUs() const;
+
+    // Whether a retransmission of this packet was requested.
+    bool wasRequested(int32_t extSeqNo) const;
+
+private:
+    struct Entry {
+        int64_t mLastRequestUs;
+        int32_t mNumRequests;
+    };
+
+    KeyedVector<int32_t, Entry> mMissing;
+
+    bool mScanned;
+    int32_t mScannedUpTo;
+
+    int64_t mRttUs;
+
+    DISALLOW_EVIL_CONSTRUCTORS(NackTracker);
+};
+
+}  // namespace android
+
+#endif  // NACK_TRACKER_H_
@@ -0,0 +1,89 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PacketRing"
+#include <utils/Log.h>
+
+#include "PacketRing.h"
+
+#include <cutils/atomic.h>
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+
+namespace android {
+
+PacketRing::PacketRing(size_t capacity)
+    : mSlots(NULL),
+      mCapacity(1),
+      mWriteIndex(0),
+      mNumOverflows(0),
+      mReadIndex(0),
+      mCount(0) {
+    while (mCapacity < capacity) {
+        mCapacity <<= 1;
+    }
+    mMask = mCapacity - 1;
+
+    mSlots = new sp<ABuffer>[mCapacity];
+}
+
+PacketRing::~PacketRing() {
+    delete[] mSlots;
+    mSlots = NULL;
+}
+
+bool PacketRing::push(const sp<ABuffer> &buffer, bool *wakeConsumer) {
+    *wakeConsumer = false;
+
+    // Slots are only reused after the consumer retired them in
+    // finishBatch(), the acquire pairs with its release.
+    if ((size_t)android_atomic_acquire_load(&mCount) >= mCapacity) {
+        ++mNumOverflows;
+        return false;
+    }
+
+    mSlots[mWriteIndex & mMask] = buffer;
+    ++mWriteIndex;
+
+    // Publishes the slot written above (release semantics).
+    int32_t prevCount = android_atomic_inc(&mCount);
+
+    *wakeConsumer = (prevCount == 0);
+
+    return true;
+}
+
+size_t PacketRing::numAvailable() const {
+    return android_atomic_acquire_load(&mCount);
+}
+
+sp<ABuffer> PacketRing::pop() {
+    sp<ABuffer> &slot = mSlots[mReadIndex & mMask];
+    ++mReadIndex;
+
+    sp<ABuffer> buffer = slot;
+    slot.clear();
+
+    CHECK(buffer != NULL);
+
+    return buffer;
+}
+
+bool PacketRing::finishBatch(size_t numPopped) {
+    if (numPopped == 0) {
+        return android_atomic_acquire_load(&mCount) > 0;
+    }
+
+    int32_t prevCount = android_atomic_add(-(int32_t)numPopped, &mCount);
+    CHECK_GE(prevCount, (int32_t)numPopped);
+
+    return prevCount > (int32_t)numPopped;
+}
+
+size_t PacketRing::capacity() const {
+    return mCapacity;
+}
+
+size_t PacketRing::numOverflows() const {
+    return mNumOverflows;
+}
+
+}  // namespace android
@@ -0,0 +1,63 @@
+#ifndef PACKET_RING_H_
+
+#define PACKET_RING_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Lock-free queue handing packets from exactly one producer thread to
+// exactly one consumer thread. Both sides synchronize through a single
+// atomic packet count, which also tells the producer when the consumer
+// has run dry and needs to be woken up, so wakeups happen once per batch
+// instead of once per packet.
+struct PacketRing {
+    // "capacity" is rounded up to the next power of 2.
+    PacketRing(size_t capacity);
+    ~PacketRing();
+
+    // Producer side. Returns false (dropping the packet) if the ring is
+    // full. Otherwise "*wakeConsumer" is set if the consumer has finished
+    // its last batch and must be signalled to pick this packet up.
+    bool push(const sp<ABuffer> &buffer, bool *wakeConsumer);
+
+    // Consumer side. Number of packets that may be pop()ed right now.
+    size_t numAvailable() const;
+
+    sp<ABuffer> pop();
+
+    // Consumer side, to be called after pop()ing "numPopped" packets.
+    // Returns true if more packets were pushed meanwhile, in that case
+    // the consumer keeps going without another wakeup. If it returns
+    // false the next push() reports "*wakeConsumer".
+    bool finishBatch(size_t numPopped);
+
+    size_t capacity() const;
+
+    // Number of packets push() had to drop, producer side.
+    size_t numOverflows() const;
+
+private:
+    sp<ABuffer> *mSlots;
+    size_t mCapacity;
+    size_t mMask;
+
+    // Only ever touched by the producer.
+    size_t mWriteIndex;
+    size_t mNumOverflows;
+
+    // Only ever touched by the consumer.
+    size_t mReadIndex;
+
+    // Packets pushed but not yet retired by finishBatch().
+    volatile int32_t mCount;
+
+    DISALLOW_EVIL_CONSTRUCTORS(PacketRing);
+};
+
+}  // namespace android
+
+#endif  // PACKET_RING_H_
@@ -0,0 +1,94 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PlayoutDelayEstimator"
+#include <utils/Log.h>
+
+#include "PlayoutDelayEstimator.h"
+
+#include <string.h>
+
+namespace android {
+
+PlayoutDelayEstimator::PlayoutDelayEstimator()
+    : mNumSamples(0),
+      mWindowPos(0),
+      mSamplesSinceUpdate(0),
+      mLossWaitUs(kDefaultLossWaitUs) {
+    memset(mHistogram, 0, sizeof(mHistogram));
+}
+
+void PlayoutDelayEstimator::addLateness(int64_t latenessUs) {
+    // Early packets don't need any slack.
+    int64_t bin = (latenessUs > 0ll) ? latenessUs / 1000ll : 0ll;
+    if (bin >= kNumBins) {
+        bin = kNumBins - 1;
+    }
+
+    if (mNumSamples == kWindowSize) {
+        // Evict the oldest sample.
+        --mHistogram[mWindow[mWindowPos]];
+    } else {
+        ++mNumSamples;
+    }
+
+    mWindow[mWindowPos] = (uint8_t)bin;
+    ++mHistogram[bin];
+
+    if (++mWindowPos == kWindowSize) {
+        mWindowPos = 0;
+    }
+
+    ++mSamplesSinceUpdate;
+}
+
+bool PlayoutDelayEstimator::update(int64_t *lossWaitUs) {
+    *lossWaitUs = mLossWaitUs;
+
+    if (mNumSamples < kMinSamples || mSamplesSinceUpdate < kUpdateInterval) {
+        return false;
+    }
+
+    mSamplesSinceUpdate = 0;
+
+    size_t threshold = (mNumSamples * kPercentile + 99) / 100;
+
+    size_t count = 0;
+    size_t bin = 0;
+    while (bin < kNumBins - 1) {
+        count += mHistogram[bin];
+        if (count >= threshold) {
+            break;
+        }
+        ++bin;
+    }
+
+    // The percentile falls somewhere within this bin, assume its upper end.
+    int64_t newLossWaitUs = (bin + 1) * 1000ll + kMarginUs;
+
+    if (newLossWaitUs < kMinLossWaitUs) {
+        newLossWaitUs = kMinLossWaitUs;
+    } else if (newLossWaitUs > kMaxLossWaitUs) {
+        newLossWaitUs = kMaxLossWaitUs;
+    }
+
+    // Grow right away but shrink only once the improvement is worthwhile,
+    // so the window doesn't flap between neighbouring bins.
+    if (newLossWaitUs == mLossWaitUs
+            || (newLossWaitUs < mLossWaitUs
+                && mLossWaitUs - newLossWaitUs < kHysteresisUs)) {
+        return false;
+    }
+
+    ALOGV("loss-wait window now %lld ms (was %lld ms)",
+          newLossWaitUs / 1000ll, mLossWaitUs / 1000ll);
+
+    mLossWaitUs = newLossWaitUs;
+    *lossWaitUs = mLossWaitUs;
+
+    return true;
+}
+
+int64_t PlayoutDelayEstimator::lossWaitUs() const {
+    return mLossWaitUs;
+}
+
+}  // namespace android
@@ -0,0 +1,54 @@
+#ifndef PLAYOUT_DELAY_ESTIMATOR_H_
+
+#define PLAYOUT_DELAY_ESTIMATOR_H_
+
+#include <sys/types.h>
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Keeps a histogram of the lateness of the most recent packets (relative
+// to their expected arrival time) and derives how long the renderer should
+// hold out for a missing packet before giving up on it. Clean links end up
+// with a window of a few milliseconds, lossy or bursty ones get enough
+// slack to cover packets that were merely late.
+struct PlayoutDelayEstimator {
+    PlayoutDelayEstimator();
+
+    void addLateness(int64_t latenessUs);
+
+    // Returns true if the loss-wait window changed since the last call.
+    bool update(int64_t *lossWaitUs);
+
+    int64_t lossWaitUs() const;
+
+    static const int64_t kDefaultLossWaitUs = 50000ll;
+
+private:
+    enum {
+        kNumBins = 256,             // 1 ms each
+        kWindowSize = 1024,         // packets
+        kMinSamples = 256,
+        kUpdateInterval = 64,
+        kPercentile = 95,
+    };
+
+    static const int64_t kMinLossWaitUs = 2000ll;
+    static const int64_t kMaxLossWaitUs = 200000ll;
+    static const int64_t kMarginUs = 2000ll;
+    static const int64_t kHysteresisUs = 3000ll;
+
+    uint32_t mHistogram[kNumBins];
+    uint8_t mWindow[kWindowSize];
+    size_t mNumSamples;
+    size_t mWindowPos;
+    size_t mSamplesSinceUpdate;
+
+    int64_t mLossWaitUs;
+
+    DISALLOW_EVIL_CONSTRUCTORS(PlayoutDelayEstimator);
+};
+
+}  // namespace android
+
+#endif  // PLAYOUT_DELAY_ESTIMATOR_H_
@@ -0,0 +1,374 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "RTPCapture"
+#include <utils/Log.h>
+
+#include "RTPCapture.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+#include <media/stagefright/MediaErrors.h>
+#include <media/stagefright/Utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace android {
+
+static const uint32_t kFileMagic = 'WFDC';
+static const uint32_t kTrailerMagic = 'WFDX';
+
+static void WriteU16(uint8_t *ptr, uint16_t x) {
+    ptr[0] = x >> 8;
+    ptr[1] = x & 0xff;
+}
+
+static void WriteU32(uint8_t *ptr, uint32_t x) {
+    ptr[0] = x >> 24;
+    ptr[1] = (x >> 16) & 0xff;
+    ptr[2] = (x >> 8) & 0xff;
+    ptr[3] = x & 0xff;
+}
+
+static void WriteU64(uint8_t *ptr, uint64_t x) {
+    WriteU32(ptr, x >> 32);
+    WriteU32(ptr + 4, x & 0xffffffff);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RTPCaptureWriter::RTPCaptureWriter()
+    : mFile(NULL),
+      mOffset(0),
+      mNumPackets(0) {
+}
+
+RTPCaptureWriter::~RTPCaptureWriter() {
+    close();
+}
+
+status_t RTPCaptureWriter::open(const char *path) {
+    CHECK(mFile == NULL);
+
+    mFile = fopen(path, "wb");
+
+    if (mFile == NULL) {
+        ALOGE("unable to create capture file '%s' (%s)",
+              path, strerror(errno));
+        return -errno;
+    }
+
+    setvbuf(mFile, NULL, _IOFBF, kWriteBufferSize);
+
+    uint8_t header[RTPCapture::kFileHeaderSize];
+    memset(header, 0, sizeof(header));
+    WriteU32(&header[0], kFileMagic);
+    WriteU32(&header[4], RTPCapture::kVersion);
+
+    return write(header, sizeof(header));
+}
+
+status_t RTPCaptureWriter::write(const void *data, size_t size) {
+    if (fwrite(data, 1, size, mFile) != size) {
+        return ERROR_IO;
+    }
+
+    mOffset += size;
+
+    return OK;
+}
+
+void RTPCaptureWriter::writePacket(bool isRTP, const sp<ABuffer> &buffer) {
+    if (mFile == NULL) {
+        return;
+    }
+
+    int64_t arrivalTimeUs;
+    if (!buffer->meta()->findInt64("arrivalTimeUs", &arrivalTimeUs)) {
+        arrivalTimeUs = ALooper::GetNowUs();
+    }
+
+    if (buffer->size() > 0xffff) {
+        ALOGW("not capturing oversized datagram (%d bytes)", buffer->size());
+        return;
+    }
+
+    if ((mNumPackets % RTPCapture::kIndexInterval) == 0) {
+        IndexEntry entry;
+        entry.mOffset = mOffset;
+        entry.mArrivalTimeUs = arrivalTimeUs;
+        mIndex.push(entry);
+    }
+
+    uint8_t header[RTPCapture::kRecordHeaderSize];
+    WriteU64(&header[0], arrivalTimeUs);
+    WriteU16(&header[8], buffer->size());
+    header[10] = isRTP ? RTPCapture::kFlagRTP : 0;
+    header[11] = 0;
+
+    if (write(header, sizeof(header)) != OK
+            || write(buffer->data(), buffer->size()) != OK) {
+        ALOGE("writing to the capture file failed, capture stopped.");
+
+        fclose(mFile);
+        mFile = NULL;
+        return;
+    }
+
+    ++mNumPackets;
+}
+
+status_t RTPCaptureWriter::close() {
+    if (mFile == NULL) {
+        return OK;
+    }
+
+    uint64_t indexOffset = mOffset;
+
+    status_t err = OK;
+    for (size_t i = 0; err == OK && i < mIndex.size(); ++i) {
+        uint8_t entry[RTPCapture::kIndexEntrySize];
+        WriteU64(&entry[0], mIndex.itemAt(i).mOffset);
+        WriteU64(&entry[8], mIndex.itemAt(i).mArrivalTimeUs);
+
+        err = write(entry, sizeof(entry));
+    }
+
+    if (err == OK) {
+        uint8_t trailer[RTPCapture::kTrailerSize];
+        WriteU64(&trailer[0], indexOffset);
+        WriteU32(&trailer[8], mNumPackets);
+        WriteU32(&trailer[12], mIndex.size());
+        WriteU32(&trailer[16], RTPCapture::kIndexInterval);
+        WriteU32(&trailer[20], kTrailerMagic);
+
+        err = write(trailer, sizeof(trailer));
+    }
+
+    if (fclose(mFile) != 0 && err == OK) {
+        err = ERROR_IO;
+    }
+    mFile = NULL;
+
+    ALOGI("captured %d packets", mNumPackets);
+
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RTPCaptureReader::RTPCaptureReader()
+    : mBase(NULL),
+      mSize(0),
+      mRecordsEnd(0),
+      mOffset(0),
+      mNumPackets(0),
+      mFirstArrivalTimeUs(0ll),
+      mLastArrivalTimeUs(0ll) {
+}
+
+RTPCaptureReader::~RTPCaptureReader() {
+    if (mBase != NULL) {
+        munmap(mBase, mSize);
+        mBase = NULL;
+    }
+}
+
+status_t RTPCaptureReader::open(const char *path) {
+    CHECK(mBase == NULL);
+
+    int fd = ::open(path, O_RDONLY);
+
+    if (fd < 0) {
+        ALOGE("unable to open capture file '%s' (%s)", path, strerror(errno));
+        return -errno;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)RTPCapture::kFileHeaderSize) {
+        ::close(fd);
+        return ERROR_MALFORMED;
+    }
+
+    mSize = st.st_size;
+
+    // Private and writable, so that the packets can be handed to code
+    // that modifies them in place without touching the file.
+    void *base = mmap(
+            NULL, mSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    ::close(fd);
+    fd = -1;
+
+    if (base == MAP_FAILED) {
+        ALOGE("unable to map capture file (%s)", strerror(errno));
+        mSize = 0;
+        return -errno;
+    }
+
+    mBase = (uint8_t *)base;
+
+    if (U32_AT(&mBase[0]) != kFileMagic
+            || U32_AT(&mBase[4]) != RTPCapture::kVersion) {
+        ALOGE("'%s' is not a capture file we understand.", path);
+        return ERROR_UNSUPPORTED;
+    }
+
+    if (!parseTrailer()) {
+        ALOGW("capture file has no index, scanning it.");
+        scanRecords();
+    }
+
+    if (mNumPackets == 0) {
+        return ERROR_END_OF_STREAM;
+    }
+
+    mFirstArrivalTimeUs = mIndex.itemAt(0).mArrivalTimeUs;
+
+    // Only the records following the last index entry remain to be
+    // walked to find the last arrival time.
+    size_t offset = mIndex.itemAt(mIndex.size() - 1).mOffset;
+
+    Packet packet;
+    while (parseRecord(offset, &packet)) {
+        mLastArrivalTimeUs = packet.mArrivalTimeUs;
+        offset += RTPCapture::kRecordHeaderSize + packet.mSize;
+    }
+
+    mOffset = RTPCapture::kFileHeaderSize;
+
+    return OK;
+}
+
+bool RTPCaptureReader::parseTrailer() {
+    if (mSize < RTPCapture::kFileHeaderSize + RTPCapture::kTrailerSize) {
+        return false;
+    }
+
+    const uint8_t *trailer = &mBase[mSize - RTPCapture::kTrailerSize];
+
+    if (U32_AT(&trailer[20]) != kTrailerMagic
+            || U32_AT(&trailer[16]) != RTPCapture::kIndexInterval) {
+        return false;
+    }
+
+    uint64_t indexOffset = U64_AT(&trailer[0]);
+    size_t numPackets = U32_AT(&trailer[8]);
+    size_t numIndexEntries = U32_AT(&trailer[12]);
+
+    if (indexOffset < RTPCapture::kFileHeaderSize
+            || indexOffset + numIndexEntries * RTPCapture::kIndexEntrySize
+                    != mSize - RTPCapture::kTrailerSize
+            || numIndexEntries
+                    != (numPackets + RTPCapture::kIndexInterval - 1)
+                            / RTPCapture::kIndexInterval) {
+        return false;
+    }
+
+    mIndex.clear();
+    for (size_t i = 0; i < numIndexEntries; ++i) {
+        const uint8_t *ptr =
+            &mBase[indexOffset + i * RTPCapture::kIndexEntrySize];
+
+        IndexEntry entry;
+        entry.mOffset = U64_AT(&ptr[0]);
+        entry.mArrivalTimeUs = U64_AT(&ptr[8]);
+
+        if (entry.mOffset >= indexOffset) {
+            return false;
+        }
+
+        mIndex.push(entry);
+    }
+
+    mRecordsEnd = indexOffset;
+    mNumPackets = numPackets;
+
+    return true;
+}
+
+void RTPCaptureReader::scanRecords() {
+    mIndex.clear();
+    mNumPackets = 0;
+    mRecordsEnd = mSize;
+
+    size_t offset = RTPCapture::kFileHeaderSize;
+
+    Packet packet;
+    while (parseRecord(offset, &packet)) {
+        if ((mNumPackets % RTPCapture::kIndexInterval) == 0) {
+            IndexEntry entry;
+            entry.mOffset = offset;
+            entry.mArrivalTimeUs = packet.mArrivalTimeUs;
+            mIndex.push(entry);
+        }
+
+        ++mNumPackets;
+        offset += RTPCapture::kRecordHeaderSize + packet.mSize;
+    }
+
+    // Anything following is a record that was only partially written.
+    mRecordsEnd = offset;
+}
+
+bool RTPCaptureReader::parseRecord(size_t offset, Packet *packet) const {
+    if (offset + RTPCapture::kRecordHeaderSize > mRecordsEnd) {
+        return false;
+    }
+
+    const uint8_t *header = &mBase[offset];
+    size_t size = U16_AT(&header[8]);
+
+    if (offset + RTPCapture::kRecordHeaderSize + size > mRecordsEnd) {
+        return false;
+    }
+
+    packet->mData = &mBase[offset + RTPCapture::kRecordHeaderSize];
+    packet->mSize = size;
+    packet->mIsRTP = (header[10] & RTPCapture::kFlagRTP) != 0;
+    packet->mArrivalTimeUs = U64_AT(&header[0]);
+
+    return true;
+}
+
+void RTPCaptureReader::seekTo(int64_t timeUs) {
+    if (mIndex.isEmpty()) {
+        return;
+    }
+
+    // Last index entry at or before "timeUs".
+    size_t lo = 0;
+    size_t hi = mIndex.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+
+        if (mIndex.itemAt(mid).mArrivalTimeUs <= timeUs) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    mOffset = mIndex.itemAt(lo).mOffset;
+
+    Packet packet;
+    while (parseRecord(mOffset, &packet) && packet.mArrivalTimeUs < timeUs) {
+        mOffset += RTPCapture::kRecordHeaderSize + packet.mSize;
+    }
+}
+
+bool RTPCaptureReader::next(Packet *packet) {
+    if (!parseRecord(mOffset, packet)) {
+        return false;
+    }
+
+    mOffset += RTPCapture::kRecordHeaderSize + packet->mSize;
+
+    return true;
+}
+
+}  // namespace android
@@ -0,0 +1,139 @@
+#ifndef RTP_CAPTURE_H_
+
+#define RTP_CAPTURE_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+#include <utils/Vector.h>
+
+#include <stdio.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Capture files hold the RTP and RTCP datagrams received by an RTPSink
+// together with their arrival times, so that a session can be replayed
+// later on (see wfdreplay). All integers are stored in network byte order.
+//
+//   file header     'WFDC', version, 8 reserved bytes
+//   records         arrival time (int64 us), payload size (uint16),
+//                   flags (uint8, kFlagRTP), reserved (uint8), payload
+//   index           one (file offset, arrival time) pair per
+//                   kIndexInterval records
+//   trailer         index offset (uint64), number of records (uint32),
+//                   number of index entries (uint32), index interval
+//                   (uint32), 'WFDX'
+//
+// Index and trailer are written when the capture is closed, a capture cut
+// short (i.e. the process died) is still readable, it's just scanned
+// sequentially instead.
+struct RTPCapture {
+    enum {
+        kFlagRTP = 1,
+    };
+
+    static const size_t kFileHeaderSize = 16;
+    static const size_t kRecordHeaderSize = 12;
+    static const size_t kIndexEntrySize = 16;
+    static const size_t kTrailerSize = 24;
+    static const size_t kIndexInterval = 256;
+
+    static const uint32_t kVersion = 1;
+};
+
+struct RTPCaptureWriter : public RefBase {
+    RTPCaptureWriter();
+
+    status_t open(const char *path);
+
+    // Records "buffer" as it arrived, before any parsing, its arrival time
+    // taken from the "arrivalTimeUs" meta entry if present.
+    void writePacket(bool isRTP, const sp<ABuffer> &buffer);
+
+    // Writes index and trailer.
+    status_t close();
+
+    size_t numPackets() const { return mNumPackets; }
+
+protected:
+    virtual ~RTPCaptureWriter();
+
+private:
+    struct IndexEntry {
+        uint64_t mOffset;
+        int64_t mArrivalTimeUs;
+    };
+
+    // Records are buffered, writing one doesn't normally cost a syscall.
+    static const size_t kWriteBufferSize = 256 * 1024;
+
+    FILE *mFile;
+    uint64_t mOffset;
+    size_t mNumPackets;
+    Vector<IndexEntry> mIndex;
+
+    status_t write(const void *data, size_t size);
+
+    DISALLOW_EVIL_CONSTRUCTORS(RTPCaptureWriter);
+};
+
+// Memory maps a capture file and walks its records without copying them.
+struct RTPCaptureReader : public RefBase {
+    struct Packet {
+        // Points into the (private, writable) mapping, valid for the
+        // lifetime of the reader.
+        uint8_t *mData;
+        size_t mSize;
+        bool mIsRTP;
+        int64_t mArrivalTimeUs;
+    };
+
+    RTPCaptureReader();
+
+    status_t open(const char *path);
+
+    size_t numPackets() const { return mNumPackets; }
+
+    // Arrival times of the first and the last packet.
+    int64_t firstArrivalTimeUs() const { return mFirstArrivalTimeUs; }
+    int64_t lastArrivalTimeUs() const { return mLastArrivalTimeUs; }
+
+    // Continues with the first packet that arrived no earlier than
+    // "timeUs" (an absolute arrival time).
+    void seekTo(int64_t timeUs);
+
+    // Returns false once all packets have been read.
+    bool next(Packet *packet);
+
+protected:
+    virtual ~RTPCaptureReader();
+
+private:
+    struct IndexEntry {
+        size_t mOffset;
+        int64_t mArrivalTimeUs;
+    };
+
+    uint8_t *mBase;
+    size_t mSize;
+
+    // End of the record section.
+    size_t mRecordsEnd;
+    size_t mOffset;
+
+    size_t mNumPackets;
+    int64_t mFirstArrivalTimeUs;
+    int64_t mLastArrivalTimeUs;
+    Vector<IndexEntry> mIndex;
+
+    bool parseTrailer();
+    void scanRecords();
+    bool parseRecord(size_t offset, Packet *packet) const;
+
+    DISALLOW_EVIL_CONSTRUCTORS(RTPCaptureReader);
+};
+
+}  // namespace android
+
+#endif  // RTP_CAPTURE_H_
@@ -6,8 +6,14 @@
 #include "RTPSink.h"
 
 #include "ANetworkSession.h"
+#include "DatagramPool.h"
+#include "FECDecoder.h"
+#include "LatencyTrace.h"
+#include "RTPCapture.h"
+#include "SinkStats.h"
 #include "TunnelRenderer.h"
 
+#include <cutils/properties.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
@@ -19,11 +25,14 @@ namespace android {
 
 struct RTPSink::Source : public RefBase {
     Source(uint16_t seq, const sp<ABuffer> &buffer,
-           const sp<AMessage> queueBufferMsg);
+           const sp<TunnelRenderer> &renderer);
 
     bool updateSeq(uint16_t seq, const sp<ABuffer> &buffer);
 
-    void addReportBlock(uint32_t ssrc, const sp<ABuffer> &buf);
+    // "jitter" is the interarrival jitter in RTP timestamp units.
+    // Returns the fraction lost reported, in 1/256.
+    uint8_t addReportBlock(
+            uint32_t ssrc, uint32_t jitter, const sp<ABuffer> &buf);
 
 protected:
     virtual ~Source();
@@ -34,7 +43,7 @@ private:
     static const uint32_t kMaxMisorder = 100;
     static const uint32_t kRTPSeqMod = 1u << 16;
 
-    sp<AMessage> mQueueBufferMsg;
+    sp<TunnelRenderer> mRenderer;
 
     uint16_t mMaxSeq;
     uint32_t mCycles;
@@ -55,8 +64,8 @@ private:
 
 RTPSink::Source::Source(
         uint16_t seq, const sp<ABuffer> &buffer,
-        const sp<AMessage> queueBufferMsg)
-    : mQueueBufferMsg(queueBufferMsg),
+        const sp<TunnelRenderer> &renderer)
+    : mRenderer(renderer),
       mProbation(kMinSequential) {
     initSeq(seq);
     mMaxSeq = seq - 1;
@@ -151,13 +160,11 @@ bool RTPSink::Source::updateSeq(uint16_t seq, const sp<ABuffer> &buffer) {
 }
 
 void RTPSink::Source::queuePacket(const sp<ABuffer> &buffer) {
-    sp<AMessage> msg = mQueueBufferMsg->dup();
-    msg->setBuffer("buffer", buffer);
-    msg->post();
+    mRenderer->enqueuePacket(buffer);
 }
 
-void RTPSink::Source::addReportBlock(
-        uint32_t ssrc, const sp<ABuffer> &buf) {
+uint8_t RTPSink::Source::addReportBlock(
+        uint32_t ssrc, uint32_t jitter, const sp<ABuffer> &buf) {
     uint32_t extMaxSeq = mMaxSeq | mCycles;
     uint32_t expected = extMaxSeq - mBaseSeq + 1;
 
@@ -201,12 +208,12 @@ void RTPSink::Source::addReportBlock(
     ptr[10] = (extMaxSeq >> 8) & 0xff;
     ptr[11] = extMaxSeq & 0xff;
 
-    // XXX TODO:
+    ptr[12] = jitter >> 24;  // interarrival jitter
+    ptr[13] = (jitter >> 16) & 0xff;
+    ptr[14] = (jitter >> 8) & 0xff;
+    ptr[15] = jitter & 0xff;
 
-    ptr[12] = 0x00;  // interarrival jitter
-    ptr[13] = 0x00;
-    ptr[14] = 0x00;
-    ptr[15] = 0x00;
+    // XXX TODO:
 
     ptr[16] = 0x00;  // last SR
     ptr[17] = 0x00;
@@ -217,26 +224,102 @@ void RTPSink::Source::addReportBlock(
     ptr[21] = 0x00;
     ptr[22] = 0x00;
     ptr[23] = 0x00;
+
+    return fractionLost;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int getSocketReceiveBufferSize() {
+    // Covers about 400ms of a 20 Mbit/s stream should the thread servicing
+    // the socket be held up.
+    static const int kDefaultSize = 1024 * 1024;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.rcvbuf", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x;
+        }
+    }
+
+    return kDefaultSize;
+}
+
 RTPSink::RTPSink(
         const sp<ANetworkSession> &netSession,
-        const sp<ISurfaceTexture> &surfaceTex)
+        const sp<ISurfaceTexture> &surfaceTex,
+        uint32_t flags,
+        const sp<AMessage> &notify,
+        const char *metricsPrefix)
     : mNetSession(netSession),
       mSurfaceTex(surfaceTex),
+      mFlags(flags),
+      mNotify(notify),
+      mMetricsPrefix(metricsPrefix),
       mRTPPort(0),
       mRTPSessionID(0),
       mRTCPSessionID(0),
       mFirstArrivalTimeUs(-1ll),
+      mExtendedRTPTime(-1ll),
       mNumPacketsReceived(0ll),
       mRegression(1000),
       mMaxDelayMs(-1ll),
-      mIsConnectRemotePort(false) {
+#if ENABLE_REMB
+      mIntervalStartUs(-1ll),
+      mIntervalBytesReceived(0),
+      mIntervalLatenessSumUs(0ll),
+      mIntervalLatenessCount(0),
+      mPrevMeanLatenessUs(-1ll),
+#endif
+      mFECMatrixSize(0),
+      mRRIntervalStartUs(-1ll),
+      mRRIntervalPacketsStart(0ll),
+      mLastIDRRequestUs(-1ll),
+      mIsConnectRemotePort(false),
+      mPrevTransit(0ll),
+      mJitter(0.0),
+      mStatsIntervalStartUs(-1ll),
+      mStatsIntervalBytesReceived(0ll) {
+    sp<MetricsRegistry> metrics = MetricsRegistry::Get();
+    mPacketsReceivedMetric = metrics->counter(
+            StringPrintf("%s.rtp.packets_received", metricsPrefix).c_str());
+    mBytesReceivedMetric = metrics->counter(
+            StringPrintf("%s.rtp.bytes_received", metricsPrefix).c_str());
+    mPacketsRecoveredMetric = metrics->counter(
+            StringPrintf("%s.fec.packets_recovered", metricsPrefix).c_str());
+    mNACKsSentMetric = metrics->counter(
+            StringPrintf("%s.rtcp.nacks_sent", metricsPrefix).c_str());
+    mIDRRequestsMetric = metrics->counter(
+            StringPrintf("%s.rtsp.idr_requests", metricsPrefix).c_str());
+    mLatenessMetric = metrics->histogram(
+            StringPrintf("%s.rtp.lateness_us", metricsPrefix).c_str());
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.capture-file", val, NULL) && val[0]) {
+        mCapture = new RTPCaptureWriter;
+
+        if (mCapture->open(val) == OK) {
+            ALOGI("capturing incoming RTP/RTCP to '%s'", val);
+        } else {
+            mCapture.clear();
+        }
+    }
 }
 
 RTPSink::~RTPSink() {
+    if (mRendererLooper != NULL) {
+        mRendererLooper->unregisterHandler(mRenderer->id());
+        mRendererLooper->stop();
+    }
+
+    if (mCapture != NULL) {
+        mCapture->close();
+        mCapture.clear();
+    }
+
     if (mRTCPSessionID != 0) {
         mNetSession->destroySession(mRTCPSessionID);
     }
@@ -246,6 +329,26 @@ RTPSink::~RTPSink() {
     }
 }
 
+void RTPSink::enableFEC(size_t numColumns, size_t numRows) {
+    CHECK(numColumns >= 1 && numColumns <= kMaxFECColumns);
+    CHECK(numRows >= 1 && numRows <= kMaxFECRows);
+
+    ALOGI("expecting %d x %d FEC", numColumns, numRows);
+
+    mFECMatrixSize = numColumns * numRows;
+    mFECDecoder = new FECDecoder(numColumns, numRows, kReceiveBufferSize);
+}
+
+void RTPSink::setStats(const sp<SinkStats> &stats) {
+    mStats = stats;
+}
+
+void RTPSink::setRenderer(const sp<TunnelRenderer> &renderer) {
+    CHECK(mRenderer == NULL);
+
+    mRenderer = renderer;
+}
+
 status_t RTPSink::init(bool useTCPInterleaving) {
     if (useTCPInterleaving) {
         return OK;
@@ -255,7 +358,7 @@ status_t RTPSink::init(bool useTCPInterleaving) {
 
     sp<AMessage> rtpNotify = new AMessage(kWhatRTPNotify, id());
     sp<AMessage> rtcpNotify = new AMessage(kWhatRTCPNotify, id());
-    for (clientRtp = 15550;; clientRtp += 2) {
+    for (clientRtp = 15550; clientRtp < 65535; clientRtp += 2) {
         int32_t rtpSession;
         status_t err = mNetSession->createUDPSession(
                     clientRtp, rtpNotify, &rtpSession);
@@ -284,6 +387,32 @@ status_t RTPSink::init(bool useTCPInterleaving) {
         return UNKNOWN_ERROR;
     }
 
+    status_t err = mNetSession->setSocketReceiveBufferSize(
+            mRTPSessionID, getSocketReceiveBufferSize());
+
+    if (err != OK) {
+        ALOGW("unable to enlarge the RTP receive buffer (%d).", err);
+    }
+
+    // At 20 Mbit/s a datagram arrives every 600us or so, batching saves
+    // a syscall and a notification per packet.
+    err = mNetSession->setBatchedReceive(mRTPSessionID, true);
+
+    if (err != OK) {
+        ALOGW("batched receive unavailable (%d), continuing without.", err);
+    }
+
+    // Received payloads live until the renderer has handed them to the
+    // player, recycle them rather than hitting the heap for every packet.
+    mReceivePool = new DatagramPool(kNumReceiveBuffers, kReceiveBufferSize);
+
+    err = mNetSession->setReceivePool(mRTPSessionID, mReceivePool);
+
+    if (err != OK) {
+        ALOGW("unable to use receive pool (%d), continuing without.", err);
+        mReceivePool.clear();
+    }
+
     return OK;
 }
 
@@ -353,6 +482,35 @@ void RTPSink::onMessageReceived(const sp<AMessage> &msg) {
                     break;
                 }
 
+                case ANetworkSession::kWhatDatagramBatch:
+                {
+                    sp<RefBase> obj;
+                    CHECK(msg->findObject("batch", &obj));
+
+                    sp<ANetworkSession::DatagramBatch> batch =
+                        static_cast<ANetworkSession::DatagramBatch *>(
+                                obj.get());
+
+                    int32_t fromPort;
+                    AString fromAddr;
+                    if (!mIsConnectRemotePort
+                            && msg->findString("fromAddr", &fromAddr)
+                            && msg->findInt32("fromPort", &fromPort)) {
+                        connect(fromAddr.c_str(), fromPort, fromPort+1);
+                    }
+
+                    for (size_t i = 0; i < batch->mDatagrams.size(); ++i) {
+                        const sp<ABuffer> &data = batch->mDatagrams.itemAt(i);
+
+                        if (msg->what() == kWhatRTPNotify) {
+                            parseRTP(data);
+                        } else {
+                            parseRTCP(data);
+                        }
+                    }
+                    break;
+                }
+
                 default:
                     TRESPASS();
             }
@@ -402,7 +560,28 @@ status_t RTPSink::injectPacket(bool isRTP, const sp<ABuffer> &buffer) {
     return OK;
 }
 
+int64_t RTPSink::extendRTPTime(uint32_t rtpTime) {
+    if (mExtendedRTPTime < 0ll) {
+        mExtendedRTPTime = rtpTime;
+        return mExtendedRTPTime;
+    }
+
+    // Reordered packets may be slightly older than the latest one.
+    int32_t diff = (int32_t)(rtpTime - (uint32_t)mExtendedRTPTime);
+    int64_t extended = mExtendedRTPTime + diff;
+
+    if (diff > 0) {
+        mExtendedRTPTime = extended;
+    }
+
+    return extended;
+}
+
 status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
+    if (mCapture != NULL) {
+        mCapture->writePacket(true /* isRTP */, buffer);
+    }
+
     size_t size = buffer->size();
     if (size < 12) {
         // Too short to be a valid RTP header.
@@ -465,6 +644,19 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
     uint32_t rtpTime = U32_AT(&data[4]);
     uint16_t seqNo = U16_AT(&data[2]);
 
+    if ((data[1] & 0x7f) == FECDecoder::kPayloadType) {
+        // FEC packets are neither media nor representative of the
+        // media packets' timing.
+        if (mFECDecoder != NULL) {
+            onFECPacket(srcId, buffer);
+        }
+        return OK;
+    }
+
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Mark(LatencyTrace::kStageParsed, buffer);
+#endif
+
     int64_t arrivalTimeUs;
     CHECK(buffer->meta()->findInt64("arrivalTimeUs", &arrivalTimeUs));
 
@@ -478,22 +670,71 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
     ALOGV("seqNo: %d, SSRC 0x%08x, diff %lld",
             seqNo, srcId, rtpTime - arrivalTimeMedia);
 
-    mRegression.addPoint((float)rtpTime, (float)arrivalTimeMedia);
+    int64_t extendedRTPTime = extendRTPTime(rtpTime);
+
+    mRegression.addPoint((double)extendedRTPTime, (double)arrivalTimeMedia);
+
+    // Interarrival jitter as per RFC 3550, A.8.
+    int64_t transit = arrivalTimeMedia - extendedRTPTime;
+    if (mNumPacketsReceived > 0ll) {
+        int64_t d = transit - mPrevTransit;
+        if (d < 0ll) {
+            d = -d;
+        }
+
+        mJitter += ((double)d - mJitter) / 16.0;
+    }
+    mPrevTransit = transit;
+
+#if ENABLE_CLOCK_RECOVERY
+    // The source stamps RTP packets with its system clock as they are
+    // sent, the same clock its PTS and PCR are derived from.
+    mClockSkew.addPacket(extendedRTPTime, arrivalTimeMedia);
+
+    double clockRate;
+    if (mClockSkew.update(&clockRate) && mRenderer != NULL) {
+        mRenderer->setClockRate(clockRate);
+    }
+#endif
 
     ++mNumPacketsReceived;
+    mPacketsReceivedMetric->increment();
+    mBytesReceivedMetric->increment(size);
+    mStatsIntervalBytesReceived += size;
+
+#if ENABLE_REMB
+    mIntervalBytesReceived += size;
+#endif
+
+    double latenessMedia;
+    if (mRegression.getResidual(
+                (double)extendedRTPTime, (double)arrivalTimeMedia,
+                &latenessMedia)) {
+        double skew;
+        CHECK(mRegression.getSlope(&skew));
 
-    float n1, n2, b;
-    if (mRegression.approxLine(&n1, &n2, &b)) {
-        ALOGV("Line %lld: %.2f %.2f %.2f, slope %.2f",
-              mNumPacketsReceived, n1, n2, b, -n1 / n2);
+        ALOGV("packet %lld: clock skew %.6f, lateness %.2f ms",
+              mNumPacketsReceived, skew, latenessMedia / 90.0);
 
-        float expectedArrivalTimeMedia = (b - n1 * (float)rtpTime) / n2;
-        float latenessMs = (arrivalTimeMedia - expectedArrivalTimeMedia) / 90.0;
+        float latenessMs = latenessMedia / 90.0;
 
         if (mMaxDelayMs < 0ll || latenessMs > mMaxDelayMs) {
             mMaxDelayMs = latenessMs;
             ALOGI("packet was %.2f ms late", latenessMs);
         }
+
+        mPlayoutDelay.addLateness((int64_t)(latenessMs * 1000.0f));
+        mLatenessMetric->record((int64_t)(latenessMs * 1000.0f));
+
+#if ENABLE_REMB
+        mIntervalLatenessSumUs += (int64_t)(latenessMs * 1000.0f);
+        ++mIntervalLatenessCount;
+#endif
+
+        int64_t lossWaitUs;
+        if (mPlayoutDelay.update(&lossWaitUs) && mRenderer != NULL) {
+            mRenderer->setLossWaitUs(lossWaitUs);
+        }
     }
 
     sp<AMessage> meta = buffer->meta();
@@ -504,29 +745,93 @@ status_t RTPSink::parseRTP(const sp<ABuffer> &buffer) {
 
     buffer->setRange(payloadOffset, size - payloadOffset);
 
+    // Has to happen before the packet is handed to the renderer.
+    List<sp<ABuffer> > recovered;
+    if (mFECDecoder != NULL) {
+        mFECDecoder->addMediaPacket(seqNo, buffer, &recovered);
+    }
+
     ssize_t index = mSources.indexOfKey(srcId);
     if (index < 0) {
         if (mRenderer == NULL) {
             sp<AMessage> notifyLost = new AMessage(kWhatPacketLost, id());
             notifyLost->setInt32("ssrc", srcId);
 
-            mRenderer = new TunnelRenderer(notifyLost, mSurfaceTex);
-            looper()->registerHandler(mRenderer);
-        }
+            mRenderer = new TunnelRenderer(
+                    notifyLost,
+                    mSurfaceTex,
+                    (mFlags & FLAG_DIRECT_RENDERING) != 0,
+                    (mFlags & FLAG_DISCARD_OUTPUT) != 0,
+                    mMetricsPrefix.c_str());
+            CHECK_EQ(TunnelRenderer::StartLooper(&mRendererLooper),
+                     (status_t)OK);
+            mRendererLooper->registerHandler(mRenderer);
+
+            if (mStats != NULL) {
+                mRenderer->setStats(mStats);
+            }
 
-        sp<AMessage> queueBufferMsg =
-            new AMessage(TunnelRenderer::kWhatQueueBuffer, mRenderer->id());
+            mRenderer->setLossWaitUs(mPlayoutDelay.lossWaitUs());
+        } else if (mSources.isEmpty()) {
+            // The renderer was handed to us, it may still hold on to the
+            // previous session's stream.
+            sp<AMessage> notifyLost = new AMessage(kWhatPacketLost, id());
+            notifyLost->setInt32("ssrc", srcId);
 
-        sp<Source> source = new Source(seqNo, buffer, queueBufferMsg);
+            mRenderer->startStream(notifyLost);
+            mRenderer->setLossWaitUs(mPlayoutDelay.lossWaitUs());
+        }
+
+        sp<Source> source = new Source(seqNo, buffer, mRenderer);
         mSources.add(srcId, source);
     } else {
         mSources.valueAt(index)->updateSeq(seqNo, buffer);
     }
 
+    queueRecoveredPackets(srcId, recovered);
+
     return OK;
 }
 
+void RTPSink::onFECPacket(uint32_t srcId, const sp<ABuffer> &buffer) {
+    List<sp<ABuffer> > recovered;
+    status_t err = mFECDecoder->addFECPacket(buffer, &recovered);
+
+    if (err != OK) {
+        ALOGW("discarding FEC packet (err %d)", err);
+        return;
+    }
+
+    queueRecoveredPackets(srcId, recovered);
+}
+
+void RTPSink::queueRecoveredPackets(
+        uint32_t srcId, const List<sp<ABuffer> > &recovered) {
+    if (recovered.empty()) {
+        return;
+    }
+
+    ssize_t index = mSources.indexOfKey(srcId);
+    if (index < 0) {
+        return;
+    }
+
+    sp<Source> source = mSources.valueAt(index);
+
+    mPacketsRecoveredMetric->increment(recovered.size());
+
+    for (List<sp<ABuffer> >::const_iterator it = recovered.begin();
+            it != recovered.end(); ++it) {
+        const sp<ABuffer> &buffer = *it;
+        source->updateSeq(buffer->int32Data() & 0xffff, buffer);
+    }
+}
+
 status_t RTPSink::parseRTCP(const sp<ABuffer> &buffer) {
+    if (mCapture != NULL) {
+        mCapture->writePacket(false /* isRTP */, buffer);
+    }
+
     const uint8_t *data = buffer->data();
     size_t size = buffer->size();
 
@@ -722,6 +1027,82 @@ void RTPSink::addSDES(const sp<ABuffer> &buffer) {
     buffer->setRange(buffer->offset(), buffer->size() + offset);
 }
 
+#if ENABLE_REMB
+void RTPSink::addREMB(const sp<ABuffer> &buffer) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    int64_t startUs = mIntervalStartUs;
+    size_t bytesReceived = mIntervalBytesReceived;
+
+    int64_t meanLatenessUs = -1ll;
+    if (mIntervalLatenessCount > 0) {
+        meanLatenessUs = mIntervalLatenessSumUs / mIntervalLatenessCount;
+    }
+
+    int64_t latenessIncreaseUs = 0ll;
+    if (meanLatenessUs >= 0ll && mPrevMeanLatenessUs >= 0ll) {
+        latenessIncreaseUs = meanLatenessUs - mPrevMeanLatenessUs;
+    }
+
+    mIntervalStartUs = nowUs;
+    mIntervalBytesReceived = 0;
+    mIntervalLatenessSumUs = 0ll;
+    mIntervalLatenessCount = 0;
+
+    if (meanLatenessUs >= 0ll) {
+        mPrevMeanLatenessUs = meanLatenessUs;
+    }
+
+    if (latenessIncreaseUs <= kCongestionLatenessIncreaseUs
+            || startUs < 0ll || nowUs <= startUs
+            || mSources.isEmpty()) {
+        return;
+    }
+
+    // Ask for somewhat less than what made it through, the queues need
+    // to drain.
+    uint64_t bitrate =
+        (uint64_t)bytesReceived * 8000000ull / (nowUs - startUs) * 85 / 100;
+
+    ALOGI("packets arriving %lld us later than before, "
+          "estimating %llu bps available",
+          latenessIncreaseUs, bitrate);
+
+    unsigned exp = 0;
+    while (bitrate >= (1ull << 18)) {
+        bitrate >>= 1;
+        ++exp;
+    }
+
+    uint32_t ssrc = mSources.keyAt(0);
+
+    uint8_t *data = buffer->data() + buffer->size();
+    data[0] = 0x80 | 15;  // FMT 15: application layer feedback
+    data[1] = 206;  // PSFB
+    data[2] = 0;
+    data[3] = 5;
+    data[4] = 0xde;  // SSRC
+    data[5] = 0xad;
+    data[6] = 0xbe;
+    data[7] = 0xef;
+    data[8] = 0;  // media source SSRC, unused
+    data[9] = 0;
+    data[10] = 0;
+    data[11] = 0;
+    memcpy(&data[12], "REMB", 4);
+    data[16] = 1;  // number of SSRCs
+    data[17] = (exp << 2) | (bitrate >> 16);
+    data[18] = (bitrate >> 8) & 0xff;
+    data[19] = bitrate & 0xff;
+    data[20] = ssrc >> 24;
+    data[21] = (ssrc >> 16) & 0xff;
+    data[22] = (ssrc >> 8) & 0xff;
+    data[23] = ssrc & 0xff;
+
+    buffer->setRange(buffer->offset(), buffer->size() + 24);
+}
+#endif
+
 void RTPSink::onSendRR() {
     sp<ABuffer> buf = new ABuffer(1500);
     buf->setRange(0, 0);
@@ -739,6 +1120,7 @@ void RTPSink::onSendRR() {
     buf->setRange(0, 8);
 
     size_t numReportBlocks = 0;
+    uint8_t maxFractionLost = 0;
     for (size_t i = 0; i < mSources.size(); ++i) {
         uint32_t ssrc = mSources.keyAt(i);
         sp<Source> source = mSources.valueAt(i);
@@ -748,7 +1130,12 @@ void RTPSink::onSendRR() {
             break;
         }
 
-        source->addReportBlock(ssrc, buf);
+        // All sources share the clock of the one stream we receive.
+        uint8_t fractionLost =
+            source->addReportBlock(ssrc, (uint32_t)mJitter, buf);
+        if (fractionLost > maxFractionLost) {
+            maxFractionLost = fractionLost;
+        }
         ++numReportBlocks;
     }
 
@@ -762,28 +1149,91 @@ void RTPSink::onSendRR() {
 
     addSDES(buf);
 
+#if ENABLE_REMB
+    addREMB(buf);
+#endif
+
     mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
 
+    if (mStats != NULL) {
+        updateStats(maxFractionLost);
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+    int64_t numPackets = mNumPacketsReceived - mRRIntervalPacketsStart;
+
+    if (mFECMatrixSize > 0 && mRenderer != NULL
+            && mRRIntervalStartUs >= 0ll && numPackets > 0ll) {
+        // The parity covering a packet may only be sent once the rest of
+        // its matrix was.
+        int64_t packetIntervalUs = (nowUs - mRRIntervalStartUs) / numPackets;
+        mRenderer->setFECWaitUs(mFECMatrixSize * packetIntervalUs);
+    }
+
+    mRRIntervalStartUs = nowUs;
+    mRRIntervalPacketsStart = mNumPacketsReceived;
+
+    if (mReceivePool != NULL) {
+        ALOGV("receive pool: %d of %d buffers in use, %d overflows",
+              mReceivePool->numBuffersInUse(),
+              mReceivePool->numBuffers(),
+              mReceivePool->numOverflows());
+    }
+
+    if (mFECDecoder != NULL) {
+        ALOGV("FEC: %d packets recovered, %d FEC packets unrecoverable",
+              mFECDecoder->numRecovered(),
+              mFECDecoder->numUnrecoverable());
+    }
+
+    MetricsRegistry::Get()->dumpIfRequested();
+
     scheduleSendRR();
 }
 
+void RTPSink::updateStats(uint8_t fractionLost) {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mStatsIntervalStartUs >= 0ll && nowUs > mStatsIntervalStartUs) {
+        mStats->set(
+                SinkStats::kBitrateBps,
+                (mStatsIntervalBytesReceived * 8000000ll)
+                    / (nowUs - mStatsIntervalStartUs));
+    }
+
+    mStatsIntervalStartUs = nowUs;
+    mStatsIntervalBytesReceived = 0ll;
+
+    mStats->set(SinkStats::kPacketsReceived, mNumPacketsReceived);
+    mStats->set(SinkStats::kFractionLost, fractionLost);
+    mStats->set(SinkStats::kJitterUs, (int64_t)((mJitter * 100.0) / 9.0));
+}
+
 void RTPSink::onPacketLost(const sp<AMessage> &msg) {
     uint32_t srcId;
     CHECK(msg->findInt32("ssrc", (int32_t *)&srcId));
 
-    int32_t seqNo;
-    CHECK(msg->findInt32("seqNo", &seqNo));
+    int32_t unrecoverable;
+    if (msg->findInt32("unrecoverable", &unrecoverable) && unrecoverable) {
+        onUnrecoverableLoss();
+        return;
+    }
 
-    int32_t blp = 0;
+    // Any number of PID + BLP entries, each covering up to 17 packets.
+    sp<ABuffer> nacks;
+    CHECK(msg->findBuffer("nacks", &nacks));
 
-    sp<ABuffer> buf = new ABuffer(1500);
+    size_t numFCIs = nacks->size() / 4;
+    CHECK_GT(numFCIs, 0u);
+
+    sp<ABuffer> buf = new ABuffer(12 + nacks->size());
     buf->setRange(0, 0);
 
     uint8_t *ptr = buf->data();
     ptr[0] = 0x80 | 1;  // generic NACK
     ptr[1] = 205;  // RTPFB
-    ptr[2] = 0;
-    ptr[3] = 3;
+    ptr[2] = ((2 + numFCIs) >> 8) & 0xff;
+    ptr[3] = (2 + numFCIs) & 0xff;
     ptr[4] = 0xde;  // sender SSRC
     ptr[5] = 0xad;
     ptr[6] = 0xbe;
@@ -792,15 +1242,37 @@ void RTPSink::onPacketLost(const sp<AMessage> &msg) {
     ptr[9] = (srcId >> 16) & 0xff;
     ptr[10] = (srcId >> 8) & 0xff;
     ptr[11] = (srcId & 0xff);
-    ptr[12] = (seqNo >> 8) & 0xff;
-    ptr[13] = (seqNo & 0xff);
-    ptr[14] = (blp >> 8) & 0xff;
-    ptr[15] = (blp & 0xff);
 
-    buf->setRange(0, 16);
+    memcpy(&ptr[12], nacks->data(), 4 * numFCIs);
+
+    buf->setRange(0, 12 + 4 * numFCIs);
+
+    ALOGV("sending NACK with %d entries", numFCIs);
+
+    mNACKsSentMetric->increment();
 
     mNetSession->sendRequest(mRTCPSessionID, buf->data(), buf->size());
 }
 
+void RTPSink::onUnrecoverableLoss() {
+    if (mNotify == NULL) {
+        return;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mLastIDRRequestUs >= 0ll
+            && nowUs < mLastIDRRequestUs + kMinIDRRequestIntervalUs) {
+        return;
+    }
+
+    mLastIDRRequestUs = nowUs;
+    mIDRRequestsMetric->increment();
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatRequestIDR);
+    notify->post();
+}
+
 }  // namespace android
 
@@ -5,28 +5,87 @@
 
 #include <media/stagefright/foundation/AHandler.h>
 
+#include "ClockSkewEstimator.h"
 #include "LinearRegression.h"
+#include "Metrics.h"
+#include "PlayoutDelayEstimator.h"
 
 #include <gui/Surface.h>
 
 namespace android {
 
+// If enabled, a receiver estimated maximum bitrate (REMB) is appended to
+// receiver reports whenever packets arrive increasingly late, i.e. queues
+// on the path build up, allowing the source to back off before loss sets in.
+#define ENABLE_REMB     1
+
+// Estimate the source's clock skew and have the renderer slew stream
+// timestamps to match it.
+#define ENABLE_CLOCK_RECOVERY   1
+
 struct ABuffer;
 struct ANetworkSession;
+struct DatagramPool;
+struct FECDecoder;
+struct RTPCaptureWriter;
+struct SinkStats;
 struct TunnelRenderer;
 
 // Creates a pair of sockets for RTP/RTCP traffic, instantiates a renderer
 // for incoming transport stream data and occasionally sends statistics over
-// the RTCP channel.
+// the RTCP channel. WifiDisplaySink runs it (and with it the renderer) on
+// a looper and network session separate from RTSP control traffic.
 struct RTPSink : public AHandler {
+    enum {
+        // Decode the transport stream in-process and render frames as soon
+        // as they're decoded instead of going through a mediaplayer.
+        FLAG_DIRECT_RENDERING = 1,
+
+        // Reassemble the transport stream but drop it instead of rendering
+        // it, for exercising the receive path without a display.
+        FLAG_DISCARD_OUTPUT = 2,
+    };
+
+    enum {
+        // The renderer had to give up on lost data and waits for an IDR
+        // frame. Rate-limited, sent only if a notify message was given.
+        kWhatRequestIDR,
+    };
+
+    // Largest XOR FEC matrix we're able to decode.
+    enum {
+        kMaxFECColumns = 20,
+        kMaxFECRows = 10,
+    };
+
+    // Metrics of this sink and the renderer it creates are registered
+    // under "metricsPrefix", unique among the sinks of a process.
     RTPSink(const sp<ANetworkSession> &netSession,
-            const sp<ISurfaceTexture> &surfaceTex);
+            const sp<ISurfaceTexture> &surfaceTex,
+            uint32_t flags = 0,
+            const sp<AMessage> &notify = NULL,
+            const char *metricsPrefix = "sink");
 
     // If TCP interleaving is used, no UDP sockets are created, instead
     // incoming RTP/RTCP packets (arriving on the RTSP control connection)
     // are manually injected by WifiDisplaySink.
     status_t init(bool useTCPInterleaving);
 
+    // The source protects the RTP stream with XOR FEC over a matrix of
+    // numColumns x numRows packets. Must be called before init().
+    void enableFEC(size_t numColumns, size_t numRows);
+
+    // Hands incoming data to "renderer" (already registered with our
+    // looper, possibly prepared and used by an earlier session) instead of
+    // creating a renderer once the first packet arrives. Must be called
+    // before init().
+    void setRenderer(const sp<TunnelRenderer> &renderer);
+
+    // Bitrate, fraction lost and jitter are published through "stats"
+    // with every receiver report, renderers we create publish theirs.
+    // Must be called before init().
+    void setStats(const sp<SinkStats> &stats);
+
     status_t connect(
             const char *host, int32_t remoteRtpPort, int32_t remoteRtcpPort);
 
@@ -50,8 +109,25 @@ private:
     struct Source;
     struct StreamSource;
 
+#if ENABLE_REMB
+    // Mean lateness growth between receiver reports considered congestion.
+    static const int64_t kCongestionLatenessIncreaseUs = 5000ll;
+#endif
+
+    // Give the source a chance to deliver the IDR frame asked for before
+    // asking again.
+    static const int64_t kMinIDRRequestIntervalUs = 500000ll;
+
+    // Enough receive buffers to cover a full reorder queue at 20 Mbit/s.
+    static const size_t kNumReceiveBuffers = 1024;
+    static const size_t kReceiveBufferSize = 1500;
+
     sp<ANetworkSession> mNetSession;
     sp<ISurfaceTexture> mSurfaceTex;
+    uint32_t mFlags;
+    sp<AMessage> mNotify;
+    AString mMetricsPrefix;
+    sp<DatagramPool> mReceivePool;
     KeyedVector<uint32_t, sp<Source> > mSources;
 
     int32_t mRTPPort;
@@ -59,22 +135,81 @@ private:
     int32_t mRTCPSessionID;
 
     int64_t mFirstArrivalTimeUs;
+
+    // Most recent RTP timestamp extended to 64 bits, -1 before the first.
+    int64_t mExtendedRTPTime;
     int64_t mNumPacketsReceived;
     LinearRegression mRegression;
     int64_t mMaxDelayMs;
+    PlayoutDelayEstimator mPlayoutDelay;
+
+#if ENABLE_CLOCK_RECOVERY
+    ClockSkewEstimator mClockSkew;
+#endif
+
+#if ENABLE_REMB
+    // Statistics accumulated since the last receiver report.
+    int64_t mIntervalStartUs;
+    size_t mIntervalBytesReceived;
+    int64_t mIntervalLatenessSumUs;
+    size_t mIntervalLatenessCount;
+    int64_t mPrevMeanLatenessUs;
+#endif
 
     sp<TunnelRenderer> mRenderer;
 
+    // Only set if we created mRenderer ourselves.
+    sp<ALooper> mRendererLooper;
+
+    sp<FECDecoder> mFECDecoder;
+    size_t mFECMatrixSize;
+
+    // Packets received over the current receiver report interval, these
+    // pace the FEC matrices.
+    int64_t mRRIntervalStartUs;
+    int64_t mRRIntervalPacketsStart;
+
+    int64_t mLastIDRRequestUs;
+
+    // Records all incoming datagrams if "media.wfd.sink.capture-file"
+    // names a file to write them to.
+    sp<RTPCaptureWriter> mCapture;
+
     bool mIsConnectRemotePort;
 
+    // Transit time of the previous packet and the interarrival jitter,
+    // both in 90kHz units.
+    int64_t mPrevTransit;
+    double mJitter;
+
+    sp<SinkStats> mStats;
+    int64_t mStatsIntervalStartUs;
+    int64_t mStatsIntervalBytesReceived;
+
+    MetricsRegistry::Counter *mPacketsReceivedMetric;
+    MetricsRegistry::Counter *mBytesReceivedMetric;
+    MetricsRegistry::Counter *mPacketsRecoveredMetric;
+    MetricsRegistry::Counter *mNACKsSentMetric;
+    MetricsRegistry::Counter *mIDRRequestsMetric;
+    MetricsRegistry::Histogram *mLatenessMetric;
+
     status_t parseRTP(const sp<ABuffer> &buffer);
+    int64_t extendRTPTime(uint32_t rtpTime);
     status_t parseRTCP(const sp<ABuffer> &buffer);
     status_t parseBYE(const uint8_t *data, size_t size);
     status_t parseSR(const uint8_t *data, size_t size);
 
     void addSDES(const sp<ABuffer> &buffer);
+#if ENABLE_REMB
+    void addREMB(const sp<ABuffer> &buffer);
+#endif
     void onSendRR();
+    void updateStats(uint8_t fractionLost);
     void onPacketLost(const sp<AMessage> &msg);
+    void onUnrecoverableLoss();
+    void onFECPacket(uint32_t srcId, const sp<ABuffer> &buffer);
+    void queueRecoveredPackets(
+            uint32_t srcId, const List<sp<ABuffer> > &recovered);
     void scheduleSendRR();
 
     DISALLOW_EVIL_CONSTRUCTORS(RTPSink);
@@ -0,0 +1,423 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SinkCapabilities"
+#include <utils/Log.h>
+
+#include "SinkCapabilities.h"
+
+#include <cutils/properties.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/MediaCodecList.h>
+#include <media/stagefright/MediaDefs.h>
+
+#include <OMX_Video.h>
+
+#include <pthread.h>
+
+namespace android {
+
+// What we advertised before probing, still used if there's no H.264
+// decoder to ask.
+static const char *kDefaultVideoFormats =
+    "48 00 02 02 0001DEFF 157C7FFF 00000FFF 00 0000 0000 00 none none";
+
+static const char *kLPCM = "LPCM 00000003 00";
+static const char *kAAC = "AAC 00000001 00";
+
+struct VideoMode {
+    int32_t mWidth;
+    int32_t mHeight;
+    int32_t mFrameRate;  // full frames, i.e. half the field rate
+    bool mInterlaced;
+};
+
+// Indexed by bit position in the respective bitmap of the WFD spec.
+static const VideoMode kCEAModes[] = {
+    {  640,  480, 60, false },
+    {  720,  480, 60, false },
+    {  720,  480, 30, true },
+    {  720,  576, 50, false },
+    {  720,  576, 25, true },
+    { 1280,  720, 30, false },
+    { 1280,  720, 60, false },
+    { 1920, 1080, 30, false },
+    { 1920, 1080, 60, false },
+    { 1920, 1080, 30, true },
+    { 1280,  720, 25, false },
+    { 1280,  720, 50, false },
+    { 1920, 1080, 25, false },
+    { 1920, 1080, 50, false },
+    { 1920, 1080, 25, true },
+    { 1280,  720, 24, false },
+    { 1920, 1080, 24, false },
+};
+
+static const VideoMode kVESAModes[] = {
+    {  800,  600, 30, false },
+    {  800,  600, 60, false },
+    { 1024,  768, 30, false },
+    { 1024,  768, 60, false },
+    { 1152,  864, 30, false },
+    { 1152,  864, 60, false },
+    { 1280,  768, 30, false },
+    { 1280,  768, 60, false },
+    { 1280,  800, 30, false },
+    { 1280,  800, 60, false },
+    { 1360,  768, 30, false },
+    { 1360,  768, 60, false },
+    { 1366,  768, 30, false },
+    { 1366,  768, 60, false },
+    { 1280, 1024, 30, false },
+    { 1280, 1024, 60, false },
+    { 1400, 1050, 30, false },
+    { 1400, 1050, 60, false },
+    { 1440,  900, 30, false },
+    { 1440,  900, 60, false },
+    { 1600,  900, 30, false },
+    { 1600,  900, 60, false },
+    { 1600, 1200, 30, false },
+    { 1600, 1200, 60, false },
+    { 1680, 1024, 30, false },
+    { 1680, 1024, 60, false },
+    { 1680, 1050, 30, false },
+    { 1680, 1050, 60, false },
+    { 1920, 1200, 30, false },
+    { 1920, 1200, 60, false },
+};
+
+static const VideoMode kHHModes[] = {
+    {  800,  480, 30, false },
+    {  800,  480, 60, false },
+    {  854,  480, 30, false },
+    {  854,  480, 60, false },
+    {  864,  480, 30, false },
+    {  864,  480, 60, false },
+    {  640,  360, 30, false },
+    {  640,  360, 60, false },
+    {  960,  540, 30, false },
+    {  960,  540, 60, false },
+    {  848,  480, 30, false },
+    {  848,  480, 60, false },
+};
+
+static const size_t kNumCEAModes = sizeof(kCEAModes) / sizeof(kCEAModes[0]);
+static const size_t kNumVESAModes = sizeof(kVESAModes) / sizeof(kVESAModes[0]);
+static const size_t kNumHHModes = sizeof(kHHModes) / sizeof(kHHModes[0]);
+
+// Table A-1 of the H.264 spec.
+struct LevelLimits {
+    uint32_t mLevel;
+    int32_t mMaxMBPS;
+    int32_t mMaxFrameSize;  // in macroblocks
+};
+
+static const LevelLimits kLevelLimits[] = {
+    { OMX_VIDEO_AVCLevel1,     1485,    99 },
+    { OMX_VIDEO_AVCLevel1b,    1485,    99 },
+    { OMX_VIDEO_AVCLevel11,    3000,   396 },
+    { OMX_VIDEO_AVCLevel12,    6000,   396 },
+    { OMX_VIDEO_AVCLevel13,   11880,   396 },
+    { OMX_VIDEO_AVCLevel2,    11880,   396 },
+    { OMX_VIDEO_AVCLevel21,   19800,   792 },
+    { OMX_VIDEO_AVCLevel22,   20250,  1620 },
+    { OMX_VIDEO_AVCLevel3,    40500,  1620 },
+    { OMX_VIDEO_AVCLevel31,  108000,  3600 },
+    { OMX_VIDEO_AVCLevel32,  216000,  5120 },
+    { OMX_VIDEO_AVCLevel4,   245760,  8192 },
+    { OMX_VIDEO_AVCLevel41,  245760,  8192 },
+    { OMX_VIDEO_AVCLevel42,  522240,  8704 },
+    { OMX_VIDEO_AVCLevel5,   589824, 22080 },
+    { OMX_VIDEO_AVCLevel51,  983040, 36864 },
+};
+
+static const size_t kNumLevelLimits =
+    sizeof(kLevelLimits) / sizeof(kLevelLimits[0]);
+
+// The levels bitmap of "wfd_video_formats".
+struct WFDLevel {
+    uint32_t mBit;
+    uint32_t mLevel;
+};
+
+static const WFDLevel kWFDLevels[] = {
+    { 0x01, OMX_VIDEO_AVCLevel31 },
+    { 0x02, OMX_VIDEO_AVCLevel32 },
+    { 0x04, OMX_VIDEO_AVCLevel4 },
+    { 0x08, OMX_VIDEO_AVCLevel41 },
+    { 0x10, OMX_VIDEO_AVCLevel42 },
+};
+
+static const size_t kNumWFDLevels = sizeof(kWFDLevels) / sizeof(kWFDLevels[0]);
+
+static const uint32_t kWFDProfileCBP = 0x01;
+static const uint32_t kWFDProfileCHP = 0x02;
+
+static const LevelLimits *FindLevelLimits(uint32_t level) {
+    for (size_t i = 0; i < kNumLevelLimits; ++i) {
+        if (kLevelLimits[i].mLevel == level) {
+            return &kLevelLimits[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int32_t NumMacroblocks(const VideoMode &mode) {
+    return ((mode.mWidth + 15) / 16) * ((mode.mHeight + 15) / 16);
+}
+
+static bool IsSoftwareCodec(const char *name) {
+    return !strncmp(name, "OMX.google.", 11);
+}
+
+static uint32_t ModesWithinLimits(
+        const VideoMode *modes, size_t numModes,
+        int32_t maxFrameSize, int32_t maxMBPS) {
+    uint32_t bitmap = 0;
+    for (size_t i = 0; i < numModes; ++i) {
+        int32_t numMBs = NumMacroblocks(modes[i]);
+
+        if (numMBs <= maxFrameSize
+                && numMBs * modes[i].mFrameRate <= maxMBPS) {
+            bitmap |= 1u << i;
+        }
+    }
+
+    return bitmap;
+}
+
+static Mutex gCapabilitiesLock;
+static sp<SinkCapabilities> gCapabilities;
+static bool gPrefetchStarted = false;
+
+// static
+sp<SinkCapabilities> SinkCapabilities::Get() {
+    Mutex::Autolock autoLock(gCapabilitiesLock);
+
+    if (gCapabilities == NULL) {
+        gCapabilities = new SinkCapabilities;
+    }
+
+    return gCapabilities;
+}
+
+// static
+void SinkCapabilities::Prefetch() {
+    {
+        Mutex::Autolock autoLock(gCapabilitiesLock);
+
+        if (gCapabilities != NULL || gPrefetchStarted) {
+            return;
+        }
+
+        gPrefetchStarted = true;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int res = pthread_create(&thread, &attr, PrefetchThread, NULL);
+
+    pthread_attr_destroy(&attr);
+
+    if (res != 0) {
+        // Get() will have to probe on its own then.
+        ALOGW("unable to start probing the decoders (%d)", res);
+
+        Mutex::Autolock autoLock(gCapabilitiesLock);
+        gPrefetchStarted = false;
+    }
+}
+
+// static
+void *SinkCapabilities::PrefetchThread(void *) {
+    Get();
+
+    return NULL;
+}
+
+SinkCapabilities::SinkCapabilities()
+    : mVideoFormats(kDefaultVideoFormats),
+      mAudioCodecs(kLPCM) {
+    probeVideo();
+    probeAudio();
+
+    ALOGI("wfd_video_formats: %s", mVideoFormats.c_str());
+    ALOGI("wfd_audio_codecs: %s", mAudioCodecs.c_str());
+}
+
+SinkCapabilities::~SinkCapabilities() {
+}
+
+void SinkCapabilities::probeVideo() {
+    const MediaCodecList *list = MediaCodecList::getInstance();
+
+    // The first one is what MediaCodec::CreateByType instantiates.
+    ssize_t index =
+        (list != NULL)
+            ? list->findCodecByType(MEDIA_MIMETYPE_VIDEO_AVC, false)
+            : -1;
+
+    if (index < 0) {
+        ALOGW("no H.264 decoder found, advertising the default formats.");
+        return;
+    }
+
+    const char *name = list->getCodecName(index);
+
+    Vector<MediaCodecList::ProfileLevel> profileLevels;
+    Vector<uint32_t> colorFormats;
+    status_t err = list->getCodecCapabilities(
+            index, MEDIA_MIMETYPE_VIDEO_AVC, &profileLevels, &colorFormats);
+
+    if (err != OK || profileLevels.isEmpty()) {
+        ALOGW("unable to query %s (%d), advertising the default formats.",
+              name, err);
+        return;
+    }
+
+    // Constrained baseline streams decode on any profile, the highest
+    // level reported goes for them. High profile is offered if supported
+    // at a level WFD knows about.
+    uint32_t baselineLevel = 0;
+    uint32_t highLevel = 0;
+    for (size_t i = 0; i < profileLevels.size(); ++i) {
+        const MediaCodecList::ProfileLevel &entry = profileLevels.itemAt(i);
+
+        if (entry.mLevel > baselineLevel) {
+            baselineLevel = entry.mLevel;
+        }
+
+        if (entry.mProfile == OMX_VIDEO_AVCProfileHigh
+                && entry.mLevel > highLevel) {
+            highLevel = entry.mLevel;
+        }
+    }
+
+    uint32_t profile = kWFDProfileCBP;
+    uint32_t level = baselineLevel;
+    if (highLevel >= OMX_VIDEO_AVCLevel31) {
+        profile = kWFDProfileCHP;
+        level = highLevel;
+    }
+
+    const LevelLimits *limits = FindLevelLimits(level);
+
+    if (limits == NULL) {
+        ALOGW("%s reports unknown level 0x%x, advertising the default "
+              "formats.", name, level);
+        return;
+    }
+
+    int32_t maxFrameSize = limits->mMaxFrameSize;
+    int32_t maxMBPS = limits->mMaxMBPS;
+
+    if (IsSoftwareCodec(name)) {
+        // Whatever the level, no software decoder we ship keeps up with
+        // more than this.
+        const LevelLimits *softLimits =
+            FindLevelLimits(OMX_VIDEO_AVCLevel31);
+
+        if (maxFrameSize > softLimits->mMaxFrameSize) {
+            maxFrameSize = softLimits->mMaxFrameSize;
+        }
+        if (maxMBPS > softLimits->mMaxMBPS) {
+            maxMBPS = softLimits->mMaxMBPS;
+        }
+    }
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.max-decode-mbps", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            if ((int32_t)x < maxMBPS) {
+                maxMBPS = x;
+            }
+        } else {
+            ALOGW("ignoring malformed media.wfd.sink.max-decode-mbps '%s'",
+                  val);
+        }
+    }
+
+    // The highest level within what the decoder is trusted with, the
+    // modes decide about the rest.
+    uint32_t levelBit = kWFDLevels[0].mBit;
+    for (size_t i = 0; i < kNumWFDLevels; ++i) {
+        const LevelLimits *wfdLimits = FindLevelLimits(kWFDLevels[i].mLevel);
+
+        if (kWFDLevels[i].mLevel <= level
+                && wfdLimits->mMaxFrameSize <= maxFrameSize
+                && wfdLimits->mMaxMBPS <= maxMBPS) {
+            levelBit = kWFDLevels[i].mBit;
+        }
+    }
+
+    uint32_t cea = ModesWithinLimits(
+            kCEAModes, kNumCEAModes, maxFrameSize, maxMBPS);
+    uint32_t vesa = ModesWithinLimits(
+            kVESAModes, kNumVESAModes, maxFrameSize, maxMBPS);
+    uint32_t hh = ModesWithinLimits(
+            kHHModes, kNumHHModes, maxFrameSize, maxMBPS);
+
+    // 640x480p60 is mandatory.
+    cea |= 1;
+
+    // The most demanding progressive CEA mode we can handle is the one
+    // we'd like to get.
+    size_t nativeIndex = 0;
+    int32_t nativeMBPS = 0;
+    for (size_t i = 0; i < kNumCEAModes; ++i) {
+        const VideoMode &mode = kCEAModes[i];
+        int32_t mbps = NumMacroblocks(mode) * mode.mFrameRate;
+
+        if ((cea & (1u << i)) && !mode.mInterlaced && mbps > nativeMBPS) {
+            nativeIndex = i;
+            nativeMBPS = mbps;
+        }
+    }
+
+    mVideoFormats = StringPrintf(
+            "%02X 00 %02X %02X %08X %08X %08X 00 0000 0000 00 none none",
+            (unsigned)(nativeIndex << 3) | 0 /* CEA */,
+            profile,
+            levelBit,
+            cea,
+            vesa,
+            hh);
+
+    ALOGI("%s decodes up to %d macroblocks per frame, %d per second",
+          name, maxFrameSize, maxMBPS);
+}
+
+void SinkCapabilities::probeAudio() {
+    const MediaCodecList *list = MediaCodecList::getInstance();
+
+    if (list == NULL) {
+        return;
+    }
+
+    for (size_t start = 0;;) {
+        ssize_t index = list->findCodecByType(
+                MEDIA_MIMETYPE_AUDIO_AAC, false, start);
+
+        if (index < 0) {
+            break;
+        }
+
+        const char *name = list->getCodecName(index);
+
+        if (!IsSoftwareCodec(name)) {
+            ALOGI("offering AAC, %s decodes it", name);
+
+            mAudioCodecs = StringPrintf("%s, %s", kAAC, kLPCM);
+            return;
+        }
+
+        start = index + 1;
+    }
+}
+
+}  // namespace android
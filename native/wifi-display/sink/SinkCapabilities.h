@@ -0,0 +1,55 @@
+#ifndef SINK_CAPABILITIES_H_
+
+#define SINK_CAPABILITIES_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <media/stagefright/foundation/AString.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+// What this device decodes in real time, as advertised to sources in
+// response to M3. The decoder MediaCodec would instantiate for H.264 is
+// asked for its profiles and levels once per process (instantiating it
+// for that takes a while, so it's best done ahead of the first session),
+// the level limits (macroblocks per frame and per second) then decide
+// which CEA, VESA and HH modes make it into "wfd_video_formats".
+// Software decoders are trusted with no more than 720p30, and
+// "media.wfd.sink.max-decode-mbps" caps the macroblock rate of any
+// decoder that claims more than it can keep up with.
+//
+// AAC is offered ahead of LPCM if there's a hardware AAC decoder, it
+// takes a fraction of the bandwidth at no CPU cost then.
+struct SinkCapabilities : public RefBase {
+    // Blocks while the decoders are probed, unless that's been done
+    // already.
+    static sp<SinkCapabilities> Get();
+
+    // Starts probing on a thread of its own and returns right away, a
+    // later Get() only waits for whatever is left of it.
+    static void Prefetch();
+
+    // The values of "wfd_video_formats" and "wfd_audio_codecs".
+    const AString &videoFormats() const { return mVideoFormats; }
+    const AString &audioCodecs() const { return mAudioCodecs; }
+
+protected:
+    virtual ~SinkCapabilities();
+
+private:
+    AString mVideoFormats;
+    AString mAudioCodecs;
+
+    SinkCapabilities();
+
+    static void *PrefetchThread(void *);
+
+    void probeVideo();
+    void probeAudio();
+
+    DISALLOW_EVIL_CONSTRUCTORS(SinkCapabilities);
+};
+
+}  // namespace android
+
+#endif  // SINK_CAPABILITIES_H_
@@ -0,0 +1,133 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SinkStats"
+#include <utils/Log.h>
+
+#include "SinkStats.h"
+
+#include <cutils/atomic.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+#include <string.h>
+
+namespace android {
+
+SinkStats::SinkStats()
+    : mBlock(new Block),
+      mThresholdMask(0) {
+    memset(mBlock, 0, sizeof(*mBlock));
+    mBlock->mVersion = kVersion;
+
+    for (size_t i = 0; i < kNumFields; ++i) {
+        mThresholds[i] = -1ll;
+        mAbove[i] = false;
+    }
+}
+
+SinkStats::~SinkStats() {
+    delete mBlock;
+    mBlock = NULL;
+}
+
+void SinkStats::set(Field field, int64_t value) {
+    CHECK_LT((size_t)field, (size_t)kNumFields);
+
+    // Nobody else writes the field right now, reading it is safe.
+    if (mBlock->mValues[field] == value) {
+        return;
+    }
+
+    store(field, value);
+    checkThreshold(field, value);
+}
+
+void SinkStats::add(Field field, int64_t amount) {
+    CHECK_LT((size_t)field, (size_t)kNumFields);
+
+    if (amount == 0) {
+        return;
+    }
+
+    int64_t value = mBlock->mValues[field] + amount;
+
+    store(field, value);
+    checkThreshold(field, value);
+}
+
+void SinkStats::store(Field field, int64_t value) {
+    // Odd while the update is in progress, 64-bit stores aren't atomic on
+    // all of our CPUs. A writer of another field may be in the middle of
+    // its update, which takes no longer than the store below.
+    int32_t seq;
+    for (;;) {
+        seq = android_atomic_acquire_load(&mBlock->mSequence);
+
+        if ((seq & 1) == 0
+                && android_atomic_acquire_cas(
+                    seq, seq + 1, &mBlock->mSequence) == 0) {
+            break;
+        }
+    }
+
+    mBlock->mValues[field] = value;
+
+    android_atomic_release_store(seq + 2, &mBlock->mSequence);
+}
+
+void SinkStats::checkThreshold(Field field, int64_t value) {
+    if ((android_atomic_acquire_load(&mThresholdMask) & (1 << field)) == 0) {
+        return;
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
+    if (mThresholds[field] < 0ll || mNotify == NULL) {
+        return;
+    }
+
+    bool above = value > mThresholds[field];
+
+    if (above != mAbove[field]) {
+        mAbove[field] = above;
+
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("what", kWhatThresholdCrossed);
+        notify->setInt32("field", field);
+        notify->setInt64("value", value);
+        notify->setInt32("above", above);
+        notify->post();
+    }
+}
+
+void SinkStats::setThreshold(Field field, int64_t threshold) {
+    CHECK_LT((size_t)field, (size_t)kNumFields);
+
+    Mutex::Autolock autoLock(mLock);
+
+    mThresholds[field] = threshold;
+
+    // The first update on the far side of the new threshold is reported.
+    mAbove[field] = false;
+
+    if (threshold < 0ll) {
+        android_atomic_and(~(1 << field), &mThresholdMask);
+    } else {
+        android_atomic_or(1 << field, &mThresholdMask);
+    }
+}
+
+void SinkStats::setNotify(const sp<AMessage> &notify) {
+    Mutex::Autolock autoLock(mLock);
+
+    mNotify = notify;
+}
+
+void *SinkStats::data() const {
+    return mBlock;
+}
+
+size_t SinkStats::size() const {
+    return sizeof(*mBlock);
+}
+
+}  // namespace android
@@ -0,0 +1,108 @@
+#ifndef SINK_STATS_H_
+
+#define SINK_STATS_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+#include <utils/threads.h>
+
+namespace android {
+
+struct AMessage;
+
+// Link quality of a sink, kept in a block of memory that the application
+// maps (as a direct ByteBuffer) and polls without calling into native code.
+//
+// The block starts with a 32-bit sequence number followed by a 32-bit
+// layout version and kNumFields 64-bit values, all in native byte order.
+// Writers make the sequence number odd before and even again after updating
+// a field, so readers take a consistent snapshot by retrying until they see
+// the same even sequence number on both sides of their reads.
+//
+// Writers take no locks. Every field has a single writer at a time, or its
+// writers serialize among themselves: RTPSink's looper owns the receive
+// side fields, the renderer (under its lock) the queue, loss and frame
+// rate fields. Writers of different fields only ever contend for the
+// sequence number, which is claimed with a compare-and-swap for the
+// duration of one 64-bit store.
+//
+// A threshold can be set per field, crossing it in either direction posts
+// the notify message given to setNotify(). Only updates of fields with a
+// threshold take a lock to check it.
+struct SinkStats : public RefBase {
+    enum Field {
+        // Received over the last receiver report interval.
+        kBitrateBps,
+        kPacketsReceived,
+        // Given up on by the renderer, i.e. neither retransmitted nor
+        // recovered in time.
+        kPacketsLost,
+        // RTCP "fraction lost" over the last receiver report interval,
+        // in 1/256.
+        kFractionLost,
+        // RFC 3550 interarrival jitter.
+        kJitterUs,
+        // Source time spanned by what's queued in the jitter buffer.
+        kLatencyUs,
+        kQueuedBytes,
+        kQueuedPackets,
+        // Video frames handed to the decoder per second, times 100.
+        kFrameRateX100,
+        kNumFields,
+    };
+
+    enum {
+        kVersion = 1,
+    };
+
+    enum {
+        // "field", "value" (int64_t) and "above" (whether "value" now
+        // exceeds the threshold).
+        kWhatThresholdCrossed,
+    };
+
+    SinkStats();
+
+    // See above for who may call these for which field.
+    void set(Field field, int64_t value);
+    void add(Field field, int64_t amount);
+
+    // A negative threshold (the default) disables notifications.
+    void setThreshold(Field field, int64_t threshold);
+    void setNotify(const sp<AMessage> &notify);
+
+    // The shared block, valid for as long as this object is alive.
+    void *data() const;
+    size_t size() const;
+
+protected:
+    virtual ~SinkStats();
+
+private:
+    struct Block {
+        volatile int32_t mSequence;
+        int32_t mVersion;
+        int64_t mValues[kNumFields];
+    };
+
+    Block *mBlock;
+
+    // Bit "field" is set while a threshold is, read without the lock.
+    volatile int32_t mThresholdMask;
+
+    // Protects the threshold state below.
+    Mutex mLock;
+
+    sp<AMessage> mNotify;
+    int64_t mThresholds[kNumFields];
+    bool mAbove[kNumFields];
+
+    void store(Field field, int64_t value);
+    void checkThreshold(Field field, int64_t value);
+
+    DISALLOW_EVIL_CONSTRUCTORS(SinkStats);
+};
+
+}  // namespace android
+
+#endif  // SINK_STATS_H_
@@ -0,0 +1,171 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "SinkThreadPool"
+#include <utils/Log.h>
+
+#include "SinkThreadPool.h"
+
+#include "ANetworkSession.h"
+#include "Metrics.h"
+#include "ThreadConfig.h"
+
+#include <cutils/properties.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AString.h>
+
+#include <unistd.h>
+
+namespace android {
+
+static Mutex gPoolLock;
+static sp<SinkThreadPool> gPool;
+
+// static
+sp<SinkThreadPool> SinkThreadPool::Get() {
+    Mutex::Autolock autoLock(gPoolLock);
+
+    if (gPool == NULL) {
+        gPool = new SinkThreadPool;
+    }
+
+    return gPool;
+}
+
+SinkThreadPool::SinkThreadPool() {
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    mMaxLanes = (numCPUs > 0) ? numCPUs : 1;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.media-lanes", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            mMaxLanes = x;
+        } else {
+            ALOGW("ignoring malformed media.wfd.sink.media-lanes '%s'", val);
+        }
+    }
+
+    ALOGI("hosting sinks on up to %d media lanes", mMaxLanes);
+}
+
+SinkThreadPool::~SinkThreadPool() {
+    // Never reached, the pool lives as long as the process.
+    for (size_t i = 0; i < mLanes.size(); ++i) {
+        mLanes.editItemAt(i).mLooper->stop();
+        mLanes.editItemAt(i).mNetSession->stop();
+    }
+}
+
+status_t SinkThreadPool::acquire(
+        sp<ANetworkSession> *netSession, sp<ALooper> *looper, size_t *lane) {
+    Mutex::Autolock autoLock(mLock);
+
+    ssize_t best = -1;
+    for (size_t i = 0; i < mLanes.size(); ++i) {
+        if (best < 0
+                || mLanes.itemAt(i).mNumSinks
+                        < mLanes.itemAt(best).mNumSinks) {
+            best = i;
+        }
+    }
+
+    if ((best < 0 || mLanes.itemAt(best).mNumSinks > 0)
+            && mLanes.size() < mMaxLanes) {
+        Lane newLane;
+        newLane.mNumSinks = 0;
+
+        status_t err = startLane_l(&newLane);
+
+        if (err == OK) {
+            best = mLanes.add(newLane);
+        } else if (best < 0) {
+            return err;
+        } else {
+            ALOGW("unable to start another media lane (%d), sharing one.",
+                  err);
+        }
+    }
+
+    Lane *entry = &mLanes.editItemAt(best);
+    ++entry->mNumSinks;
+
+    *netSession = entry->mNetSession;
+    *looper = entry->mLooper;
+    *lane = best;
+
+    ALOGI("sink placed on media lane %d, now shared by %d sink(s)",
+          best, entry->mNumSinks);
+
+    MetricsRegistry::Get()->gauge(
+            StringPrintf("sink.host.lane%d.sinks", best).c_str())
+        ->set(entry->mNumSinks);
+
+    return OK;
+}
+
+void SinkThreadPool::release(size_t lane) {
+    Mutex::Autolock autoLock(mLock);
+
+    CHECK_LT(lane, mLanes.size());
+
+    Lane *entry = &mLanes.editItemAt(lane);
+    CHECK_GT(entry->mNumSinks, 0u);
+
+    // The lane stays up even if it's idle now, the next sink gets going
+    // without starting any threads.
+    --entry->mNumSinks;
+
+    MetricsRegistry::Get()->gauge(
+            StringPrintf("sink.host.lane%d.sinks", lane).c_str())
+        ->set(entry->mNumSinks);
+}
+
+status_t SinkThreadPool::startLane_l(Lane *lane) {
+    size_t index = mLanes.size();
+    AString name = StringPrintf("rtp_sink_looper.%d", index);
+
+    ThreadConfig config =
+        ThreadConfig::FromProperties("media.wfd.sink.rtp-thread");
+
+    if (config.mCPU >= 0) {
+        long numCPUs = sysconf(_SC_NPROCESSORS_CONF);
+
+        config.mCPU += index;
+        if (numCPUs > 0) {
+            config.mCPU %= numCPUs;
+        }
+    }
+
+    sp<ANetworkSession> netSession = new ANetworkSession;
+
+    status_t err = netSession->start(config);
+
+    if (err != OK) {
+        ALOGE("unable to start the media network session (%d)", err);
+        return err;
+    }
+
+    sp<ALooper> looper = new ALooper;
+    looper->setName(name.c_str());
+
+    err = looper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+
+    if (err != OK) {
+        netSession->stop();
+        return err;
+    }
+
+    config.applyToLooper(looper, name.c_str());
+
+    lane->mNetSession = netSession;
+    lane->mLooper = looper;
+
+    return OK;
+}
+
+}  // namespace android
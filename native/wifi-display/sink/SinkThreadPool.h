@@ -0,0 +1,62 @@
+#ifndef SINK_THREAD_POOL_H_
+
+#define SINK_THREAD_POOL_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/RefBase.h>
+#include <utils/threads.h>
+#include <utils/Vector.h>
+
+namespace android {
+
+struct ALooper;
+struct ANetworkSession;
+
+// The network sessions and loopers ("lanes") carrying the RTP/RTCP traffic
+// and rendering of all sinks hosted by this process. A sink is put on the
+// lane with the fewest sinks, a new lane is started as long as all of them
+// are busy and there are fewer than the maximum, one per CPU unless
+// "media.wfd.sink.media-lanes" says otherwise. Sinks only end up sharing a
+// thread once there are more of them than lanes, so a heavy stream can't
+// hold up the others.
+//
+// Lanes are tuned through media.wfd.sink.rtp-thread.{nice,fifo,cpu}, a
+// configured cpu is where the first lane is pinned, the others go to the
+// CPUs following it.
+struct SinkThreadPool : public RefBase {
+    static sp<SinkThreadPool> Get();
+
+    // Returns the lane the calling sink is to use, to be handed back to
+    // release() once all of the sink's handlers are unregistered from its
+    // looper.
+    status_t acquire(
+            sp<ANetworkSession> *netSession, sp<ALooper> *looper, size_t *lane);
+
+    void release(size_t lane);
+
+    size_t maxLanes() const { return mMaxLanes; }
+
+protected:
+    virtual ~SinkThreadPool();
+
+private:
+    struct Lane {
+        sp<ANetworkSession> mNetSession;
+        sp<ALooper> mLooper;
+        size_t mNumSinks;
+    };
+
+    Mutex mLock;
+    size_t mMaxLanes;
+    Vector<Lane> mLanes;
+
+    SinkThreadPool();
+
+    status_t startLane_l(Lane *lane);
+
+    DISALLOW_EVIL_CONSTRUCTORS(SinkThreadPool);
+};
+
+}  // namespace android
+
+#endif  // SINK_THREAD_POOL_H_
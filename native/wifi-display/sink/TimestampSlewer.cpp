@@ -0,0 +1,167 @@
+//#define LOG_NDEBUG 0
+#define LOG_TAG "TimestampSlewer"
+#include <utils/Log.h>
+
+#include "TimestampSlewer.h"
+
+#include <math.h>
+
+#include <media/stagefright/foundation/ADebug.h>
+
+namespace android {
+
+static const size_t kTSPacketSize = 188;
+static const uint64_t kTimestampMask = (1ull << 33) - 1;
+
+TimestampSlewer::TimestampSlewer()
+    : mHaveAnchor(false),
+      mRate(1.0),
+      mLastTime(0ll),
+      mSrcAnchor(0ll),
+      mDstAnchor(0ll) {
+}
+
+void TimestampSlewer::setRate(double rate) {
+    if (mHaveAnchor) {
+        // Re-anchor at the most recent timestamp to keep the mapping
+        // continuous.
+        mDstAnchor = map(mLastTime);
+        mSrcAnchor = mLastTime;
+    }
+
+    mRate = rate;
+}
+
+void TimestampSlewer::reset() {
+    mHaveAnchor = false;
+    mRate = 1.0;
+    mLastTime = 0ll;
+    mSrcAnchor = 0ll;
+    mDstAnchor = 0ll;
+}
+
+int64_t TimestampSlewer::extend(uint64_t time33) {
+    if (!mHaveAnchor) {
+        mHaveAnchor = true;
+        mLastTime = time33;
+        mSrcAnchor = time33;
+        mDstAnchor = time33;
+        return mLastTime;
+    }
+
+    // PTS, DTS and PCR of all streams are within a few seconds of each
+    // other, far less than half the 33 bit range.
+    int64_t diff = (int64_t)((time33 - (uint64_t)mLastTime) & kTimestampMask);
+    if (diff >= (1ll << 32)) {
+        diff -= 1ll << 33;
+    }
+
+    mLastTime += diff;
+
+    return mLastTime;
+}
+
+int64_t TimestampSlewer::map(int64_t time) const {
+    return mDstAnchor + (int64_t)floor((time - mSrcAnchor) * mRate + 0.5);
+}
+
+uint64_t TimestampSlewer::slew(uint64_t time33) {
+    return (uint64_t)map(extend(time33)) & kTimestampMask;
+}
+
+void TimestampSlewer::process(uint8_t *data, size_t size) {
+    CHECK_EQ(size % kTSPacketSize, 0u);
+
+    for (size_t offset = 0; offset < size; offset += kTSPacketSize) {
+        processPacket(data + offset);
+    }
+}
+
+void TimestampSlewer::processPacket(uint8_t *packet) {
+    if (packet[0] != 0x47) {
+        return;
+    }
+
+    bool payloadUnitStart = (packet[1] & 0x40) != 0;
+    unsigned adaptationFieldControl = (packet[3] >> 4) & 3;
+
+    size_t offset = 4;
+
+    if (adaptationFieldControl & 2) {
+        size_t adaptationFieldLength = packet[4];
+
+        if (5 + adaptationFieldLength > kTSPacketSize) {
+            return;
+        }
+
+        if (adaptationFieldLength >= 7 && (packet[5] & 0x10)) {
+            // PCR_flag, 33 bit base followed by 6 reserved bits and the
+            // 9 bit extension which is left alone.
+            uint8_t *pcr = &packet[6];
+
+            uint64_t base =
+                ((uint64_t)pcr[0] << 25)
+                | (pcr[1] << 17)
+                | (pcr[2] << 9)
+                | (pcr[3] << 1)
+                | (pcr[4] >> 7);
+
+            base = slew(base);
+
+            pcr[0] = base >> 25;
+            pcr[1] = (base >> 17) & 0xff;
+            pcr[2] = (base >> 9) & 0xff;
+            pcr[3] = (base >> 1) & 0xff;
+            pcr[4] = ((base & 1) << 7) | (pcr[4] & 0x7f);
+        }
+
+        offset += 1 + adaptationFieldLength;
+    }
+
+    if ((adaptationFieldControl & 1) && payloadUnitStart
+            && offset < kTSPacketSize) {
+        processPESHeader(&packet[offset], kTSPacketSize - offset);
+    }
+}
+
+void TimestampSlewer::processPESHeader(uint8_t *pes, size_t size) {
+    if (size < 9 || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01) {
+        // Not a PES packet, i.e. PSI.
+        return;
+    }
+
+    if ((pes[6] & 0xc0) != 0x80) {
+        // Stream without the optional PES header.
+        return;
+    }
+
+    unsigned PTS_DTS_flags = pes[7] >> 6;
+
+    if (PTS_DTS_flags == 2 && size >= 14) {
+        WriteTimestamp(&pes[9], slew(ReadTimestamp(&pes[9])));
+    } else if (PTS_DTS_flags == 3 && size >= 19) {
+        WriteTimestamp(&pes[9], slew(ReadTimestamp(&pes[9])));
+        WriteTimestamp(&pes[14], slew(ReadTimestamp(&pes[14])));
+    }
+}
+
+// static
+uint64_t TimestampSlewer::ReadTimestamp(const uint8_t *data) {
+    return ((uint64_t)((data[0] >> 1) & 7) << 30)
+        | (data[1] << 22)
+        | ((data[2] >> 1) << 15)
+        | (data[3] << 7)
+        | (data[4] >> 1);
+}
+
+// static
+void TimestampSlewer::WriteTimestamp(uint8_t *data, uint64_t time33) {
+    // Keeps the 4 bit prefix, sets the marker bits.
+    data[0] = (data[0] & 0xf0) | ((time33 >> 29) & 0x0e) | 1;
+    data[1] = (time33 >> 22) & 0xff;
+    data[2] = ((time33 >> 14) & 0xfe) | 1;
+    data[3] = (time33 >> 7) & 0xff;
+    data[4] = ((time33 << 1) & 0xfe) | 1;
+}
+
+}  // namespace android
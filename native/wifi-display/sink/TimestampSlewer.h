@@ -0,0 +1,52 @@
+#ifndef TIMESTAMP_SLEWER_H_
+
+#define TIMESTAMP_SLEWER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Rewrites the PCRs and PES PTS/DTS of a transport stream in place so that
+// media time advances at "rate" times the rate it was stamped at. The
+// mapping is continuous, rate changes only affect timestamps from then on,
+// and starts out as the identity.
+// Not thread-safe, the owner is expected to serialize access.
+struct TimestampSlewer {
+    TimestampSlewer();
+
+    void setRate(double rate);
+
+    // Back to the identity mapping, for a stream from a different clock.
+    void reset();
+
+    // "data" holds a whole number ("size" / 188) of TS packets. It must be
+    // a private copy, not a buffer anybody else may still read.
+    void process(uint8_t *data, size_t size);
+
+private:
+    bool mHaveAnchor;
+    double mRate;
+
+    // 33 bit timestamps extended to 64 bits.
+    int64_t mLastTime;
+    int64_t mSrcAnchor;
+    int64_t mDstAnchor;
+
+    int64_t extend(uint64_t time33);
+    int64_t map(int64_t time) const;
+    uint64_t slew(uint64_t time33);
+
+    void processPacket(uint8_t *packet);
+    void processPESHeader(uint8_t *pes, size_t size);
+
+    static uint64_t ReadTimestamp(const uint8_t *data);
+    static void WriteTimestamp(uint8_t *data, uint64_t time33);
+
+    DISALLOW_EVIL_CONSTRUCTORS(TimestampSlewer);
+};
+
+}  // namespace android
+
+#endif  // TIMESTAMP_SLEWER_H_
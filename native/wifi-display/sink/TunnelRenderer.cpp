@@ -6,9 +6,16 @@
 #include "TunnelRenderer.h"
 
 #include "ATSParser.h"
+#include "DirectRenderer.h"
+#include "LatencyTrace.h"
+#include "PlayoutDelayEstimator.h"
+#include "SinkStats.h"
+#include "ThreadConfig.h"
 
 #include <binder/IMemory.h>
+#include <cutils/atomic.h>
 #include <binder/IServiceManager.h>
+#include <cutils/properties.h>
 #include <gui/SurfaceComposerClient.h>
 #include <media/IMediaPlayerService.h>
 #include <media/IStreamSource.h>
@@ -45,6 +52,10 @@ struct TunnelRenderer::StreamSource : public BnStreamSource {
 
     void doSomeWork();
 
+    // The player may still call us after it was let go of, from now on
+    // nothing is dequeued from the owner anymore.
+    void detach();
+
 protected:
     virtual ~StreamSource();
 
@@ -58,7 +69,13 @@ private:
     Vector<sp<IMemory> > mBuffers;
     List<size_t> mIndicesAvailable;
 
+    // Dequeued from the renderer but didn't fit into the last buffer.
+    sp<ABuffer> mPendingBuffer;
+
     size_t mNumDeqeued;
+    size_t mNumBuffersQueued;
+
+    void onPacketDequeued();
 
     DISALLOW_EVIL_CONSTRUCTORS(StreamSource);
 };
@@ -67,7 +84,8 @@ private:
 
 TunnelRenderer::StreamSource::StreamSource(TunnelRenderer *owner)
     : mOwner(owner),
-      mNumDeqeued(0) {
+      mNumDeqeued(0),
+      mNumBuffersQueued(0) {
 }
 
 TunnelRenderer::StreamSource::~StreamSource() {
@@ -81,6 +99,9 @@ void TunnelRenderer::StreamSource::setListener(
 void TunnelRenderer::StreamSource::setBuffers(
         const Vector<sp<IMemory> > &buffers) {
     mBuffers = buffers;
+
+    ALOGI("player provided %d buffers of %d bytes",
+          buffers.size(), buffers.isEmpty() ? 0 : buffers[0]->size());
 }
 
 void TunnelRenderer::StreamSource::onBufferAvailable(size_t index) {
@@ -98,138 +119,633 @@ uint32_t TunnelRenderer::StreamSource::flags() const {
     return kFlagAlignedVideoData;
 }
 
+// Every packet that is ready is packed into the player's buffers, filling
+// each one up to its capacity before handing it over. This doesn't wait
+// for packets that haven't arrived yet, so no latency is added.
 void TunnelRenderer::StreamSource::doSomeWork() {
     Mutex::Autolock autoLock(mLock);
 
+    if (mOwner == NULL) {
+        return;
+    }
+
     while (!mIndicesAvailable.empty()) {
-        sp<ABuffer> srcBuffer = mOwner->dequeueBuffer();
-        if (srcBuffer == NULL) {
-            break;
-        }
+        size_t index = *mIndicesAvailable.begin();
+        sp<IMemory> mem = mBuffers.itemAt(index);
 
-        ++mNumDeqeued;
+        uint8_t *dst = static_cast<uint8_t *>(mem->pointer());
+        size_t filled = 0;
 
-        if (mNumDeqeued == 1) {
-            ALOGI("fixing real time now.");
+#if ENABLE_LATENCY_TRACE
+        Vector<sp<ABuffer> > copied;
+#endif
 
-            sp<AMessage> extra = new AMessage;
+        for (;;) {
+            sp<ABuffer> srcBuffer = mPendingBuffer;
+            mPendingBuffer.clear();
 
-            extra->setInt32(
-                    IStreamListener::kKeyDiscontinuityMask,
-                    ATSParser::DISCONTINUITY_ABSOLUTE_TIME);
+            if (srcBuffer == NULL) {
+                srcBuffer = mOwner->dequeueBuffer();
 
-            extra->setInt64("timeUs", ALooper::GetNowUs());
+                if (srcBuffer == NULL) {
+                    break;
+                }
+
+                onPacketDequeued();
+            }
 
-            mListener->issueCommand(
-                    IStreamListener::DISCONTINUITY,
-                    false /* synchronous */,
-                    extra);
+            CHECK_EQ((srcBuffer->size() % 188), 0u);
+
+            if (filled + srcBuffer->size() > mem->size()) {
+                CHECK_GT(filled, 0u);
+
+                mPendingBuffer = srcBuffer;
+                break;
+            }
+
+            ALOGV("dequeue TS packet of size %d", srcBuffer->size());
+
+            memcpy(dst + filled, srcBuffer->data(), srcBuffer->size());
+            mOwner->slewTimestamps(dst + filled, srcBuffer->size());
+            filled += srcBuffer->size();
+
+#if ENABLE_LATENCY_TRACE
+            copied.push(srcBuffer);
+#endif
         }
 
-        ALOGV("dequeue TS packet of size %d", srcBuffer->size());
+        if (filled == 0) {
+            break;
+        }
 
-        size_t index = *mIndicesAvailable.begin();
         mIndicesAvailable.erase(mIndicesAvailable.begin());
+        mListener->queueBuffer(index, filled);
 
-        sp<IMemory> mem = mBuffers.itemAt(index);
-        CHECK_LE(srcBuffer->size(), mem->size());
-        CHECK_EQ((srcBuffer->size() % 188), 0u);
+#if ENABLE_LATENCY_TRACE
+        for (size_t i = 0; i < copied.size(); ++i) {
+            LatencyTrace::Mark(
+                    LatencyTrace::kStageQueuedToPlayer, copied.itemAt(i));
+        }
+#endif
+
+        if ((++mNumBuffersQueued % 1000) == 0) {
+            ALOGV("queued %d buffers for %d packets",
+                  mNumBuffersQueued, mNumDeqeued);
+        }
+    }
+}
+
+void TunnelRenderer::StreamSource::detach() {
+    Mutex::Autolock autoLock(mLock);
+
+    mOwner = NULL;
+    mPendingBuffer.clear();
+}
+
+void TunnelRenderer::StreamSource::onPacketDequeued() {
+    ++mNumDeqeued;
 
-        memcpy(mem->pointer(), srcBuffer->data(), srcBuffer->size());
-        mListener->queueBuffer(index, srcBuffer->size());
+    if (mNumDeqeued == 1) {
+        ALOGI("fixing real time now.");
+
+        sp<AMessage> extra = new AMessage;
+
+        extra->setInt32(
+                IStreamListener::kKeyDiscontinuityMask,
+                ATSParser::DISCONTINUITY_ABSOLUTE_TIME);
+
+        extra->setInt64("timeUs", ALooper::GetNowUs());
+
+        mListener->issueCommand(
+                IStreamListener::DISCONTINUITY,
+                false /* synchronous */,
+                extra);
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static const size_t kIncomingQueueSize = 1024;
+
+static size_t getMaxQueuedBytes() {
+    // Half a second of a 20 Mbit/s stream is a little over 1 MB, twice
+    // that leaves room for peaks without hurting 512 MB devices.
+    static const size_t kDefaultMaxQueuedKB = 2048;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.max-queued-kb", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x * 1024;
+        }
+
+        ALOGW("ignoring malformed media.wfd.sink.max-queued-kb '%s'", val);
+    }
+
+    return kDefaultMaxQueuedKB * 1024;
+}
+
+// By default the window spans twice as many packets as the byte cap
+// admits, so that it's the cap (and with it the overflow policy) that
+// trips first even with plenty of gaps queued.
+static size_t getJitterBufferCapacity(size_t maxQueuedBytes) {
+    // 7 TS packets per datagram.
+    static const size_t kPacketSize = 7 * 188;
+
+    // A 20 Mbit/s stream of 7 TS packets per datagram comes in at roughly
+    // 2 packets per millisecond.
+    static const size_t kPacketsPerMs = 2;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.jitter-ms", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x * kPacketsPerMs;
+        }
+    }
+
+    if (property_get("media.wfd.sink.jitter-packets", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x;
+        }
+    }
+
+    return 2 * maxQueuedBytes / kPacketSize;
+}
+
 TunnelRenderer::TunnelRenderer(
         const sp<AMessage> &notifyLost,
-        const sp<ISurfaceTexture> &surfaceTex)
+        const sp<ISurfaceTexture> &surfaceTex,
+        bool directRendering,
+        bool discardOutput,
+        const char *metricsPrefix)
     : mNotifyLost(notifyLost),
       mSurfaceTex(surfaceTex),
-      mTotalBytesQueued(0ll),
+      mMaxQueuedBytes(getMaxQueuedBytes()),
+      mIncoming(kIncomingQueueSize),
+      mPackets(getJitterBufferCapacity(mMaxQueuedBytes)),
+      mDirectRendering(directRendering),
+      mDiscardOutput(discardOutput),
+      mDrainPending(false),
       mLastDequeuedExtSeqNo(-1),
       mFirstFailedAttemptUs(-1ll),
-      mRequestedRetransmission(false) {
+      mRequestedRetransmission(false),
+      mLossWaitUs(PlayoutDelayEstimator::kDefaultLossWaitUs),
+      mFECWaitUs(0ll),
+      mMaxQueuedUs(0ll),
+      mOverflowPolicy(kOverflowSkipToIDR),
+      mHaveNewestRTPTime(false),
+      mNewestRTPTime(0),
+      mSkippingToIDR(false),
+      mSkipStartedUs(-1ll),
+      mVideoPID(-1),
+      mVideoEncrypted(false),
+      mFrameCount(0),
+      mFrameCountStartUs(-1ll),
+      mFrameRateUpdatePending(false) {
+    ALOGI("reorder queue holds up to %d packets", mPackets.capacity());
+
+    initQueueLimits();
+
+    sp<MetricsRegistry> metrics = MetricsRegistry::Get();
+    mPacketsLostMetric = metrics->counter(
+            StringPrintf("%s.rtp.packets_lost", metricsPrefix).c_str());
+    mPacketsDuplicatedMetric = metrics->counter(
+            StringPrintf("%s.rtp.packets_duplicated", metricsPrefix).c_str());
+    mReorderDepthMetric = metrics->histogram(
+            StringPrintf("%s.rtp.reorder_depth", metricsPrefix).c_str());
+    mJitterBufferPacketsMetric = metrics->gauge(
+            StringPrintf("%s.jitter_buffer.packets", metricsPrefix).c_str());
+    mJitterBufferBytesMetric = metrics->gauge(
+            StringPrintf("%s.jitter_buffer.bytes", metricsPrefix).c_str());
+    mJitterBufferLatencyMetric = metrics->gauge(
+            StringPrintf("%s.jitter_buffer.latency_ms", metricsPrefix).c_str());
+    mOverflowDropsMetric = metrics->counter(
+            StringPrintf(
+                "%s.jitter_buffer.overflow_drops", metricsPrefix).c_str());
+    mPacketsSkippedMetric = metrics->counter(
+            StringPrintf("%s.video.ts_packets_skipped", metricsPrefix).c_str());
+    mTransitMetric = metrics->histogram(
+            StringPrintf("%s.discard.transit_us", metricsPrefix).c_str());
 }
 
 TunnelRenderer::~TunnelRenderer() {
     destroyPlayer();
 }
 
-void TunnelRenderer::queueBuffer(const sp<ABuffer> &buffer) {
+// mMaxQueuedBytes is set up front, see getMaxQueuedBytes().
+void TunnelRenderer::initQueueLimits() {
+    static const int64_t kDefaultMaxQueuedMs = 500ll;
+
+    mMaxQueuedUs = kDefaultMaxQueuedMs * 1000ll;
+    mOverflowPolicy = kOverflowSkipToIDR;
+
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.sink.max-queued-ms", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            mMaxQueuedUs = x * 1000ll;
+        } else {
+            ALOGW("ignoring malformed media.wfd.sink.max-queued-ms '%s'", val);
+        }
+    }
+
+    if (property_get("media.wfd.sink.overflow-policy", val, NULL)) {
+        if (!strcmp(val, "skip-to-idr")) {
+            mOverflowPolicy = kOverflowSkipToIDR;
+        } else if (!strcmp(val, "drop-oldest")) {
+            mOverflowPolicy = kOverflowDropOldest;
+        } else {
+            ALOGW("ignoring unknown media.wfd.sink.overflow-policy '%s'", val);
+        }
+    }
+
+    ALOGI("queueing up to %d KB or %lld ms, then %s",
+          mMaxQueuedBytes / 1024,
+          mMaxQueuedUs / 1000ll,
+          mOverflowPolicy == kOverflowSkipToIDR
+            ? "skipping to the next IDR frame" : "dropping the oldest packets");
+}
+
+// static
+status_t TunnelRenderer::StartLooper(sp<ALooper> *looper) {
+    static const char *kName = "tunnel_renderer_looper";
+
+    sp<ALooper> newLooper = new ALooper;
+    newLooper->setName(kName);
+
+    status_t err = newLooper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+
+    if (err != OK) {
+        return err;
+    }
+
+    ThreadConfig::FromProperties("media.wfd.sink.render-thread")
+        .applyToLooper(newLooper, kName);
+
+    *looper = newLooper;
+
+    return OK;
+}
+
+void TunnelRenderer::prepare() {
+    (new AMessage(kWhatPrepare, id()))->post();
+}
+
+void TunnelRenderer::startStream(const sp<AMessage> &notifyLost) {
+    // The ring may only be drained by its consumer, i.e. on our looper.
+    // Nothing is pushed meanwhile, the producer is waiting right here.
+    sp<AMessage> msg = new AMessage(kWhatStartStream, id());
+    if (notifyLost != NULL) {
+        msg->setMessage("notifyLost", notifyLost);
+    }
+
+    sp<AMessage> response;
+    CHECK_EQ(msg->postAndAwaitResponse(&response), (status_t)OK);
+}
+
+void TunnelRenderer::onStartStream(const sp<AMessage> &notifyLost) {
+    // Anything left over from the previous stream.
+    for (;;) {
+        size_t numPackets = mIncoming.numAvailable();
+
+        for (size_t i = 0; i < numPackets; ++i) {
+            mIncoming.pop();
+        }
+
+        if (!mIncoming.finishBatch(numPackets)) {
+            break;
+        }
+    }
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        mPackets.clear();
+        mNacks.reset();
+        mSlewer.reset();
+
+        mLastDequeuedExtSeqNo = -1;
+        mFirstFailedAttemptUs = -1ll;
+        mRequestedRetransmission = false;
+
+        mSkippingToIDR = false;
+        mVideoPID = -1;
+        mVideoEncrypted = false;
+
+        mHaveNewestRTPTime = false;
+
+        mJitterBufferPacketsMetric->set(0);
+        mJitterBufferBytesMetric->set(0);
+        mJitterBufferLatencyMetric->set(0);
+
+        mNotifyLost = notifyLost;
+    }
+
+    if (mStreamSource != NULL) {
+        // The new stream needs its own absolute time discontinuity, which
+        // the player's ATSParser only accepts before it has seen any
+        // program. Start over with a fresh player on the same surface once
+        // packets are queued again.
+        releaseStreamPlayer();
+    }
+}
+
+void TunnelRenderer::setStats(const sp<SinkStats> &stats) {
+    mStats = stats;
+}
+
+void TunnelRenderer::setLossWaitUs(int64_t lossWaitUs) {
     Mutex::Autolock autoLock(mLock);
 
-    mTotalBytesQueued += buffer->size();
+    if (lossWaitUs != mLossWaitUs) {
+        ALOGV("waiting up to %lld ms for missing packets",
+              lossWaitUs / 1000ll);
 
-    if (mPackets.empty()) {
-        mPackets.push_back(buffer);
+        mLossWaitUs = lossWaitUs;
+    }
+}
+
+void TunnelRenderer::setFECWaitUs(int64_t fecWaitUs) {
+    Mutex::Autolock autoLock(mLock);
+
+    if (fecWaitUs != mFECWaitUs) {
+        ALOGV("a FEC matrix takes %lld ms to arrive", fecWaitUs / 1000ll);
+
+        mFECWaitUs = fecWaitUs;
+    }
+}
+
+int64_t TunnelRenderer::effectiveLossWaitUs_l() const {
+    int64_t waitUs = mLossWaitUs;
+
+    // The estimate only covers packets that were merely late, recovery
+    // takes longer.
+    if (mFECWaitUs > waitUs) {
+        waitUs = mFECWaitUs;
+    }
+
+    if (mNacks.wasRequested(mPackets.nextExtSeqNo())) {
+        int64_t rttWaitUs = mNacks.rttUs() + mNacks.rttUs() / 2;
+
+        if (rttWaitUs > waitUs) {
+            waitUs = rttWaitUs;
+        }
+    }
+
+    return waitUs;
+}
+
+void TunnelRenderer::enqueuePacket(const sp<ABuffer> &buffer) {
+    bool wakeConsumer;
+    if (!mIncoming.push(buffer, &wakeConsumer)) {
+        if ((mIncoming.numOverflows() % 100) == 1) {
+            ALOGW("incoming packet queue is full, dropped %d packets so far",
+                  mIncoming.numOverflows());
+        }
         return;
     }
 
-    int32_t newExtendedSeqNo = buffer->int32Data();
+    // Only signal if we're not already draining the queue, everything
+    // pushed meanwhile is picked up by the same pass.
+    if (wakeConsumer) {
+        (new AMessage(kWhatPacketsAvailable, id()))->post();
+    }
+}
+
+void TunnelRenderer::queueIncomingPackets() {
+    int64_t nowUs = ALooper::GetNowUs();
 
-    List<sp<ABuffer> >::iterator firstIt = mPackets.begin();
-    List<sp<ABuffer> >::iterator it = --mPackets.end();
     for (;;) {
-        int32_t extendedSeqNo = (*it)->int32Data();
+        size_t numPackets = mIncoming.numAvailable();
 
-        if (extendedSeqNo == newExtendedSeqNo) {
-            // Duplicate packet.
-            return;
-        }
+        {
+            Mutex::Autolock autoLock(mLock);
 
-        if (extendedSeqNo < newExtendedSeqNo) {
-            // Insert new packet after the one at "it".
-            mPackets.insert(++it, buffer);
-            return;
+            // Packets the reorder window pushed out ahead of the caps.
+            size_t numWindowDropped = 0;
+            size_t numWindowSkipped = 0;
+
+            for (size_t i = 0; i < numPackets; ++i) {
+                sp<ABuffer> buffer = mIncoming.pop();
+                int32_t extSeqNo = buffer->int32Data();
+
+                int32_t maxExtSeqNo = mPackets.maxExtSeqNo();
+                if (maxExtSeqNo >= 0 && extSeqNo < maxExtSeqNo) {
+                    mReorderDepthMetric->record(maxExtSeqNo - extSeqNo);
+                }
+
+                // Duplicates and retransmissions of packets we've already
+                // returned (or given up on) are dropped right here.
+                size_t numDropped, numSkipped;
+                bool queued = mPackets.queue(buffer, &numDropped, &numSkipped);
+
+                numWindowDropped += numDropped;
+                numWindowSkipped += numSkipped;
+
+                if (queued) {
+                    mNacks.onPacketQueued(extSeqNo, nowUs);
+
+                    int32_t rtpTime;
+                    if (extSeqNo == mPackets.maxExtSeqNo()
+                            && buffer->meta()->findInt32(
+                                "rtp-time", &rtpTime)) {
+                        mNewestRTPTime = rtpTime;
+                        mHaveNewestRTPTime = true;
+                    }
+                } else {
+                    mPacketsDuplicatedMetric->increment();
+                }
+            }
+
+            if (numWindowDropped > 0) {
+                ALOGW("reorder window overflowed, dropped the %d oldest "
+                      "packets",
+                      numWindowDropped);
+
+                mLastDequeuedExtSeqNo = mPackets.nextExtSeqNo() - 1;
+                onQueueOverflow_l(numWindowDropped, numWindowSkipped);
+            }
+
+            enforceQueueLimits_l();
+
+            mJitterBufferPacketsMetric->set(mPackets.numPackets());
+            mJitterBufferBytesMetric->set(mPackets.numBytes());
+            mJitterBufferLatencyMetric->set(queuedDurationUs_l() / 1000ll);
+
+            if (mStats != NULL) {
+                mStats->set(SinkStats::kQueuedPackets, mPackets.numPackets());
+                mStats->set(SinkStats::kQueuedBytes, mPackets.numBytes());
+                mStats->set(SinkStats::kLatencyUs, queuedDurationUs_l());
+            }
         }
 
-        if (it == firstIt) {
-            // Insert new packet before the first existing one.
-            mPackets.insert(it, buffer);
-            return;
+        if (!mIncoming.finishBatch(numPackets)) {
+            break;
         }
+    }
+
+    sp<ABuffer> nacks;
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        mNacks.scanForGaps(mPackets);
+        nacks = mNacks.collectNACKs(nowUs);
+    }
 
-        --it;
+    if (nacks != NULL) {
+        sp<AMessage> notify = mNotifyLost->dup();
+        notify->setBuffer("nacks", nacks);
+        notify->post();
     }
 }
 
-sp<ABuffer> TunnelRenderer::dequeueBuffer() {
-    Mutex::Autolock autoLock(mLock);
+int64_t TunnelRenderer::queuedDurationUs_l() const {
+    sp<ABuffer> oldest = mPackets.peekFirstAvailable();
 
-    sp<ABuffer> buffer;
-    int32_t extSeqNo;
-    while (!mPackets.empty()) {
-        buffer = *mPackets.begin();
-        extSeqNo = buffer->int32Data();
+    int32_t oldestRTPTime;
+    if (oldest == NULL || !mHaveNewestRTPTime
+            || !oldest->meta()->findInt32("rtp-time", &oldestRTPTime)) {
+        return 0ll;
+    }
+
+    int32_t diff =
+        (int32_t)((uint32_t)mNewestRTPTime - (uint32_t)oldestRTPTime);
+
+    return (diff > 0) ? (diff * 100ll) / 9ll : 0ll;
+}
+
+void TunnelRenderer::enforceQueueLimits_l() {
+    if (mPackets.numBytes() <= mMaxQueuedBytes
+            && queuedDurationUs_l() <= mMaxQueuedUs) {
+        return;
+    }
 
-        if (mLastDequeuedExtSeqNo < 0 || extSeqNo > mLastDequeuedExtSeqNo) {
+    // Shed down to half the caps, a consumer that's persistently too slow
+    // then loses data in occasional bursts rather than a little with every
+    // packet that arrives.
+    size_t numDropped = 0;
+    size_t numSkipped = 0;
+    while (mPackets.numBytes() > mMaxQueuedBytes / 2
+            || queuedDurationUs_l() > mMaxQueuedUs / 2) {
+        size_t n;
+        sp<ABuffer> buffer = mPackets.dequeueFirstAvailable(&n);
+
+        if (buffer == NULL) {
             break;
         }
 
-        // This is a retransmission of a packet we've already returned.
+        numSkipped += n;
+        ++numDropped;
 
-        mTotalBytesQueued -= buffer->size();
-        buffer.clear();
-        extSeqNo = -1;
+        mLastDequeuedExtSeqNo = buffer->int32Data();
+    }
+
+    ALOGW("consumer fell behind, dropped the %d oldest packets "
+          "(%d KB, %lld ms left queued)",
+          numDropped,
+          mPackets.numBytes() / 1024,
+          queuedDurationUs_l() / 1000ll);
+
+    onQueueOverflow_l(numDropped, numSkipped);
+}
 
-        mPackets.erase(mPackets.begin());
+void TunnelRenderer::onQueueOverflow_l(size_t numDropped, size_t numSkipped) {
+    mOverflowDropsMetric->increment(numDropped);
+    mPacketsLostMetric->increment(numSkipped);
+
+    if (mStats != NULL) {
+        mStats->add(SinkStats::kPacketsLost, numDropped + numSkipped);
     }
 
-    if (mPackets.empty()) {
-        if (mFirstFailedAttemptUs < 0ll) {
-            mFirstFailedAttemptUs = ALooper::GetNowUs();
-            mRequestedRetransmission = false;
-        } else {
-            ALOGV("no packets available for %.2f secs",
-                    (ALooper::GetNowUs() - mFirstFailedAttemptUs) / 1E6);
+    // Whatever we were waiting for is gone now.
+    mFirstFailedAttemptUs = -1ll;
+    mRequestedRetransmission = false;
+
+    if (mOverflowPolicy != kOverflowSkipToIDR) {
+        return;
+    }
+
+    if (!mSkippingToIDR && !mVideoEncrypted) {
+        ALOGI("skipping video up to the next IDR frame");
+
+        mSkippingToIDR = true;
+        mSkipStartedUs = ALooper::GetNowUs();
+    }
+
+    if (mNotifyLost != NULL) {
+        sp<AMessage> notify = mNotifyLost->dup();
+        notify->setInt32("unrecoverable", true);
+        notify->post();
+    }
+}
+
+void TunnelRenderer::setClockRate(double rate) {
+    Mutex::Autolock autoLock(mLock);
+
+    ALOGI("slewing timestamps to a clock skew of %.1f ppm",
+          (rate - 1.0) * 1E6);
+
+    mSlewer.setRate(rate);
+}
+
+void TunnelRenderer::slewTimestamps(uint8_t *data, size_t size) {
+    Mutex::Autolock autoLock(mLock);
+
+    mSlewer.process(data, size);
+}
+
+sp<ABuffer> TunnelRenderer::dequeueBuffer() {
+    sp<ABuffer> buffer;
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        for (;;) {
+            buffer = dequeuePacket_l();
+
+            if (buffer != NULL && mVideoPID < 0) {
+                findVideoPID_l(buffer);
+            }
+
+            if (buffer == NULL || !mSkippingToIDR) {
+                break;
+            }
+
+            buffer = skipToIDR_l(buffer);
+
+            if (buffer != NULL) {
+                break;
+            }
         }
+    }
 
-        return NULL;
+    // Only ever called from the thread feeding the player.
+    if (buffer != NULL && mStats != NULL) {
+        countVideoFrames(buffer);
     }
 
-    if (mLastDequeuedExtSeqNo < 0 || extSeqNo == mLastDequeuedExtSeqNo + 1) {
+    return buffer;
+}
+
+sp<ABuffer> TunnelRenderer::dequeuePacket_l() {
+    sp<ABuffer> buffer = mPackets.dequeue();
+
+    if (buffer != NULL) {
+        int32_t extSeqNo = buffer->int32Data();
+
         if (mRequestedRetransmission) {
             ALOGI("Recovered after requesting retransmission of %d",
                   extSeqNo);
@@ -239,13 +755,27 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
         mFirstFailedAttemptUs = -1ll;
         mRequestedRetransmission = false;
 
-        mPackets.erase(mPackets.begin());
-
-        mTotalBytesQueued -= buffer->size();
+#if ENABLE_LATENCY_TRACE
+        LatencyTrace::Mark(LatencyTrace::kStageDequeued, buffer);
+#endif
 
         return buffer;
     }
 
+    if (mPackets.empty()) {
+        if (mFirstFailedAttemptUs < 0ll) {
+            mFirstFailedAttemptUs = ALooper::GetNowUs();
+            mRequestedRetransmission = false;
+        } else {
+            ALOGV("no packets available for %.2f secs",
+                    (ALooper::GetNowUs() - mFirstFailedAttemptUs) / 1E6);
+        }
+
+        return NULL;
+    }
+
+    // The packet at the head of the queue is missing, later ones are here.
+
     if (mFirstFailedAttemptUs < 0ll) {
         mFirstFailedAttemptUs = ALooper::GetNowUs();
 
@@ -253,16 +783,17 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
         return NULL;
     }
 
-    if (mFirstFailedAttemptUs + 50000ll > ALooper::GetNowUs()) {
+    if (mFirstFailedAttemptUs + effectiveLossWaitUs_l() > ALooper::GetNowUs()) {
         // We're willing to wait a little while to get the right packet.
 
+        // Its retransmission is requested by mNacks as soon as the gap
+        // shows up in the jitter buffer.
         if (!mRequestedRetransmission) {
-            ALOGI("requesting retransmission of seqNo %d",
-                  (mLastDequeuedExtSeqNo + 1) & 0xffff);
-
-            sp<AMessage> notify = mNotifyLost->dup();
-            notify->setInt32("seqNo", (mLastDequeuedExtSeqNo + 1) & 0xffff);
-            notify->post();
+            ALOGI("waiting for seqNo %d (%s, rtt %lld ms)",
+                  mPackets.nextExtSeqNo() & 0xffff,
+                  mNacks.wasRequested(mPackets.nextExtSeqNo())
+                    ? "requested" : "not requested yet",
+                  mNacks.rttUs() / 1000ll);
 
             mRequestedRetransmission = true;
         } else {
@@ -273,34 +804,342 @@ sp<ABuffer> TunnelRenderer::dequeueBuffer() {
     }
 
     ALOGI("dropping packet. extSeqNo %d didn't arrive in time",
-            mLastDequeuedExtSeqNo + 1);
+            mPackets.nextExtSeqNo());
 
     // Permanent failure, we never received the packet.
-    mLastDequeuedExtSeqNo = extSeqNo;
+    size_t numSkipped;
+    buffer = mPackets.dequeueFirstAvailable(&numSkipped);
+    CHECK(buffer != NULL);
+
+    if (numSkipped > 1) {
+        ALOGI("skipped %d missing packets in total", numSkipped);
+    }
+
+    mPacketsLostMetric->increment(numSkipped);
+
+    if (mStats != NULL) {
+        mStats->add(SinkStats::kPacketsLost, numSkipped);
+    }
+
+    // Whatever references the lost data won't decode properly, wait for
+    // a fresh IDR frame instead. Requests are rate-limited by RTPSink.
+    if (!mSkippingToIDR && !mVideoEncrypted) {
+        ALOGI("skipping video up to the next IDR frame");
+
+        mSkippingToIDR = true;
+        mSkipStartedUs = ALooper::GetNowUs();
+    }
+
+    if (mNotifyLost != NULL) {
+        sp<AMessage> notify = mNotifyLost->dup();
+        notify->setInt32("unrecoverable", true);
+        notify->post();
+    }
+
+    mLastDequeuedExtSeqNo = buffer->int32Data();
     mFirstFailedAttemptUs = -1ll;
     mRequestedRetransmission = false;
 
-    mTotalBytesQueued -= buffer->size();
-
-    mPackets.erase(mPackets.begin());
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Mark(LatencyTrace::kStageDequeued, buffer);
+#endif
 
     return buffer;
 }
 
+// HDCP 2.x as used by Wifi Display encrypts the PES payload and carries
+// its counters as PES_private_data, the PES header stays in the clear.
+static bool IsEncryptedPES(const uint8_t *pes, size_t size) {
+    if (pes[6] & 0x30) {
+        // PES_scrambling_control
+        return true;
+    }
+
+    uint8_t flags = pes[7];
+    if (!(flags & 0x01)) {
+        // No PES_extension, hence no PES_private_data.
+        return false;
+    }
+
+    size_t offset = 9;
+    if ((flags >> 6) == 2) {
+        offset += 5;  // PTS
+    } else if ((flags >> 6) == 3) {
+        offset += 10;  // PTS and DTS
+    }
+    if (flags & 0x20) {
+        offset += 6;  // ESCR
+    }
+    if (flags & 0x10) {
+        offset += 3;  // ES_rate
+    }
+    if (flags & 0x08) {
+        offset += 1;  // DSM_trick_mode
+    }
+    if (flags & 0x04) {
+        offset += 1;  // additional_copy_info
+    }
+    if (flags & 0x02) {
+        offset += 2;  // previous_PES_packet_CRC
+    }
+
+    return offset < size && (pes[offset] & 0x80);
+}
+
+// static
+bool TunnelRenderer::StartsIDRFrame(
+        const uint8_t *ts, bool *isVideo, bool *isEncrypted) {
+    *isVideo = false;
+    *isEncrypted = false;
+
+    if (!(ts[1] & 0x40) || !(ts[3] & 0x10)) {
+        // Doesn't start a PES packet or carries no payload.
+        return false;
+    }
+
+    size_t offset = 4;
+    bool randomAccess = false;
+    if (ts[3] & 0x20) {
+        // random_access_indicator, for sources that flag IDR frames at the
+        // transport level.
+        randomAccess = ts[4] > 0 && (ts[5] & 0x40);
+
+        offset += 1 + ts[4];
+    }
+
+    if (offset + 9 > 188) {
+        return false;
+    }
+
+    const uint8_t *pes = &ts[offset];
+    if (pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01
+            || (pes[3] & 0xf0) != 0xe0) {
+        return false;
+    }
+
+    *isVideo = true;
+    *isEncrypted = IsEncryptedPES(pes, 188 - offset);
+
+    if (randomAccess) {
+        return true;
+    }
+
+    if (*isEncrypted) {
+        return false;
+    }
+
+    // The source prepends SPS and PPS to IDR frames, so they all start
+    // within the first TS packet of the access unit.
+    size_t start = offset + 9 + pes[8];
+    for (size_t i = start; i + 3 < 188; ++i) {
+        if (ts[i] == 0x00 && ts[i + 1] == 0x00 && ts[i + 2] == 0x01) {
+            unsigned nalType = ts[i + 3] & 0x1f;
+
+            if (nalType == 5 || nalType == 7) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void TunnelRenderer::countVideoFrames(const sp<ABuffer> &buffer) {
+    const uint8_t *data = buffer->data();
+    size_t numPackets = buffer->size() / 188;
+
+    // Every frame starts a PES packet of its own.
+    int32_t numFrames = 0;
+    for (size_t i = 0; i < numPackets; ++i) {
+        bool isVideo, isEncrypted;
+        StartsIDRFrame(&data[i * 188], &isVideo, &isEncrypted);
+
+        if (isVideo) {
+            ++numFrames;
+        }
+    }
+
+    if (numFrames > 0) {
+        android_atomic_add(numFrames, &mFrameCount);
+    }
+}
+
+void TunnelRenderer::scheduleFrameRateUpdate() {
+    static const int64_t kFrameRateIntervalUs = 1000000ll;
+
+    if (mStats == NULL || mFrameRateUpdatePending) {
+        return;
+    }
+
+    if (mFrameCountStartUs < 0ll) {
+        mFrameCountStartUs = ALooper::GetNowUs();
+        android_atomic_and(0, &mFrameCount);
+    }
+
+    mFrameRateUpdatePending = true;
+    (new AMessage(kWhatUpdateFrameRate, id()))->post(kFrameRateIntervalUs);
+}
+
+void TunnelRenderer::onUpdateFrameRate() {
+    mFrameRateUpdatePending = false;
+
+    int64_t nowUs = ALooper::GetNowUs();
+    int32_t numFrames = android_atomic_and(0, &mFrameCount);
+
+    if (nowUs > mFrameCountStartUs) {
+        mStats->set(
+                SinkStats::kFrameRateX100,
+                (numFrames * 100000000ll) / (nowUs - mFrameCountStartUs));
+    }
+
+    if (numFrames == 0) {
+        // Stalled or done, that's been published now. Packets arriving
+        // start counting afresh.
+        mFrameCountStartUs = -1ll;
+        return;
+    }
+
+    mFrameCountStartUs = nowUs;
+    scheduleFrameRateUpdate();
+}
+
+sp<ABuffer> TunnelRenderer::skipToIDR_l(const sp<ABuffer> &buffer) {
+    // Don't freeze forever should the source ignore our requests, the
+    // periodic IDR frames may just be too far apart.
+    static const int64_t kMaxSkipDurationUs = 2000000ll;
+
+    if (mVideoEncrypted) {
+        // Skipping may have started before the first video PES told us.
+        ALOGW("video is encrypted, can't tell IDR frames apart, "
+              "no longer skipping video");
+
+        mSkippingToIDR = false;
+        return buffer;
+    }
+
+    if (ALooper::GetNowUs() > mSkipStartedUs + kMaxSkipDurationUs) {
+        ALOGW("no IDR frame in time, no longer skipping video");
+
+        mSkippingToIDR = false;
+        return buffer;
+    }
+
+    // The receive buffer may still be referenced elsewhere (FEC, NACK
+    // bookkeeping), so what's kept is copied into a buffer of our own, but
+    // only once the first packet needs to go.
+    const uint8_t *data = buffer->data();
+    size_t numPackets = buffer->size() / 188;
+    size_t numKept = 0;
+    sp<ABuffer> kept;
+
+    for (size_t i = 0; i < numPackets; ++i) {
+        const uint8_t *ts = &data[i * 188];
+        int32_t pid = ((ts[1] & 0x1f) << 8) | ts[2];
+
+        if (mSkippingToIDR) {
+            bool isVideo, isEncrypted;
+            bool isIDR = StartsIDRFrame(ts, &isVideo, &isEncrypted);
+
+            if (isVideo) {
+                mVideoPID = pid;
+            }
+
+            if (isIDR) {
+                ALOGI("IDR frame arrived %lld ms after the loss",
+                      (ALooper::GetNowUs() - mSkipStartedUs) / 1000ll);
+
+                mSkippingToIDR = false;
+            }
+        }
+
+        // PSI, audio and anything else on other PIDs always pass, and
+        // so does everything until we know which PID carries video.
+        bool skip = mSkippingToIDR && pid == mVideoPID;
+
+        if (skip) {
+            if (kept == NULL) {
+                kept = new ABuffer(buffer->size());
+                memcpy(kept->data(), data, numKept * 188);
+            }
+
+            mPacketsSkippedMetric->increment();
+            continue;
+        }
+
+        if (kept != NULL) {
+            memcpy(kept->data() + numKept * 188, ts, 188);
+        }
+        ++numKept;
+    }
+
+    if (kept == NULL) {
+        return buffer;
+    }
+
+    if (numKept == 0) {
+        return NULL;
+    }
+
+    kept->setRange(0, numKept * 188);
+    kept->setInt32Data(buffer->int32Data());
+
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Carry(buffer, kept);
+#endif
+
+    return kept;
+}
+
+void TunnelRenderer::findVideoPID_l(const sp<ABuffer> &buffer) {
+    const uint8_t *data = buffer->data();
+    size_t numPackets = buffer->size() / 188;
+
+    for (size_t i = 0; i < numPackets; ++i) {
+        const uint8_t *ts = &data[i * 188];
+
+        bool isVideo, isEncrypted;
+        bool isIDR = StartsIDRFrame(ts, &isVideo, &isEncrypted);
+
+        if (isVideo) {
+            mVideoPID = ((ts[1] & 0x1f) << 8) | ts[2];
+
+            // Streams start with an IDR frame, so a source flagging random
+            // access points has flagged this one.
+            mVideoEncrypted = isEncrypted && !isIDR;
+
+            ALOGV("video on PID 0x%04x%s",
+                  mVideoPID, mVideoEncrypted ? ", encrypted" : "");
+            return;
+        }
+    }
+}
+
 void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
     switch (msg->what()) {
-        case kWhatQueueBuffer:
+        case kWhatPacketsAvailable:
         {
-            sp<ABuffer> buffer;
-            CHECK(msg->findBuffer("buffer", &buffer));
+            queueIncomingPackets();
+            scheduleFrameRateUpdate();
+
+            if (mDiscardOutput) {
+                drainToDirectRenderer();
+            } else if (mDirectRendering) {
+                if (mDirectRenderer == NULL) {
+                    initDirectRenderer();
+                }
 
-            queueBuffer(buffer);
+                drainToDirectRenderer();
+            } else if (mStreamSource == NULL) {
+                size_t numBytesQueued;
+                {
+                    Mutex::Autolock autoLock(mLock);
+                    numBytesQueued = mPackets.numBytes();
+                }
 
-            if (mStreamSource == NULL) {
-                if (mTotalBytesQueued > 0ll) {
+                if (numBytesQueued > 0) {
                     initPlayer();
                 } else {
-                    ALOGI("Have %lld bytes queued...", mTotalBytesQueued);
+                    ALOGI("Have %d bytes queued...", numBytesQueued);
                 }
             } else {
                 mStreamSource->doSomeWork();
@@ -308,13 +1147,59 @@ void TunnelRenderer::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatDrain:
+        {
+            mDrainPending = false;
+
+            drainToDirectRenderer();
+            break;
+        }
+
+        case kWhatStartStream:
+        {
+            uint32_t replyID;
+            CHECK(msg->senderAwaitsResponse(&replyID));
+
+            sp<AMessage> notifyLost;
+            if (!msg->findMessage("notifyLost", &notifyLost)) {
+                notifyLost.clear();
+            }
+
+            onStartStream(notifyLost);
+
+            (new AMessage)->postReply(replyID);
+            break;
+        }
+
+        case kWhatUpdateFrameRate:
+        {
+            onUpdateFrameRate();
+            break;
+        }
+
+        case kWhatPrepare:
+        {
+            if (mDiscardOutput) {
+                break;
+            }
+
+            if (mDirectRendering) {
+                if (mDirectRenderer == NULL) {
+                    initDirectRenderer();
+                }
+            } else if (mStreamSource == NULL) {
+                initPlayer();
+            }
+            break;
+        }
+
         default:
             TRESPASS();
     }
 }
 
-void TunnelRenderer::initPlayer() {
-    if (mSurfaceTex == NULL) {
+void TunnelRenderer::initSurface() {
+    if (mSurfaceTex == NULL && mComposerClient == NULL) {
         mComposerClient = new SurfaceComposerClient;
         CHECK_EQ(mComposerClient->initCheck(), (status_t)OK);
 
@@ -352,6 +1237,10 @@ void TunnelRenderer::initPlayer() {
         mSurface = mSurfaceControl->getSurface();
         CHECK(mSurface != NULL);
     }
+}
+
+void TunnelRenderer::initPlayer() {
+    initSurface();
 
     sp<IServiceManager> sm = defaultServiceManager();
     sp<IBinder> binder = sm->getService(String16("media.player"));
@@ -372,13 +1261,49 @@ void TunnelRenderer::initPlayer() {
     mPlayer->start();
 }
 
+void TunnelRenderer::initDirectRenderer() {
+    initSurface();
+
+    mDirectLooper = new ALooper;
+    mDirectLooper->setName("direct_renderer_looper");
+
+    mDirectLooper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+
+    mDirectRenderer = new DirectRenderer(
+            mSurfaceTex != NULL ? mSurfaceTex : mSurface->getSurfaceTexture());
+
+    mDirectLooper->registerHandler(mDirectRenderer);
+}
+
+void TunnelRenderer::releaseStreamPlayer() {
+    if (mStreamSource != NULL) {
+        mStreamSource->detach();
+        mStreamSource.clear();
+    }
+
+    if (mPlayer != NULL) {
+        mPlayer->stop();
+        mPlayer.clear();
+    }
+
+    mPlayerClient.clear();
+}
+
 void TunnelRenderer::destroyPlayer() {
-    mStreamSource.clear();
+    if (mDirectRenderer != NULL) {
+        mDirectLooper->unregisterHandler(mDirectRenderer->id());
+        mDirectRenderer.clear();
 
-    mPlayer->stop();
-    mPlayer.clear();
+        mDirectLooper->stop();
+        mDirectLooper.clear();
+    }
+
+    releaseStreamPlayer();
 
-    if (mSurfaceTex == NULL) {
+    if (mSurfaceTex == NULL && mComposerClient != NULL) {
         mSurface.clear();
         mSurfaceControl.clear();
 
@@ -387,5 +1312,48 @@ void TunnelRenderer::destroyPlayer() {
     }
 }
 
+void TunnelRenderer::drainToDirectRenderer() {
+    for (;;) {
+        sp<ABuffer> buffer = dequeueBuffer();
+
+        if (buffer == NULL) {
+            break;
+        }
+
+        if (mDiscardOutput) {
+            // Packets recovered through FEC don't carry a timestamp.
+            int32_t rtpTime;
+            if (buffer->meta()->findInt32("rtp-time", &rtpTime)) {
+                uint32_t nowMedia = (ALooper::GetNowUs() * 9ll) / 100ll;
+                int32_t transit = (int32_t)(nowMedia - (uint32_t)rtpTime);
+
+                mTransitMetric->record((transit * 100ll) / 9ll);
+            }
+            continue;
+        }
+
+        mDirectRenderer->queueTSPackets(buffer);
+
+#if ENABLE_LATENCY_TRACE
+        LatencyTrace::Mark(LatencyTrace::kStageQueuedToPlayer, buffer);
+#endif
+    }
+
+    bool packetsPending;
+    {
+        Mutex::Autolock autoLock(mLock);
+        packetsPending = !mPackets.empty();
+    }
+
+    // Without a mediaplayer pulling data, we have to come back by ourselves
+    // to give up on a missing packet if nothing else arrives meanwhile.
+    if (packetsPending && !mDrainPending) {
+        static const int64_t kDrainPollIntervalUs = 5000ll;
+
+        mDrainPending = true;
+        (new AMessage(kWhatDrain, id()))->post(kDrainPollIntervalUs);
+    }
+}
+
 }  // namespace android
 
@@ -6,9 +6,17 @@
 #include <gui/Surface.h>
 #include <media/stagefright/foundation/AHandler.h>
 
+#include "JitterBuffer.h"
+#include "Metrics.h"
+#include "NackTracker.h"
+#include "PacketRing.h"
+#include "TimestampSlewer.h"
+
 namespace android {
 
 struct ABuffer;
+struct DirectRenderer;
+struct SinkStats;
 struct SurfaceComposerClient;
 struct SurfaceControl;
 struct Surface;
@@ -18,15 +26,79 @@ struct IStreamListener;
 // This class reassembles incoming RTP packets into the correct order
 // and sends the resulting transport stream to a mediaplayer instance
 // for playback.
+// Once a packet has to be given up on, video is skipped up to the next IDR
+// frame (which "notifyLost" is asked to request) rather than having the
+// decoder show corrupt frames. Should the consumer fall behind, the queue is
+// capped by "media.wfd.sink.max-queued-kb" and
+// "media.wfd.sink.max-queued-ms" (see OverflowPolicy) so that neither memory
+// nor latency grow without bounds. With "directRendering" the transport
+// stream is decoded in-process by a DirectRenderer instead, with
+// "discardOutput" it's thrown away as soon as it's dequeued and no surface
+// is ever created.
+// Metrics are registered under "metricsPrefix", which has to be unique among
+// the renderers of a process.
 struct TunnelRenderer : public AHandler {
     TunnelRenderer(
             const sp<AMessage> &notifyLost,
-            const sp<ISurfaceTexture> &surfaceTex);
+            const sp<ISurfaceTexture> &surfaceTex,
+            bool directRendering = false,
+            bool discardOutput = false,
+            const char *metricsPrefix = "sink");
+
+    // Starts a looper to run a renderer on. RTP processing (the thread
+    // calling enqueuePacket()) and rendering must not share one, the
+    // packet ring between them is what keeps the two stages apart.
+    static status_t StartLooper(sp<ALooper> *looper);
+
+    // Called for every incoming packet, must always be called from the
+    // same thread.
+    void enqueuePacket(const sp<ABuffer> &buffer);
 
     sp<ABuffer> dequeueBuffer();
 
+    // Creates surface and player (or DirectRenderer) right away instead of
+    // waiting for the first packet, so that this doesn't add to the time
+    // to the first frame.
+    void prepare();
+
+    // Starts over with a new stream, e.g. when a renderer created ahead of
+    // time or kept from a previous session is handed to a new RTPSink.
+    // Whatever is still queued is dropped, losses are reported through
+    // "notifyLost" from now on. The surface is kept, a fresh player is
+    // brought up on it by the first packets of the new stream. Must be
+    // called from the thread calling enqueuePacket(), blocks until our
+    // looper has dropped what was queued.
+    void startStream(const sp<AMessage> &notifyLost);
+
+    // How long to wait for a missing packet before skipping over it.
+    // While its retransmission was requested we hold out for at least
+    // 1.5 round trips, with FEC at least until the parity covering it can
+    // have arrived.
+    void setLossWaitUs(int64_t lossWaitUs);
+
+    // Time it takes a full FEC matrix to arrive, 0 without FEC.
+    void setFECWaitUs(int64_t fecWaitUs);
+
+    // Duration of a second of source time on our clock. Timestamps of the
+    // stream handed to the mediaplayer are slewed accordingly, so that it
+    // plays out at the source's pace and latency doesn't creep.
+    void setClockRate(double rate);
+
+    // Applies the clock rate to a copy of what dequeueBuffer() returned,
+    // the returned buffer itself may be shared and is left alone.
+    void slewTimestamps(uint8_t *data, size_t size);
+
+    // Queue depth, losses and the rate at which video frames are handed
+    // on for decoding are published through "stats". Must be called
+    // before the first packet is enqueued.
+    void setStats(const sp<SinkStats> &stats);
+
     enum {
-        kWhatQueueBuffer,
+        kWhatPacketsAvailable,
+        kWhatDrain,
+        kWhatPrepare,
+        kWhatStartStream,
+        kWhatUpdateFrameRate,
     };
 
 protected:
@@ -37,13 +109,30 @@ private:
     struct PlayerClient;
     struct StreamSource;
 
+    // What to do once the queue exceeds its caps, set through
+    // "media.wfd.sink.overflow-policy". Either way the oldest packets are
+    // dropped until the queue is down to half its caps.
+    enum OverflowPolicy {
+        // Video is then skipped up to the next IDR frame, which is
+        // requested right away, audio plays on.
+        kOverflowSkipToIDR,
+        // Nothing else happens, the decoder has to conceal the gap.
+        kOverflowDropOldest,
+    };
+
     mutable Mutex mLock;
 
     sp<AMessage> mNotifyLost;
     sp<ISurfaceTexture> mSurfaceTex;
 
-    List<sp<ABuffer> > mPackets;
-    int64_t mTotalBytesQueued;
+    // Declared ahead of mPackets, whose window is sized from it.
+    size_t mMaxQueuedBytes;
+
+    // Packets handed over by enqueuePacket(), not yet in mPackets.
+    PacketRing mIncoming;
+
+    JitterBuffer mPackets;
+    NackTracker mNacks;
 
     sp<SurfaceComposerClient> mComposerClient;
     sp<SurfaceControl> mSurfaceControl;
@@ -52,14 +141,109 @@ private:
     sp<IMediaPlayer> mPlayer;
     sp<StreamSource> mStreamSource;
 
+    bool mDirectRendering;
+    bool mDiscardOutput;
+    sp<ALooper> mDirectLooper;
+    sp<DirectRenderer> mDirectRenderer;
+    bool mDrainPending;
+
     int32_t mLastDequeuedExtSeqNo;
     int64_t mFirstFailedAttemptUs;
     bool mRequestedRetransmission;
-
+    int64_t mLossWaitUs;
+    int64_t mFECWaitUs;
+
+    int64_t mMaxQueuedUs;
+    OverflowPolicy mOverflowPolicy;
+
+    // RTP timestamp of the packet with the highest sequence number queued.
+    bool mHaveNewestRTPTime;
+    int32_t mNewestRTPTime;
+
+    // Set after an unrecoverable loss, video TS packets are dropped until
+    // an IDR frame starts. mVideoPID is -1 as long as the video PID is
+    // unknown, nothing is dropped until then. mVideoEncrypted is set if the
+    // stream's first video PES was encrypted and not flagged as a random
+    // access point, IDR frames can't be found then and video isn't skipped.
+    // Protected by mLock like the rest of the loss handling state.
+    bool mSkippingToIDR;
+    int64_t mSkipStartedUs;
+    int32_t mVideoPID;
+    bool mVideoEncrypted;
+
+    TimestampSlewer mSlewer;
+
+    sp<SinkStats> mStats;
+
+    // Video frames dequeued since mFrameCountStartUs, counted by the thread
+    // calling dequeueBuffer() and collected once a second on our looper,
+    // which publishes the rate even if the decoder stopped taking data.
+    volatile int32_t mFrameCount;
+    int64_t mFrameCountStartUs;
+    bool mFrameRateUpdatePending;
+
+    MetricsRegistry::Counter *mPacketsLostMetric;
+    MetricsRegistry::Counter *mPacketsDuplicatedMetric;
+    MetricsRegistry::Histogram *mReorderDepthMetric;
+    MetricsRegistry::Gauge *mJitterBufferPacketsMetric;
+    MetricsRegistry::Gauge *mJitterBufferBytesMetric;
+    MetricsRegistry::Gauge *mJitterBufferLatencyMetric;
+    MetricsRegistry::Counter *mOverflowDropsMetric;
+    MetricsRegistry::Counter *mPacketsSkippedMetric;
+
+    // Time from transmission to dequeueing in discard mode. Derived from
+    // the RTP timestamps, it's only meaningful if source and sink share a
+    // clock, i.e. run in the same process (see udptest).
+    MetricsRegistry::Histogram *mTransitMetric;
+
+    void initSurface();
     void initPlayer();
+    void initDirectRenderer();
     void destroyPlayer();
 
-    void queueBuffer(const sp<ABuffer> &buffer);
+    // Lets go of the mediaplayer and its stream source, keeps the surface.
+    void releaseStreamPlayer();
+
+    // Hands dequeued packets to the DirectRenderer or, in discard mode,
+    // drops them.
+    void drainToDirectRenderer();
+
+    void queueIncomingPackets();
+    void onStartStream(const sp<AMessage> &notifyLost);
+
+    // How long to wait for the packet at the head of the queue.
+    int64_t effectiveLossWaitUs_l() const;
+
+    void initQueueLimits();
+
+    // Source time spanned by the queued packets, 0 unless both ends carry
+    // an RTP timestamp.
+    int64_t queuedDurationUs_l() const;
+
+    // Drops the oldest packets if the queue exceeds its caps.
+    void enforceQueueLimits_l();
+
+    // The queue lost "numDropped" packets (and "numSkipped" that never
+    // arrived) to one of its limits, applies mOverflowPolicy.
+    void onQueueOverflow_l(size_t numDropped, size_t numSkipped);
+
+    // dequeueBuffer() minus skipping to IDR frames.
+    sp<ABuffer> dequeuePacket_l();
+
+    // Returns "buffer" minus the video TS packets preceding the next IDR
+    // frame, NULL if nothing is left. "buffer" itself may be shared and is
+    // left alone, a copy is returned if anything was removed.
+    sp<ABuffer> skipToIDR_l(const sp<ABuffer> &buffer);
+    void findVideoPID_l(const sp<ABuffer> &buffer);
+
+    // "isEncrypted" is set for a video PES whose payload can't be looked
+    // into, only a random_access_indicator tells IDR frames apart then.
+    static bool StartsIDRFrame(
+            const uint8_t *ts, bool *isVideo, bool *isEncrypted);
+
+    void countVideoFrames(const sp<ABuffer> &buffer);
+    void scheduleFrameRateUpdate();
+    void onUpdateFrameRate();
 
     DISALLOW_EVIL_CONSTRUCTORS(TunnelRenderer);
 };
@@ -4,27 +4,66 @@
 #include <utils/Log.h>
 
 #include "WifiDisplaySink.h"
+#include "Parameters.h"
 #include "ParsedMessage.h"
 #include "RTPSink.h"
+#include "SinkCapabilities.h"
+#include "SinkStats.h"
+#include "SinkThreadPool.h"
+#include "TunnelRenderer.h"
 
+#include <cutils/atomic.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/MediaErrors.h>
 
+#include <strings.h>
+
 namespace android {
 
+static volatile int32_t gNextSinkID = 0;
+
 WifiDisplaySink::WifiDisplaySink(
         const sp<ANetworkSession> &netSession,
-        const sp<ISurfaceTexture> &surfaceTex)
+        const sp<ISurfaceTexture> &surfaceTex,
+        uint32_t flags,
+        const sp<AMessage> &notify)
     : mState(UNDEFINED),
       mNetSession(netSession),
       mSurfaceTex(surfaceTex),
+      mFlags(flags),
+      mNotify(notify),
+      mMetricsPrefix(
+              StringPrintf("sink%d", android_atomic_inc(&gNextSinkID))),
+      mRTSPPort(0),
       mSessionID(0),
-      mNextCSeq(1) {
+      mHaveConnected(false),
+      mNumReconnectAttempts(0),
+      mFECColumns(0),
+      mFECRows(0),
+      mNextCSeq(1),
+      mMediaLane(0) {
 }
 
 WifiDisplaySink::~WifiDisplaySink() {
+    if (mMediaLooper != NULL) {
+        if (mRTPSink != NULL) {
+            mMediaLooper->unregisterHandler(mRTPSink->id());
+            mRTPSink.clear();
+        }
+
+        if (mRenderer != NULL) {
+            mRendererLooper->unregisterHandler(mRenderer->id());
+            mRenderer.clear();
+
+            mRendererLooper->stop();
+            mRendererLooper.clear();
+        }
+
+        // Other sinks may be using the same threads.
+        SinkThreadPool::Get()->release(mMediaLane);
+    }
 }
 
 void WifiDisplaySink::start(const char *sourceHost, int32_t sourcePort) {
@@ -40,6 +79,10 @@ void WifiDisplaySink::start(const char *uri) {
     msg->post();
 }
 
+void WifiDisplaySink::setStats(const sp<SinkStats> &stats) {
+    mStats = stats;
+}
+
 // static
 bool WifiDisplaySink::ParseURL(
         const char *url, AString *host, int32_t *port, AString *path,
@@ -124,10 +167,47 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
 
             sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());   //ϢЭ
 
+            mRTSPPort = sourcePort;
+
             status_t err = mNetSession->createRTSPClient(
                     mRTSPHost.c_str(), sourcePort, notify, &mSessionID);//RTSPͻ
             CHECK_EQ(err, (status_t)OK);
 
+            mState = CONNECTING;
+
+            // Overlaps with the connection setup and the RTSP exchange.
+            err = prepareRenderer();
+
+            if (err != OK) {
+                ALOGW("unable to prepare the renderer ahead of time (%d)", err);
+            }
+
+            // Probing the decoders takes a while, better done before the
+            // source asks for the result in M3. Not here though, M1 and M2
+            // would have to wait for it.
+            SinkCapabilities::Prefetch();
+            break;
+        }
+
+        case kWhatReconnect:
+        {
+            ALOGI("reconnecting to %s:%d (attempt %d)",
+                  mRTSPHost.c_str(), mRTSPPort, mNumReconnectAttempts);
+
+            sp<AMessage> notify = new AMessage(kWhatRTSPNotify, id());
+
+            status_t err = mNetSession->createRTSPClient(
+                    mRTSPHost.c_str(), mRTSPPort, notify, &mSessionID);
+
+            if (err != OK) {
+                mSessionID = 0;
+
+                if (!scheduleReconnect()) {
+                    terminate(err);
+                }
+                break;
+            }
+
             mState = CONNECTING;
             break;
         }
@@ -162,7 +242,11 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
                         mNetSession->destroySession(mSessionID);
                         mSessionID = 0;
 
-                        looper()->stop();
+                        tearDownSession();
+
+                        if (!scheduleReconnect()) {
+                            terminate(err);
+                        }
                     }
                     break;
                 }
@@ -172,6 +256,9 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
                     ALOGI("We're now connected.");
                     mState = CONNECTED;
 
+                    mHaveConnected = true;
+                    mNumReconnectAttempts = 0;
+
                     if (!mSetupURI.empty()) {
                         status_t err =
                             sendDescribe(mSessionID, mSetupURI.c_str());
@@ -209,7 +296,26 @@ void WifiDisplaySink::onMessageReceived(const sp<AMessage> &msg) {
 
         case kWhatStop:
         {
-            looper()->stop();
+            terminate(OK);
+            break;
+        }
+
+        case kWhatRTPSinkNotify:
+        {
+            int32_t what;
+            CHECK(msg->findInt32("what", &what));
+
+            if (what == RTPSink::kWhatRequestIDR) {
+                if (mSessionID != 0 && mState == PLAYING) {
+                    status_t err = sendIDRRequest(mSessionID);
+
+                    if (err != OK) {
+                        ALOGW("unable to request an IDR frame (%d)", err);
+                    }
+                }
+            } else {
+                TRESPASS();
+            }
             break;
         }
 
@@ -491,8 +597,14 @@ void WifiDisplaySink::onGetParameterRequest(
         const sp<ParsedMessage> &data) {
     ALOGD("WifiDisplaySink:: onGetParameterRequest");
 
-    {
-        // mRTPSink....
+    // The RTP/RTCP ports are taken now so that we can tell the source
+    // which ones, every sink in the process gets a pair of its own.
+    status_t err = createRTPSink();
+
+    if (err != OK) {
+        ALOGE("unable to set up the RTP sink (%d)", err);
+        sendErrorResponse(sessionID, "500 Internal Server Error", cseq);
+        return;
     }
 
     /* AString body =
@@ -500,18 +612,30 @@ void WifiDisplaySink::onGetParameterRequest(
         "wfd_audio_codecs: xxx\r\n"
         "wfd_client_rtp_ports: RTP/AVP/UDP;unicast xxx 0 mode=play\r\n"; */
 
-    AString body =
-        "wfd_video_formats: 48 00 02 02 0001DEFF 157C7FFF 00000FFF 00 0000 0000 00 none none\r\n"
-        "wfd_audio_codecs: LPCM 00000003 00\r\n";
+    sp<SinkCapabilities> capabilities = SinkCapabilities::Get();
+
+    AString body = StringPrintf(
+            "wfd_video_formats: %s\r\n"
+            "wfd_audio_codecs: %s\r\n",
+            capabilities->videoFormats().c_str(),
+            capabilities->audioCodecs().c_str());
 
     body.append("wfd_content_protection: none\r\n");
     body.append("wfd_coupled_sink: 00 none\r\n");
     body.append("wfd_uibc_capability: none\r\n");
     body.append("wfd_standby_resume_capability: none\r\n");
     body.append("wfd_lg_dlna_uuid: none\r\n");
-    //body.append("wfd_client_rtp_ports: RTP/AVP/UDP;unicast %d 0 mode=play\r\n",
-    //            mRTPSink->getRTPPort());
-    body.append("wfd_client_rtp_ports: RTP/AVP/UDP;unicast 15550 0 mode=play\r\n");
+    body.append(
+            StringPrintf(
+                "wfd_client_rtp_ports: RTP/AVP/UDP;unicast %d 0 mode=play\r\n",
+                mRTPSink->getRTPPort()));
+    body.append(
+            StringPrintf(
+                "wfd_fec_capability: XOR max_cols=%d;max_rows=%d;"
+                "max_overhead=%d\r\n",
+                RTPSink::kMaxFECColumns,
+                RTPSink::kMaxFECRows,
+                kMaxFECOverheadPercent));
     AString response = "RTSP/1.0 200 OK\r\n";
     AppendCommonResponse(&response, cseq);
     response.append("Content-Type: text/parameters\r\n");
@@ -519,7 +643,7 @@ void WifiDisplaySink::onGetParameterRequest(
     response.append("\r\n");
     response.append(body);
 
-    status_t err = mNetSession->sendRequest(sessionID, response.c_str());
+    err = mNetSession->sendRequest(sessionID, response.c_str());
     CHECK_EQ(err, (status_t)OK);
 }
 
@@ -553,17 +677,17 @@ status_t WifiDisplaySink::sendDescribe(int32_t sessionID, const char *uri) {
 status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
     ALOGD("WifiDisplaySink:: sendSetup");
 
-    mRTPSink = new RTPSink(mNetSession, mSurfaceTex);
-    looper()->registerHandler(mRTPSink);
-
-    status_t err = mRTPSink->init(sUseTCPInterleaving);
+    // Normally exists since M3 already, where its port was announced.
+    status_t err = createRTPSink();
 
     if (err != OK) {
-        looper()->unregisterHandler(mRTPSink->id());
-        mRTPSink.clear();
         return err;
     }
 
+    if (mFECColumns > 0) {
+        mRTPSink->enableFEC(mFECColumns, mFECRows);
+    }
+
     AString request = StringPrintf("SETUP %s RTSP/1.0\r\n", uri);
 
     AppendCommonResponse(&request, mNextCSeq);
@@ -597,6 +721,178 @@ status_t WifiDisplaySink::sendSetup(int32_t sessionID, const char *uri) {
     return OK;
 }
 
+status_t WifiDisplaySink::initMediaThreads() {
+    if (mMediaLooper != NULL) {
+        return OK;
+    }
+
+    return SinkThreadPool::Get()->acquire(
+            &mMediaNetSession, &mMediaLooper, &mMediaLane);
+}
+
+status_t WifiDisplaySink::createRTPSink() {
+    if (mRTPSink != NULL) {
+        return OK;
+    }
+
+    status_t err = initMediaThreads();
+
+    if (err != OK) {
+        return err;
+    }
+
+    mRTPSink = new RTPSink(
+            mMediaNetSession,
+            mSurfaceTex,
+            (mFlags & FLAG_DIRECT_RENDERING)
+                ? RTPSink::FLAG_DIRECT_RENDERING : 0,
+            new AMessage(kWhatRTPSinkNotify, id()),
+            mMetricsPrefix.c_str());
+    mMediaLooper->registerHandler(mRTPSink);
+
+    if (mStats != NULL) {
+        mRTPSink->setStats(mStats);
+    }
+
+    if (mRenderer != NULL) {
+        mRTPSink->setRenderer(mRenderer);
+    }
+
+    err = mRTPSink->init(sUseTCPInterleaving);
+
+    if (err != OK) {
+        mMediaLooper->unregisterHandler(mRTPSink->id());
+        mRTPSink.clear();
+        return err;
+    }
+
+    return OK;
+}
+
+status_t WifiDisplaySink::sendIDRRequest(int32_t sessionID) {
+    ALOGI("requesting an IDR frame");
+
+    AString body = "wfd_idr_request\r\n";
+
+    AString request = "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
+    AppendCommonResponse(&request, mNextCSeq);
+
+    request.append(StringPrintf("Session: %s\r\n", mPlaybackSessionID.c_str()));
+    request.append("Content-Type: text/parameters\r\n");
+    request.append(StringPrintf("Content-Length: %d\r\n", body.size()));
+    request.append("\r\n");
+    request.append(body);
+
+    status_t err =
+        mNetSession->sendRequest(sessionID, request.c_str(), request.size());
+
+    if (err != OK) {
+        return err;
+    }
+
+    registerResponseHandler(
+            sessionID,
+            mNextCSeq,
+            &WifiDisplaySink::onReceiveIDRRequestResponse);
+
+    ++mNextCSeq;
+
+    return OK;
+}
+
+status_t WifiDisplaySink::onReceiveIDRRequestResponse(
+        int32_t sessionID, const sp<ParsedMessage> &msg) {
+    int32_t statusCode;
+    if (!msg->getStatusCode(&statusCode)) {
+        return ERROR_MALFORMED;
+    }
+
+    if (statusCode != 200) {
+        // Not worth tearing the session down over, the next periodic
+        // IDR frame will do.
+        ALOGW("source refused the IDR request (%d)", statusCode);
+    }
+
+    return OK;
+}
+
+status_t WifiDisplaySink::prepareRenderer() {
+    if (mRenderer != NULL) {
+        return OK;
+    }
+
+    status_t err = initMediaThreads();
+
+    if (err != OK) {
+        return err;
+    }
+
+    // RTPSink takes care of loss notifications once it has a stream.
+    mRenderer = new TunnelRenderer(
+            NULL /* notifyLost */,
+            mSurfaceTex,
+            (mFlags & FLAG_DIRECT_RENDERING) != 0,
+            false /* discardOutput */,
+            mMetricsPrefix.c_str());
+
+    if (mStats != NULL) {
+        mRenderer->setStats(mStats);
+    }
+
+    err = TunnelRenderer::StartLooper(&mRendererLooper);
+
+    if (err != OK) {
+        mRenderer.clear();
+        return err;
+    }
+
+    mRendererLooper->registerHandler(mRenderer);
+
+    mRenderer->prepare();
+
+    return OK;
+}
+
+void WifiDisplaySink::tearDownSession() {
+    if (mRTPSink != NULL) {
+        mMediaLooper->unregisterHandler(mRTPSink->id());
+        mRTPSink.clear();
+    }
+
+    mResponseHandlers.clear();
+    mPlaybackSessionID.clear();
+    mFECColumns = 0;
+    mFECRows = 0;
+
+    mState = UNDEFINED;
+}
+
+bool WifiDisplaySink::scheduleReconnect() {
+    if (!mHaveConnected || mNumReconnectAttempts >= kMaxReconnectAttempts) {
+        return false;
+    }
+
+    ++mNumReconnectAttempts;
+
+    (new AMessage(kWhatReconnect, id()))->post(kReconnectDelayUs);
+
+    return true;
+}
+
+void WifiDisplaySink::terminate(status_t err) {
+    if (mNotify == NULL) {
+        // Nobody else is on our looper.
+        looper()->stop();
+        return;
+    }
+
+    // Other sinks may share the looper, it's up to our owner to stop it.
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatTerminated);
+    notify->setInt32("err", err);
+    notify->post();
+}
+
 status_t WifiDisplaySink::sendPlay(int32_t sessionID, const char *uri) {
     ALOGD("WifiDisplaySink: sendPlay");
     AString request = StringPrintf("PLAY %s RTSP/1.0\r\n", uri);
@@ -628,12 +924,19 @@ void WifiDisplaySink::onSetParameterRequest(
         const sp<ParsedMessage> &data) {
     ALOGD("WifiDisplaySink onSetParameterRequest");
     const char *content = data->getContent();
+    size_t contentLength = data->getContentLength();
 
     // if M4
-    onSetParameterRequest_CheckM4Parameter(content);
+    onSetParameterRequest_CheckM4Parameter(content, contentLength);
+    onSetParameterRequest_CheckFECParameter(content, contentLength);
 
     // if M5(setup) request.  then send M6
-    if (strstr(content, "wfd_trigger_method: SETUP\r\n") != NULL) {
+    const char *method;
+    size_t methodLength;
+    if (Parameters::FindParameter(
+                content, contentLength, "wfd_trigger_method",
+                &method, &methodLength)
+            && methodLength == 5 && !strncmp(method, "SETUP", 5)) {
         // AString uri = StringPrintf("rtsp://%s/wfd1.0/streamid=0", mPresentation_URL.c_str());
         AString uri = StringPrintf("rtsp://%s/wfd1.0/streamid=0", mPresentation_URL.c_str());
         status_t err =
@@ -653,46 +956,65 @@ void WifiDisplaySink::onSetParameterRequest(
     CHECK_EQ(err, (status_t)OK);
 }
 
-void WifiDisplaySink::onSetParameterRequest_CheckM4Parameter(const char *content) {
-    ALOGV("onSetParameterRequest_CheckM4Parameter in");
-    int len = strlen(content) + 1;
-    char *contentTemp = new char[len];
-    memset(contentTemp, 0, len);
-    strcpy(contentTemp, content);
-    contentTemp[len-1] = '\0';
-    AString strOld(contentTemp);
-    int pos1 = 0;
-    int pos2 = 0;
-    while (pos1 >= 0 && pos2 >= 0) {
-        ALOGD("pos1 = %d, pos2 = %d", pos1, pos2);
-        pos2 = strOld.find("\r\n", pos1);
-        if (pos2 > 0) {
-            char * array = new char[pos2 - pos1 + 1];
-            memset(array, 0, pos2-pos1+1);
-            strncpy(array, (strOld.c_str() + pos1), pos2 - pos1);
-            AString oneLine = array;
-            char tmp[20];
-            memset(tmp, 20, 0);
-            const char *startstr = "wfd_presentation_URL: rtsp://";
-            int startstrlen = strlen(startstr);
-            if (oneLine.startsWith(startstr)) {
-                int endpos = oneLine.find("/", startstrlen);
-                ALOGV("startlen = %d, endpos = %d", startstrlen, endpos);
-                strncpy(tmp, oneLine.c_str() + startstrlen, endpos - startstrlen);
-                tmp[endpos - startstrlen] = '\0';
-                mPresentation_URL.clear();
-                mPresentation_URL = tmp;
-                break;
-            }
-        } else {
-            break;
-        }
-        pos1 = pos2 + 2;
+void WifiDisplaySink::onSetParameterRequest_CheckM4Parameter(
+        const char *content, size_t size) {
+    const char *value;
+    size_t length;
+    if (!Parameters::FindParameter(
+                content, size, "wfd_presentation_URL", &value, &length)) {
+        return;
+    }
+
+    // "rtsp://<host>/wfd1.0/streamid=0 none", we're after the host.
+    static const char kScheme[] = "rtsp://";
+    static const size_t kSchemeLength = sizeof(kScheme) - 1;
+
+    if (length < kSchemeLength || strncasecmp(value, kScheme, kSchemeLength)) {
+        ALOGW("ignoring malformed wfd_presentation_URL");
+        return;
+    }
+
+    const char *host = value + kSchemeLength;
+    const char *end = value + length;
+
+    const char *hostEnd = host;
+    while (hostEnd < end && *hostEnd != '/' && *hostEnd != ' ') {
+        ++hostEnd;
     }
 
+    mPresentation_URL.setTo(host, hostEnd - host);
+
     ALOGV("onSetParameterRequest_CheckM4Parameter result. mPresentation_URL = %s\n", mPresentation_URL.c_str());
 }
 
+void WifiDisplaySink::onSetParameterRequest_CheckFECParameter(
+        const char *content, size_t size) {
+    const char *s;
+    size_t length;
+    if (!Parameters::FindParameter(content, size, "wfd_fec", &s, &length)) {
+        return;
+    }
+
+    AString value(s, length);
+
+    int32_t columns, rows;
+    if (!value.startsWith("XOR ")
+            || !ParsedMessage::GetInt32Attribute(
+                value.c_str() + 4, "cols", &columns)
+            || !ParsedMessage::GetInt32Attribute(
+                value.c_str() + 4, "rows", &rows)
+            || columns < 1 || columns > RTPSink::kMaxFECColumns
+            || rows < 1 || rows > RTPSink::kMaxFECRows) {
+        ALOGE("malformed wfd_fec: '%s'", value.c_str());
+        return;
+    }
+
+    ALOGI("Source protects the stream with %d x %d XOR FEC.", columns, rows);
+
+    mFECColumns = columns;
+    mFECRows = rows;
+}
+
 void WifiDisplaySink::sendErrorResponse(
         int32_t sessionID,
         const char *errorDetail,
@@ -12,18 +12,38 @@ namespace android {
 
 struct ParsedMessage;
 struct RTPSink;
+struct SinkStats;
+struct TunnelRenderer;
 
 // Represents the RTSP client acting as a wifi display sink.
 // Connects to a wifi display source and renders the incoming
 // transport stream using a MediaPlayer instance.
 struct WifiDisplaySink : public AHandler {
+    enum {
+        // Passed on to RTPSink, see RTPSink::FLAG_DIRECT_RENDERING.
+        FLAG_DIRECT_RENDERING = 1,
+    };
+
+    enum {
+        // We gave up on the source, "err" says why. Only sent if a notify
+        // message was given, without one the sink owns its looper and
+        // stops it instead.
+        kWhatTerminated,
+    };
+
     WifiDisplaySink(
             const sp<ANetworkSession> &netSession,
-            const sp<ISurfaceTexture> &surfaceTex = NULL);
+            const sp<ISurfaceTexture> &surfaceTex = NULL,
+            uint32_t flags = 0,
+            const sp<AMessage> &notify = NULL);
 
     void start(const char *sourceHost, int32_t sourcePort);
     void start(const char *uri);
 
+    // Link quality of every session is published through "stats" (see
+    // SinkStats). Must be called before start().
+    void setStats(const sp<SinkStats> &stats);
+
 protected:
     virtual ~WifiDisplaySink();
     virtual void onMessageReceived(const sp<AMessage> &msg);
@@ -41,6 +61,8 @@ private:
         kWhatStart,
         kWhatRTSPNotify,
         kWhatStop,
+        kWhatReconnect,
+        kWhatRTPSinkNotify,
     };
 
     struct ResponseID {
@@ -59,27 +81,76 @@ private:
 
     static const bool sUseTCPInterleaving = false;
 
+    // Upper bound on the bandwidth we're willing to spend on FEC packets,
+    // in percent of the media stream.
+    static const int32_t kMaxFECOverheadPercent = 30;
+
+    // After losing the control connection of an established session we
+    // try to get it back this often before giving up.
+    static const int64_t kReconnectDelayUs = 500000ll;
+    static const int32_t kMaxReconnectAttempts = 20;
+
     State mState;
     sp<ANetworkSession> mNetSession;
     sp<ISurfaceTexture> mSurfaceTex;
+    uint32_t mFlags;
+    sp<AMessage> mNotify;
+
+    // "sink<N>", keeps the metrics of the sinks of a process apart.
+    AString mMetricsPrefix;
+
     AString mSetupURI;
     AString mRTSPHost;
+    int32_t mRTSPPort;
     int32_t mSessionID;
 
+    bool mHaveConnected;
+    int32_t mNumReconnectAttempts;
+
     AString mPresentation_URL;
 
+    // XOR FEC matrix announced by the source in "wfd_fec", 0 columns if
+    // the stream isn't protected.
+    size_t mFECColumns;
+    size_t mFECRows;
+
     int32_t mNextCSeq;
 
     KeyedVector<ResponseID, HandleRTSPResponseFunc> mResponseHandlers;
 
+    // RTP/RTCP traffic is handled by a network session and looper of its
+    // own so that RTSP processing can't hold up the media data path. Both
+    // belong to a lane of the SinkThreadPool shared by all sinks of the
+    // process.
+    sp<ANetworkSession> mMediaNetSession;
+    sp<ALooper> mMediaLooper;
+    size_t mMediaLane;
+
+    // Created when we start connecting and kept across sessions, so that
+    // neither the player nor the surface are set up on the way to the
+    // first frame.
+    sp<TunnelRenderer> mRenderer;
+    sp<ALooper> mRendererLooper;
+
     sp<RTPSink> mRTPSink;
+    sp<SinkStats> mStats;
     AString mPlaybackSessionID;
     int32_t mPlaybackSessionTimeoutSecs;
 
     status_t sendM2(int32_t sessionID);
     status_t sendDescribe(int32_t sessionID, const char *uri);
     status_t sendSetup(int32_t sessionID, const char *uri);
+    status_t initMediaThreads();
+    status_t createRTPSink();
+    status_t prepareRenderer();
+
+    // Drops the state of the RTSP session that just went away, renderer
+    // and media threads stay around for the next one.
+    void tearDownSession();
+    bool scheduleReconnect();
+    void terminate(status_t err);
     status_t sendPlay(int32_t sessionID, const char *uri);
+    status_t sendIDRRequest(int32_t sessionID);
 
     status_t onReceiveM2Response(
             int32_t sessionID, const sp<ParsedMessage> &msg);
@@ -95,6 +166,9 @@ private:
     status_t onReceivePlayResponse(
             int32_t sessionID, const sp<ParsedMessage> &msg);
 
+    status_t onReceiveIDRRequestResponse(
+            int32_t sessionID, const sp<ParsedMessage> &msg);
+
     void registerResponseHandler(
             int32_t sessionID, int32_t cseq, HandleRTSPResponseFunc func);
 
@@ -115,7 +189,10 @@ private:
             int32_t cseq,
             const sp<ParsedMessage> &data);
 
-    void onSetParameterRequest_CheckM4Parameter(const char *content);
+    void onSetParameterRequest_CheckM4Parameter(
+            const char *content, size_t size);
+    void onSetParameterRequest_CheckFECParameter(
+            const char *content, size_t size);
 
     void sendErrorResponse(
             int32_t sessionID,
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "BitrateController"
+#include <utils/Log.h>
+
+#include "BitrateController.h"
+
+#include <media/stagefright/foundation/ADebug.h>
+
+#include <cutils/properties.h>
+
+namespace android {
+
+// Same default as the Converter's.
+static int32_t GetVideoBitrate() {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get("media.wfd.video-bitrate", val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x;
+        }
+    }
+
+    return 5000000;
+}
+
+BitrateController::BitrateController()
+    : mMaxBitrate(GetVideoBitrate()),
+      mMinBitrate(kMinBitrate),
+      mEstimate(mMaxBitrate),
+      mTargetBitrate(mMaxBitrate),
+      mLastChangeUs(-1ll),
+      mRemoteEstimate(-1ll),
+      mRemoteEstimateTimeUs(-1ll) {
+    if (mMinBitrate > mMaxBitrate) {
+        mMinBitrate = mMaxBitrate;
+    }
+}
+
+bool BitrateController::onReceiverReport(
+        int64_t nowUs, int32_t fractionLost, int32_t jitter) {
+    if (fractionLost > kHighLossThreshold) {
+        // Back off in proportion to the loss, i.e. by (1 - loss / 2).
+        mEstimate = mEstimate * (512 - fractionLost) / 512;
+    } else if (fractionLost < kLowLossThreshold && jitter < kMaxJitter) {
+        mEstimate = mEstimate * 105 / 100;
+    }
+
+    ALOGV("fraction lost %d/256, jitter %d => estimate %lld bps",
+          fractionLost, jitter, mEstimate);
+
+    return update(nowUs);
+}
+
+bool BitrateController::onBandwidthEstimate(int64_t nowUs, int64_t bitrate) {
+    mRemoteEstimate = bitrate;
+    mRemoteEstimateTimeUs = nowUs;
+
+    return update(nowUs);
+}
+
+int64_t BitrateController::upperBound(int64_t nowUs) const {
+    if (mRemoteEstimateTimeUs >= 0ll
+            && nowUs < mRemoteEstimateTimeUs + kEstimateTimeoutUs
+            && mRemoteEstimate < mMaxBitrate) {
+        return mRemoteEstimate;
+    }
+
+    return mMaxBitrate;
+}
+
+bool BitrateController::update(int64_t nowUs) {
+    int64_t maxBitrate = upperBound(nowUs);
+
+    if (mEstimate > maxBitrate) {
+        mEstimate = maxBitrate;
+    }
+
+    if (mEstimate < mMinBitrate) {
+        mEstimate = mMinBitrate;
+    }
+
+    int64_t delta = mEstimate - mTargetBitrate;
+    bool decrease = delta < 0;
+
+    if (decrease) {
+        delta = -delta;
+    }
+
+    // Always allow returning all the way to either bound, we'd get stuck
+    // just short of it otherwise.
+    if (delta * 100 < (int64_t)mTargetBitrate * kMinChangePercent
+            && mEstimate != mMinBitrate && mEstimate != maxBitrate) {
+        return false;
+    }
+
+    if (delta == 0) {
+        return false;
+    }
+
+    if (mLastChangeUs >= 0ll
+            && nowUs < mLastChangeUs
+                + (decrease ? kMinDecreaseIntervalUs : kMinIncreaseIntervalUs)) {
+        return false;
+    }
+
+    ALOGI("video bitrate %d -> %lld bps", mTargetBitrate, mEstimate);
+
+    mTargetBitrate = mEstimate;
+    mLastChangeUs = nowUs;
+
+    return true;
+}
+
+}  // namespace android
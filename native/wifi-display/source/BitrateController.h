@@ -0,0 +1,78 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BITRATE_CONTROLLER_H_
+
+#define BITRATE_CONTROLLER_H_
+
+#include <media/stagefright/foundation/ABase.h>
+
+namespace android {
+
+// Derives the video bitrate to encode at from the sink's RTCP feedback.
+// Receiver report loss drives an additive-increase/multiplicative-decrease
+// loop between a floor and the configured video bitrate, a receiver
+// estimated maximum bitrate (REMB), if the sink sends any, caps the result.
+// Since every change restarts the encoder, the target only moves by
+// significant steps and not too often.
+struct BitrateController {
+    BitrateController();
+
+    // Both return true iff the target bitrate changed.
+    bool onReceiverReport(
+            int64_t nowUs, int32_t fractionLost, int32_t jitter);
+
+    bool onBandwidthEstimate(int64_t nowUs, int64_t bitrate);
+
+    int32_t targetBitrate() const { return mTargetBitrate; }
+
+private:
+    static const int32_t kMinBitrate = 1000000;
+
+    // fractionLost is in units of 1/256.
+    static const int32_t kLowLossThreshold = 5;     // ~2%
+    static const int32_t kHighLossThreshold = 26;   // ~10%
+
+    // Interarrival jitter (90kHz units) beyond which we stop probing upwards.
+    static const int32_t kMaxJitter = 2700;         // 30ms
+
+    static const int32_t kMinChangePercent = 15;
+
+    static const int64_t kMinDecreaseIntervalUs = 2000000ll;
+    static const int64_t kMinIncreaseIntervalUs = 10000000ll;
+
+    // Bandwidth estimates not refreshed for this long no longer apply.
+    static const int64_t kEstimateTimeoutUs = 10000000ll;
+
+    int32_t mMaxBitrate;
+    int32_t mMinBitrate;
+
+    int64_t mEstimate;
+    int32_t mTargetBitrate;
+    int64_t mLastChangeUs;
+
+    int64_t mRemoteEstimate;
+    int64_t mRemoteEstimateTimeUs;
+
+    int64_t upperBound(int64_t nowUs) const;
+    bool update(int64_t nowUs);
+
+    DISALLOW_EVIL_CONSTRUCTORS(BitrateController);
+};
+
+}  // namespace android
+
+#endif  // BITRATE_CONTROLLER_H_
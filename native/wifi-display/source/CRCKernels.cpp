@@ -0,0 +1,368 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "CRCKernels"
+#include <utils/Log.h>
+
+#include "CRCKernels.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(__PCLMUL__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+namespace android {
+
+static const uint32_t kPolynomial = 0x04C11DB7;
+
+// gTable[0] is the classic byte-wise table, gTable[k][i] the CRC of byte i
+// followed by k zero bytes.
+static uint32_t gTable[8][256];
+
+static uint32_t MPEG2Bytewise(const uint8_t *p, size_t size, uint32_t crc) {
+    const uint8_t *end = p + size;
+
+    for (; p < end; ++p) {
+        crc = (crc << 8) ^ gTable[0][((crc >> 24) ^ *p) & 0xFF];
+    }
+
+    return crc;
+}
+
+static uint32_t MPEG2SlicingBy8(const uint8_t *p, size_t size, uint32_t crc) {
+    const uint8_t *end = p + size;
+
+    while (end - p >= 8) {
+        crc ^= (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+
+        crc = gTable[7][crc >> 24]
+            ^ gTable[6][(crc >> 16) & 0xFF]
+            ^ gTable[5][(crc >> 8) & 0xFF]
+            ^ gTable[4][crc & 0xFF]
+            ^ gTable[3][p[4]]
+            ^ gTable[2][p[5]]
+            ^ gTable[1][p[6]]
+            ^ gTable[0][p[7]];
+
+        p += 8;
+    }
+
+    return MPEG2Bytewise(p, end - p, crc);
+}
+
+#if defined(__ARM_FEATURE_CRC32)
+
+static inline uint32_t ReverseBits(uint32_t x) {
+#if defined(__aarch64__)
+    asm("rbit %w0, %w1" : "=r"(x) : "r"(x));
+#else
+    asm("rbit %0, %1" : "=r"(x) : "r"(x));
+#endif
+    return x;
+}
+
+// The CRC32 instructions implement the bit-reflected form of our
+// polynomial. Reflecting every input byte, the initial value and the
+// result turns that into the MSB-first CRC we need.
+static uint32_t MPEG2ARMv8(const uint8_t *p, size_t size, uint32_t crc) {
+    crc = ReverseBits(crc);
+
+    while (size >= 4) {
+        uint32_t x;
+        memcpy(&x, p, sizeof(x));
+
+        // Reverses the bits within each byte, keeping the byte order.
+        crc = __crc32w(crc, __builtin_bswap32(ReverseBits(x)));
+
+        p += 4;
+        size -= 4;
+    }
+
+    while (size > 0) {
+        crc = __crc32b(crc, ReverseBits(*p) >> 24);
+
+        ++p;
+        --size;
+    }
+
+    return ReverseBits(crc);
+}
+
+// Builds for CRC32 capable CPUs still end up on some that aren't, the
+// kernel tells us through the auxiliary vector.
+static bool CPUHasCRC32() {
+    static const unsigned long kAT_NULL = 0;
+#if defined(__aarch64__)
+    static const unsigned long kAT_HWCAP = 16;
+    static const unsigned long kHWCAP_CRC32 = 1ul << 7;
+#else
+    static const unsigned long kAT_HWCAP = 26;  // AT_HWCAP2
+    static const unsigned long kHWCAP_CRC32 = 1ul << 4;
+#endif
+
+    int fd = open("/proc/self/auxv", O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool hasCRC32 = false;
+
+    unsigned long entry[2];
+    while (read(fd, entry, sizeof(entry)) == (ssize_t)sizeof(entry)
+            && entry[0] != kAT_NULL) {
+        if (entry[0] == kAT_HWCAP) {
+            hasCRC32 = (entry[1] & kHWCAP_CRC32) != 0;
+            break;
+        }
+    }
+
+    close(fd);
+
+    return hasCRC32;
+}
+
+#elif defined(__PCLMUL__)
+
+// x^(n + 64) and x^n modulo the polynomial, for folding across n = 128
+// (one block) and n = 512 bits (four blocks), see MPEG2PCLMUL.
+static uint32_t gFold1Hi;
+static uint32_t gFold1Lo;
+static uint32_t gFold4Hi;
+static uint32_t gFold4Lo;
+
+static uint32_t XPowModPolynomial(size_t n) {
+    // x^32 mod P.
+    uint32_t r = kPolynomial;
+
+    for (size_t i = 32; i < n; ++i) {
+        r = (r << 1) ^ ((r & 0x80000000) ? kPolynomial : 0);
+    }
+
+    return r;
+}
+
+// 16 message bytes as a polynomial, the first bit being the coefficient
+// of x^127.
+static inline __m128i LoadBigEndian(const uint8_t *p) {
+    uint64_t hi, lo;
+    memcpy(&hi, p, sizeof(hi));
+    memcpy(&lo, p + 8, sizeof(lo));
+
+    return _mm_set_epi64x(__builtin_bswap64(hi), __builtin_bswap64(lo));
+}
+
+// A * x^n + B, congruent to A_hi * (x^(n + 64) mod P)
+// + A_lo * (x^n mod P) + B, neither product exceeding 96 bits.
+static inline __m128i Fold(__m128i acc, __m128i fold, __m128i data) {
+    return _mm_xor_si128(
+            _mm_xor_si128(
+                _mm_clmulepi64_si128(acc, fold, 0x11),
+                _mm_clmulepi64_si128(acc, fold, 0x00)),
+            data);
+}
+
+// Folds the message into a 128-bit remainder that's congruent to what
+// was consumed so far, four independent blocks at a time while there's
+// enough of it, since each multiplication takes several cycles to
+// complete. The last remainder and the tail have the same CRC (starting
+// at 0) as the message, the tables take it from there.
+static uint32_t MPEG2PCLMUL(const uint8_t *p, size_t size, uint32_t crc) {
+    if (size < 32) {
+        return MPEG2SlicingBy8(p, size, crc);
+    }
+
+    const __m128i fold1 = _mm_set_epi64x(gFold1Hi, gFold1Lo);
+
+    __m128i acc = _mm_xor_si128(
+            LoadBigEndian(p), _mm_set_epi32((int)crc, 0, 0, 0));
+
+    p += 16;
+    size -= 16;
+
+    if (size >= 112) {
+        const __m128i fold4 = _mm_set_epi64x(gFold4Hi, gFold4Lo);
+
+        __m128i acc1 = LoadBigEndian(p);
+        __m128i acc2 = LoadBigEndian(p + 16);
+        __m128i acc3 = LoadBigEndian(p + 32);
+
+        p += 48;
+        size -= 48;
+
+        while (size >= 64) {
+            acc = Fold(acc, fold4, LoadBigEndian(p));
+            acc1 = Fold(acc1, fold4, LoadBigEndian(p + 16));
+            acc2 = Fold(acc2, fold4, LoadBigEndian(p + 32));
+            acc3 = Fold(acc3, fold4, LoadBigEndian(p + 48));
+
+            p += 64;
+            size -= 64;
+        }
+
+        acc = Fold(acc, fold1, acc1);
+        acc = Fold(acc, fold1, acc2);
+        acc = Fold(acc, fold1, acc3);
+    }
+
+    while (size >= 16) {
+        acc = Fold(acc, fold1, LoadBigEndian(p));
+
+        p += 16;
+        size -= 16;
+    }
+
+    uint64_t words[2];
+    _mm_storeu_si128((__m128i *)words, acc);
+
+    uint8_t remainder[16];
+    uint64_t hi = __builtin_bswap64(words[1]);
+    uint64_t lo = __builtin_bswap64(words[0]);
+    memcpy(remainder, &hi, sizeof(hi));
+    memcpy(remainder + 8, &lo, sizeof(lo));
+
+    crc = MPEG2SlicingBy8(remainder, sizeof(remainder), 0);
+
+    return MPEG2SlicingBy8(p, size, crc);
+}
+
+static bool CPUHasPCLMUL() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+
+    return (ecx & bit_PCLMUL) != 0;
+}
+
+#endif
+
+static pthread_once_t gInitOnce = PTHREAD_ONCE_INIT;
+
+static uint32_t (*gMPEG2)(const uint8_t *, size_t, uint32_t) =
+    MPEG2SlicingBy8;
+
+static uint32_t (*gMPEG2Accelerated)(const uint8_t *, size_t, uint32_t) =
+    NULL;
+
+// static
+void CRCKernels::Init() {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i << 24;
+        for (int j = 0; j < 8; j++) {
+            crc = (crc << 1) ^ ((crc & 0x80000000) ? kPolynomial : 0);
+        }
+        gTable[0][i] = crc;
+    }
+
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t crc = gTable[k - 1][i];
+            gTable[k][i] = (crc << 8) ^ gTable[0][crc >> 24];
+        }
+    }
+
+#if defined(__ARM_FEATURE_CRC32)
+    if (CPUHasCRC32()) {
+        gMPEG2Accelerated = MPEG2ARMv8;
+    }
+#elif defined(__PCLMUL__)
+    if (CPUHasPCLMUL()) {
+        gFold1Hi = XPowModPolynomial(128 + 64);
+        gFold1Lo = XPowModPolynomial(128);
+        gFold4Hi = XPowModPolynomial(512 + 64);
+        gFold4Lo = XPowModPolynomial(512);
+
+        gMPEG2Accelerated = MPEG2PCLMUL;
+    }
+#endif
+
+    if (gMPEG2Accelerated != NULL) {
+        gMPEG2 = gMPEG2Accelerated;
+    }
+
+    ALOGI("using %s CRC kernels",
+          NameOf(gMPEG2Accelerated != NULL
+                ? kImplAccelerated : kImplSlicingBy8));
+}
+
+// static
+uint32_t CRCKernels::MPEG2(const void *data, size_t size) {
+    pthread_once(&gInitOnce, Init);
+
+    return gMPEG2((const uint8_t *)data, size, 0xFFFFFFFF);
+}
+
+// static
+bool CRCKernels::MPEG2With(
+        Implementation impl, const void *data, size_t size, uint32_t *crc) {
+    pthread_once(&gInitOnce, Init);
+
+    uint32_t (*func)(const uint8_t *, size_t, uint32_t);
+    switch (impl) {
+        case kImplBytewise:
+            func = MPEG2Bytewise;
+            break;
+        case kImplSlicingBy8:
+            func = MPEG2SlicingBy8;
+            break;
+        case kImplAccelerated:
+            func = gMPEG2Accelerated;
+            break;
+        default:
+            func = NULL;
+            break;
+    }
+
+    if (func == NULL) {
+        return false;
+    }
+
+    *crc = func((const uint8_t *)data, size, 0xFFFFFFFF);
+
+    return true;
+}
+
+// static
+const char *CRCKernels::NameOf(Implementation impl) {
+    switch (impl) {
+        case kImplBytewise:
+            return "bytewise";
+        case kImplSlicingBy8:
+            return "slicing-by-8";
+        case kImplAccelerated:
+#if defined(__ARM_FEATURE_CRC32)
+            return "ARMv8 CRC32";
+#elif defined(__PCLMUL__)
+            return "PCLMUL";
+#else
+            return "accelerated (not built)";
+#endif
+        default:
+            return "unknown";
+    }
+}
+
+}  // namespace android
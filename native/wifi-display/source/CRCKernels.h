@@ -0,0 +1,60 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CRC_KERNELS_H_
+
+#define CRC_KERNELS_H_
+
+#include <media/stagefright/foundation/ABase.h>
+
+#include <stdint.h>
+#include <sys/types.h>
+
+namespace android {
+
+// The CRC_32 of MPEG-2 transport stream sections (polynomial 0x04C11DB7,
+// MSB first, initial value 0xffffffff, no final inversion).
+//
+// PCLMULQDQ folding (x86) or the ARMv8 CRC32 instructions are used if the
+// build has them and the CPU we find ourselves on supports them, a
+// slicing-by-8 table lookup otherwise.
+struct CRCKernels {
+    static uint32_t MPEG2(const void *data, size_t size);
+
+    // Every implementation, so that crctest can compare and time them.
+    enum Implementation {
+        kImplBytewise,
+        kImplSlicingBy8,
+        kImplAccelerated,
+        kNumImplementations,
+    };
+
+    // Returns false if "impl" isn't available on this build and CPU.
+    static bool MPEG2With(
+            Implementation impl, const void *data, size_t size,
+            uint32_t *crc);
+
+    static const char *NameOf(Implementation impl);
+
+private:
+    static void Init();
+
+    DISALLOW_EVIL_CONSTRUCTORS(CRCKernels);
+};
+
+}  // namespace android
+
+#endif  // CRC_KERNELS_H_
@@ -20,7 +20,9 @@
 
 #include "Converter.h"
 
+#include "LatencyTrace.h"
 #include "MediaPuller.h"
+#include "PCMKernels.h"
 
 #include <cutils/properties.h>
 #include <gui/SurfaceTextureClient.h>
@@ -49,7 +51,11 @@ Converter::Converter(
       mIsVideo(false),
       mIsPCMAudio(usePCMAudio),
       mNeedToManuallyPrependSPSPPS(false),
-      mDoMoreWorkPending(false)
+      mVideoBitrate(0),
+      mDoMoreWorkPending(false),
+      mAccessUnitsMetric(NULL),
+      mEncodeLatencyMetric(NULL),
+      mBitrateMetric(NULL)
 #if ENABLE_SILENCE_DETECTION
       ,mFirstSilentFrameUs(-1ll)
       ,mInSilentMode(false)
@@ -64,6 +70,18 @@ Converter::Converter(
 
     CHECK(!usePCMAudio || !mIsVideo);
 
+    sp<MetricsRegistry> metrics = MetricsRegistry::Get();
+    if (mIsVideo) {
+        mAccessUnitsMetric = metrics->counter("source.video.access_units");
+        mEncodeLatencyMetric =
+            metrics->histogram("source.video.encode_latency_us");
+        mBitrateMetric = metrics->gauge("source.video.bitrate");
+    } else {
+        mAccessUnitsMetric = metrics->counter("source.audio.access_units");
+        mEncodeLatencyMetric =
+            metrics->histogram("source.audio.encode_latency_us");
+    }
+
     mInitCheck = initEncoder();
 
     if (mInitCheck != OK) {
@@ -150,7 +168,15 @@ status_t Converter::initEncoder() {
     mOutputFormat->setString("mime", outputMIME.c_str());
 
     int32_t audioBitrate = getBitrate("media.wfd.audio-bitrate", 128000);
-    int32_t videoBitrate = getBitrate("media.wfd.video-bitrate", 5000000);
+
+    if (mVideoBitrate == 0) {
+        mVideoBitrate = getBitrate("media.wfd.video-bitrate", 5000000);
+    }
+    int32_t videoBitrate = mVideoBitrate;
+
+    if (mBitrateMetric != NULL) {
+        mBitrateMetric->set(videoBitrate);
+    }
 
     ALOGI("using audio bitrate of %d bps, video bitrate of %d bps",
           audioBitrate, videoBitrate);
@@ -238,6 +264,104 @@ status_t Converter::initEncoder() {
     return mEncoder->getOutputBuffers(&mEncoderOutputBuffers);
 }
 
+status_t Converter::reinitEncoder() {
+    // MediaCodec offers no way to change the bitrate of a running encoder,
+    // so tear it down and start over. Frames the old instance is still
+    // working on are drained first, input still queued in
+    // mInputBufferQueue is fed to the new instance.
+    drainEncoder();
+
+    mEncoder->release();
+    mEncoder.clear();
+
+    mEncoderInputBuffers.clear();
+    mEncoderOutputBuffers.clear();
+    mAvailEncoderInputIndices.clear();
+
+    // Any activity notification requested from the old encoder is gone.
+    mDoMoreWorkPending = false;
+
+    status_t err = initEncoder();
+
+    if (err != OK) {
+        if (mEncoder != NULL) {
+            mEncoder->release();
+            mEncoder.clear();
+        }
+
+        return err;
+    }
+
+    scheduleDoMoreWork();
+
+    return OK;
+}
+
+void Converter::drainEncoder() {
+    // Bounds the time the looper is held up by an encoder that does not
+    // honour EOS.
+    static const int64_t kMaxDrainDurationUs = 200000ll;
+    static const int64_t kDequeueTimeoutUs = 10000ll;
+
+    int64_t deadlineUs = ALooper::GetNowUs() + kMaxDrainDurationUs;
+
+    size_t bufferIndex;
+    status_t err;
+    if (!mAvailEncoderInputIndices.empty()) {
+        bufferIndex = *mAvailEncoderInputIndices.begin();
+        mAvailEncoderInputIndices.erase(mAvailEncoderInputIndices.begin());
+        err = OK;
+    } else {
+        err = mEncoder->dequeueInputBuffer(&bufferIndex, kMaxDrainDurationUs);
+    }
+
+    if (err == OK) {
+        err = mEncoder->queueInputBuffer(
+                bufferIndex, 0, 0, 0ll, MediaCodec::BUFFER_FLAG_EOS);
+    }
+
+    if (err != OK) {
+        ALOGW("unable to signal EOS to the encoder (err %d), "
+              "in-flight frames are lost", err);
+        return;
+    }
+
+    size_t numDrained = 0;
+    while (ALooper::GetNowUs() < deadlineUs) {
+        size_t offset;
+        size_t size;
+        int64_t timeUs;
+        uint32_t flags;
+        err = mEncoder->dequeueOutputBuffer(
+                &bufferIndex, &offset, &size, &timeUs, &flags,
+                kDequeueTimeoutUs);
+
+        if (err == -EAGAIN) {
+            continue;
+        } else if (err == INFO_OUTPUT_BUFFERS_CHANGED) {
+            mEncoder->getOutputBuffers(&mEncoderOutputBuffers);
+            continue;
+        } else if (err != OK) {
+            break;
+        }
+
+        if (!(flags & MediaCodec::BUFFER_FLAG_EOS)) {
+            onEncoderOutput(bufferIndex, offset, size, timeUs, flags);
+            ++numDrained;
+        }
+
+        mEncoder->releaseOutputBuffer(bufferIndex);
+
+        if (flags & MediaCodec::BUFFER_FLAG_EOS) {
+            ALOGV("drained %d buffers from the encoder", numDrained);
+            return;
+        }
+    }
+
+    ALOGW("encoder did not drain in time (err %d), "
+          "in-flight frames are lost", err);
+}
+
 void Converter::notifyError(status_t err) {
     sp<AMessage> notify = mNotify->dup();
     notify->setInt32("what", kWhatError);
@@ -247,16 +371,7 @@ void Converter::notifyError(status_t err) {
 
 // static
 bool Converter::IsSilence(const sp<ABuffer> &accessUnit) {
-    const uint8_t *ptr = accessUnit->data();
-    const uint8_t *end = ptr + accessUnit->size();
-    while (ptr < end) {
-        if (*ptr != 0) {
-            return false;
-        }
-        ++ptr;
-    }
-
-    return true;
+    return PCMKernels::IsAllZero(accessUnit->data(), accessUnit->size());
 }
 
 void Converter::onMessageReceived(const sp<AMessage> &msg) {
@@ -383,6 +498,29 @@ void Converter::onMessageReceived(const sp<AMessage> &msg) {
             break;
         }
 
+        case kWhatSetVideoBitrate:
+        {
+            int32_t bitrate;
+            CHECK(msg->findInt32("bitrate", &bitrate));
+
+            if (mEncoder == NULL || !mIsVideo || bitrate == mVideoBitrate) {
+                break;
+            }
+
+            ALOGI("changing video bitrate from %d to %d bps",
+                  mVideoBitrate, bitrate);
+
+            mVideoBitrate = bitrate;
+
+            status_t err = reinitEncoder();
+
+            if (err != OK) {
+                ALOGE("failed to restart the encoder (err %d)", err);
+                notifyError(err);
+            }
+            break;
+        }
+
         case kWhatShutdown:
         {
             ALOGI("shutting down encoder");
@@ -435,12 +573,9 @@ status_t Converter::feedRawAudioInputBuffers() {
         sp<ABuffer> buffer = *mInputBufferQueue.begin();
         mInputBufferQueue.erase(mInputBufferQueue.begin());
 
-        int16_t *ptr = (int16_t *)buffer->data();
-        int16_t *stop = (int16_t *)(buffer->data() + buffer->size());
-        while (ptr < stop) {
-            *ptr = htons(*ptr);
-            ++ptr;
-        }
+        // Samples are byte swapped on their way into the LPCM access
+        // units below, which takes whole samples.
+        CHECK_EQ(buffer->size() % sizeof(int16_t), 0u);
 
         static const size_t kFrameSize = 2 * sizeof(int16_t);  // stereo
         static const size_t kFramesPerAU = 80;
@@ -456,9 +591,10 @@ status_t Converter::feedRawAudioInputBuffers() {
                 copy = bytesMissingForFullAU;
             }
 
-            memcpy(mPartialAudioAU->data() + mPartialAudioAU->size(),
-                   buffer->data(),
-                   copy);
+            PCMKernels::SwapCopy16(
+                    mPartialAudioAU->data() + mPartialAudioAU->size(),
+                    buffer->data(),
+                    copy / sizeof(int16_t));
 
             mPartialAudioAU->setRange(0, mPartialAudioAU->size() + copy);
 
@@ -505,7 +641,8 @@ status_t Converter::feedRawAudioInputBuffers() {
                 copy = partialAudioAU->size() - 4;
             }
 
-            memcpy(&ptr[4], buffer->data(), copy);
+            PCMKernels::SwapCopy16(
+                    &ptr[4], buffer->data(), copy / sizeof(int16_t));
 
             partialAudioAU->setRange(0, 4 + copy);
             buffer->setRange(buffer->offset() + copy, buffer->size() - copy);
@@ -620,24 +757,7 @@ status_t Converter::doMoreWork() {
             notify->setInt32("what", kWhatEOS);
             notify->post();
         } else {
-            sp<ABuffer> buffer = new ABuffer(size);
-            buffer->meta()->setInt64("timeUs", timeUs);
-
-            ALOGV("[%s] time %lld us (%.2f secs)",
-                  mIsVideo ? "video" : "audio", timeUs, timeUs / 1E6);
-
-            memcpy(buffer->data(),
-                   mEncoderOutputBuffers.itemAt(bufferIndex)->base() + offset,
-                   size);
-
-            if (flags & MediaCodec::BUFFER_FLAG_CODECCONFIG) {
-                mOutputFormat->setBuffer("csd-0", buffer);
-            } else {
-                sp<AMessage> notify = mNotify->dup();
-                notify->setInt32("what", kWhatAccessUnit);
-                notify->setBuffer("accessUnit", buffer);
-                notify->post();
-            }
+            onEncoderOutput(bufferIndex, offset, size, timeUs, flags);
         }
 
         mEncoder->releaseOutputBuffer(bufferIndex);
@@ -650,8 +770,55 @@ status_t Converter::doMoreWork() {
     return err;
 }
 
+void Converter::onEncoderOutput(
+        size_t bufferIndex, size_t offset, size_t size, int64_t timeUs,
+        uint32_t flags) {
+    sp<ABuffer> buffer = new ABuffer(size);
+    buffer->meta()->setInt64("timeUs", timeUs);
+
+    ALOGV("[%s] time %lld us (%.2f secs)",
+          mIsVideo ? "video" : "audio", timeUs, timeUs / 1E6);
+
+    memcpy(buffer->data(),
+           mEncoderOutputBuffers.itemAt(bufferIndex)->base() + offset,
+           size);
+
+    if (flags & MediaCodec::BUFFER_FLAG_CODECCONFIG) {
+        mOutputFormat->setBuffer("csd-0", buffer);
+
+        // A restarted encoder may come up with different parameter sets,
+        // anybody who cached the previous ones needs to know.
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("what", kWhatFormatChanged);
+        notify->setMessage("format", mOutputFormat->dup());
+        notify->post();
+        return;
+    }
+
+    // Input timestamps are capture times on the system clock.
+    mAccessUnitsMetric->increment();
+    mEncodeLatencyMetric->record(ALooper::GetNowUs() - timeUs);
+
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Mark(
+            LatencyTrace::kStageEncoded, (int32_t)timeUs, timeUs);
+    LatencyTrace::Stamp((int32_t)timeUs, buffer);
+#endif
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatAccessUnit);
+    notify->setBuffer("accessUnit", buffer);
+    notify->post();
+}
+
 void Converter::requestIDRFrame() {
     (new AMessage(kWhatRequestIDRFrame, id()))->post();
 }
 
+void Converter::setVideoBitrate(int32_t bitrate) {
+    sp<AMessage> msg = new AMessage(kWhatSetVideoBitrate, id());
+    msg->setInt32("bitrate", bitrate);
+    msg->post();
+}
+
 }  // namespace android
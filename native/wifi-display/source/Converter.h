@@ -18,6 +18,7 @@
 
 #define CONVERTER_H_
 
+#include "Metrics.h"
 #include "WifiDisplaySource.h"
 
 #include <media/stagefright/foundation/AHandler.h>
@@ -51,10 +52,17 @@ struct Converter : public AHandler {
 
     void requestIDRFrame();
 
+    // Takes effect asynchronously, the stream continues with an IDR frame
+    // at the new bitrate.
+    void setVideoBitrate(int32_t bitrate);
+
     enum {
         kWhatAccessUnit,
         kWhatEOS,
         kWhatError,
+        // The encoder emitted (new) codec specific data, "format" is the
+        // updated output format.
+        kWhatFormatChanged,
     };
 
     enum {
@@ -63,6 +71,7 @@ struct Converter : public AHandler {
         kWhatShutdown,
         kWhatMediaPullerNotify,
         kWhatEncoderActivity,
+        kWhatSetVideoBitrate,
     };
 
     void shutdownAsync();
@@ -81,6 +90,9 @@ private:
     sp<AMessage> mOutputFormat;
     bool mNeedToManuallyPrependSPSPPS;
 
+    // 0 until initEncoder() picked up the configured default.
+    int32_t mVideoBitrate;
+
     sp<MediaCodec> mEncoder;
     sp<AMessage> mEncoderActivityNotify;
 
@@ -100,13 +112,26 @@ private:
 
     sp<ABuffer> mPartialAudioAU;
 
+    MetricsRegistry::Counter *mAccessUnitsMetric;
+    MetricsRegistry::Histogram *mEncodeLatencyMetric;
+    MetricsRegistry::Gauge *mBitrateMetric;
+
     status_t initEncoder();
+    status_t reinitEncoder();
+
+    // Signals EOS to the encoder and passes on all output it still holds.
+    void drainEncoder();
 
     status_t feedEncoderInputBuffers();
 
     void scheduleDoMoreWork();
     status_t doMoreWork();
 
+    // Handles an output buffer other than EOS.
+    void onEncoderOutput(
+            size_t bufferIndex, size_t offset, size_t size, int64_t timeUs,
+            uint32_t flags);
+
     void notifyError(status_t err);
 
     // Packetizes raw PCM audio data available in mInputBufferQueue
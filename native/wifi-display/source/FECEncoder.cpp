@@ -0,0 +1,187 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "FECEncoder"
+#include <utils/Log.h>
+
+#include "FECEncoder.h"
+
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/Utils.h>
+
+namespace android {
+
+FECEncoder::Accumulator::Accumulator()
+    : mNumPackets(0),
+      mSNBase(0),
+      mLengthRecovery(0),
+      mPTRecovery(0),
+      mTSRecovery(0),
+      mMaxPayloadSize(0) {
+}
+
+FECEncoder::FECEncoder(size_t numColumns, size_t numRows, uint32_t ssrc)
+    : mNumColumns(numColumns),
+      mNumRows(numRows),
+      mSSRC(ssrc),
+      mSeqNo(0),
+      mMatrixIndex(0),
+      mColumns(NULL) {
+    // offset and NA are transmitted as 8 bit quantities.
+    CHECK(numColumns >= 1 && numColumns <= 255);
+    CHECK(numRows >= 1 && numRows <= 255);
+
+    if (mNumRows > 1) {
+        mColumns = new Accumulator[mNumColumns];
+    }
+}
+
+FECEncoder::~FECEncoder() {
+    delete[] mColumns;
+    mColumns = NULL;
+}
+
+void FECEncoder::addMediaPacket(
+        const uint8_t *rtp, const uint8_t *payload, size_t payloadSize,
+        List<sp<ABuffer> > *fecPackets) {
+    CHECK_LE(payloadSize, kMaxPayloadSize);
+
+    size_t column = mMatrixIndex % mNumColumns;
+
+    Accumulate(&mRow, rtp, payload, payloadSize);
+
+    if (mColumns != NULL) {
+        Accumulate(&mColumns[column], rtp, payload, payloadSize);
+    }
+
+    uint32_t rtpTime = U32_AT(&rtp[4]);
+
+    if (column + 1 == mNumColumns) {
+        fecPackets->push_back(finish(&mRow, true /* isRow */, rtpTime));
+    }
+
+    if (++mMatrixIndex < mNumColumns * mNumRows) {
+        return;
+    }
+
+    mMatrixIndex = 0;
+
+    if (mColumns == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < mNumColumns; ++i) {
+        fecPackets->push_back(
+                finish(&mColumns[i], false /* isRow */, rtpTime));
+    }
+}
+
+// static
+void FECEncoder::Accumulate(
+        Accumulator *acc, const uint8_t *rtp,
+        const uint8_t *payload, size_t payloadSize) {
+    if (acc->mNumPackets == 0) {
+        acc->mSNBase = U16_AT(&rtp[2]);
+        acc->mLengthRecovery = 0;
+        acc->mPTRecovery = 0;
+        acc->mTSRecovery = 0;
+        acc->mMaxPayloadSize = 0;
+    }
+
+    if (payloadSize > acc->mMaxPayloadSize) {
+        // Whatever lies beyond the previous maximum is implicitly padded
+        // with zeros in all packets seen so far.
+        memset(&acc->mPayload[acc->mMaxPayloadSize],
+               0,
+               payloadSize - acc->mMaxPayloadSize);
+
+        acc->mMaxPayloadSize = payloadSize;
+    }
+
+    for (size_t i = 0; i < payloadSize; ++i) {
+        acc->mPayload[i] ^= payload[i];
+    }
+
+    acc->mLengthRecovery ^= payloadSize;
+    acc->mPTRecovery ^= rtp[1] & 0x7f;
+    acc->mTSRecovery ^= U32_AT(&rtp[4]);
+
+    ++acc->mNumPackets;
+}
+
+sp<ABuffer> FECEncoder::finish(
+        Accumulator *acc, bool isRow, uint32_t rtpTime) {
+    CHECK_GT(acc->mNumPackets, 0u);
+
+    sp<ABuffer> packet = new ABuffer(12 + 16 + acc->mMaxPayloadSize);
+    uint8_t *data = packet->data();
+
+    data[0] = 0x80;
+    data[1] = kPayloadType;
+    data[2] = mSeqNo >> 8;
+    data[3] = mSeqNo & 0xff;
+    ++mSeqNo;
+
+    data[4] = rtpTime >> 24;
+    data[5] = (rtpTime >> 16) & 0xff;
+    data[6] = (rtpTime >> 8) & 0xff;
+    data[7] = rtpTime & 0xff;
+
+    data[8] = mSSRC >> 24;
+    data[9] = (mSSRC >> 16) & 0xff;
+    data[10] = (mSSRC >> 8) & 0xff;
+    data[11] = mSSRC & 0xff;
+
+    uint8_t *fec = &data[12];
+
+    fec[0] = acc->mSNBase >> 8;
+    fec[1] = acc->mSNBase & 0xff;
+    fec[2] = acc->mLengthRecovery >> 8;
+    fec[3] = acc->mLengthRecovery & 0xff;
+
+    // E bit is always set, the mask is unused in favour of offset/NA.
+    fec[4] = 0x80 | acc->mPTRecovery;
+    fec[5] = 0;
+    fec[6] = 0;
+    fec[7] = 0;
+
+    fec[8] = acc->mTSRecovery >> 24;
+    fec[9] = (acc->mTSRecovery >> 16) & 0xff;
+    fec[10] = (acc->mTSRecovery >> 8) & 0xff;
+    fec[11] = acc->mTSRecovery & 0xff;
+
+    // N = 0, D = 1 for rows (second FEC stream), type 0 = XOR, index 0.
+    fec[12] = isRow ? 0x40 : 0x00;
+    fec[13] = isRow ? 1 : mNumColumns;
+    fec[14] = acc->mNumPackets;
+    fec[15] = 0;  // SNBase ext bits
+
+    memcpy(&fec[16], acc->mPayload, acc->mMaxPayloadSize);
+
+    ALOGV("%s FEC packet, SNBase %u, NA %d, %d bytes",
+          isRow ? "row" : "column",
+          acc->mSNBase,
+          acc->mNumPackets,
+          acc->mMaxPayloadSize);
+
+    acc->mNumPackets = 0;
+
+    return packet;
+}
+
+}  // namespace android
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FEC_ENCODER_H_
+
+#define FEC_ENCODER_H_
+
+#include <media/stagefright/foundation/ABase.h>
+#include <utils/List.h>
+#include <utils/RefBase.h>
+
+namespace android {
+
+struct ABuffer;
+
+// Generates SMPTE 2022-1 style XOR parity packets over a matrix of
+// "numColumns" x "numRows" consecutive RTP media packets. A row FEC packet
+// is emitted as soon as a row of the matrix is complete, one FEC packet per
+// column once the whole matrix has been sent. With numRows == 1 only row
+// FEC is produced.
+// FEC packets share the SSRC of the media stream, are told apart by their
+// payload type and carry their own sequence number space.
+struct FECEncoder : public RefBase {
+    enum {
+        kPayloadType = 96,
+    };
+
+    FECEncoder(size_t numColumns, size_t numRows, uint32_t ssrc);
+
+    // "rtp" is the 12 byte header (no CSRCs) of a media RTP packet that
+    // was just handed to the network, "payload" its payload, which need not
+    // follow the header in memory. Any FEC packets completed by it are
+    // appended to "fecPackets".
+    void addMediaPacket(
+            const uint8_t *rtp, const uint8_t *payload, size_t payloadSize,
+            List<sp<ABuffer> > *fecPackets);
+
+    size_t numColumns() const { return mNumColumns; }
+    size_t numRows() const { return mNumRows; }
+
+protected:
+    virtual ~FECEncoder();
+
+private:
+    static const size_t kMaxPayloadSize = 1500 - 12;
+
+    struct Accumulator {
+        Accumulator();
+
+        size_t mNumPackets;
+        uint16_t mSNBase;
+        uint16_t mLengthRecovery;
+        uint8_t mPTRecovery;
+        uint32_t mTSRecovery;
+        size_t mMaxPayloadSize;
+        uint8_t mPayload[kMaxPayloadSize];
+    };
+
+    size_t mNumColumns;
+    size_t mNumRows;
+    uint32_t mSSRC;
+
+    uint16_t mSeqNo;
+    size_t mMatrixIndex;
+
+    Accumulator mRow;
+    Accumulator *mColumns;
+
+    static void Accumulate(
+            Accumulator *acc, const uint8_t *rtp,
+            const uint8_t *payload, size_t payloadSize);
+
+    sp<ABuffer> finish(
+            Accumulator *acc, bool isRow, uint32_t rtpTime);
+
+    DISALLOW_EVIL_CONSTRUCTORS(FECEncoder);
+};
+
+}  // namespace android
+
+#endif  // FEC_ENCODER_H_
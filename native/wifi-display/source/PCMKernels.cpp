@@ -0,0 +1,256 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "PCMKernels"
+#include <utils/Log.h>
+
+#include "PCMKernels.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#include <fcntl.h>
+#include <unistd.h>
+#elif defined(__SSE2__)
+#include <cpuid.h>
+#include <emmintrin.h>
+#endif
+
+namespace android {
+
+static void SwapCopy16Portable(
+        uint8_t *dst, const uint8_t *src, size_t numSamples) {
+    // Two samples at a time, read before written in case dst == src.
+    while (numSamples >= 2) {
+        uint32_t x;
+        memcpy(&x, src, sizeof(x));
+        x = ((x & 0x00ff00ff) << 8) | ((x >> 8) & 0x00ff00ff);
+        memcpy(dst, &x, sizeof(x));
+
+        src += 4;
+        dst += 4;
+        numSamples -= 2;
+    }
+
+    if (numSamples > 0) {
+        uint8_t lo = src[0];
+        dst[0] = src[1];
+        dst[1] = lo;
+    }
+}
+
+static bool IsAllZeroPortable(const uint8_t *ptr, size_t size) {
+    while (size > 0 && ((uintptr_t)ptr & 3) != 0) {
+        if (*ptr != 0) {
+            return false;
+        }
+        ++ptr;
+        --size;
+    }
+
+    const uint32_t *words = (const uint32_t *)ptr;
+    while (size >= 16) {
+        if ((words[0] | words[1] | words[2] | words[3]) != 0) {
+            return false;
+        }
+        words += 4;
+        size -= 16;
+    }
+
+    ptr = (const uint8_t *)words;
+    while (size > 0) {
+        if (*ptr != 0) {
+            return false;
+        }
+        ++ptr;
+        --size;
+    }
+
+    return true;
+}
+
+#if defined(__ARM_NEON__)
+
+static void SwapCopy16NEON(
+        uint8_t *dst, const uint8_t *src, size_t numSamples) {
+    while (numSamples >= 16) {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 16);
+        vst1q_u8(dst, vrev16q_u8(a));
+        vst1q_u8(dst + 16, vrev16q_u8(b));
+
+        src += 32;
+        dst += 32;
+        numSamples -= 16;
+    }
+
+    SwapCopy16Portable(dst, src, numSamples);
+}
+
+static bool IsAllZeroNEON(const uint8_t *ptr, size_t size) {
+    while (size >= 64) {
+        uint8x16_t acc =
+            vorrq_u8(
+                    vorrq_u8(vld1q_u8(ptr), vld1q_u8(ptr + 16)),
+                    vorrq_u8(vld1q_u8(ptr + 32), vld1q_u8(ptr + 48)));
+
+        uint32x2_t folded =
+            vreinterpret_u32_u8(vorr_u8(vget_low_u8(acc), vget_high_u8(acc)));
+
+        if ((vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1)) != 0) {
+            return false;
+        }
+
+        ptr += 64;
+        size -= 64;
+    }
+
+    return IsAllZeroPortable(ptr, size);
+}
+
+// Builds for NEON capable CPUs still end up on some that aren't (Tegra 2),
+// the kernel tells us through the AT_HWCAP auxiliary vector entry.
+static bool CPUHasNEON() {
+    static const unsigned long kAT_NULL = 0;
+    static const unsigned long kAT_HWCAP = 16;
+    static const unsigned long kHWCAP_NEON = 1ul << 12;
+
+    int fd = open("/proc/self/auxv", O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    bool hasNEON = false;
+
+    unsigned long entry[2];
+    while (read(fd, entry, sizeof(entry)) == (ssize_t)sizeof(entry)
+            && entry[0] != kAT_NULL) {
+        if (entry[0] == kAT_HWCAP) {
+            hasNEON = (entry[1] & kHWCAP_NEON) != 0;
+            break;
+        }
+    }
+
+    close(fd);
+
+    return hasNEON;
+}
+
+#elif defined(__SSE2__)
+
+static void SwapCopy16SSE2(
+        uint8_t *dst, const uint8_t *src, size_t numSamples) {
+    while (numSamples >= 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+
+        a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+
+        _mm_storeu_si128((__m128i *)dst, a);
+        _mm_storeu_si128((__m128i *)(dst + 16), b);
+
+        src += 32;
+        dst += 32;
+        numSamples -= 16;
+    }
+
+    SwapCopy16Portable(dst, src, numSamples);
+}
+
+static bool IsAllZeroSSE2(const uint8_t *ptr, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+
+    while (size >= 64) {
+        __m128i acc =
+            _mm_or_si128(
+                    _mm_or_si128(
+                        _mm_loadu_si128((const __m128i *)ptr),
+                        _mm_loadu_si128((const __m128i *)(ptr + 16))),
+                    _mm_or_si128(
+                        _mm_loadu_si128((const __m128i *)(ptr + 32)),
+                        _mm_loadu_si128((const __m128i *)(ptr + 48))));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+            return false;
+        }
+
+        ptr += 64;
+        size -= 64;
+    }
+
+    return IsAllZeroPortable(ptr, size);
+}
+
+static bool CPUHasSSE2() {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+
+    return (edx & bit_SSE2) != 0;
+}
+
+#endif
+
+static pthread_once_t gInitOnce = PTHREAD_ONCE_INIT;
+
+static void (*gSwapCopy16)(uint8_t *, const uint8_t *, size_t) =
+    SwapCopy16Portable;
+
+static bool (*gIsAllZero)(const uint8_t *, size_t) = IsAllZeroPortable;
+
+// static
+void PCMKernels::Init() {
+    const char *name = "portable";
+
+#if defined(__ARM_NEON__)
+    if (CPUHasNEON()) {
+        gSwapCopy16 = SwapCopy16NEON;
+        gIsAllZero = IsAllZeroNEON;
+        name = "NEON";
+    }
+#elif defined(__SSE2__)
+    if (CPUHasSSE2()) {
+        gSwapCopy16 = SwapCopy16SSE2;
+        gIsAllZero = IsAllZeroSSE2;
+        name = "SSE2";
+    }
+#endif
+
+    ALOGI("using %s PCM kernels", name);
+}
+
+// static
+void PCMKernels::SwapCopy16(void *dst, const void *src, size_t numSamples) {
+    pthread_once(&gInitOnce, Init);
+
+    gSwapCopy16((uint8_t *)dst, (const uint8_t *)src, numSamples);
+}
+
+// static
+bool PCMKernels::IsAllZero(const void *data, size_t size) {
+    pthread_once(&gInitOnce, Init);
+
+    return gIsAllZero((const uint8_t *)data, size);
+}
+
+}  // namespace android
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2012, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PCM_KERNELS_H_
+
+#define PCM_KERNELS_H_
+
+#include <media/stagefright/foundation/ABase.h>
+
+#include <sys/types.h>
+
+namespace android {
+
+// The inner loops of the LPCM path, which runs for as long as a session
+// does. NEON (ARM) or SSE2 (x86) versions are used if the build has them
+// and the CPU we find ourselves on supports them, portable word-at-a-time
+// versions otherwise.
+struct PCMKernels {
+    // Copies "numSamples" 16-bit samples from "src" to "dst", swapping the
+    // bytes of each, i.e. from our (little endian) byte order to that of
+    // the LPCM stream. "dst" and "src" are either the same or don't
+    // overlap, neither needs to be aligned.
+    static void SwapCopy16(void *dst, const void *src, size_t numSamples);
+
+    // Returns true iff all "size" bytes at "data" are zero.
+    static bool IsAllZero(const void *data, size_t size);
+
+private:
+    static void Init();
+
+    DISALLOW_EVIL_CONSTRUCTORS(PCMKernels);
+};
+
+}  // namespace android
+
+#endif  // PCM_KERNELS_H_
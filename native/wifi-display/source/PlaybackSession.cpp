@@ -21,6 +21,7 @@
 #include "PlaybackSession.h"
 
 #include "Converter.h"
+#include "LatencyTrace.h"
 #include "MediaPuller.h"
 #include "RepeaterSource.h"
 #include "Sender.h"
@@ -29,6 +30,7 @@
 #include "WifiDisplaySource.h"
 
 #include <binder/IServiceManager.h>
+#include <cutils/properties.h>
 #include <gui/ISurfaceComposer.h>
 #include <gui/SurfaceComposerClient.h>
 #include <media/IHDCP.h>
@@ -50,6 +52,8 @@
 
 #include <OMX_IVCommon.h>
 
+#include <arpa/inet.h>
+
 namespace android {
 
 struct WifiDisplaySource::PlaybackSession::Track : public AHandler {
@@ -91,7 +95,12 @@ struct WifiDisplaySource::PlaybackSession::Track : public AHandler {
         return mQueuedOutputBuffers.size();
     }
 
+    MetricsRegistry::Histogram *packetizeLatencyMetric() const {
+        return mPacketizeLatencyMetric;
+    }
+
     void requestIDRFrame();
+    void setVideoBitrate(int32_t bitrate);
 
 protected:
     virtual void onMessageReceived(const sp<AMessage> &msg);
@@ -114,6 +123,7 @@ private:
     sp<RepeaterSource> mRepeaterSource;
     List<sp<ABuffer> > mQueuedOutputBuffers;
     int64_t mLastOutputBufferQueuedTimeUs;
+    MetricsRegistry::Histogram *mPacketizeLatencyMetric;
 
     static bool IsAudioFormat(const sp<AMessage> &format);
 
@@ -135,6 +145,10 @@ WifiDisplaySource::PlaybackSession::Track::Track(
       mPacketizerTrackIndex(-1),
       mIsAudio(IsAudioFormat(mConverter->getOutputFormat())),
       mLastOutputBufferQueuedTimeUs(-1ll) {
+    mPacketizeLatencyMetric = MetricsRegistry::Get()->histogram(
+            mIsAudio
+                ? "source.audio.packetize_latency_us"
+                : "source.video.packetize_latency_us");
 }
 
 WifiDisplaySource::PlaybackSession::Track::~Track() {
@@ -265,6 +279,20 @@ void WifiDisplaySource::PlaybackSession::Track::requestIDRFrame() {
     mConverter->requestIDRFrame();
 }
 
+void WifiDisplaySource::PlaybackSession::Track::setVideoBitrate(
+        int32_t bitrate) {
+    if (mIsAudio) {
+        return;
+    }
+
+    // Make sure the restarted encoder gets a frame to open with.
+    if (mRepeaterSource != NULL) {
+        mRepeaterSource->wakeUp();
+    }
+
+    mConverter->setVideoBitrate(bitrate);
+}
+
 bool WifiDisplaySource::PlaybackSession::Track::hasOutputBuffer(
         int64_t *timeUs) const {
     *timeUs = 0ll;
@@ -315,12 +343,116 @@ bool WifiDisplaySource::PlaybackSession::Track::isSuspended() const {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Encrypts video access units in place on its own looper, so that
+// encrypting the next frame overlaps with packetizing and sending the
+// previous one and audio isn't held up by large IDR frames. Access units
+// are encrypted and handed back in the order they were queued, which
+// keeps the inputCTR sequence of the stream intact.
+struct WifiDisplaySource::PlaybackSession::HDCPEncrypter : public AHandler {
+    enum {
+        kWhatEncrypted,
+        kWhatError,
+    };
+
+    HDCPEncrypter(const sp<AMessage> &notify, const sp<IHDCP> &hdcp);
+
+    // "accessUnit" comes back with a kWhatEncrypted notification, its
+    // "inputCTR" meta data set.
+    void encrypt(size_t trackIndex, const sp<ABuffer> &accessUnit);
+
+protected:
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+    virtual ~HDCPEncrypter();
+
+private:
+    enum {
+        kWhatEncrypt,
+    };
+
+    sp<AMessage> mNotify;
+    sp<IHDCP> mHDCP;
+    MetricsRegistry::Histogram *mEncryptTimeMetric;
+
+    DISALLOW_EVIL_CONSTRUCTORS(HDCPEncrypter);
+};
+
+WifiDisplaySource::PlaybackSession::HDCPEncrypter::HDCPEncrypter(
+        const sp<AMessage> &notify, const sp<IHDCP> &hdcp)
+    : mNotify(notify),
+      mHDCP(hdcp),
+      mEncryptTimeMetric(
+              MetricsRegistry::Get()->histogram("source.hdcp.encrypt_us")) {
+}
+
+WifiDisplaySource::PlaybackSession::HDCPEncrypter::~HDCPEncrypter() {
+}
+
+void WifiDisplaySource::PlaybackSession::HDCPEncrypter::encrypt(
+        size_t trackIndex, const sp<ABuffer> &accessUnit) {
+    sp<AMessage> msg = new AMessage(kWhatEncrypt, id());
+    msg->setSize("trackIndex", trackIndex);
+    msg->setBuffer("accessUnit", accessUnit);
+    msg->post();
+}
+
+void WifiDisplaySource::PlaybackSession::HDCPEncrypter::onMessageReceived(
+        const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatEncrypt:
+        {
+            size_t trackIndex;
+            CHECK(msg->findSize("trackIndex", &trackIndex));
+
+            sp<ABuffer> accessUnit;
+            CHECK(msg->findBuffer("accessUnit", &accessUnit));
+
+            int64_t startUs = ALooper::GetNowUs();
+
+            uint64_t inputCTR;
+            status_t err = mHDCP->encrypt(
+                    accessUnit->data(), accessUnit->size(),
+                    trackIndex  /* streamCTR */,
+                    &inputCTR,
+                    accessUnit->data());
+
+            mEncryptTimeMetric->record(ALooper::GetNowUs() - startUs);
+
+            sp<AMessage> notify = mNotify->dup();
+
+            if (err != OK) {
+                ALOGE("Failed to HDCP-encrypt media data (err %d)", err);
+
+                notify->setInt32("what", kWhatError);
+                notify->setInt32("err", err);
+                notify->post();
+                break;
+            }
+
+            accessUnit->meta()->setInt64("inputCTR", inputCTR);
+
+            notify->setInt32("what", kWhatEncrypted);
+            notify->setSize("trackIndex", trackIndex);
+            notify->setBuffer("accessUnit", accessUnit);
+            notify->post();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 WifiDisplaySource::PlaybackSession::PlaybackSession(
         const sp<ANetworkSession> &netSession,
         const sp<AMessage> &notify,
         const in_addr &interfaceAddr,
         const sp<IHDCP> &hdcp)
     : mNetSession(netSession),
+      mPrimarySenderID(0),
+      mNextSenderID(1),
+      mStarted(false),
       mNotify(notify),
       mInterfaceAddr(interfaceAddr),
       mHDCP(hdcp),
@@ -328,21 +460,35 @@ WifiDisplaySource::PlaybackSession::PlaybackSession(
       mLastLifesignUs(),
       mVideoTrackIndex(-1),
       mPrevTimeUs(-1ll),
+      mDrainAccessUnitsPending(false),
       mAllTracksHavePacketizerIndex(false) {
 }
 
 status_t WifiDisplaySource::PlaybackSession::init(
         const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
         Sender::TransportMode transportMode,
-        bool usePCMAudio) {
+        bool usePCMAudio,
+        size_t fecColumns,
+        size_t fecRows) {
     status_t err = setupPacketizer(usePCMAudio);
 
     if (err != OK) {
         return err;
     }
 
-    sp<AMessage> notify = new AMessage(kWhatSenderNotify, id());
-    mSender = new Sender(mNetSession, notify);
+    if (mHDCP != NULL) {
+        mEncrypterLooper = new ALooper;
+        mEncrypterLooper->setName("hdcp_encrypter_looper");
+
+        mEncrypterLooper->start(
+                false /* runOnCallingThread */,
+                false /* canCallJava */,
+                PRIORITY_AUDIO);
+
+        sp<AMessage> notify = new AMessage(kWhatEncrypterNotify, id());
+        mEncrypter = new HDCPEncrypter(notify, mHDCP);
+        mEncrypterLooper->registerHandler(mEncrypter);
+    }
 
     mSenderLooper = new ALooper;
     mSenderLooper->setName("sender_looper");
@@ -352,24 +498,163 @@ status_t WifiDisplaySource::PlaybackSession::init(
             false /* canCallJava */,
             PRIORITY_AUDIO);
 
-    mSenderLooper->registerHandler(mSender);
+    int32_t rtspSessionID = 0;
+    if (transportMode == Sender::TRANSPORT_TCP_INTERLEAVED) {
+        CHECK(mNotify->findInt32("sessionID", &rtspSessionID));
+    }
 
-    err = mSender->init(clientIP, clientRtp, clientRtcp, transportMode);
+    err = addSender(
+            clientIP, clientRtp, clientRtcp, transportMode, rtspSessionID,
+            fecColumns, fecRows, &mPrimarySenderID);
 
     if (err != OK) {
         return err;
     }
 
+    addExtraSinks(fecColumns, fecRows);
+
     updateLiveness();
 
     return OK;
 }
 
+status_t WifiDisplaySource::PlaybackSession::addSender(
+        const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
+        Sender::TransportMode transportMode,
+        int32_t rtspSessionID,
+        size_t fecColumns,
+        size_t fecRows,
+        int32_t *senderID) {
+    int32_t newSenderID = mNextSenderID++;
+
+    sp<AMessage> notify = new AMessage(kWhatSenderNotify, id());
+    notify->setInt32("senderID", newSenderID);
+
+    sp<Sender> sender = new Sender(mNetSession, notify);
+
+    if (fecColumns > 0 && transportMode == Sender::TRANSPORT_UDP) {
+        sender->enableFEC(fecColumns, fecRows);
+    }
+
+    struct in_addr addr;
+    if (transportMode == Sender::TRANSPORT_UDP
+            && inet_aton(clientIP, &addr) != 0
+            && IN_MULTICAST(ntohl(addr.s_addr))) {
+        int ttl = 1;
+
+        char val[PROPERTY_VALUE_MAX];
+        if (property_get("media.wfd.source.multicast-ttl", val, NULL)) {
+            char *end;
+            unsigned long x = strtoul(val, &end, 10);
+
+            if (*end == '\0' && end > val && x > 0 && x < 256) {
+                ttl = x;
+            }
+        }
+
+        sender->enableMulticast(mInterfaceAddr, ttl);
+    }
+
+    mSenderLooper->registerHandler(sender);
+
+    status_t err = sender->init(
+            clientIP, clientRtp, clientRtcp, transportMode, rtspSessionID);
+
+    if (err == OK && mStarted) {
+        // Joining a session that's already under way.
+        err = sender->finishInit();
+    }
+
+    if (err != OK) {
+        mSenderLooper->unregisterHandler(sender->id());
+        return err;
+    }
+
+    SenderInfo info;
+    info.mSender = sender;
+    info.mFractionLost = 0;
+    info.mJitter = 0;
+    info.mBandwidthEstimate = -1ll;
+    mSenders.add(newSenderID, info);
+
+    ALOGI("sender %d streams to %s:%d, %d sender(s) in this session",
+          newSenderID, clientIP, clientRtp, mSenders.size());
+
+    *senderID = newSenderID;
+
+    return OK;
+}
+
+void WifiDisplaySource::PlaybackSession::removeSender(int32_t senderID) {
+    CHECK_NE(senderID, mPrimarySenderID);
+
+    ssize_t index = mSenders.indexOfKey(senderID);
+
+    if (index < 0) {
+        return;
+    }
+
+    mSenderLooper->unregisterHandler(
+            mSenders.valueAt(index).mSender->id());
+
+    mSenders.removeItemsAt(index);
+
+    ALOGI("sender %d removed, %d sender(s) left", senderID, mSenders.size());
+}
+
+void WifiDisplaySource::PlaybackSession::addExtraSinks(
+        size_t fecColumns, size_t fecRows) {
+    char val[PROPERTY_VALUE_MAX];
+    if (!property_get("media.wfd.source.extra-sinks", val, NULL)) {
+        return;
+    }
+
+    // "host:port[,host:port...]", RTCP goes to port + 1 and the receivers
+    // are expected to use the FEC matrix negotiated with our client.
+    char *entry = val;
+    while (entry != NULL && *entry != '\0') {
+        char *next = strchr(entry, ',');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+
+        char *colon = strchr(entry, ':');
+        unsigned long port = 0;
+
+        if (colon != NULL) {
+            *colon = '\0';
+
+            char *end;
+            port = strtoul(colon + 1, &end, 10);
+
+            if (*end != '\0' || end == colon + 1 || port > 65534) {
+                port = 0;
+            }
+        }
+
+        if (port == 0) {
+            ALOGW("ignoring malformed extra sink '%s'", entry);
+        } else {
+            int32_t senderID;
+            status_t err = addSender(
+                    entry, port, port + 1, Sender::TRANSPORT_UDP,
+                    0 /* rtspSessionID */, fecColumns, fecRows, &senderID);
+
+            if (err != OK) {
+                ALOGW("unable to stream to extra sink %s:%lu (%d)",
+                      entry, port, err);
+            }
+        }
+
+        entry = next;
+    }
+}
+
 WifiDisplaySource::PlaybackSession::~PlaybackSession() {
 }
 
 int32_t WifiDisplaySource::PlaybackSession::getRTPPort() const {
-    return mSender->getRTPPort();
+    return mSenders.valueFor(mPrimarySenderID).mSender->getRTPPort();
 }
 
 int64_t WifiDisplaySource::PlaybackSession::getLastLifesignUs() const {
@@ -393,11 +678,21 @@ status_t WifiDisplaySource::PlaybackSession::finishPlay() {
 }
 
 status_t WifiDisplaySource::PlaybackSession::onFinishPlay() {
-    return mSender->finishInit();
+    mStarted = true;
+
+    for (size_t i = 0; i < mSenders.size(); ++i) {
+        status_t err = mSenders.valueAt(i).mSender->finishInit();
+
+        if (err != OK) {
+            return err;
+        }
+    }
+
+    return OK;
 }
 
 status_t WifiDisplaySource::PlaybackSession::onFinishPlay2() {
-    mSender->scheduleSendSR();
+    mSenders.valueFor(mPrimarySenderID).mSender->scheduleSendSR();
 
     for (size_t i = 0; i < mTracks.size(); ++i) {
         CHECK_EQ((status_t)OK, mTracks.editValueAt(i)->start());
@@ -478,10 +773,25 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
                     break;
                 }
 
-                track->queueOutputBuffer(accessUnit);
+                queueOutputBuffer(trackIndex, accessUnit);
 
                 drainAccessUnits();
                 break;
+            } else if (what == Converter::kWhatFormatChanged) {
+                const sp<Track> &track = mTracks.valueFor(trackIndex);
+
+                ssize_t packetizerTrackIndex = track->packetizerTrackIndex();
+
+                if (packetizerTrackIndex < 0) {
+                    // The packetizer track will be created from the
+                    // converter's current output format.
+                    break;
+                }
+
+                sp<AMessage> format;
+                CHECK(msg->findMessage("format", &format));
+
+                mPacketizer->updateCSD(packetizerTrackIndex, format);
             } else if (what == Converter::kWhatEOS) {
                 CHECK_EQ(what, (status_t)Converter::kWhatEOS);
 
@@ -517,10 +827,34 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
             int32_t what;
             CHECK(msg->findInt32("what", &what));
 
+            int32_t senderID;
+            CHECK(msg->findInt32("senderID", &senderID));
+
+            if (mSenders.indexOfKey(senderID) < 0) {
+                // Removed in the meantime.
+                break;
+            }
+
             if (what == Sender::kWhatInitDone) {
-                onFinishPlay2();
+                if (senderID == mPrimarySenderID) {
+                    onFinishPlay2();
+                } else {
+                    mSenders.valueFor(senderID).mSender->scheduleSendSR();
+
+                    // The newcomer can't decode anything before the next
+                    // IDR frame.
+                    requestIDRFrame();
+                }
             } else if (what == Sender::kWhatSessionDead) {
-                notifySessionDead();
+                if (senderID == mPrimarySenderID) {
+                    notifySessionDead();
+                } else {
+                    ALOGW("sender %d lost its receiver", senderID);
+                    removeSender(senderID);
+                }
+            } else if (what == Sender::kWhatReceiverReport
+                    || what == Sender::kWhatBandwidthEstimate) {
+                onSenderFeedback(senderID, what, msg);
             } else {
                 TRESPASS();
             }
@@ -534,6 +868,52 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
             break;
         }
 
+        case kWhatDrainAccessUnits:
+        {
+            mDrainAccessUnitsPending = false;
+
+            if (mWeAreDead) {
+                break;
+            }
+
+            drainAccessUnits();
+            break;
+        }
+
+        case kWhatEncrypterNotify:
+        {
+            if (mWeAreDead) {
+                break;
+            }
+
+            int32_t what;
+            CHECK(msg->findInt32("what", &what));
+
+            if (what == HDCPEncrypter::kWhatError) {
+                notifySessionDead();
+                break;
+            }
+
+            CHECK_EQ(what, (int32_t)HDCPEncrypter::kWhatEncrypted);
+
+            size_t trackIndex;
+            CHECK(msg->findSize("trackIndex", &trackIndex));
+
+            sp<ABuffer> accessUnit;
+            CHECK(msg->findBuffer("accessUnit", &accessUnit));
+
+            ssize_t index = mTracks.indexOfKey(trackIndex);
+            if (index < 0) {
+                // The track is gone by now.
+                break;
+            }
+
+            mTracks.valueAt(index)->queueOutputBuffer(accessUnit);
+
+            drainAccessUnits();
+            break;
+        }
+
         case kWhatTrackNotify:
         {
             int32_t what;
@@ -555,10 +935,19 @@ void WifiDisplaySource::PlaybackSession::onMessageReceived(
                     break;
                 }
 
-                mSenderLooper->unregisterHandler(mSender->id());
-                mSender.clear();
+                for (size_t i = 0; i < mSenders.size(); ++i) {
+                    mSenderLooper->unregisterHandler(
+                            mSenders.valueAt(i).mSender->id());
+                }
+                mSenders.clear();
                 mSenderLooper.clear();
 
+                if (mEncrypter != NULL) {
+                    mEncrypterLooper->unregisterHandler(mEncrypter->id());
+                    mEncrypter.clear();
+                    mEncrypterLooper.clear();
+                }
+
                 mPacketizer.clear();
 
                 sp<AMessage> notify = mNotify->dup();
@@ -762,6 +1151,68 @@ int32_t WifiDisplaySource::PlaybackSession::height() const {
 #endif
 }
 
+void WifiDisplaySource::PlaybackSession::onSenderFeedback(
+        int32_t senderID, int32_t what, const sp<AMessage> &msg) {
+    if (mVideoTrackIndex < 0) {
+        return;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+
+    SenderInfo *info = &mSenders.editValueFor(senderID);
+
+    // There's only the one encoder, it has to run at a bitrate the
+    // receiver faring worst can cope with.
+    bool changed;
+    if (what == Sender::kWhatReceiverReport) {
+        CHECK(msg->findInt32("fractionLost", &info->mFractionLost));
+        CHECK(msg->findInt32("jitter", &info->mJitter));
+
+        int32_t fractionLost = 0;
+        int32_t jitter = 0;
+        for (size_t i = 0; i < mSenders.size(); ++i) {
+            const SenderInfo &other = mSenders.valueAt(i);
+
+            if (other.mFractionLost > fractionLost) {
+                fractionLost = other.mFractionLost;
+            }
+
+            if (other.mJitter > jitter) {
+                jitter = other.mJitter;
+            }
+        }
+
+        changed = mBitrateController.onReceiverReport(
+                nowUs, fractionLost, jitter);
+    } else {
+        CHECK(msg->findInt64("bitrate", &info->mBandwidthEstimate));
+
+        int64_t bitrate = info->mBandwidthEstimate;
+        for (size_t i = 0; i < mSenders.size(); ++i) {
+            const SenderInfo &other = mSenders.valueAt(i);
+
+            if (other.mBandwidthEstimate >= 0ll
+                    && other.mBandwidthEstimate < bitrate) {
+                bitrate = other.mBandwidthEstimate;
+            }
+        }
+
+        changed = mBitrateController.onBandwidthEstimate(nowUs, bitrate);
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    int32_t bitrate = mBitrateController.targetBitrate();
+
+    mTracks.valueFor(mVideoTrackIndex)->setVideoBitrate(bitrate);
+
+    for (size_t i = 0; i < mSenders.size(); ++i) {
+        mSenders.valueAt(i).mSender->setVideoBitrate(bitrate);
+    }
+}
+
 void WifiDisplaySource::PlaybackSession::requestIDRFrame() {
     for (size_t i = 0; i < mTracks.size(); ++i) {
         const sp<Track> &track = mTracks.valueAt(i);
@@ -797,31 +1248,14 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
     uint64_t inputCTR;
     uint8_t HDCP_private_data[16];
 
-    bool manuallyPrependSPSPPS =
-        !track->isAudio()
-        && track->converter()->needToManuallyPrependSPSPPS()
-        && IsIDR(accessUnit);
-
     if (mHDCP != NULL && !track->isAudio()) {
+        // The encrypter already took care of prepending the codec
+        // specific data, if necessary.
         isHDCPEncrypted = true;
 
-        if (manuallyPrependSPSPPS) {
-            accessUnit = mPacketizer->prependCSD(
-                    track->packetizerTrackIndex(), accessUnit);
-        }
-
-        status_t err = mHDCP->encrypt(
-                accessUnit->data(), accessUnit->size(),
-                trackIndex  /* streamCTR */,
-                &inputCTR,
-                accessUnit->data());
-
-        if (err != OK) {
-            ALOGE("Failed to HDCP-encrypt media data (err %d)",
-                  err);
-
-            return err;
-        }
+        int64_t encryptedCTR;
+        CHECK(accessUnit->meta()->findInt64("inputCTR", &encryptedCTR));
+        inputCTR = encryptedCTR;
 
         HDCP_private_data[0] = 0x00;
 
@@ -889,10 +1323,15 @@ status_t WifiDisplaySource::PlaybackSession::packetizeAccessUnit(
 #endif
 
         flags |= TSPacketizer::IS_ENCRYPTED;
-    } else if (manuallyPrependSPSPPS) {
+    } else if (!track->isAudio()
+            && track->converter()->needToManuallyPrependSPSPPS()
+            && IsIDR(accessUnit)) {
         flags |= TSPacketizer::PREPEND_SPS_PPS_TO_IDR_FRAMES;
     }
 
+    // The sender fills in the RTP headers in place.
+    flags |= TSPacketizer::RESERVE_RTP_HEADERS;
+
     int64_t timeUs = ALooper::GetNowUs();
     if (mPrevTimeUs < 0ll || mPrevTimeUs + 100000ll <= timeUs) {
         flags |= TSPacketizer::EMIT_PCR;
@@ -919,7 +1358,7 @@ status_t WifiDisplaySource::PlaybackSession::packetizeQueuedAccessUnits() {
 
             sp<ABuffer> accessUnit = track->dequeueAccessUnit();
             if (accessUnit != NULL) {
-                track->queueOutputBuffer(accessUnit);
+                queueOutputBuffer(trackIndex, accessUnit);
                 gotMoreData = true;
             }
         }
@@ -932,6 +1371,25 @@ status_t WifiDisplaySource::PlaybackSession::packetizeQueuedAccessUnits() {
     return OK;
 }
 
+void WifiDisplaySource::PlaybackSession::queueOutputBuffer(
+        size_t trackIndex, sp<ABuffer> accessUnit) {
+    const sp<Track> &track = mTracks.valueFor(trackIndex);
+
+    if (mEncrypter == NULL || track->isAudio()) {
+        track->queueOutputBuffer(accessUnit);
+        return;
+    }
+
+    // The codec specific data has to be encrypted along with the frame.
+    if (track->converter()->needToManuallyPrependSPSPPS()
+            && IsIDR(accessUnit)) {
+        accessUnit = mPacketizer->prependCSD(
+                track->packetizerTrackIndex(), accessUnit);
+    }
+
+    mEncrypter->encrypt(trackIndex, accessUnit);
+}
+
 void WifiDisplaySource::PlaybackSession::notifySessionDead() {
     // Inform WifiDisplaySource of our premature death (wish).
     sp<AMessage> notify = mNotify->dup();
@@ -950,9 +1408,20 @@ void WifiDisplaySource::PlaybackSession::drainAccessUnits() {
     }
 }
 
+void WifiDisplaySource::PlaybackSession::scheduleDrainAccessUnits(
+        int64_t delayUs) {
+    if (mDrainAccessUnitsPending) {
+        return;
+    }
+
+    mDrainAccessUnitsPending = true;
+    (new AMessage(kWhatDrainAccessUnits, id()))->post(delayUs);
+}
+
 bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
     ssize_t minTrackIndex = -1;
     int64_t minTimeUs = -1ll;
+    bool waitingForTrack = false;
 
     for (size_t i = 0; i < mTracks.size(); ++i) {
         const sp<Track> &track = mTracks.valueAt(i);
@@ -969,13 +1438,13 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
             // We still consider this track "live", so it should keep
             // delivering output data whose time stamps we'll have to
             // consider for proper interleaving.
-            return false;
+            waitingForTrack = true;
         }
 #else
         else {
             // We need access units available on all tracks to be able to
             // dequeue the earliest one.
-            return false;
+            waitingForTrack = true;
         }
 #endif
     }
@@ -984,6 +1453,18 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
         return false;
     }
 
+    if (waitingForTrack) {
+        int64_t delayUs =
+            minTimeUs + kMaxInterleaveSkewUs - ALooper::GetNowUs();
+
+        if (delayUs > 0ll) {
+            // Give the other track(s) a chance to catch up, but not for
+            // longer than the skew we're willing to tolerate.
+            scheduleDrainAccessUnits(delayUs);
+            return false;
+        }
+    }
+
     const sp<Track> &track = mTracks.valueFor(minTrackIndex);
     sp<ABuffer> accessUnit = track->dequeueOutputBuffer();
 
@@ -995,21 +1476,29 @@ bool WifiDisplaySource::PlaybackSession::drainAccessUnit() {
         return false;
     }
 
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Carry(accessUnit, packets);
+    LatencyTrace::Mark(LatencyTrace::kStagePacketized, packets);
+#endif
+
     if ((ssize_t)minTrackIndex == mVideoTrackIndex) {
         packets->meta()->setInt32("isVideo", 1);
     }
-    mSender->queuePackets(minTimeUs, packets);
-
-#if 0
-    if (minTrackIndex == mVideoTrackIndex) {
-        int64_t nowUs = ALooper::GetNowUs();
+    // Latency from "data acquired" to "ready to send if we wanted to".
+    track->packetizeLatencyMetric()->record(ALooper::GetNowUs() - minTimeUs);
+
+    // The last sender fills in its RTP headers in the room the packetizer
+    // left for them. All others share the TS packets with it and keep
+    // their headers apart, they have to be queued first since the last
+    // one owns the buffer from then on.
+    for (size_t i = 0; i + 1 < mSenders.size(); ++i) {
+        mSenders.valueAt(i).mSender->queueSharedPackets(minTimeUs, packets);
+    }
 
-        // Latency from "data acquired" to "ready to send if we wanted to".
-        ALOGI("[%s] latencyUs = %lld ms",
-              minTrackIndex == mVideoTrackIndex ? "video" : "audio",
-              (nowUs - minTimeUs) / 1000ll);
+    if (!mSenders.isEmpty()) {
+        mSenders.valueAt(mSenders.size() - 1).mSender->queuePackets(
+                minTimeUs, packets);
     }
-#endif
 
     return true;
 }
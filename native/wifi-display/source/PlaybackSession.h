@@ -18,6 +18,7 @@
 
 #define PLAYBACK_SESSION_H_
 
+#include "BitrateController.h"
 #include "Sender.h"
 #include "WifiDisplaySource.h"
 
@@ -43,7 +44,24 @@ struct WifiDisplaySource::PlaybackSession : public AHandler {
     status_t init(
             const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
             Sender::TransportMode transportMode,
-            bool usePCMAudio);
+            bool usePCMAudio,
+            size_t fecColumns,
+            size_t fecRows);
+
+    // Sends the stream to another receiver as well, it's encoded and
+    // packetized only once for all of them while every sender keeps its own
+    // sequence numbers, retransmission history and pacing. "clientIP" may
+    // be a multicast group (UDP only). The video bitrate follows whichever
+    // receiver fares worst.
+    status_t addSender(
+            const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
+            Sender::TransportMode transportMode,
+            int32_t rtspSessionID,
+            size_t fecColumns,
+            size_t fecRows,
+            int32_t *senderID);
+
+    void removeSender(int32_t senderID);
 
     void destroyAsync();
 
@@ -74,6 +92,7 @@ protected:
     virtual ~PlaybackSession();
 
 private:
+    struct HDCPEncrypter;
     struct Track;
 
     enum {
@@ -84,16 +103,44 @@ private:
         kWhatUpdateSurface,
         kWhatFinishPlay,
         kWhatPacketize,
+        kWhatDrainAccessUnits,
+        kWhatEncrypterNotify,
+    };
+
+    // An access unit waits at most this long (measured against its
+    // time stamp) for the other tracks before it's sent out regardless,
+    // instead of blocking on the slowest track.
+    static const int64_t kMaxInterleaveSkewUs = 20000ll;
+
+    struct SenderInfo {
+        sp<Sender> mSender;
+
+        // The latest feedback from this sender's receiver.
+        int32_t mFractionLost;
+        int32_t mJitter;
+        int64_t mBandwidthEstimate;  // -1 if none
     };
 
     sp<ANetworkSession> mNetSession;
-    sp<Sender> mSender;
+
+    // All senders share the looper, the one created by init() is the
+    // primary one, it's the one the session lives and dies with.
+    KeyedVector<int32_t, SenderInfo> mSenders;
+    int32_t mPrimarySenderID;
+    int32_t mNextSenderID;
     sp<ALooper> mSenderLooper;
+    bool mStarted;
+
     sp<AMessage> mNotify;
     in_addr mInterfaceAddr;
     sp<IHDCP> mHDCP;
     bool mWeAreDead;
 
+    // With HDCP, video access units are encrypted on a looper of their
+    // own on their way to the packetizer.
+    sp<ALooper> mEncrypterLooper;
+    sp<HDCPEncrypter> mEncrypter;
+
     int64_t mLastLifesignUs;
 
     sp<TSPacketizer> mPacketizer;
@@ -102,12 +149,19 @@ private:
     KeyedVector<size_t, sp<Track> > mTracks;
     ssize_t mVideoTrackIndex;
 
+    BitrateController mBitrateController;
+
     int64_t mPrevTimeUs;
 
+    bool mDrainAccessUnitsPending;
+
     bool mAllTracksHavePacketizerIndex;
 
     status_t setupPacketizer(bool usePCMAudio);
 
+    // Receivers listed in "media.wfd.source.extra-sinks".
+    void addExtraSinks(size_t fecColumns, size_t fecRows);
+
     status_t addSource(
             bool isVideo,
             const sp<MediaSource> &source,
@@ -126,15 +180,23 @@ private:
 
     bool allTracksHavePacketizerIndex();
 
+    void onSenderFeedback(
+            int32_t senderID, int32_t what, const sp<AMessage> &msg);
+
     status_t packetizeAccessUnit(
             size_t trackIndex, sp<ABuffer> accessUnit,
             sp<ABuffer> *packets);
 
     status_t packetizeQueuedAccessUnits();
 
+    // Queues a converted access unit for packetization, once encrypted
+    // if it needs to be.
+    void queueOutputBuffer(size_t trackIndex, sp<ABuffer> accessUnit);
+
     void notifySessionDead();
 
     void drainAccessUnits();
+    void scheduleDrainAccessUnits(int64_t delayUs);
 
     // Returns true iff an access unit was successfully drained.
     bool drainAccessUnit();
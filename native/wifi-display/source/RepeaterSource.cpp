@@ -4,6 +4,8 @@
 
 #include "RepeaterSource.h"
 
+#include "LatencyTrace.h"
+
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/ALooper.h>
 #include <media/stagefright/foundation/AMessage.h>
@@ -20,7 +22,12 @@ RepeaterSource::RepeaterSource(const sp<MediaSource> &source, double rateHz)
       mResult(OK),
       mLastBufferUpdateUs(-1ll),
       mStartTimeUs(-1ll),
-      mFrameCount(0) {
+      mFrameCount(0),
+      mBufferGeneration(0),
+      mDeliveredGeneration(0),
+      mNumRepeats(0),
+      mLastFrameTimeUs(-1ll),
+      mIdle(false) {
 }
 
 RepeaterSource::~RepeaterSource() {
@@ -40,6 +47,9 @@ status_t RepeaterSource::start(MetaData *params) {
     mResult = OK;
     mStartTimeUs = -1ll;
     mFrameCount = 0;
+    mNumRepeats = 0;
+    mLastFrameTimeUs = -1ll;
+    mIdle = false;
 
     mLooper = new ALooper;
     mLooper->setName("repeater_looper");
@@ -92,11 +102,12 @@ status_t RepeaterSource::read(
     ReadOptions::SeekMode seekMode;
     CHECK(options == NULL || !options->getSeekTo(&seekTimeUs, &seekMode));
 
+    Mutex::Autolock autoLock(mLock);
+
     for (;;) {
         int64_t bufferTimeUs = -1ll;
 
         if (mStartTimeUs < 0ll) {
-            Mutex::Autolock autoLock(mLock);
             while ((mLastBufferUpdateUs < 0ll || mBuffer == NULL)
                     && mResult == OK) {
                 mCondition.wait(mLock);
@@ -104,52 +115,119 @@ status_t RepeaterSource::read(
 
             ALOGV("now resuming.");
             mStartTimeUs = ALooper::GetNowUs();
+            mFrameCount = 1;
+            mNumRepeats = 0;
+            mIdle = false;
             bufferTimeUs = mStartTimeUs;
         } else {
-            bufferTimeUs = mStartTimeUs + (mFrameCount * 1000000ll) / mRateHz;
+            bufferTimeUs = waitForNextFrame_l();
+        }
 
-            int64_t nowUs = ALooper::GetNowUs();
-            int64_t delayUs = bufferTimeUs - nowUs;
+        if (mResult != OK) {
+            CHECK(mBuffer == NULL);
+            return mResult;
+        }
 
-            if (delayUs > 0ll) {
-                usleep(delayUs);
-            }
+#if SUSPEND_VIDEO_IF_IDLE
+        int64_t nowUs = ALooper::GetNowUs();
+        if (nowUs - mLastBufferUpdateUs > 1000000ll) {
+            mLastBufferUpdateUs = -1ll;
+            mStartTimeUs = -1ll;
+            mFrameCount = 0;
+            ALOGV("now dormant");
+            continue;
+        }
+#endif
+
+        if (mDeliveredGeneration == mBufferGeneration) {
+            ++mNumRepeats;
+        } else {
+            mDeliveredGeneration = mBufferGeneration;
+            mNumRepeats = 0;
         }
 
-        bool stale = false;
+        mLastFrameTimeUs = bufferTimeUs;
 
-        {
-            Mutex::Autolock autoLock(mLock);
-            if (mResult != OK) {
-                CHECK(mBuffer == NULL);
-                return mResult;
-            }
+        mBuffer->add_ref();
+        *buffer = mBuffer;
+        (*buffer)->meta_data()->setInt64(kKeyTime, bufferTimeUs);
 
-#if SUSPEND_VIDEO_IF_IDLE
-            int64_t nowUs = ALooper::GetNowUs();
-            if (nowUs - mLastBufferUpdateUs > 1000000ll) {
-                mLastBufferUpdateUs = -1ll;
-                stale = true;
-            } else
+#if ENABLE_LATENCY_TRACE
+        LatencyTrace::Mark(
+                LatencyTrace::kStageCapture, (int32_t)bufferTimeUs, -1ll);
 #endif
-            {
-                mBuffer->add_ref();
-                *buffer = mBuffer;
-                (*buffer)->meta_data()->setInt64(kKeyTime, bufferTimeUs);
-                ++mFrameCount;
+
+        return OK;
+    }
+}
+
+int64_t RepeaterSource::waitForNextFrame_l() {
+    int64_t frameDurationUs = 1000000ll / mRateHz;
+
+    for (;;) {
+        if (mResult != OK) {
+            return -1ll;
+        }
+
+        int64_t nowUs = ALooper::GetNowUs();
+
+        if (mDeliveredGeneration == mBufferGeneration
+                && mNumRepeats >= kNumFullRateRepeats) {
+            // Nothing changed in a while, no point in encoding the same
+            // frame over and over again. Wait for an update, only
+            // repeating the frame occasionally.
+            if (!mIdle) {
+                ALOGV("content is static, reducing frame rate");
+                mIdle = true;
+            }
+
+            int64_t deadlineUs = mLastFrameTimeUs + kIdleFrameIntervalUs;
+
+            if (nowUs < deadlineUs) {
+                mCondition.waitRelative(mLock, (deadlineUs - nowUs) * 1000ll);
+                continue;
             }
+
+            return nowUs;
         }
 
-        if (!stale) {
-            break;
+        if (mIdle) {
+            // Deliver the update right away and continue at the full rate
+            // from here on.
+            ALOGV("content changed, back to full frame rate");
+            mIdle = false;
+
+            mStartTimeUs = nowUs;
+            mFrameCount = 1;
+
+            return nowUs;
         }
 
-        mStartTimeUs = -1ll;
-        mFrameCount = 0;
-        ALOGV("now dormant");
-    }
+        int64_t frameTimeUs =
+            mStartTimeUs + (mFrameCount * 1000000ll) / mRateHz;
 
-    return OK;
+        if (nowUs < frameTimeUs) {
+            // A new buffer or wakeUp() interrupts the wait, in which case
+            // we simply wait for the remainder.
+            mCondition.waitRelative(mLock, (frameTimeUs - nowUs) * 1000ll);
+            continue;
+        }
+
+        if (nowUs - frameTimeUs >= frameDurationUs) {
+            // We fell behind by more than a frame, skip the missed slots
+            // instead of catching up with a burst of frames.
+            ALOGV("late by %lld us, skipping frames", nowUs - frameTimeUs);
+
+            mStartTimeUs = nowUs;
+            mFrameCount = 1;
+
+            return nowUs;
+        }
+
+        ++mFrameCount;
+
+        return frameTimeUs;
+    }
 }
 
 void RepeaterSource::postRead() {
@@ -173,6 +251,7 @@ void RepeaterSource::onMessageReceived(const sp<AMessage> &msg) {
             mBuffer = buffer;
             mResult = err;
             mLastBufferUpdateUs = ALooper::GetNowUs();
+            ++mBufferGeneration;
 
             mCondition.broadcast();
 
@@ -193,6 +272,11 @@ void RepeaterSource::wakeUp() {
     if (mLastBufferUpdateUs < 0ll && mBuffer != NULL) {
         mLastBufferUpdateUs = ALooper::GetNowUs();
         mCondition.broadcast();
+    } else if (mIdle) {
+        // Somebody needs a frame (e.g. for an IDR), don't make them wait
+        // for the next idle repeat.
+        mNumRepeats = 0;
+        mCondition.broadcast();
     }
 }
 
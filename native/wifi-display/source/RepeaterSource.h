@@ -11,7 +11,10 @@
 namespace android {
 
 // This MediaSource delivers frames at a constant rate by repeating buffers
-// if necessary.
+// if necessary. Frame times lie on a fixed grid, so the cadence doesn't
+// drift with scheduling jitter. Once the content has been static for a few
+// frames, repeats drop to a low rate until the next update arrives, which
+// is then delivered immediately, followed by frames at the full rate again.
 struct RepeaterSource : public MediaSource {
     RepeaterSource(const sp<MediaSource> &source, double rateHz);
 
@@ -36,6 +39,13 @@ private:
         kWhatRead,
     };
 
+    // Repeats of unchanged content at the full rate, enough for the
+    // encoder's intra refresh to go through the whole picture.
+    static const int32_t kNumFullRateRepeats = 10;
+
+    // Interval between repeats after that.
+    static const int64_t kIdleFrameIntervalUs = 200000ll;
+
     Mutex mLock;
     Condition mCondition;
 
@@ -54,8 +64,19 @@ private:
     int64_t mStartTimeUs;
     int32_t mFrameCount;
 
+    // Incremented for every new buffer received from mSource.
+    uint32_t mBufferGeneration;
+    uint32_t mDeliveredGeneration;
+    int32_t mNumRepeats;
+    int64_t mLastFrameTimeUs;
+    bool mIdle;
+
     void postRead();
 
+    // Called with mLock held, blocks until the next frame is due and
+    // returns its time or -1 if mSource failed.
+    int64_t waitForNextFrame_l();
+
     DISALLOW_EVIL_CONSTRUCTORS(RepeaterSource);
 };
 
@@ -21,8 +21,12 @@
 #include "Sender.h"
 
 #include "ANetworkSession.h"
+#include "FECEncoder.h"
+#include "LatencyTrace.h"
 #include "TimeSeries.h"
+#include "TSPacketizer.h"
 
+#include <cutils/properties.h>
 #include <media/stagefright/foundation/ABuffer.h>
 #include <media/stagefright/foundation/ADebug.h>
 #include <media/stagefright/foundation/AMessage.h>
@@ -32,8 +36,34 @@
 
 namespace android {
 
-static size_t kMaxRTPPacketSize = 1500;
-static size_t kMaxNumTSPacketsPerRTPPacket = (kMaxRTPPacketSize - 12) / 188;
+// Matches the layout produced by the TSPacketizer, 7 TS packets plus RTP
+// header fit into a 1500 byte MTU.
+static size_t kMaxNumTSPacketsPerRTPPacket =
+    TSPacketizer::kNumTSPacketsPerRTPPacket;
+static size_t kFullRTPPacketSize =
+    TSPacketizer::kRTPHeaderSize + 188 * kMaxNumTSPacketsPerRTPPacket;
+
+#if ENABLE_PACING
+// Up to this many packets may leave back to back.
+static const int64_t kMaxPacingBurstPackets = 8;
+
+static const int64_t kMinPacingIntervalUs = 1000ll;
+#endif
+
+static int32_t GetPositiveIntProperty(
+        const char *propName, int32_t defaultValue) {
+    char val[PROPERTY_VALUE_MAX];
+    if (property_get(propName, val, NULL)) {
+        char *end;
+        unsigned long x = strtoul(val, &end, 10);
+
+        if (*end == '\0' && end > val && x > 0) {
+            return x;
+        }
+    }
+
+    return defaultValue;
+}
 
 Sender::Sender(
         const sp<ANetworkSession> &netSession,
@@ -41,11 +71,14 @@ Sender::Sender(
     : mNetSession(netSession),
       mNotify(notify),
       mTransportMode(TRANSPORT_UDP),
+      mRTSPSessionID(0),
       mRTPChannel(0),
       mRTCPChannel(0),
       mRTPPort(0),
       mRTPSessionID(0),
       mRTCPSessionID(0),
+      mMulticast(false),
+      mMulticastTTL(1),
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
       mRTPRetransmissionSessionID(0),
       mRTCPRetransmissionSessionID(0),
@@ -67,8 +100,19 @@ Sender::Sender(
       mNumSRsSent(0),
       mSendSRPending(false)
 #if ENABLE_RETRANSMISSION
+      ,mHistory(NULL)
+      ,mHistorySeqNo(NULL)
+      ,mHistoryPacketSize(NULL)
       ,mHistoryLength(0)
 #endif
+#if ENABLE_PACING
+      ,mPacedBytesQueued(0)
+      ,mMaxPacedBytesQueued(0)
+      ,mPacingRateBps(0ll)
+      ,mPacingTokens(0ll)
+      ,mLastTokenUpdateUs(-1ll)
+      ,mPacePending(false)
+#endif
 #if TRACK_BANDWIDTH
       ,mFirstPacketTimeUs(-1ll)
       ,mTotalBytesSent(0ll)
@@ -77,12 +121,33 @@ Sender::Sender(
     ,mLogFile(NULL)
 #endif
 {
+    mMulticastInterfaceAddr.s_addr = INADDR_ANY;
+
 #if LOG_TRANSPORT_STREAM
     mLogFile = fopen("/system/etc/log.ts", "wb");
 #endif
+
+    sp<MetricsRegistry> metrics = MetricsRegistry::Get();
+    mPacketsSentMetric = metrics->counter("source.rtp.packets_sent");
+    mBytesSentMetric = metrics->counter("source.rtp.bytes_sent");
+    mPacketsRetransmittedMetric =
+        metrics->counter("source.rtp.packets_retransmitted");
+    mSendLatencyMetric = metrics->histogram("source.rtp.send_latency_us");
+    mPacingQueuedBytesMetric = metrics->gauge("source.pacing.queued_bytes");
 }
 
 Sender::~Sender() {
+#if ENABLE_RETRANSMISSION
+    delete[] mHistory;
+    mHistory = NULL;
+
+    delete[] mHistorySeqNo;
+    mHistorySeqNo = NULL;
+
+    delete[] mHistoryPacketSize;
+    mHistoryPacketSize = NULL;
+#endif
+
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
     if (mRTCPRetransmissionSessionID != 0) {
         mNetSession->destroySession(mRTCPRetransmissionSessionID);
@@ -111,11 +176,27 @@ Sender::~Sender() {
 
 status_t Sender::init(
         const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
-        TransportMode transportMode) {
+        TransportMode transportMode, int32_t rtspSessionID) {
     mClientIP = clientIP;
     mTransportMode = transportMode;
 
+    // Same defaults as the Converter's.
+    int64_t bitrate =
+        (int64_t)GetPositiveIntProperty("media.wfd.video-bitrate", 5000000)
+            + GetPositiveIntProperty("media.wfd.audio-bitrate", 128000);
+
+#if ENABLE_RETRANSMISSION
+    allocateHistory(bitrate);
+#endif
+
+#if ENABLE_PACING
+    mPacingRateBps = kPacingRateFactor * bitrate;
+
+    ALOGI("pacing RTP packets at %lld bps", mPacingRateBps);
+#endif
+
     if (transportMode == TRANSPORT_TCP_INTERLEAVED) {
+        mRTSPSessionID = rtspSessionID;
         mRTPChannel = clientRtp;
         mRTCPChannel = clientRtcp;
         mRTPPort = 0;
@@ -191,6 +272,27 @@ status_t Sender::init(
             }
         }
 
+        if (mMulticast) {
+            err = mNetSession->setMulticastOptions(
+                    rtpSession, mMulticastInterfaceAddr, mMulticastTTL);
+
+            if (err == OK && rtcpSession != 0) {
+                err = mNetSession->setMulticastOptions(
+                        rtcpSession, mMulticastInterfaceAddr, mMulticastTTL);
+            }
+
+            if (err != OK) {
+                ALOGE("unable to send to multicast group %s (%d)",
+                      clientIP, err);
+
+                if (rtcpSession != 0) {
+                    mNetSession->destroySession(rtcpSession);
+                }
+                mNetSession->destroySession(rtpSession);
+                return err;
+            }
+        }
+
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
         if (mTransportMode == TRANSPORT_UDP) {
             int32_t rtpRetransmissionSession;
@@ -284,61 +386,108 @@ int32_t Sender::getRTPPort() const {
     return mRTPPort;
 }
 
+void Sender::setVideoBitrate(int32_t bitrate) {
+    sp<AMessage> msg = new AMessage(kWhatSetVideoBitrate, id());
+    msg->setInt32("bitrate", bitrate);
+    msg->post();
+}
+
+// static
+void Sender::InitRTPHeader(uint8_t *rtp) {
+    static const bool kMarkerBit = false;
+
+    rtp[0] = 0x80;
+    rtp[1] = 33 | (kMarkerBit ? (1 << 7) : 0);  // M-bit
+    rtp[2] = 0x00;  // sequence number to be filled in later.
+    rtp[3] = 0x00;
+    rtp[4] = 0x00;  // rtp time to be filled in later.
+    rtp[5] = 0x00;
+    rtp[6] = 0x00;
+    rtp[7] = 0x00;
+    rtp[8] = kSourceID >> 24;
+    rtp[9] = (kSourceID >> 16) & 0xff;
+    rtp[10] = (kSourceID >> 8) & 0xff;
+    rtp[11] = kSourceID & 0xff;
+}
+
 void Sender::queuePackets(
-        int64_t timeUs, const sp<ABuffer> &tsPackets) {
-    const size_t numTSPackets = tsPackets->size() / 188;
+        int64_t timeUs, const sp<ABuffer> &packets) {
+    packets->meta()->setInt64("timeUs", timeUs);
 
-    const size_t numRTPPackets =
-        (numTSPackets + kMaxNumTSPacketsPerRTPPacket - 1)
-            / kMaxNumTSPacketsPerRTPPacket;
+    // The packetizer left room for the RTP headers.
+    for (size_t offset = 0; offset < packets->size();
+            offset += kFullRTPPacketSize) {
+        uint8_t *rtp = packets->data() + offset;
+        InitRTPHeader(rtp);
 
-    sp<ABuffer> udpPackets = new ABuffer(
-            numRTPPackets * (12 + kMaxNumTSPacketsPerRTPPacket * 188));
+#if LOG_TRANSPORT_STREAM
+        if (mLogFile != NULL) {
+            size_t size = packets->size() - offset;
+            if (size > kFullRTPPacketSize) {
+                size = kFullRTPPacketSize;
+            }
 
-    udpPackets->meta()->setInt64("timeUs", timeUs);
+            fwrite(rtp + 12, 1, size - 12, mLogFile);
+        }
+#endif
+    }
 
-    size_t dstOffset = 0;
-    for (size_t i = 0; i < numTSPackets; ++i) {
-        if ((i % kMaxNumTSPacketsPerRTPPacket) == 0) {
-            static const bool kMarkerBit = false;
+    sp<AMessage> msg = new AMessage(kWhatDrainQueue, id());
+    msg->setBuffer("udpPackets", packets);
+    msg->post();
+}
 
-            uint8_t *rtp = udpPackets->data() + dstOffset;
-            rtp[0] = 0x80;
-            rtp[1] = 33 | (kMarkerBit ? (1 << 7) : 0);  // M-bit
-            rtp[2] = (mRTPSeqNo >> 8) & 0xff;
-            rtp[3] = mRTPSeqNo & 0xff;
-            rtp[4] = 0x00;  // rtp time to be filled in later.
-            rtp[5] = 0x00;
-            rtp[6] = 0x00;
-            rtp[7] = 0x00;
-            rtp[8] = kSourceID >> 24;
-            rtp[9] = (kSourceID >> 16) & 0xff;
-            rtp[10] = (kSourceID >> 8) & 0xff;
-            rtp[11] = kSourceID & 0xff;
+void Sender::queueSharedPackets(
+        int64_t timeUs, const sp<ABuffer> &packets) {
+    int32_t isVideo;
+    if (!packets->meta()->findInt32("isVideo", &isVideo)) {
+        isVideo = 0;
+    }
 
-            ++mRTPSeqNo;
+    if (mTransportMode != TRANSPORT_UDP) {
+        // Only datagrams can be sent with their headers kept apart.
+        sp<ABuffer> copy = new ABuffer(packets->size());
+        memcpy(copy->data(), packets->data(), packets->size());
 
-            dstOffset += 12;
+        if (isVideo) {
+            copy->meta()->setInt32("isVideo", isVideo);
         }
+#if ENABLE_LATENCY_TRACE
+        LatencyTrace::Carry(packets, copy);
+#endif
+
+        queuePackets(timeUs, copy);
+        return;
+    }
 
-        memcpy(udpPackets->data() + dstOffset,
-               tsPackets->data() + 188 * i,
-               188);
+    // A buffer of our own over the same memory, whoever sends it moves its
+    // range along independently of the other senders.
+    sp<ABuffer> ours = new ABuffer(packets->data(), packets->size());
+    ours->meta()->setBuffer("parent", packets);
+    ours->meta()->setInt64("timeUs", timeUs);
 
-        dstOffset += 188;
+    if (isVideo) {
+        ours->meta()->setInt32("isVideo", isVideo);
     }
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Carry(packets, ours);
+#endif
 
-    udpPackets->setRange(0, dstOffset);
+    size_t numPackets =
+        (packets->size() + kFullRTPPacketSize - 1) / kFullRTPPacketSize;
 
-    sp<AMessage> msg = new AMessage(kWhatDrainQueue, id());
-    msg->setBuffer("udpPackets", udpPackets);
-    msg->post();
+    sp<ABuffer> headers =
+        new ABuffer(numPackets * TSPacketizer::kRTPHeaderSize);
 
-#if LOG_TRANSPORT_STREAM
-    if (mLogFile != NULL) {
-        fwrite(tsPackets->data(), 1, tsPackets->size(), mLogFile);
+    for (size_t i = 0; i < numPackets; ++i) {
+        InitRTPHeader(headers->data() + i * TSPacketizer::kRTPHeaderSize);
     }
-#endif
+
+    ours->meta()->setBuffer("rtpHeaders", headers);
+
+    sp<AMessage> msg = new AMessage(kWhatDrainQueue, id());
+    msg->setBuffer("udpPackets", ours);
+    msg->post();
 }
 
 void Sender::onMessageReceived(const sp<AMessage> &msg) {
@@ -462,10 +611,47 @@ void Sender::onMessageReceived(const sp<AMessage> &msg) {
             sp<ABuffer> udpPackets;
             CHECK(msg->findBuffer("udpPackets", &udpPackets));
 
+#if ENABLE_PACING
+            if (mTransportMode == TRANSPORT_UDP) {
+                queueForPacing(udpPackets);
+                break;
+            }
+#endif
+
             onDrainQueue(udpPackets);
             break;
         }
 
+#if ENABLE_PACING
+        case kWhatPace:
+        {
+            mPacePending = false;
+            onPace();
+            break;
+        }
+#endif
+
+        case kWhatSetVideoBitrate:
+        {
+            int32_t videoBitrate;
+            CHECK(msg->findInt32("bitrate", &videoBitrate));
+
+            int64_t bitrate =
+                (int64_t)videoBitrate
+                    + GetPositiveIntProperty("media.wfd.audio-bitrate", 128000);
+
+#if ENABLE_RETRANSMISSION
+            allocateHistory(bitrate);
+#endif
+
+#if ENABLE_PACING
+            mPacingRateBps = kPacingRateFactor * bitrate;
+
+            ALOGI("pacing RTP packets at %lld bps", mPacingRateBps);
+#endif
+            break;
+        }
+
         case kWhatSendSR:
         {
             mSendSRPending = false;
@@ -600,16 +786,28 @@ void Sender::onSendSR() {
     addSDES(buffer);
 
     if (mTransportMode == TRANSPORT_TCP_INTERLEAVED) {
-        sp<AMessage> notify = mNotify->dup();
-        notify->setInt32("what", kWhatBinaryData);
-        notify->setInt32("channel", mRTCPChannel);
-        notify->setBuffer("data", buffer);
-        notify->post();
+        status_t err = mNetSession->sendInterleaved(
+                mRTSPSessionID, mRTCPChannel, buffer, buffer->size());
+
+        if (err != OK) {
+            ALOGE("failed to queue interleaved RTCP packet (err %d)", err);
+        }
     } else {
         sendPacket(mRTCPSessionID, buffer->data(), buffer->size());
     }
 
     ++mNumSRsSent;
+
+#if ENABLE_PACING
+    ALOGV("pacing queue holds %zu bytes, %zu bytes max. since last report",
+          mPacedBytesQueued, mMaxPacedBytesQueued);
+
+    mMaxPacedBytesQueued = mPacedBytesQueued;
+
+    mPacingQueuedBytesMetric->set(mPacedBytesQueued);
+#endif
+
+    MetricsRegistry::Get()->dumpIfRequested();
 }
 
 #if ENABLE_RETRANSMISSION
@@ -628,62 +826,15 @@ status_t Sender::parseTSFB(
         uint16_t seqNo = U16_AT(&data[i]);
         uint16_t blp = U16_AT(&data[i + 2]);
 
-        List<sp<ABuffer> >::iterator it = mHistory.begin();
-        bool foundSeqNo = false;
-        while (it != mHistory.end()) {
-            const sp<ABuffer> &buffer = *it;
-
-            uint16_t bufferSeqNo = buffer->int32Data() & 0xffff;
-
-            bool retransmit = false;
-            if (bufferSeqNo == seqNo) {
-                retransmit = true;
-            } else if (blp != 0) {
-                for (size_t i = 0; i < 16; ++i) {
-                    if ((blp & (1 << i))
-                        && (bufferSeqNo == ((seqNo + i + 1) & 0xffff))) {
-                        blp &= ~(1 << i);
-                        retransmit = true;
-                    }
-                }
-            }
-
-            if (retransmit) {
-                ALOGI("retransmitting seqNo %d", bufferSeqNo);
+        bool allAvailable = retransmit(seqNo);
 
-#if RETRANSMISSION_ACCORDING_TO_RFC_XXXX
-                sp<ABuffer> retransRTP = new ABuffer(2 + buffer->size());
-                uint8_t *rtp = retransRTP->data();
-                memcpy(rtp, buffer->data(), 12);
-                rtp[2] = (mRTPRetransmissionSeqNo >> 8) & 0xff;
-                rtp[3] = mRTPRetransmissionSeqNo & 0xff;
-                rtp[12] = (bufferSeqNo >> 8) & 0xff;
-                rtp[13] = bufferSeqNo & 0xff;
-                memcpy(&rtp[14], buffer->data() + 12, buffer->size() - 12);
-
-                ++mRTPRetransmissionSeqNo;
-
-                sendPacket(
-                        mRTPRetransmissionSessionID,
-                        retransRTP->data(), retransRTP->size());
-#else
-                sendPacket(
-                        mRTPSessionID, buffer->data(), buffer->size());
-#endif
-
-                if (bufferSeqNo == seqNo) {
-                    foundSeqNo = true;
-                }
-
-                if (foundSeqNo && blp == 0) {
-                    break;
-                }
+        for (size_t j = 0; j < 16; ++j) {
+            if ((blp & (1 << j)) && !retransmit(seqNo + j + 1)) {
+                allAvailable = false;
             }
-
-            ++it;
         }
 
-        if (!foundSeqNo || blp != 0) {
+        if (!allAvailable) {
             ALOGI("Some sequence numbers were no longer available for "
                   "retransmission");
         }
@@ -691,6 +842,42 @@ status_t Sender::parseTSFB(
 
     return OK;
 }
+
+bool Sender::retransmit(uint16_t seqNo) {
+    size_t slot = seqNo & (mHistoryLength - 1);
+
+    size_t size = mHistoryPacketSize[slot];
+    if (size == 0 || mHistorySeqNo[slot] != seqNo) {
+        return false;
+    }
+
+    const uint8_t *packet = &mHistory[slot * kFullRTPPacketSize];
+
+    ALOGI("retransmitting seqNo %d", seqNo);
+
+    mPacketsRetransmittedMetric->increment();
+
+#if RETRANSMISSION_ACCORDING_TO_RFC_XXXX
+    sp<ABuffer> retransRTP = new ABuffer(2 + size);
+    uint8_t *rtp = retransRTP->data();
+    memcpy(rtp, packet, 12);
+    rtp[2] = (mRTPRetransmissionSeqNo >> 8) & 0xff;
+    rtp[3] = mRTPRetransmissionSeqNo & 0xff;
+    rtp[12] = (seqNo >> 8) & 0xff;
+    rtp[13] = seqNo & 0xff;
+    memcpy(&rtp[14], packet + 12, size - 12);
+
+    ++mRTPRetransmissionSeqNo;
+
+    sendPacket(
+            mRTPRetransmissionSessionID,
+            retransRTP->data(), retransRTP->size());
+#else
+    sendPacket(mRTPSessionID, packet, size);
+#endif
+
+    return true;
+}
 #endif
 
 status_t Sender::parseRTCP(
@@ -732,7 +919,12 @@ status_t Sender::parseRTCP(
 
         switch (data[1]) {
             case 200:
+                break;
+
             case 201:  // RR
+                parseRR(data, headerLength);
+                break;
+
             case 202:  // SDES
             case 203:
             case 204:  // APP
@@ -745,7 +937,7 @@ status_t Sender::parseRTCP(
 #endif
 
             case 206:  // PSFB (payload specific feedback)
-                hexdump(data, headerLength);
+                parsePSFB(data, headerLength);
                 break;
 
             default:
@@ -763,6 +955,61 @@ status_t Sender::parseRTCP(
     return OK;
 }
 
+status_t Sender::parseRR(const uint8_t *data, size_t size) {
+    size_t reportCount = data[0] & 0x1f;
+
+    if (size < 8 + reportCount * 24) {
+        return ERROR_MALFORMED;
+    }
+
+    for (size_t i = 0; i < reportCount; ++i) {
+        const uint8_t *block = &data[8 + i * 24];
+
+        if (U32_AT(block) != kSourceID) {
+            continue;
+        }
+
+        sp<AMessage> notify = mNotify->dup();
+        notify->setInt32("what", kWhatReceiverReport);
+        notify->setInt32("fractionLost", block[4]);
+        notify->setInt32("jitter", U32_AT(&block[12]));
+        notify->post();
+    }
+
+    return OK;
+}
+
+status_t Sender::parsePSFB(const uint8_t *data, size_t size) {
+    // Application layer feedback (FMT 15) in the REMB flavour
+    // (draft-alvestrand-rmcat-remb), everything else is just logged.
+    if ((data[0] & 0x1f) != 15
+            || size < 20
+            || memcmp(&data[12], "REMB", 4)) {
+        hexdump(data, size);
+        return ERROR_UNSUPPORTED;
+    }
+
+    size_t numSSRCs = data[16];
+    if (size < 20 + numSSRCs * 4) {
+        return ERROR_MALFORMED;
+    }
+
+    unsigned exp = data[17] >> 2;
+    uint32_t mantissa =
+        ((data[17] & 3) << 16) | (data[18] << 8) | data[19];
+
+    int64_t bitrate = (int64_t)mantissa << exp;
+
+    ALOGV("receiver estimated max. bitrate %lld bps", bitrate);
+
+    sp<AMessage> notify = mNotify->dup();
+    notify->setInt32("what", kWhatBandwidthEstimate);
+    notify->setInt64("bitrate", bitrate);
+    notify->post();
+
+    return OK;
+}
+
 status_t Sender::sendPacket(
         int32_t sessionID, const void *data, size_t size) {
     return mNetSession->sendRequest(sessionID, data, size);
@@ -781,8 +1028,23 @@ void Sender::notifySessionDead() {
 }
 
 void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
-    static const size_t kFullRTPPacketSize =
-        12 + 188 * kMaxNumTSPacketsPerRTPPacket;
+    List<sp<ABuffer> > fecPackets;
+
+    // Latency from "data acquired" to "handed to the network". The buffer
+    // must not be looked at anymore once it's been queued below.
+    int64_t timeUs;
+    if (udpPackets->meta()->findInt64("timeUs", &timeUs)) {
+        mSendLatencyMetric->record(ALooper::GetNowUs() - timeUs);
+    }
+
+#if ENABLE_LATENCY_TRACE
+    LatencyTrace::Mark(LatencyTrace::kStageSent, udpPackets);
+#endif
+
+    // Set by queueSharedPackets(), the TS packets are shared with other
+    // senders and our RTP headers are kept here, one per packet.
+    sp<ABuffer> headers;
+    udpPackets->meta()->findBuffer("rtpHeaders", &headers);
 
     size_t srcOffset = 0;
     while (srcOffset < udpPackets->size()) {
@@ -793,12 +1055,27 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
             rtpPacketSize = kFullRTPPacketSize;
         }
 
+        const uint8_t *payload = rtp + TSPacketizer::kRTPHeaderSize;
+        size_t payloadSize = rtpPacketSize - TSPacketizer::kRTPHeaderSize;
+
+        if (headers != NULL) {
+            rtp = headers->data()
+                + (srcOffset / kFullRTPPacketSize)
+                    * TSPacketizer::kRTPHeaderSize;
+        }
+
         int64_t nowUs = ALooper::GetNowUs();
         mLastNTPTime = GetNowNTP();
 
         // 90kHz time scale
         uint32_t rtpTime = (nowUs * 9ll) / 100ll;
 
+        // Sequence numbers are assigned in transmission order, which
+        // differs from queueing order if pacing lets audio overtake video.
+        rtp[2] = (mRTPSeqNo >> 8) & 0xff;
+        rtp[3] = mRTPSeqNo & 0xff;
+        ++mRTPSeqNo;
+
         rtp[4] = rtpTime >> 24;
         rtp[5] = (rtpTime >> 16) & 0xff;
         rtp[6] = (rtpTime >> 8) & 0xff;
@@ -807,20 +1084,24 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
         ++mNumRTPSent;
         mNumRTPOctetsSent += rtpPacketSize - 12;
 
+        mPacketsSentMetric->increment();
+        mBytesSentMetric->increment(rtpPacketSize);
+
         mLastRTPTime = rtpTime;
 
-        if (mTransportMode == TRANSPORT_TCP_INTERLEAVED) {
-            sp<AMessage> notify = mNotify->dup();
-            notify->setInt32("what", kWhatBinaryData);
+        if (mTransportMode != TRANSPORT_TCP_INTERLEAVED) {
+            if (mTransportMode == TRANSPORT_TCP) {
+                sendPacket(mRTPSessionID, rtp, rtpPacketSize);
+            }
 
-            sp<ABuffer> data = new ABuffer(rtpPacketSize);
-            memcpy(data->data(), rtp, rtpPacketSize);
+            // In UDP and TCP interleaved mode the whole access unit is
+            // handed to the network session once all packets are stamped,
+            // see below.
 
-            notify->setInt32("channel", mRTPChannel);
-            notify->setBuffer("data", data);
-            notify->post();
-        } else {
-            sendPacket(mRTPSessionID, rtp, rtpPacketSize);
+            if (mFECEncoder != NULL) {
+                mFECEncoder->addMediaPacket(
+                        rtp, payload, payloadSize, &fecPackets);
+            }
 
 #if TRACK_BANDWIDTH
             mTotalBytesSent += rtpPacketSize->size();
@@ -834,35 +1115,246 @@ void Sender::onDrainQueue(const sp<ABuffer> &udpPackets) {
         }
 
 #if ENABLE_RETRANSMISSION
-        addToHistory(rtp, rtpPacketSize);
+        addToHistory(rtp, payload, payloadSize);
 #endif
 
         srcOffset += rtpPacketSize;
     }
 
-#if 0
-    int64_t timeUs;
-    CHECK(udpPackets->meta()->findInt64("timeUs", &timeUs));
+    if (mTransportMode == TRANSPORT_UDP) {
+        // Ownership of udpPackets passes to the network thread.
+        status_t err = mNetSession->sendDatagrams(
+                mRTPSessionID, udpPackets, kFullRTPPacketSize,
+                headers, TSPacketizer::kRTPHeaderSize);
+
+        if (err != OK) {
+            ALOGE("failed to queue RTP packets (err %d)", err);
+        }
+    } else if (mTransportMode == TRANSPORT_TCP_INTERLEAVED) {
+        // The packets are framed as they are written to the RTSP
+        // connection, ownership of udpPackets passes to the network thread.
+        status_t err = mNetSession->sendInterleaved(
+                mRTSPSessionID, mRTPChannel, udpPackets, kFullRTPPacketSize);
+
+        if (err != OK) {
+            ALOGE("failed to queue interleaved RTP packets (err %d)", err);
+        }
+    }
+
+    for (List<sp<ABuffer> >::iterator it = fecPackets.begin();
+            it != fecPackets.end(); ++it) {
+        const sp<ABuffer> &fec = *it;
+        sendPacket(mRTPSessionID, fec->data(), fec->size());
+    }
+}
+
+#if ENABLE_PACING
+void Sender::queueForPacing(const sp<ABuffer> &udpPackets) {
+    udpPackets->meta()->setInt64("queuedUs", ALooper::GetNowUs());
+
+    int32_t isVideo;
+    if (udpPackets->meta()->findInt32("isVideo", &isVideo) && isVideo) {
+        mPacedVideo.push_back(udpPackets);
+    } else {
+        mPacedAudio.push_back(udpPackets);
+    }
+
+    mPacedBytesQueued += udpPackets->size();
+    if (mPacedBytesQueued > mMaxPacedBytesQueued) {
+        mMaxPacedBytesQueued = mPacedBytesQueued;
+    }
+
+    onPace();
+}
 
-    ALOGI("dTimeUs = %lld us", ALooper::GetNowUs() - timeUs);
+void Sender::onPace() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    if (mLastTokenUpdateUs >= 0ll) {
+        mPacingTokens +=
+            (nowUs - mLastTokenUpdateUs) * mPacingRateBps / 8000000ll;
+    }
+    mLastTokenUpdateUs = nowUs;
+
+    int64_t maxTokens = kMaxPacingBurstPackets * kFullRTPPacketSize;
+    if (mPacingTokens > maxTokens) {
+        mPacingTokens = maxTokens;
+    }
+
+    while (!mPacedAudio.empty() || !mPacedVideo.empty()) {
+        List<sp<ABuffer> > *queue =
+            !mPacedAudio.empty() ? &mPacedAudio : &mPacedVideo;
+
+        sp<ABuffer> packets = *queue->begin();
+
+        int64_t queuedUs;
+        CHECK(packets->meta()->findInt64("queuedUs", &queuedUs));
+
+        size_t size = PacedSendSize(
+                mPacingTokens, packets->size(),
+                nowUs - queuedUs >= kMaxPacingDelayUs);
+
+        if (size == 0) {
+            break;
+        }
+
+        mPacingTokens -= size;
+        mPacedBytesQueued -= size;
+
+        if (size == packets->size()) {
+            queue->erase(queue->begin());
+            onDrainQueue(packets);
+            continue;
+        }
+
+        // Whatever is handed to onDrainQueue belongs to the network thread
+        // afterwards, so split off the head as a buffer of its own that
+        // keeps the remainder's memory alive.
+        sp<ABuffer> head = new ABuffer(packets->data(), size);
+        head->meta()->setBuffer("parent", packets);
+
+        packets->setRange(packets->offset() + size, packets->size() - size);
+
+        sp<ABuffer> headers;
+        if (packets->meta()->findBuffer("rtpHeaders", &headers)) {
+            // Shared TS packets, split our RTP headers along with them.
+            size_t headersSize =
+                (size / kFullRTPPacketSize) * TSPacketizer::kRTPHeaderSize;
+
+            sp<ABuffer> headHeaders =
+                new ABuffer(headers->data(), headersSize);
+            headHeaders->meta()->setBuffer("parent", headers);
+            head->meta()->setBuffer("rtpHeaders", headHeaders);
+
+            headers->setRange(
+                    headers->offset() + headersSize,
+                    headers->size() - headersSize);
+        }
+
+        onDrainQueue(head);
+    }
+
+    if (mPacePending || (mPacedAudio.empty() && mPacedVideo.empty())) {
+        return;
+    }
+
+    int64_t delayUs =
+        ((int64_t)kFullRTPPacketSize - mPacingTokens) * 8000000ll
+            / mPacingRateBps;
+
+    if (delayUs < kMinPacingIntervalUs) {
+        delayUs = kMinPacingIntervalUs;
+    } else if (delayUs > kMaxPacingDelayUs) {
+        delayUs = kMaxPacingDelayUs;
+    }
+
+    mPacePending = true;
+    (new AMessage(kWhatPace, id()))->post(delayUs);
+}
+
+// static
+size_t Sender::PacedSendSize(int64_t tokens, size_t size, bool overdue) {
+    if (overdue || tokens >= (int64_t)size) {
+        // Overdue buffers go out in full, even if that means going into
+        // debt.
+        return size;
+    }
+
+    if (tokens < (int64_t)kFullRTPPacketSize) {
+        // Possibly still in debt from an overdue buffer.
+        return 0;
+    }
+
+    return (size_t)(tokens / (int64_t)kFullRTPPacketSize) * kFullRTPPacketSize;
+}
 #endif
+
+void Sender::enableFEC(size_t numColumns, size_t numRows) {
+    ALOGI("enabling %d x %d FEC", numColumns, numRows);
+
+    mFECEncoder = new FECEncoder(numColumns, numRows, kSourceID);
+}
+
+void Sender::enableMulticast(const struct in_addr &interfaceAddr, int ttl) {
+    CHECK_EQ(mRTPPort, 0);
+
+    mMulticast = true;
+    mMulticastInterfaceAddr = interfaceAddr;
+    mMulticastTTL = ttl;
 }
 
 #if ENABLE_RETRANSMISSION
-void Sender::addToHistory(const uint8_t *rtp, size_t rtpPacketSize) {
-    sp<ABuffer> packet = new ABuffer(rtpPacketSize);
-    memcpy(packet->data(), rtp, rtpPacketSize);
+void Sender::allocateHistory(int64_t bitrate) {
+    int32_t historyMs = GetPositiveIntProperty(
+            "media.wfd.retransmission-window-ms", kDefaultHistoryMs);
+
+    int64_t numPackets =
+        (bitrate * historyMs) / (8000ll * (kFullRTPPacketSize - 12));
+
+    // Slots are indexed by sequence number, which wraps at 65536, so the
+    // length has to be a power of two.
+    size_t length = kMinHistoryLength;
+    while ((int64_t)length < numPackets && length < kMaxHistoryLength) {
+        length *= 2;
+    }
+
+    // Only ever grown, after the bitrate drops the packets sent at the
+    // higher rate still have to be found.
+    if (length <= mHistoryLength) {
+        return;
+    }
+
+    ALOGI("retransmission history holds %zu packets (%d ms requested)",
+          length, historyMs);
+
+    uint8_t *history = new uint8_t[length * kFullRTPPacketSize];
+    uint16_t *historySeqNo = new uint16_t[length];
+    size_t *historyPacketSize = new size_t[length];
+
+    memset(historyPacketSize, 0, length * sizeof(size_t));
+
+    // What's retained moves over to the slots of the longer history.
+    for (size_t i = 0; i < mHistoryLength; ++i) {
+        size_t size = mHistoryPacketSize[i];
+
+        if (size == 0) {
+            continue;
+        }
 
-    unsigned rtpSeqNo = U16_AT(&rtp[2]);
-    packet->setInt32Data(rtpSeqNo);
+        size_t slot = mHistorySeqNo[i] & (length - 1);
 
-    mHistory.push_back(packet);
-    ++mHistoryLength;
+        memcpy(&history[slot * kFullRTPPacketSize],
+               &mHistory[i * kFullRTPPacketSize],
+               size);
 
-    if (mHistoryLength > kMaxHistoryLength) {
-        mHistory.erase(mHistory.begin());
-        --mHistoryLength;
+        historySeqNo[slot] = mHistorySeqNo[i];
+        historyPacketSize[slot] = size;
     }
+
+    delete[] mHistory;
+    delete[] mHistorySeqNo;
+    delete[] mHistoryPacketSize;
+
+    mHistory = history;
+    mHistorySeqNo = historySeqNo;
+    mHistoryPacketSize = historyPacketSize;
+    mHistoryLength = length;
+}
+
+void Sender::addToHistory(
+        const uint8_t *rtp, const uint8_t *payload, size_t payloadSize) {
+    size_t rtpPacketSize = TSPacketizer::kRTPHeaderSize + payloadSize;
+    CHECK_LE(rtpPacketSize, kFullRTPPacketSize);
+
+    uint16_t rtpSeqNo = U16_AT(&rtp[2]);
+    size_t slot = rtpSeqNo & (mHistoryLength - 1);
+
+    uint8_t *dst = &mHistory[slot * kFullRTPPacketSize];
+    memcpy(dst, rtp, TSPacketizer::kRTPHeaderSize);
+    memcpy(dst + TSPacketizer::kRTPHeaderSize, payload, payloadSize);
+
+    mHistorySeqNo[slot] = rtpSeqNo;
+    mHistoryPacketSize[slot] = rtpPacketSize;
 }
 #endif
 
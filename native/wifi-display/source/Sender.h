@@ -20,6 +20,10 @@
 
 #include <media/stagefright/foundation/AHandler.h>
 
+#include "Metrics.h"
+
+#include <netinet/in.h>
+
 namespace android {
 
 #define LOG_TRANSPORT_STREAM            0
@@ -34,8 +38,15 @@ namespace android {
 // for this purpose.
 #define RETRANSMISSION_ACCORDING_TO_RFC_XXXX    0
 
+// If enabled, RTP packets are released by a token bucket running at a
+// multiple of the configured stream bitrate instead of all at once, so
+// that IDR frames don't hit the network as one huge burst. Audio packets
+// overtake queued video packets. Only applies to UDP transport.
+#define ENABLE_PACING                           1
+
 struct ABuffer;
 struct ANetworkSession;
+struct FECEncoder;
 
 struct Sender : public AHandler {
     Sender(const sp<ANetworkSession> &netSession, const sp<AMessage> &notify);
@@ -44,6 +55,14 @@ struct Sender : public AHandler {
         kWhatInitDone,
         kWhatSessionDead,
         kWhatBinaryData,
+
+        // Carries "fractionLost" (0..255, fixed point as in RFC 3550) and
+        // "jitter" (in 90kHz units) of each receiver report block about
+        // our stream.
+        kWhatReceiverReport,
+
+        // Carries "bitrate", a receiver estimated maximum bitrate (REMB).
+        kWhatBandwidthEstimate,
     };
 
     enum TransportMode {
@@ -51,17 +70,54 @@ struct Sender : public AHandler {
         TRANSPORT_TCP_INTERLEAVED,
         TRANSPORT_TCP,
     };
+    // In TRANSPORT_TCP_INTERLEAVED mode clientRtp and clientRtcp are the
+    // interleaved channels and packets are sent over the RTSP connection
+    // "rtspSessionID", which is ignored otherwise.
     status_t init(
             const char *clientIP, int32_t clientRtp, int32_t clientRtcp,
-            TransportMode transportMode);
+            TransportMode transportMode, int32_t rtspSessionID);
 
     status_t finishInit();
 
+    // Protect the RTP stream with XOR parity packets over blocks of
+    // numColumns x numRows packets (UDP transport only). Must be called
+    // before the first packet is queued.
+    void enableFEC(size_t numColumns, size_t numRows);
+
+    // "clientIP" passed to init() is a multicast group, sent out through
+    // the interface "interfaceAddr" with the given TTL (UDP transport
+    // only). Receivers' RTCP can't reach a socket connected to the group,
+    // so there are no receiver reports or retransmissions, protect the
+    // stream with FEC instead. Must be called before init().
+    void enableMulticast(const struct in_addr &interfaceAddr, int ttl);
+
     int32_t getRTPPort() const;
 
-    void queuePackets(int64_t timeUs, const sp<ABuffer> &tsPackets);
+    // The encoder switched to a different video bitrate, pacing (if
+    // enabled) follows it and the retransmission history grows with it.
+    void setVideoBitrate(int32_t bitrate);
+
+    // "packets" holds TS packets laid out by the TSPacketizer with
+    // RESERVE_RTP_HEADERS, it's transmitted without further copying and
+    // must not be touched by the caller afterwards.
+    void queuePackets(int64_t timeUs, const sp<ABuffer> &packets);
+
+    // Like queuePackets(), but "packets" may be queued on other senders as
+    // well and is only ever read, the RTP headers go into a buffer of our
+    // own. Over UDP the TS packets are sent from the shared buffer, other
+    // transports take a private copy.
+    void queueSharedPackets(int64_t timeUs, const sp<ABuffer> &packets);
+
     void scheduleSendSR();
 
+#if ENABLE_PACING
+    // How much of a queued buffer of "size" bytes may leave now given
+    // "tokens" bytes of credit, which is negative after an overdue buffer
+    // was forced out. Always whole RTP packets unless it's all of
+    // "size", 0 if nothing may leave yet.
+    static size_t PacedSendSize(int64_t tokens, size_t size, bool overdue);
+#endif
+
 protected:
     virtual ~Sender();
     virtual void onMessageReceived(const sp<AMessage> &msg);
@@ -72,6 +128,10 @@ private:
         kWhatSendSR,
         kWhatRTPNotify,
         kWhatRTCPNotify,
+#if ENABLE_PACING
+        kWhatPace,
+#endif
+        kWhatSetVideoBitrate,
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
         kWhatRTPRetransmissionNotify,
         kWhatRTCPRetransmissionNotify,
@@ -81,19 +141,33 @@ private:
     static const int64_t kSendSRIntervalUs = 10000000ll;
 
     static const uint32_t kSourceID = 0xdeadbeef;
-    static const size_t kMaxHistoryLength = 128;
+#if ENABLE_RETRANSMISSION
+    // The retransmission history covers this much time at the configured
+    // bitrate, "media.wfd.retransmission-window-ms" overrides it.
+    static const int32_t kDefaultHistoryMs = 500;
+    static const size_t kMinHistoryLength = 128;
+    static const size_t kMaxHistoryLength = 4096;
+#endif
 
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
     static const size_t kRetransmissionPortOffset = 120;
 #endif
 
+#if ENABLE_PACING
+    static const int64_t kPacingRateFactor = 4;
+
+    // Packets never wait longer than this, no matter the token count.
+    static const int64_t kMaxPacingDelayUs = 30000ll;
+#endif
+
     sp<ANetworkSession> mNetSession;
     sp<AMessage> mNotify;
 
     TransportMode mTransportMode;
     AString mClientIP;
 
-    // in TCP mode
+    // in TCP interleaved mode
+    int32_t mRTSPSessionID;
     int32_t mRTPChannel;
     int32_t mRTCPChannel;
 
@@ -102,6 +176,10 @@ private:
     int32_t mRTPSessionID;
     int32_t mRTCPSessionID;
 
+    bool mMulticast;
+    in_addr mMulticastInterfaceAddr;
+    int mMulticastTTL;
+
 #if ENABLE_RETRANSMISSION && RETRANSMISSION_ACCORDING_TO_RFC_XXXX
     int32_t mRTPRetransmissionSessionID;
     int32_t mRTCPRetransmissionSessionID;
@@ -128,11 +206,28 @@ private:
 
     bool mSendSRPending;
 
+    sp<FECEncoder> mFECEncoder;
+
 #if ENABLE_RETRANSMISSION
-    List<sp<ABuffer> > mHistory;
+    // Ring of recently sent RTP packets, the packet with sequence number
+    // "seqNo" occupies slot seqNo % mHistoryLength (a power of two).
+    uint8_t *mHistory;
+    uint16_t *mHistorySeqNo;
+    size_t *mHistoryPacketSize;  // 0 for empty slots
     size_t mHistoryLength;
 #endif
 
+#if ENABLE_PACING
+    List<sp<ABuffer> > mPacedAudio;
+    List<sp<ABuffer> > mPacedVideo;
+    size_t mPacedBytesQueued;
+    size_t mMaxPacedBytesQueued;
+    int64_t mPacingRateBps;
+    int64_t mPacingTokens;  // in bytes, negative after forced sends
+    int64_t mLastTokenUpdateUs;
+    bool mPacePending;
+#endif
+
 #if TRACK_BANDWIDTH
     int64_t mFirstPacketTimeUs;
     uint64_t mTotalBytesSent;
@@ -142,25 +237,43 @@ private:
     FILE *mLogFile;
 #endif
 
+    MetricsRegistry::Counter *mPacketsSentMetric;
+    MetricsRegistry::Counter *mBytesSentMetric;
+    MetricsRegistry::Counter *mPacketsRetransmittedMetric;
+    MetricsRegistry::Histogram *mSendLatencyMetric;
+    MetricsRegistry::Gauge *mPacingQueuedBytesMetric;
+
     void onSendSR();
     void addSR(const sp<ABuffer> &buffer);
     void addSDES(const sp<ABuffer> &buffer);
     static uint64_t GetNowNTP();
 
 #if ENABLE_RETRANSMISSION
+    void allocateHistory(int64_t bitrate);
     status_t parseTSFB(const uint8_t *data, size_t size);
-    void addToHistory(const uint8_t *rtp, size_t rtpPacketSize);
+    bool retransmit(uint16_t seqNo);
+    void addToHistory(
+            const uint8_t *rtp, const uint8_t *payload, size_t payloadSize);
 #endif
 
     status_t parseRTCP(const sp<ABuffer> &buffer);
+    status_t parseRR(const uint8_t *data, size_t size);
+    status_t parsePSFB(const uint8_t *data, size_t size);
 
     status_t sendPacket(int32_t sessionID, const void *data, size_t size);
 
+    static void InitRTPHeader(uint8_t *rtp);
+
     void notifyInitDone();
     void notifySessionDead();
 
     void onDrainQueue(const sp<ABuffer> &udpPackets);
 
+#if ENABLE_PACING
+    void queueForPacing(const sp<ABuffer> &udpPackets);
+    void onPace();
+#endif
+
     DISALLOW_EVIL_CONSTRUCTORS(Sender);
 };
 
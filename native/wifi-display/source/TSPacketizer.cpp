@@ -19,6 +19,7 @@
 #include <utils/Log.h>
 
 #include "TSPacketizer.h"
+#include "CRCKernels.h"
 #include "include/avc_utils.h"
 
 #include <media/stagefright/foundation/ABuffer.h>
@@ -51,8 +52,16 @@ struct TSPacketizer::Track : public RefBase {
     bool lacksADTSHeader() const;
     bool isPCMAudio() const;
 
+    size_t countCSD() const;
+    const sp<ABuffer> &CSDAt(size_t index) const;
+
+    // Replaces the codec specific data taken from the format at creation.
+    void setCSD(const sp<AMessage> &format);
+
     sp<ABuffer> prependCSD(const sp<ABuffer> &accessUnit) const;
-    sp<ABuffer> prependADTSHeader(const sp<ABuffer> &accessUnit) const;
+
+    // Writes the 7 byte ADTS header for a raw access unit of the given size.
+    void writeADTSHeader(size_t accessUnitSize, uint8_t *header) const;
 
     size_t countDescriptors() const;
     sp<ABuffer> descriptorAt(size_t index) const;
@@ -95,14 +104,7 @@ TSPacketizer::Track::Track(
 
     if (!strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_VIDEO_AVC)
             || !strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_AUDIO_AAC)) {
-        for (size_t i = 0;; ++i) {
-            sp<ABuffer> csd;
-            if (!format->findBuffer(StringPrintf("csd-%d", i).c_str(), &csd)) {
-                break;
-            }
-
-            mCSD.push(csd);
-        }
+        setCSD(format);
 
         if (!strcasecmp(mMIME.c_str(), MEDIA_MIMETYPE_AUDIO_AAC)) {
             int32_t isADTS;
@@ -162,6 +164,28 @@ bool TSPacketizer::Track::lacksADTSHeader() const {
     return mAudioLacksATDSHeaders;
 }
 
+size_t TSPacketizer::Track::countCSD() const {
+    return mCSD.size();
+}
+
+const sp<ABuffer> &TSPacketizer::Track::CSDAt(size_t index) const {
+    CHECK_LT(index, mCSD.size());
+    return mCSD.itemAt(index);
+}
+
+void TSPacketizer::Track::setCSD(const sp<AMessage> &format) {
+    mCSD.clear();
+
+    for (size_t i = 0;; ++i) {
+        sp<ABuffer> csd;
+        if (!format->findBuffer(StringPrintf("csd-%d", i).c_str(), &csd)) {
+            break;
+        }
+
+        mCSD.push(csd);
+    }
+}
+
 sp<ABuffer> TSPacketizer::Track::prependCSD(
         const sp<ABuffer> &accessUnit) const {
     size_t size = 0;
@@ -183,15 +207,13 @@ sp<ABuffer> TSPacketizer::Track::prependCSD(
     return dup;
 }
 
-sp<ABuffer> TSPacketizer::Track::prependADTSHeader(
-        const sp<ABuffer> &accessUnit) const {
+void TSPacketizer::Track::writeADTSHeader(
+        size_t accessUnitSize, uint8_t *header) const {
     CHECK_EQ(mCSD.size(), 1u);
 
     const uint8_t *codec_specific_data = mCSD.itemAt(0)->data();
 
-    const uint32_t aac_frame_length = accessUnit->size() + 7;
-
-    sp<ABuffer> dup = new ABuffer(aac_frame_length);
+    const uint32_t aac_frame_length = accessUnitSize + 7;
 
     unsigned profile = (codec_specific_data[0] >> 3) - 1;
 
@@ -202,7 +224,7 @@ sp<ABuffer> TSPacketizer::Track::prependADTSHeader(
     unsigned channel_configuration =
         (codec_specific_data[1] >> 3) & 0x0f;
 
-    uint8_t *ptr = dup->data();
+    uint8_t *ptr = header;
 
     *ptr++ = 0xff;
     *ptr++ = 0xf1;  // b11110001, ID=0, layer=0, protection_absent=1
@@ -221,10 +243,6 @@ sp<ABuffer> TSPacketizer::Track::prependADTSHeader(
 
     // adts_buffer_fullness=0, number_of_raw_data_blocks_in_frame=0
     *ptr++ = 0;
-
-    memcpy(ptr, accessUnit->data(), accessUnit->size());
-
-    return dup;
 }
 
 size_t TSPacketizer::Track::countDescriptors() const {
@@ -338,10 +356,88 @@ void TSPacketizer::Track::finalize() {
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// The PES payload gathered from separate pieces, so that codec specific
+// data (any number of buffers) or an ADTS header don't have to be copied in
+// front of the access unit before it is split into TS packets.
+struct TSPacketizer::PESPayload {
+    PESPayload()
+        : mSize(0),
+          mSegmentIndex(0),
+          mSegmentOffset(0) {
+    }
+
+    void append(const uint8_t *data, size_t size) {
+        Segment segment;
+        segment.mData = data;
+        segment.mSize = size;
+        mSegments.push(segment);
+
+        mSize += size;
+    }
+
+    size_t size() const {
+        return mSize;
+    }
+
+    // Copies the next "size" bytes of the payload to "dst".
+    void read(uint8_t *dst, size_t size) {
+        while (size > 0) {
+            CHECK_LT(mSegmentIndex, mSegments.size());
+            const Segment &segment = mSegments.itemAt(mSegmentIndex);
+
+            size_t copy = segment.mSize - mSegmentOffset;
+            if (copy > size) {
+                copy = size;
+            }
+
+            memcpy(dst, segment.mData + mSegmentOffset, copy);
+            dst += copy;
+            size -= copy;
+
+            mSegmentOffset += copy;
+            if (mSegmentOffset == segment.mSize) {
+                ++mSegmentIndex;
+                mSegmentOffset = 0;
+            }
+        }
+    }
+
+private:
+    struct Segment {
+        const uint8_t *mData;
+        size_t mSize;
+    };
+
+    Vector<Segment> mSegments;
+    size_t mSize;
+
+    size_t mSegmentIndex;
+    size_t mSegmentOffset;
+
+    DISALLOW_EVIL_CONSTRUCTORS(PESPayload);
+};
+
+// Returns the start of TS packet "index" within "buffer", accounting for
+// the room left for RTP headers if "rtpHeaders" is set.
+static uint8_t *TSPacketAt(
+        const sp<ABuffer> &buffer, size_t index, bool rtpHeaders) {
+    size_t offset = index * 188;
+
+    if (rtpHeaders) {
+        offset += TSPacketizer::kRTPHeaderSize
+            * (index / TSPacketizer::kNumTSPacketsPerRTPPacket + 1);
+    }
+
+    return buffer->data() + offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 TSPacketizer::TSPacketizer()
     : mPATContinuityCounter(0),
-      mPMTContinuityCounter(0) {
-    initCrcTable();
+      mPMTContinuityCounter(0),
+      mHavePSIPackets(false) {
+    initPCRPacket();
 }
 
 TSPacketizer::~TSPacketizer() {
@@ -404,6 +500,10 @@ ssize_t TSPacketizer::addTrack(const sp<AMessage> &format) {
     }
 
     sp<Track> track = new Track(format, PID, streamType, streamID);
+
+    // The PMT needs to list the new track.
+    mHavePSIPackets = false;
+
     return mTracks.add(track);
 }
 
@@ -427,15 +527,24 @@ status_t TSPacketizer::packetize(
 
     const sp<Track> &track = mTracks.itemAt(trackIndex);
 
+    PESPayload payload;
+    uint8_t ADTSHeader[7];
+
     if (track->isH264() && (flags & PREPEND_SPS_PPS_TO_IDR_FRAMES)
             && IsIDR(accessUnit)) {
         // prepend codec specific data, i.e. SPS and PPS.
-        accessUnit = track->prependCSD(accessUnit);
+        for (size_t i = 0; i < track->countCSD(); ++i) {
+            const sp<ABuffer> &csd = track->CSDAt(i);
+            payload.append(csd->data(), csd->size());
+        }
     } else if (track->isAAC() && track->lacksADTSHeader()) {
         CHECK(!(flags & IS_ENCRYPTED));
-        accessUnit = track->prependADTSHeader(accessUnit);
+        track->writeADTSHeader(accessUnit->size(), ADTSHeader);
+        payload.append(ADTSHeader, sizeof(ADTSHeader));
     }
 
+    payload.append(accessUnit->data(), accessUnit->size());
+
     // 0x47
     // transport_error_indicator = b0
     // payload_unit_start_indicator = b1
@@ -471,7 +580,7 @@ status_t TSPacketizer::packetize(
     // reserved = b1
     // the first fragment of "buffer" follows
 
-    size_t PES_packet_length = accessUnit->size() + 8 + numStuffingBytes;
+    size_t PES_packet_length = payload.size() + 8 + numStuffingBytes;
     if (PES_private_data_len > 0) {
         PES_packet_length += PES_private_data_len + 1;
     }
@@ -491,173 +600,44 @@ status_t TSPacketizer::packetize(
         ++numTSPackets;
     }
 
-    sp<ABuffer> buffer = new ABuffer(numTSPackets * 188);
-    uint8_t *packetDataStart = buffer->data();
+    bool rtpHeaders = (flags & RESERVE_RTP_HEADERS) != 0;
+
+    size_t bufferSize = numTSPackets * 188;
+    if (rtpHeaders) {
+        bufferSize += kRTPHeaderSize
+            * ((numTSPackets + kNumTSPacketsPerRTPPacket - 1)
+                    / kNumTSPacketsPerRTPPacket);
+    }
+
+    sp<ABuffer> buffer = acquireOutputBuffer(bufferSize);
+
+    size_t packetIndex = 0;
+    uint8_t *packetDataStart = TSPacketAt(buffer, packetIndex, rtpHeaders);
 
     if (flags & EMIT_PAT_AND_PMT) {
-        // Program Association Table (PAT):
-        // 0x47
-        // transport_error_indicator = b0
-        // payload_unit_start_indicator = b1
-        // transport_priority = b0
-        // PID = b0000000000000 (13 bits)
-        // transport_scrambling_control = b00
-        // adaptation_field_control = b01 (no adaptation field, payload only)
-        // continuity_counter = b????
-        // skip = 0x00
-        // --- payload follows
-        // table_id = 0x00
-        // section_syntax_indicator = b1
-        // must_be_zero = b0
-        // reserved = b11
-        // section_length = 0x00d
-        // transport_stream_id = 0x0000
-        // reserved = b11
-        // version_number = b00001
-        // current_next_indicator = b1
-        // section_number = 0x00
-        // last_section_number = 0x00
-        //   one program follows:
-        //   program_number = 0x0001
-        //   reserved = b111
-        //   program_map_PID = kPID_PMT (13 bits!)
-        // CRC = 0x????????
+        // The tables only change as tracks are added, serialize them once
+        // and just patch in the continuity counters from then on.
+        if (!mHavePSIPackets) {
+            buildPSIPackets();
+        }
 
         if (++mPATContinuityCounter == 16) {
             mPATContinuityCounter = 0;
         }
 
-        uint8_t *ptr = packetDataStart;
-        *ptr++ = 0x47;
-        *ptr++ = 0x40;
-        *ptr++ = 0x00;
-        *ptr++ = 0x10 | mPATContinuityCounter;
-        *ptr++ = 0x00;
-
-        uint8_t *crcDataStart = ptr;
-        *ptr++ = 0x00;
-        *ptr++ = 0xb0;
-        *ptr++ = 0x0d;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0xc3;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0x01;
-        *ptr++ = 0xe0 | (kPID_PMT >> 8);
-        *ptr++ = kPID_PMT & 0xff;
-
-        CHECK_EQ(ptr - crcDataStart, 12);
-        uint32_t crc = htonl(crc32(crcDataStart, ptr - crcDataStart));
-        memcpy(ptr, &crc, 4);
-        ptr += 4;
-
-        size_t sizeLeft = packetDataStart + 188 - ptr;
-        memset(ptr, 0xff, sizeLeft);
+        memcpy(packetDataStart, mPATPacket, 188);
+        packetDataStart[3] |= mPATContinuityCounter;
 
-        packetDataStart += 188;
-
-        // Program Map (PMT):
-        // 0x47
-        // transport_error_indicator = b0
-        // payload_unit_start_indicator = b1
-        // transport_priority = b0
-        // PID = kPID_PMT (13 bits)
-        // transport_scrambling_control = b00
-        // adaptation_field_control = b01 (no adaptation field, payload only)
-        // continuity_counter = b????
-        // skip = 0x00
-        // -- payload follows
-        // table_id = 0x02
-        // section_syntax_indicator = b1
-        // must_be_zero = b0
-        // reserved = b11
-        // section_length = 0x???
-        // program_number = 0x0001
-        // reserved = b11
-        // version_number = b00001
-        // current_next_indicator = b1
-        // section_number = 0x00
-        // last_section_number = 0x00
-        // reserved = b111
-        // PCR_PID = kPCR_PID (13 bits)
-        // reserved = b1111
-        // program_info_length = 0x000
-        //   one or more elementary stream descriptions follow:
-        //   stream_type = 0x??
-        //   reserved = b111
-        //   elementary_PID = b? ???? ???? ???? (13 bits)
-        //   reserved = b1111
-        //   ES_info_length = 0x000
-        // CRC = 0x????????
+        packetDataStart = TSPacketAt(buffer, ++packetIndex, rtpHeaders);
 
         if (++mPMTContinuityCounter == 16) {
             mPMTContinuityCounter = 0;
         }
 
-        ptr = packetDataStart;
-        *ptr++ = 0x47;
-        *ptr++ = 0x40 | (kPID_PMT >> 8);
-        *ptr++ = kPID_PMT & 0xff;
-        *ptr++ = 0x10 | mPMTContinuityCounter;
-        *ptr++ = 0x00;
-
-        crcDataStart = ptr;
-        *ptr++ = 0x02;
-
-        *ptr++ = 0x00;  // section_length to be filled in below.
-        *ptr++ = 0x00;
-
-        *ptr++ = 0x00;
-        *ptr++ = 0x01;
-        *ptr++ = 0xc3;
-        *ptr++ = 0x00;
-        *ptr++ = 0x00;
-        *ptr++ = 0xe0 | (kPID_PCR >> 8);
-        *ptr++ = kPID_PCR & 0xff;
-        *ptr++ = 0xf0;
-        *ptr++ = 0x00;
-
-        for (size_t i = 0; i < mTracks.size(); ++i) {
-            const sp<Track> &track = mTracks.itemAt(i);
-
-            // Make sure all the decriptors have been added.
-            track->finalize();
-
-            *ptr++ = track->streamType();
-            *ptr++ = 0xe0 | (track->PID() >> 8);
-            *ptr++ = track->PID() & 0xff;
-
-            size_t ES_info_length = 0;
-            for (size_t i = 0; i < track->countDescriptors(); ++i) {
-                ES_info_length += track->descriptorAt(i)->size();
-            }
-            CHECK_LE(ES_info_length, 0xfff);
-
-            *ptr++ = 0xf0 | (ES_info_length >> 8);
-            *ptr++ = (ES_info_length & 0xff);
-
-            for (size_t i = 0; i < track->countDescriptors(); ++i) {
-                const sp<ABuffer> &descriptor = track->descriptorAt(i);
-                memcpy(ptr, descriptor->data(), descriptor->size());
-                ptr += descriptor->size();
-            }
-        }
-
-        size_t section_length = ptr - (crcDataStart + 3) + 4 /* CRC */;
-
-        crcDataStart[1] = 0xb0 | (section_length >> 8);
-        crcDataStart[2] = section_length & 0xff;
+        memcpy(packetDataStart, mPMTPacket, 188);
+        packetDataStart[3] |= mPMTContinuityCounter;
 
-        crc = htonl(crc32(crcDataStart, ptr - crcDataStart));
-        memcpy(ptr, &crc, 4);
-        ptr += 4;
-
-        sizeLeft = packetDataStart + 188 - ptr;
-        memset(ptr, 0xff, sizeLeft);
-
-        packetDataStart += 188;
+        packetDataStart = TSPacketAt(buffer, ++packetIndex, rtpHeaders);
     }
 
     if (flags & EMIT_PCR) {
@@ -689,23 +669,16 @@ status_t TSPacketizer::packetize(
         uint64_t PCR_base = PCR / 300;
         uint32_t PCR_ext = PCR % 300;
 
-        uint8_t *ptr = packetDataStart;
-        *ptr++ = 0x47;
-        *ptr++ = 0x40 | (kPID_PCR >> 8);
-        *ptr++ = kPID_PCR & 0xff;
-        *ptr++ = 0x20;
-        *ptr++ = 0xb7;  // adaptation_field_length
-        *ptr++ = 0x10;
+        memcpy(packetDataStart, mPCRPacket, 188);
+
+        uint8_t *ptr = packetDataStart + 6;
         *ptr++ = (PCR_base >> 25) & 0xff;
         *ptr++ = (PCR_base >> 17) & 0xff;
         *ptr++ = (PCR_base >> 9) & 0xff;
         *ptr++ = ((PCR_base & 1) << 7) | 0x7e | ((PCR_ext >> 8) & 1);
         *ptr++ = (PCR_ext & 0xff);
 
-        size_t sizeLeft = packetDataStart + 188 - ptr;
-        memset(ptr, 0xff, sizeLeft);
-
-        packetDataStart += 188;
+        packetDataStart = TSPacketAt(buffer, ++packetIndex, rtpHeaders);
     }
 
     uint64_t PTS = (timeUs * 9ll) / 100ll;
@@ -771,21 +744,21 @@ status_t TSPacketizer::packetize(
     // 18 bytes of TS/PES header leave 188 - 18 = 170 bytes for the payload
 
     size_t sizeLeft = packetDataStart + 188 - ptr;
-    size_t copy = accessUnit->size();
+    size_t copy = payload.size();
     if (copy > sizeLeft) {
         copy = sizeLeft;
     }
 
-    memcpy(ptr, accessUnit->data(), copy);
+    payload.read(ptr, copy);
     ptr += copy;
     CHECK_EQ(sizeLeft, copy);
     memset(ptr, 0xff, sizeLeft - copy);
 
-    packetDataStart += 188;
+    packetDataStart = TSPacketAt(buffer, ++packetIndex, rtpHeaders);
 
     size_t offset = copy;
-    while (offset < accessUnit->size()) {
-        bool padding = (accessUnit->size() - offset) < (188 - 4);
+    while (offset < payload.size()) {
+        bool padding = (payload.size() - offset) < (188 - 4);
 
         // for subsequent fragments of "buffer":
         // 0x47
@@ -806,7 +779,7 @@ status_t TSPacketizer::packetize(
         *ptr++ = (padding ? 0x30 : 0x10) | track->incrementContinuityCounter();
 
         if (padding) {
-            size_t paddingSize = 188 - 4 - (accessUnit->size() - offset);
+            size_t paddingSize = 188 - 4 - (payload.size() - offset);
             *ptr++ = paddingSize - 1;
             if (paddingSize >= 2) {
                 *ptr++ = 0x00;
@@ -818,48 +791,255 @@ status_t TSPacketizer::packetize(
         // 4 bytes of TS header leave 188 - 4 = 184 bytes for the payload
 
         size_t sizeLeft = packetDataStart + 188 - ptr;
-        size_t copy = accessUnit->size() - offset;
+        size_t copy = payload.size() - offset;
         if (copy > sizeLeft) {
             copy = sizeLeft;
         }
 
-        memcpy(ptr, accessUnit->data() + offset, copy);
+        payload.read(ptr, copy);
         ptr += copy;
         CHECK_EQ(sizeLeft, copy);
         memset(ptr, 0xff, sizeLeft - copy);
 
         offset += copy;
-        packetDataStart += 188;
+        packetDataStart = TSPacketAt(buffer, ++packetIndex, rtpHeaders);
     }
 
-    CHECK(packetDataStart == buffer->data() + buffer->capacity());
+    CHECK_EQ(packetIndex, numTSPackets);
 
     *packets = buffer;
 
     return OK;
 }
 
-void TSPacketizer::initCrcTable() {
-    uint32_t poly = 0x04C11DB7;
+void TSPacketizer::buildPSIPackets() {
+    // Program Association Table (PAT):
+    // 0x47
+    // transport_error_indicator = b0
+    // payload_unit_start_indicator = b1
+    // transport_priority = b0
+    // PID = b0000000000000 (13 bits)
+    // transport_scrambling_control = b00
+    // adaptation_field_control = b01 (no adaptation field, payload only)
+    // continuity_counter = b????
+    // skip = 0x00
+    // --- payload follows
+    // table_id = 0x00
+    // section_syntax_indicator = b1
+    // must_be_zero = b0
+    // reserved = b11
+    // section_length = 0x00d
+    // transport_stream_id = 0x0000
+    // reserved = b11
+    // version_number = b00001
+    // current_next_indicator = b1
+    // section_number = 0x00
+    // last_section_number = 0x00
+    //   one program follows:
+    //   program_number = 0x0001
+    //   reserved = b111
+    //   program_map_PID = kPID_PMT (13 bits!)
+    // CRC = 0x????????
+
+    uint8_t *ptr = mPATPacket;
+    *ptr++ = 0x47;
+    *ptr++ = 0x40;
+    *ptr++ = 0x00;
+    *ptr++ = 0x10;  // continuity_counter is filled in on emission.
+    *ptr++ = 0x00;
+
+    uint8_t *crcDataStart = ptr;
+    *ptr++ = 0x00;
+    *ptr++ = 0xb0;
+    *ptr++ = 0x0d;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0xc3;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0x01;
+    *ptr++ = 0xe0 | (kPID_PMT >> 8);
+    *ptr++ = kPID_PMT & 0xff;
+
+    CHECK_EQ(ptr - crcDataStart, 12);
+    uint32_t crc =
+        htonl(CRCKernels::MPEG2(crcDataStart, ptr - crcDataStart));
+    memcpy(ptr, &crc, 4);
+    ptr += 4;
+
+    size_t sizeLeft = mPATPacket + 188 - ptr;
+    memset(ptr, 0xff, sizeLeft);
 
-    for (int i = 0; i < 256; i++) {
-        uint32_t crc = i << 24;
-        for (int j = 0; j < 8; j++) {
-            crc = (crc << 1) ^ ((crc & 0x80000000) ? (poly) : 0);
+    // Program Map (PMT):
+    // 0x47
+    // transport_error_indicator = b0
+    // payload_unit_start_indicator = b1
+    // transport_priority = b0
+    // PID = kPID_PMT (13 bits)
+    // transport_scrambling_control = b00
+    // adaptation_field_control = b01 (no adaptation field, payload only)
+    // continuity_counter = b????
+    // skip = 0x00
+    // -- payload follows
+    // table_id = 0x02
+    // section_syntax_indicator = b1
+    // must_be_zero = b0
+    // reserved = b11
+    // section_length = 0x???
+    // program_number = 0x0001
+    // reserved = b11
+    // version_number = b00001
+    // current_next_indicator = b1
+    // section_number = 0x00
+    // last_section_number = 0x00
+    // reserved = b111
+    // PCR_PID = kPCR_PID (13 bits)
+    // reserved = b1111
+    // program_info_length = 0x000
+    //   one or more elementary stream descriptions follow:
+    //   stream_type = 0x??
+    //   reserved = b111
+    //   elementary_PID = b? ???? ???? ???? (13 bits)
+    //   reserved = b1111
+    //   ES_info_length = 0x000
+    // CRC = 0x????????
+
+    ptr = mPMTPacket;
+    *ptr++ = 0x47;
+    *ptr++ = 0x40 | (kPID_PMT >> 8);
+    *ptr++ = kPID_PMT & 0xff;
+    *ptr++ = 0x10;  // continuity_counter is filled in on emission.
+    *ptr++ = 0x00;
+
+    crcDataStart = ptr;
+    *ptr++ = 0x02;
+
+    *ptr++ = 0x00;  // section_length to be filled in below.
+    *ptr++ = 0x00;
+
+    *ptr++ = 0x00;
+    *ptr++ = 0x01;
+    *ptr++ = 0xc3;
+    *ptr++ = 0x00;
+    *ptr++ = 0x00;
+    *ptr++ = 0xe0 | (kPID_PCR >> 8);
+    *ptr++ = kPID_PCR & 0xff;
+    *ptr++ = 0xf0;
+    *ptr++ = 0x00;
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        const sp<Track> &track = mTracks.itemAt(i);
+
+        // Make sure all the decriptors have been added.
+        track->finalize();
+
+        *ptr++ = track->streamType();
+        *ptr++ = 0xe0 | (track->PID() >> 8);
+        *ptr++ = track->PID() & 0xff;
+
+        size_t ES_info_length = 0;
+        for (size_t i = 0; i < track->countDescriptors(); ++i) {
+            ES_info_length += track->descriptorAt(i)->size();
+        }
+        CHECK_LE(ES_info_length, 0xfff);
+
+        *ptr++ = 0xf0 | (ES_info_length >> 8);
+        *ptr++ = (ES_info_length & 0xff);
+
+        for (size_t i = 0; i < track->countDescriptors(); ++i) {
+            const sp<ABuffer> &descriptor = track->descriptorAt(i);
+            memcpy(ptr, descriptor->data(), descriptor->size());
+            ptr += descriptor->size();
         }
-        mCrcTable[i] = crc;
     }
+
+    size_t section_length = ptr - (crcDataStart + 3) + 4 /* CRC */;
+
+    crcDataStart[1] = 0xb0 | (section_length >> 8);
+    crcDataStart[2] = section_length & 0xff;
+
+    crc = htonl(CRCKernels::MPEG2(crcDataStart, ptr - crcDataStart));
+    memcpy(ptr, &crc, 4);
+    ptr += 4;
+
+    sizeLeft = mPMTPacket + 188 - ptr;
+    memset(ptr, 0xff, sizeLeft);
+
+    mHavePSIPackets = true;
+}
+
+void TSPacketizer::initPCRPacket() {
+    // Everything but program_clock_reference_* is fixed, see packetize().
+    uint8_t *ptr = mPCRPacket;
+    *ptr++ = 0x47;
+    *ptr++ = 0x40 | (kPID_PCR >> 8);
+    *ptr++ = kPID_PCR & 0xff;
+    *ptr++ = 0x20;
+    *ptr++ = 0xb7;  // adaptation_field_length
+    *ptr++ = 0x10;
+
+    memset(ptr, 0xff, mPCRPacket + 188 - ptr);
 }
 
-uint32_t TSPacketizer::crc32(const uint8_t *start, size_t size) const {
-    uint32_t crc = 0xFFFFFFFF;
-    const uint8_t *p;
+sp<ABuffer> TSPacketizer::acquireOutputBuffer(size_t size) {
+    // Pick the smallest idle buffer that's large enough, failing that grow
+    // an idle one. Buffers are idle once the sender is done with them.
+    ssize_t bestIndex = -1;
+    ssize_t idleIndex = -1;
 
-    for (p = start; p < start + size; ++p) {
-        crc = (crc << 8) ^ mCrcTable[((crc >> 24) ^ *p) & 0xFF];
+    for (size_t i = 0; i < mOutputBuffers.size(); ++i) {
+        const sp<ABuffer> &buffer = mOutputBuffers.itemAt(i);
+
+        if (buffer->getStrongCount() > 1) {
+            continue;
+        }
+
+        idleIndex = i;
+
+        if (buffer->capacity() >= size
+                && (bestIndex < 0
+                    || buffer->capacity()
+                        < mOutputBuffers.itemAt(bestIndex)->capacity())) {
+            bestIndex = i;
+        }
+    }
+
+    // Round up to limit the number of reallocations as sizes fluctuate.
+    size_t capacity = (size + 4095) & ~4095;
+
+    sp<ABuffer> buffer;
+    if (bestIndex >= 0) {
+        buffer = mOutputBuffers.itemAt(bestIndex);
+        buffer->meta()->clear();
+    } else if (idleIndex >= 0) {
+        buffer = new ABuffer(capacity);
+        mOutputBuffers.editItemAt(idleIndex) = buffer;
+    } else {
+        buffer = new ABuffer(capacity);
+
+        if (mOutputBuffers.size() < kMaxNumOutputBuffers) {
+            mOutputBuffers.push(buffer);
+        }
+    }
+
+    buffer->setRange(0, size);
+
+    return buffer;
+}
+
+void TSPacketizer::updateCSD(
+        size_t trackIndex, const sp<AMessage> &format) {
+    CHECK_LT(trackIndex, mTracks.size());
+
+    const sp<Track> &track = mTracks.itemAt(trackIndex);
+    if (!track->isH264()) {
+        return;
     }
 
-    return crc;
+    // The PMT descriptors were derived from the original SPS, a new one
+    // following a bitrate change keeps profile and level.
+    track->setCSD(format);
 }
 
 sp<ABuffer> TSPacketizer::prependCSD(
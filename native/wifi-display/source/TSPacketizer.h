@@ -42,7 +42,20 @@ struct TSPacketizer : public RefBase {
         EMIT_PCR                        = 2,
         IS_ENCRYPTED                    = 4,
         PREPEND_SPS_PPS_TO_IDR_FRAMES   = 8,
+
+        // Leave kRTPHeaderSize bytes of room in front of every group of
+        // kNumTSPacketsPerRTPPacket TS packets, so that the result can be
+        // sent as RTP packets once the headers are filled in.
+        RESERVE_RTP_HEADERS             = 16,
     };
+
+    enum {
+        kNumTSPacketsPerRTPPacket       = 7,
+        kRTPHeaderSize                  = 12,
+    };
+
+    // "packets" is taken from a pool and returns to it once all references
+    // to it are dropped.
     status_t packetize(
             size_t trackIndex, const sp<ABuffer> &accessUnit,
             sp<ABuffer> *packets,
@@ -50,6 +63,11 @@ struct TSPacketizer : public RefBase {
             const uint8_t *PES_private_data, size_t PES_private_data_len,
             size_t numStuffingBytes = 0);
 
+    // Picks up the codec specific data of "format" for use by
+    // PREPEND_SPS_PPS_TO_IDR_FRAMES and prependCSD(), e.g. after the
+    // encoder feeding the track was restarted.
+    void updateCSD(size_t trackIndex, const sp<AMessage> &format);
+
     // XXX to be removed once encoder config option takes care of this for
     // encrypted mode.
     sp<ABuffer> prependCSD(
@@ -65,16 +83,29 @@ private:
     };
 
     struct Track;
+    struct PESPayload;
+
+    static const size_t kMaxNumOutputBuffers = 32;
 
     Vector<sp<Track> > mTracks;
+    Vector<sp<ABuffer> > mOutputBuffers;
 
     unsigned mPATContinuityCounter;
     unsigned mPMTContinuityCounter;
 
-    uint32_t mCrcTable[256];
+    // Serialized tables with a continuity_counter of 0, rebuilt on demand
+    // after tracks were added.
+    bool mHavePSIPackets;
+    uint8_t mPATPacket[188];
+    uint8_t mPMTPacket[188];
+
+    // Template for PCR packets, lacking just the clock reference.
+    uint8_t mPCRPacket[188];
+
+    sp<ABuffer> acquireOutputBuffer(size_t size);
 
-    void initCrcTable();
-    uint32_t crc32(const uint8_t *start, size_t size) const;
+    void buildPSIPackets();
+    void initPCRPacket();
 
     DISALLOW_EVIL_CONSTRUCTORS(TSPacketizer);
 };
@@ -50,6 +50,8 @@ WifiDisplaySource::WifiDisplaySource(
       mStopReplyID(0),
       mChosenRTPPort(-1),
       mUsingPCMAudio(false),
+      mFECColumns(0),
+      mFECRows(0),
       mClientSessionID(0),
       mReaperPending(false),
       mNextCSeq(1),
@@ -507,7 +509,8 @@ status_t WifiDisplaySource::sendM3(int32_t sessionID) {
         "wfd_content_protection\r\n"
         "wfd_video_formats\r\n"
         "wfd_audio_codecs\r\n"
-        "wfd_client_rtp_ports\r\n";
+        "wfd_client_rtp_ports\r\n"
+        "wfd_fec_capability\r\n";
 
     AString request = "GET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
     AppendCommonResponse(&request, mNextCSeq);
@@ -558,6 +561,10 @@ status_t WifiDisplaySource::sendM4(int32_t sessionID) {
             && (!strcasecmp("true", val) || !strcmp("1", val))) {
         ALOGI("Using TCP transport.");
         transportString = "TCP";
+
+        // Parity packets are pointless on a reliable transport.
+        mFECColumns = 0;
+        mFECRows = 0;
     }
 
     // For 720p60:
@@ -583,6 +590,13 @@ status_t WifiDisplaySource::sendM4(int32_t sessionID) {
             : "AAC 00000001 00"),  // 2 ch AAC 48kHz
         mClientInfo.mLocalIP.c_str(), transportString.c_str(), mChosenRTPPort);
 
+    if (mFECColumns > 0) {
+        body.append(
+                StringPrintf(
+                    "wfd_fec: XOR cols=%d;rows=%d\r\n",
+                    mFECColumns, mFECRows));
+    }
+
     AString request = "SET_PARAMETER rtsp://localhost/wfd1.0 RTSP/1.0\r\n";
     AppendCommonResponse(&request, mNextCSeq);
 
@@ -818,9 +832,68 @@ status_t WifiDisplaySource::onReceiveM3Response(
         }
     }
 
+    mFECColumns = 0;
+    mFECRows = 0;
+    if (params->findParameter("wfd_fec_capability", &value)) {
+        chooseFECMatrix(value.c_str());
+    }
+
     return sendM4(sessionID);
 }
 
+void WifiDisplaySource::chooseFECMatrix(const char *capability) {
+    if (strncmp(capability, "XOR ", 4)) {
+        ALOGI("Sink doesn't support XOR FEC.");
+        return;
+    }
+
+    int32_t maxColumns, maxRows, maxOverheadPercent;
+    if (!ParsedMessage::GetInt32Attribute(
+                capability + 4, "max_cols", &maxColumns)
+            || !ParsedMessage::GetInt32Attribute(
+                capability + 4, "max_rows", &maxRows)
+            || !ParsedMessage::GetInt32Attribute(
+                capability + 4, "max_overhead", &maxOverheadPercent)
+            || maxColumns < 1 || maxRows < 1) {
+        ALOGE("malformed wfd_fec_capability: '%s'", capability);
+        return;
+    }
+
+    // e.g. "10x5" for 10 columns and 5 rows, "20x1" for row FEC only.
+    char val[PROPERTY_VALUE_MAX];
+    unsigned columns, rows;
+    if (!property_get("media.wfd.fec", val, NULL)
+            || sscanf(val, "%ux%u", &columns, &rows) != 2
+            || columns == 0 || rows == 0) {
+        return;
+    }
+
+    if (columns > (unsigned)maxColumns) {
+        columns = maxColumns;
+    }
+
+    if (rows > (unsigned)maxRows) {
+        rows = maxRows;
+    }
+
+    // Row FEC costs one packet per "columns" media packets, column FEC
+    // another one per "rows". Give up on column FEC first.
+    if (rows > 1 && 100 / columns + 100 / rows > (unsigned)maxOverheadPercent) {
+        ALOGI("FEC overhead too high, not using column FEC.");
+        rows = 1;
+    }
+
+    if (100 / columns > (unsigned)maxOverheadPercent) {
+        ALOGI("FEC overhead too high, not using FEC.");
+        return;
+    }
+
+    ALOGI("Using %u x %u XOR FEC.", columns, rows);
+
+    mFECColumns = columns;
+    mFECRows = rows;
+}
+
 status_t WifiDisplaySource::onReceiveM4Response(
         int32_t sessionID, const sp<ParsedMessage> &msg) {
     int32_t statusCode;
@@ -1119,7 +1192,9 @@ status_t WifiDisplaySource::onSetupRequest(
             clientRtp,
             clientRtcp,
             transportMode,
-            mUsingPCMAudio);
+            mUsingPCMAudio,
+            mFECColumns,
+            mFECRows);
 
     if (err != OK) {
         looper()->unregisterHandler(playbackSession->id());
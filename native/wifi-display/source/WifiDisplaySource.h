@@ -114,6 +114,11 @@ private:
     int32_t mChosenRTPPort;  // extracted from "wfd_client_rtp_ports"
 
     bool mUsingPCMAudio;
+
+    // XOR FEC matrix agreed upon with the sink, 0 columns if disabled.
+    size_t mFECColumns;
+    size_t mFECRows;
+
     int32_t mClientSessionID;
 
     struct ClientInfo {
@@ -144,6 +149,8 @@ private:
     status_t makeHDCP();
     // <<<< HDCP specific section
 
+    void chooseFECMatrix(const char *capability);
+
     status_t sendM1(int32_t sessionID);
     status_t sendM3(int32_t sessionID);
     status_t sendM4(int32_t sessionID);
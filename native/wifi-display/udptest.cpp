@@ -4,6 +4,10 @@
 #include <utils/Log.h>
 
 #include "ANetworkSession.h"
+#include "Metrics.h"
+#include "sink/RTPSink.h"
+#include "source/Sender.h"
+#include "source/TSPacketizer.h"
 
 #include <binder/ProcessState.h>
 #include <media/stagefright/foundation/ABuffer.h>
@@ -13,6 +17,8 @@
 #include <media/stagefright/foundation/AMessage.h>
 #include <media/stagefright/Utils.h>
 
+#include <sys/resource.h>
+
 namespace android {
 
 struct TestHandler : public AHandler {
@@ -250,15 +256,757 @@ void TestHandler::postSendPacket(int64_t delayUs) {
     (new AMessage(kWhatSendPacket, id()))->post(delayUs);
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Forwards the datagrams arriving on a local UDP port to another one on
+// the loopback interface, emulating a lossy, congested network on the way.
+struct ImpairmentRelay : public AHandler {
+    struct Config {
+        Config();
+
+        // Gilbert-Elliott loss model, all probabilities are per packet.
+        double mGoodToBad;
+        double mBadToGood;
+        double mLossGood;
+        double mLossBad;
+
+        double mDuplicate;
+
+        // A reordered packet is held back by kReorderDelayUs, letting
+        // the ones following it overtake it.
+        double mReorder;
+
+        // Every packet is delayed by a uniformly distributed amount of up
+        // to this much, which reorders packets as well.
+        int64_t mJitterUs;
+
+        // Capacity of the emulated link, 0 if unlimited. Packets queue up
+        // in front of it for up to kMaxQueueDelayUs before being dropped.
+        int32_t mBandwidthKbps;
+
+        uint32_t mSeed;
+    };
+
+    ImpairmentRelay(
+            const sp<ANetworkSession> &netSession, const Config &config);
+
+    // Must be registered with a looper first. Returns the port datagrams
+    // to be forwarded to "remotePort" should be sent to.
+    status_t init(int32_t remotePort, int32_t *localPort);
+
+protected:
+    virtual ~ImpairmentRelay();
+
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatInputNotify,
+        kWhatOutputNotify,
+        kWhatForward,
+    };
+
+    static const int32_t kFirstLocalPort = 16550;
+    static const int64_t kReorderDelayUs = 5000ll;
+    static const int64_t kMaxQueueDelayUs = 200000ll;
+
+    sp<ANetworkSession> mNetSession;
+    Config mConfig;
+
+    int32_t mInputSessionID;
+    int32_t mOutputSessionID;
+
+    bool mBadState;
+    int64_t mLinkFreeUs;
+    uint32_t mRandom;
+
+    MetricsRegistry::Counter *mPacketsInMetric;
+    MetricsRegistry::Counter *mPacketsDroppedMetric;
+    MetricsRegistry::Counter *mQueueDropsMetric;
+    MetricsRegistry::Counter *mPacketsDuplicatedMetric;
+    MetricsRegistry::Counter *mPacketsReorderedMetric;
+    MetricsRegistry::Histogram *mDelayMetric;
+
+    // Uniformly distributed in [0, 1).
+    double uniform();
+
+    bool shouldDrop();
+    void onDatagram(const sp<ABuffer> &data);
+    void forward(const sp<ABuffer> &data, int64_t delayUs);
+
+    DISALLOW_EVIL_CONSTRUCTORS(ImpairmentRelay);
+};
+
+ImpairmentRelay::Config::Config()
+    : mGoodToBad(0.0),
+      mBadToGood(1.0),
+      mLossGood(0.0),
+      mLossBad(1.0),
+      mDuplicate(0.0),
+      mReorder(0.0),
+      mJitterUs(0ll),
+      mBandwidthKbps(0),
+      mSeed(1) {
+}
+
+ImpairmentRelay::ImpairmentRelay(
+        const sp<ANetworkSession> &netSession, const Config &config)
+    : mNetSession(netSession),
+      mConfig(config),
+      mInputSessionID(0),
+      mOutputSessionID(0),
+      mBadState(false),
+      mLinkFreeUs(0ll),
+      mRandom(config.mSeed != 0 ? config.mSeed : 1) {
+    sp<MetricsRegistry> metrics = MetricsRegistry::Get();
+    mPacketsInMetric = metrics->counter("bench.emulator.packets_in");
+    mPacketsDroppedMetric = metrics->counter("bench.emulator.packets_dropped");
+    mQueueDropsMetric = metrics->counter("bench.emulator.queue_drops");
+    mPacketsDuplicatedMetric =
+        metrics->counter("bench.emulator.packets_duplicated");
+    mPacketsReorderedMetric =
+        metrics->counter("bench.emulator.packets_reordered");
+    mDelayMetric = metrics->histogram("bench.emulator.delay_us");
+}
+
+ImpairmentRelay::~ImpairmentRelay() {
+    if (mOutputSessionID != 0) {
+        mNetSession->destroySession(mOutputSessionID);
+        mOutputSessionID = 0;
+    }
+
+    if (mInputSessionID != 0) {
+        mNetSession->destroySession(mInputSessionID);
+        mInputSessionID = 0;
+    }
+}
+
+status_t ImpairmentRelay::init(int32_t remotePort, int32_t *localPort) {
+    // Incoming datagrams are read from an unconnected socket, the one
+    // forwarding them is connected and would filter out everybody else.
+    for (int32_t port = kFirstLocalPort; port < 65536; port += 2) {
+        sp<AMessage> inputNotify = new AMessage(kWhatInputNotify, id());
+
+        status_t err = mNetSession->createUDPSession(
+                port, inputNotify, &mInputSessionID);
+
+        if (err != OK) {
+            continue;
+        }
+
+        sp<AMessage> outputNotify = new AMessage(kWhatOutputNotify, id());
+
+        err = mNetSession->createUDPSession(
+                port + 1, "127.0.0.1", remotePort,
+                outputNotify, &mOutputSessionID);
+
+        if (err == OK) {
+            *localPort = port;
+            return OK;
+        }
+
+        mNetSession->destroySession(mInputSessionID);
+        mInputSessionID = 0;
+    }
+
+    return UNKNOWN_ERROR;
+}
+
+double ImpairmentRelay::uniform() {
+    // xorshift32, reproducible for a given seed.
+    mRandom ^= mRandom << 13;
+    mRandom ^= mRandom >> 17;
+    mRandom ^= mRandom << 5;
+
+    return mRandom / 4294967296.0;
+}
+
+bool ImpairmentRelay::shouldDrop() {
+    if (mBadState) {
+        if (uniform() < mConfig.mBadToGood) {
+            mBadState = false;
+        }
+    } else if (uniform() < mConfig.mGoodToBad) {
+        mBadState = true;
+    }
+
+    return uniform() < (mBadState ? mConfig.mLossBad : mConfig.mLossGood);
+}
+
+void ImpairmentRelay::onDatagram(const sp<ABuffer> &data) {
+    mPacketsInMetric->increment();
+
+    if (shouldDrop()) {
+        mPacketsDroppedMetric->increment();
+        return;
+    }
+
+    int64_t nowUs = ALooper::GetNowUs();
+    int64_t delayUs = 0ll;
+
+    if (mConfig.mBandwidthKbps > 0) {
+        int64_t departureUs = (mLinkFreeUs > nowUs) ? mLinkFreeUs : nowUs;
+
+        if (departureUs - nowUs > kMaxQueueDelayUs) {
+            mPacketsDroppedMetric->increment();
+            mQueueDropsMetric->increment();
+            return;
+        }
+
+        mLinkFreeUs =
+            departureUs + (data->size() * 8000ll) / mConfig.mBandwidthKbps;
+
+        delayUs = mLinkFreeUs - nowUs;
+    }
+
+    if (mConfig.mJitterUs > 0ll) {
+        delayUs += (int64_t)(uniform() * mConfig.mJitterUs);
+    }
+
+    if (uniform() < mConfig.mReorder) {
+        mPacketsReorderedMetric->increment();
+        delayUs += kReorderDelayUs;
+    }
+
+    mDelayMetric->record(delayUs);
+
+    forward(data, delayUs);
+
+    if (uniform() < mConfig.mDuplicate) {
+        mPacketsDuplicatedMetric->increment();
+        forward(data, delayUs);
+    }
+}
+
+void ImpairmentRelay::forward(const sp<ABuffer> &data, int64_t delayUs) {
+    if (delayUs > 0ll) {
+        sp<AMessage> msg = new AMessage(kWhatForward, id());
+        msg->setBuffer("data", data);
+        msg->post(delayUs);
+        return;
+    }
+
+    mNetSession->sendRequest(mOutputSessionID, data->data(), data->size());
+}
+
+void ImpairmentRelay::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatInputNotify:
+        case kWhatOutputNotify:
+        {
+            int32_t reason;
+            CHECK(msg->findInt32("reason", &reason));
+
+            switch (reason) {
+                case ANetworkSession::kWhatError:
+                {
+                    int32_t sessionID;
+                    CHECK(msg->findInt32("sessionID", &sessionID));
+
+                    int32_t err;
+                    CHECK(msg->findInt32("err", &err));
+
+                    AString detail;
+                    CHECK(msg->findString("detail", &detail));
+
+                    // Sends to a sink that's not listening yet fail with
+                    // ECONNREFUSED, which is no reason to give up.
+                    ALOGW("An error occurred in session %d (%d, '%s/%s').",
+                          sessionID,
+                          err,
+                          detail.c_str(),
+                          strerror(-err));
+                    break;
+                }
+
+                case ANetworkSession::kWhatDatagram:
+                {
+                    sp<ABuffer> data;
+                    CHECK(msg->findBuffer("data", &data));
+
+                    if (msg->what() == kWhatInputNotify) {
+                        onDatagram(data);
+                    }
+                    break;
+                }
+
+                default:
+                    TRESPASS();
+            }
+            break;
+        }
+
+        case kWhatForward:
+        {
+            sp<ABuffer> data;
+            CHECK(msg->findBuffer("data", &data));
+
+            forward(data, 0ll);
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Feeds a Sender with a synthetic transport stream at a constant bitrate,
+// one access unit's worth of RTP packets per video frame.
+struct StreamGenerator : public AHandler {
+    StreamGenerator(int32_t bitrate);
+
+    // Must be called before the sender reports kWhatInitDone to us.
+    void setSender(const sp<Sender> &sender);
+
+    void stop();
+
+    enum {
+        kWhatSenderNotify,
+    };
+
+protected:
+    virtual ~StreamGenerator();
+
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatGenerate = kWhatSenderNotify + 1,
+        kWhatStop,
+    };
+
+    static const int64_t kFrameDurationUs = 16667ll;
+    static const size_t kNumTSPacketsPerRTPPacket = 7;
+    static const size_t kRTPPacketSize = 12 + 188 * kNumTSPacketsPerRTPPacket;
+    static const unsigned kPID = 0x1011;
+
+    int32_t mBitrate;
+    sp<Sender> mSender;
+
+    bool mStopped;
+    int64_t mNextFrameUs;
+    unsigned mContinuityCounter;
+
+    void generateFrame();
+
+    DISALLOW_EVIL_CONSTRUCTORS(StreamGenerator);
+};
+
+StreamGenerator::StreamGenerator(int32_t bitrate)
+    : mBitrate(bitrate),
+      mStopped(false),
+      mNextFrameUs(-1ll),
+      mContinuityCounter(0) {
+}
+
+StreamGenerator::~StreamGenerator() {
+}
+
+void StreamGenerator::setSender(const sp<Sender> &sender) {
+    mSender = sender;
+}
+
+void StreamGenerator::stop() {
+    (new AMessage(kWhatStop, id()))->post();
+}
+
+void StreamGenerator::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatSenderNotify:
+        {
+            int32_t what;
+            CHECK(msg->findInt32("what", &what));
+
+            if (what == Sender::kWhatInitDone) {
+                CHECK(mSender != NULL);
+
+                mSender->setVideoBitrate(mBitrate);
+
+                mNextFrameUs = ALooper::GetNowUs();
+                (new AMessage(kWhatGenerate, id()))->post();
+            } else if (what == Sender::kWhatSessionDead) {
+                ALOGE("sender session died.");
+                mStopped = true;
+            }
+            break;
+        }
+
+        case kWhatGenerate:
+        {
+            if (mStopped) {
+                break;
+            }
+
+            generateFrame();
+
+            mNextFrameUs += kFrameDurationUs;
+
+            int64_t delayUs = mNextFrameUs - ALooper::GetNowUs();
+            (new AMessage(kWhatGenerate, id()))->post(
+                    delayUs > 0ll ? delayUs : 0ll);
+            break;
+        }
+
+        case kWhatStop:
+        {
+            mStopped = true;
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+void StreamGenerator::generateFrame() {
+    size_t frameSize = ((int64_t)mBitrate * kFrameDurationUs) / 8000000ll;
+
+    size_t numRTPPackets =
+        (frameSize + kRTPPacketSize - 13) / (kRTPPacketSize - 12);
+
+    if (numRTPPackets == 0) {
+        numRTPPackets = 1;
+    }
+
+    // Laid out like the TSPacketizer does with RESERVE_RTP_HEADERS.
+    sp<ABuffer> packets = new ABuffer(numRTPPackets * kRTPPacketSize);
+
+    for (size_t i = 0; i < numRTPPackets; ++i) {
+        uint8_t *ts = packets->data() + i * kRTPPacketSize + 12;
+
+        for (size_t j = 0; j < kNumTSPacketsPerRTPPacket; ++j) {
+            bool isFirst = (i == 0 && j == 0);
+
+            ts[0] = 0x47;
+            ts[1] = (isFirst ? 0x40 : 0x00) | ((kPID >> 8) & 0x1f);
+            ts[2] = kPID & 0xff;
+            ts[3] = 0x10 | mContinuityCounter;
+            mContinuityCounter = (mContinuityCounter + 1) & 0x0f;
+
+            memset(&ts[4], i & 0xff, 188 - 4);
+
+            ts += 188;
+        }
+    }
+
+    packets->meta()->setInt32("isVideo", true);
+
+    mSender->queuePackets(ALooper::GetNowUs(), packets);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct BenchmarkOptions {
+    BenchmarkOptions();
+
+    int64_t mDurationUs;
+    int32_t mBitrate;
+    size_t mFECColumns;
+    size_t mFECRows;
+    ImpairmentRelay::Config mImpairments;
+};
+
+BenchmarkOptions::BenchmarkOptions()
+    : mDurationUs(10000000ll),
+      mBitrate(10000000),
+      mFECColumns(0),
+      mFECRows(0) {
+}
+
+static int32_t CounterValue(const char *name) {
+    return MetricsRegistry::Get()->counter(name)->value();
+}
+
+static void PrintPercentiles(const char *label, const char *name) {
+    MetricsRegistry::Histogram *histogram =
+        MetricsRegistry::Get()->histogram(name);
+
+    printf("%-24s p50 %lld us, p90 %lld us, p99 %lld us, max %d us\n",
+           label,
+           histogram->percentile(50),
+           histogram->percentile(90),
+           histogram->percentile(99),
+           histogram->max());
+}
+
+static int64_t CPUTimeUs(const struct rusage &usage) {
+    return usage.ru_utime.tv_sec * 1000000ll + usage.ru_utime.tv_usec
+        + usage.ru_stime.tv_sec * 1000000ll + usage.ru_stime.tv_usec;
+}
+
+// Streams through Sender -> ImpairmentRelay -> RTPSink -> TunnelRenderer,
+// all in this process and over the loopback interface, and reports on
+// throughput, cost and how well losses were repaired.
+static int runBenchmark(const BenchmarkOptions &options) {
+    sp<ANetworkSession> netSession = new ANetworkSession;
+    netSession->start();
+
+    sp<ALooper> sinkLooper = new ALooper;
+    sinkLooper->setName("rtp_sink");
+    sinkLooper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+
+    sp<ALooper> sourceLooper = new ALooper;
+    sourceLooper->setName("sender");
+    sourceLooper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+
+    sp<ALooper> relayLooper = new ALooper;
+    relayLooper->setName("impairment_relay");
+    relayLooper->start();
+
+    sp<RTPSink> sink =
+        new RTPSink(netSession, NULL, RTPSink::FLAG_DISCARD_OUTPUT);
+    sinkLooper->registerHandler(sink);
+
+    if (options.mFECColumns > 0) {
+        sink->enableFEC(options.mFECColumns, options.mFECRows);
+    }
+
+    CHECK_EQ(sink->init(false /* useTCPInterleaving */), (status_t)OK);
+
+    int32_t sinkRTPPort = sink->getRTPPort();
+
+    sp<ImpairmentRelay> relay =
+        new ImpairmentRelay(netSession, options.mImpairments);
+    relayLooper->registerHandler(relay);
+
+    int32_t relayPort;
+    CHECK_EQ(relay->init(sinkRTPPort, &relayPort), (status_t)OK);
+
+    sp<StreamGenerator> generator = new StreamGenerator(options.mBitrate);
+    sourceLooper->registerHandler(generator);
+
+    sp<Sender> sender = new Sender(
+            netSession,
+            new AMessage(StreamGenerator::kWhatSenderNotify, generator->id()));
+    sourceLooper->registerHandler(sender);
+
+    generator->setSender(sender);
+
+    if (options.mFECColumns > 0) {
+        sender->enableFEC(options.mFECColumns, options.mFECRows);
+    }
+
+    // RTP takes the detour through the relay, RTCP (and with it NACKs)
+    // goes straight back and forth.
+    CHECK_EQ(sender->init(
+                "127.0.0.1", relayPort, sinkRTPPort + 1,
+                Sender::TRANSPORT_UDP, 0 /* rtspSessionID */),
+             (status_t)OK);
+
+    int32_t senderRTPPort = sender->getRTPPort();
+
+    CHECK_EQ(sink->connect("127.0.0.1", relayPort + 1, senderRTPPort + 1),
+             (status_t)OK);
+
+    printf("sender :%d -> relay :%d/:%d -> sink :%d\n",
+           senderRTPPort, relayPort, relayPort + 1, sinkRTPPort);
+
+    struct rusage startUsage;
+    getrusage(RUSAGE_SELF, &startUsage);
+    int64_t startUs = ALooper::GetNowUs();
+
+    CHECK_EQ(sender->finishInit(), (status_t)OK);
+
+    MetricsRegistry::Gauge *jitterBufferPackets =
+        MetricsRegistry::Get()->gauge("sink.jitter_buffer.packets");
+
+    int32_t maxJitterBufferPackets = 0;
+
+    static const int64_t kSampleIntervalUs = 10000ll;
+    while (ALooper::GetNowUs() < startUs + options.mDurationUs) {
+        usleep(kSampleIntervalUs);
+
+        int32_t numPackets = jitterBufferPackets->value();
+        if (numPackets > maxJitterBufferPackets) {
+            maxJitterBufferPackets = numPackets;
+        }
+    }
+
+    generator->stop();
+
+    // Give retransmissions and the jitter buffer a chance to drain.
+    static const int64_t kDrainTimeUs = 1000000ll;
+    usleep(kDrainTimeUs);
+
+    struct rusage endUsage;
+    getrusage(RUSAGE_SELF, &endUsage);
+    double durationSecs = (ALooper::GetNowUs() - startUs) / 1E6;
+
+    int32_t numSent = CounterValue("source.rtp.packets_sent");
+    int32_t numReceived = CounterValue("sink.rtp.packets_received");
+    int32_t numBytesReceived = CounterValue("sink.rtp.bytes_received");
+    int32_t numDropped = CounterValue("bench.emulator.packets_dropped");
+    int32_t numLost = CounterValue("sink.rtp.packets_lost");
+
+    int64_t cpuUs = CPUTimeUs(endUsage) - CPUTimeUs(startUsage);
+
+    printf("\n");
+    printf("duration                 %.2f secs\n", durationSecs);
+    printf("packets sent             %d\n", numSent);
+
+    printf("packets received         %d (%.0f packets/sec, %.2f Mbit/sec)\n",
+           numReceived,
+           numReceived / durationSecs,
+           numBytesReceived * 8.0 / durationSecs / 1E6);
+
+    printf("cpu                      %.2f us per received packet "
+           "(source, emulator and sink)\n",
+           numReceived > 0 ? (double)cpuUs / numReceived : 0.0);
+
+    printf("emulator                 %d dropped (%d queue drops), "
+           "%d duplicated, %d reordered\n",
+           numDropped,
+           CounterValue("bench.emulator.queue_drops"),
+           CounterValue("bench.emulator.packets_duplicated"),
+           CounterValue("bench.emulator.packets_reordered"));
+
+    printf("repair                   %d recovered by FEC, "
+           "%d retransmitted, %d lost\n",
+           CounterValue("sink.fec.packets_recovered"),
+           CounterValue("source.rtp.packets_retransmitted"),
+           numLost);
+
+    if (numDropped > 0) {
+        printf("recovery rate            %.2f %%\n",
+               100.0 * (numDropped - numLost) / numDropped);
+    }
+
+    PrintPercentiles("emulator delay", "bench.emulator.delay_us");
+    PrintPercentiles("send queue latency", "source.rtp.send_latency_us");
+    PrintPercentiles("added latency", "sink.discard.transit_us");
+
+    printf("jitter buffer high-water %d packets\n", maxJitterBufferPackets);
+    printf("max resident set         %ld kB\n", endUsage.ru_maxrss);
+
+    AString metrics;
+    MetricsRegistry::Get()->snapshot(&metrics);
+    printf("\n%s", metrics.c_str());
+
+    sourceLooper->unregisterHandler(sender->id());
+    sourceLooper->unregisterHandler(generator->id());
+    relayLooper->unregisterHandler(relay->id());
+    sinkLooper->unregisterHandler(sink->id());
+
+    sourceLooper->stop();
+    relayLooper->stop();
+    sinkLooper->stop();
+
+    netSession->stop();
+
+    return 0;
+}
+
+// Runs Sender's pacing decisions through an overdue burst followed by a
+// buffer that isn't overdue yet. The burst leaves the token bucket in
+// debt, the next buffer must then wait instead of going out at once.
+static int runPacingCheck() {
+    static const size_t kPacketSize =
+        TSPacketizer::kRTPHeaderSize
+            + 188 * TSPacketizer::kNumTSPacketsPerRTPPacket;
+
+    int64_t tokens = 2 * kPacketSize;
+
+    size_t burstSize = 40 * kPacketSize;
+    size_t size = Sender::PacedSendSize(tokens, burstSize, true /* overdue */);
+    CHECK_EQ(size, burstSize);
+
+    tokens -= size;
+    CHECK_LT(tokens, 0ll);
+
+    // A short last packet, as at the end of an access unit.
+    size_t nextSize = 3 * kPacketSize + 500;
+    CHECK_EQ(Sender::PacedSendSize(tokens, nextSize, false), 0u);
+    CHECK_EQ(Sender::PacedSendSize(-1ll, nextSize, false), 0u);
+    CHECK_EQ(Sender::PacedSendSize(0ll, nextSize, false), 0u);
+
+    // Pay back the debt half a packet at a time.
+    size_t numSteps = 0;
+    size_t sent = 0;
+    while (sent < nextSize) {
+        CHECK_LT(numSteps++, 1000u);
+
+        tokens += kPacketSize / 2;
+
+        size = Sender::PacedSendSize(tokens, nextSize - sent, false);
+        CHECK_LE(size, nextSize - sent);
+
+        if (size == 0) {
+            continue;
+        }
+
+        CHECK_LE((int64_t)size, tokens);
+        CHECK(size == nextSize - sent || (size % kPacketSize) == 0);
+
+        tokens -= size;
+        sent += size;
+    }
+
+    CHECK_GE(tokens, 0ll);
+
+    printf("pacing ok, %zu steps to pay back a %zu byte burst\n",
+           numSteps, burstSize);
+
+    return 0;
+}
+
 }  // namespace android
 
 static void usage(const char *me) {
     fprintf(stderr,
             "usage: %s -c host[:port]\tconnect to test server\n"
-            "           -l            \tcreate a test server\n",
+            "           -l            \tcreate a test server\n"
+            "           -b            \trun the loopback streaming benchmark\n"
+            "           -p            \tcheck the pacing arithmetic\n"
+            "\n"
+            "benchmark options:\n"
+            "           -t secs       \tduration (10)\n"
+            "           -r mbps       \tstream bitrate (10)\n"
+            "           -f cols[xrows]\tenable XOR FEC\n"
+            "           -g p,r[,bad[,good]]\n"
+            "                         \tGilbert-Elliott loss, transition "
+            "probabilities good->bad,\n"
+            "                         \tbad->good and loss per state in %%\n"
+            "           -R percent    \treordered packets\n"
+            "           -D percent    \tduplicated packets\n"
+            "           -j ms         \tmaximum jitter\n"
+            "           -w kbps       \tbandwidth cap\n"
+            "           -s seed       \trandom seed\n",
             me);
 }
 
+static double parsePercentage(const char *s) {
+    char *end;
+    double value = strtod(s, &end);
+
+    if (*end != '\0' || end == s || value < 0.0 || value > 100.0) {
+        fprintf(stderr, "Illegal percentage specified.\n");
+        exit(1);
+    }
+
+    return value / 100.0;
+}
+
+static long parseNonNegative(const char *s) {
+    char *end;
+    long value = strtol(s, &end, 10);
+
+    if (*end != '\0' || end == s || value < 0) {
+        fprintf(stderr, "Illegal value specified.\n");
+        exit(1);
+    }
+
+    return value;
+}
+
 int main(int argc, char **argv) {
     using namespace android;
 
@@ -268,8 +1016,12 @@ int main(int argc, char **argv) {
     int32_t connectToPort = -1;
     AString connectToHost;
 
+    bool runBench = false;
+    bool runPacing = false;
+    BenchmarkOptions benchOptions;
+
     int res;
-    while ((res = getopt(argc, argv, "hc:l:")) >= 0) {
+    while ((res = getopt(argc, argv, "hc:l:bpt:r:f:g:R:D:j:w:s:")) >= 0) {
         switch (res) {
             case 'c':
             {
@@ -306,6 +1058,106 @@ int main(int argc, char **argv) {
                 break;
             }
 
+            case 'b':
+            {
+                runBench = true;
+                break;
+            }
+
+            case 'p':
+            {
+                runPacing = true;
+                break;
+            }
+
+            case 't':
+            {
+                benchOptions.mDurationUs = parseNonNegative(optarg) * 1000000ll;
+                break;
+            }
+
+            case 'r':
+            {
+                char *end;
+                double mbps = strtod(optarg, &end);
+
+                if (*end != '\0' || end == optarg
+                        || mbps <= 0.0 || mbps > 1000.0) {
+                    fprintf(stderr, "Illegal bitrate specified.\n");
+                    exit(1);
+                }
+
+                benchOptions.mBitrate = mbps * 1E6;
+                break;
+            }
+
+            case 'f':
+            {
+                unsigned columns, rows = 1;
+                if (sscanf(optarg, "%ux%u", &columns, &rows) < 1
+                        || columns < 1 || columns > RTPSink::kMaxFECColumns
+                        || rows < 1 || rows > RTPSink::kMaxFECRows) {
+                    fprintf(stderr, "Illegal FEC matrix specified.\n");
+                    exit(1);
+                }
+
+                benchOptions.mFECColumns = columns;
+                benchOptions.mFECRows = rows;
+                break;
+            }
+
+            case 'g':
+            {
+                ImpairmentRelay::Config *config = &benchOptions.mImpairments;
+
+                double p, r, bad = 100.0, good = 0.0;
+                if (sscanf(optarg, "%lf,%lf,%lf,%lf", &p, &r, &bad, &good) < 2
+                        || p < 0.0 || p > 100.0 || r < 0.0 || r > 100.0
+                        || bad < 0.0 || bad > 100.0
+                        || good < 0.0 || good > 100.0) {
+                    fprintf(stderr, "Illegal loss model specified.\n");
+                    exit(1);
+                }
+
+                config->mGoodToBad = p / 100.0;
+                config->mBadToGood = r / 100.0;
+                config->mLossBad = bad / 100.0;
+                config->mLossGood = good / 100.0;
+                break;
+            }
+
+            case 'R':
+            {
+                benchOptions.mImpairments.mReorder = parsePercentage(optarg);
+                break;
+            }
+
+            case 'D':
+            {
+                benchOptions.mImpairments.mDuplicate = parsePercentage(optarg);
+                break;
+            }
+
+            case 'j':
+            {
+                benchOptions.mImpairments.mJitterUs =
+                    parseNonNegative(optarg) * 1000ll;
+                break;
+            }
+
+            case 'w':
+            {
+                benchOptions.mImpairments.mBandwidthKbps =
+                    parseNonNegative(optarg);
+                break;
+            }
+
+            case 's':
+            {
+                benchOptions.mImpairments.mSeed = parseNonNegative(optarg);
+                break;
+            }
+
             case '?':
             case 'h':
                 usage(argv[0]);
@@ -313,9 +1165,17 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (runBench) {
+        return runBenchmark(benchOptions);
+    }
+
+    if (runPacing) {
+        return runPacingCheck();
+    }
+
     if (localPort < 0 && connectToPort < 0) {
         fprintf(stderr,
-                "You need to select either client or server mode.\n");
+                "You need to select client, server or benchmark mode.\n");
         exit(1);
     }
 
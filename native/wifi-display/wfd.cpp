@@ -15,16 +15,20 @@
 #include <media/IRemoteDisplayClient.h>
 #include <media/stagefright/DataSource.h>
 #include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AMessage.h>
 
 namespace android {
 
 static void usage(const char *me) {
     fprintf(stderr,
             "usage:\n"
-            "           %s -c host[:port]\tconnect to wifi source\n"
+            "           %s -c host[:port]\tconnect to wifi source, may be "
+            "repeated to host a sink per source\n"
             "               -u uri        \tconnect to an rtsp uri\n"
             "               -l ip[:port] \tlisten on the specified port "
-            "(create a sink)\n",
+            "(create a sink)\n"
+            "               -d            \tdecode and render directly, "
+            "bypassing the mediaplayer\n",
             me);
 }
 
@@ -122,6 +126,39 @@ void RemoteDisplayClient::waitUntilDone() {
     }
 }
 
+// Stops the looper shared by all sinks once the last of them gave up.
+struct SinkMonitor : public AHandler {
+    SinkMonitor(size_t numSinks)
+        : mNumSinksLeft(numSinks) {
+    }
+
+protected:
+    virtual ~SinkMonitor() {}
+
+    virtual void onMessageReceived(const sp<AMessage> &msg) {
+        int32_t what;
+        CHECK(msg->findInt32("what", &what));
+        CHECK_EQ(what, (int32_t)WifiDisplaySink::kWhatTerminated);
+
+        int32_t err;
+        CHECK(msg->findInt32("err", &err));
+
+        CHECK_GT(mNumSinksLeft, 0u);
+        --mNumSinksLeft;
+
+        ALOGI("sink terminated (err %d), %d left", err, mNumSinksLeft);
+
+        if (mNumSinksLeft == 0) {
+            looper()->stop();
+        }
+    }
+
+private:
+    size_t mNumSinksLeft;
+
+    DISALLOW_EVIL_CONSTRUCTORS(SinkMonitor);
+};
+
 static status_t enableAudioSubmix(bool enable) {
     status_t err = AudioSystem::setDeviceConnectionState(
             AUDIO_DEVICE_IN_REMOTE_SUBMIX,
@@ -181,17 +218,19 @@ int main(int argc, char **argv) {
 	//基类DataSource提供了一些分离器
     DataSource::RegisterDefaultSniffers();
 
-    AString connectToHost;
-    int32_t connectToPort = -1;
+    Vector<AString> connectToHosts;
+    Vector<int32_t> connectToPorts;
     AString uri;
 
     AString listenOnAddr;
     int32_t listenOnPort = -1;
 
+    uint32_t sinkFlags = 0;
+
     int res;
 
 	//解析参数
-    while ((res = getopt(argc, argv, "hc:l:u:")) >= 0) {
+    while ((res = getopt(argc, argv, "hc:l:u:d")) >= 0) {
         switch (res) {
     	
 		//建立连接，设置默认端口        
@@ -200,6 +239,9 @@ int main(int argc, char **argv) {
 
                 const char *colonPos = strrchr(optarg, ':');
 
+                AString connectToHost;
+                int32_t connectToPort;
+
                 if (colonPos == NULL) {
                     connectToHost = optarg;
                     connectToPort = WifiDisplaySource::kWifiDisplayDefaultPort;   //kWifiDisplayDefaultPort = 7236;
@@ -215,6 +257,9 @@ int main(int argc, char **argv) {
                         exit(1);
                     }
                 }
+
+                connectToHosts.push(connectToHost);
+                connectToPorts.push(connectToPort);
                 break;
             }
 
@@ -224,6 +269,12 @@ int main(int argc, char **argv) {
                 break;
             }
 
+            case 'd':
+            {
+                sinkFlags |= WifiDisplaySink::FLAG_DIRECT_RENDERING;
+                break;
+            }
+
             case 'l':
             {
                 const char *colonPos = strrchr(optarg, ':');
@@ -254,7 +305,7 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (connectToPort >= 0 && listenOnPort >= 0) {
+    if (!connectToHosts.isEmpty() && listenOnPort >= 0) {
         fprintf(stderr,
                 "You can connect to a source or create one, "
                 "but not both at the same time.\n");
@@ -266,14 +317,14 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
-    if (connectToPort < 0 && uri.empty()) {
+    if (connectToHosts.isEmpty() && uri.empty()) {
         fprintf(stderr,
                 "You need to select either source host or uri.\n");
 
         exit(1);
     }
 
-    if (connectToPort >= 0 && !uri.empty()) {
+    if (!connectToHosts.isEmpty() && !uri.empty()) {
         fprintf(stderr,
                 "You need to either connect to a wfd host or an rtsp url, "
                 "not both.\n");
@@ -286,13 +337,34 @@ int main(int argc, char **argv) {
 	//strong pointer，而wp则是weak pointer的意思
     sp<ALooper> looper = new ALooper;
 
-    sp<WifiDisplaySink> sink = new WifiDisplaySink(session);
-    looper->registerHandler(sink);
+    // All sinks share the RTSP session and looper, their media paths are
+    // spread across the threads of the SinkThreadPool.
+    Vector<sp<WifiDisplaySink> > sinks;
+
+    sp<SinkMonitor> monitor = new SinkMonitor(
+            connectToHosts.isEmpty() ? 1 : connectToHosts.size());
+    looper->registerHandler(monitor);
+
+    if (connectToHosts.isEmpty()) {
+        sp<WifiDisplaySink> sink =
+            new WifiDisplaySink(
+                    session, NULL /* surfaceTex */, sinkFlags,
+                    new AMessage(0, monitor->id()));
+        looper->registerHandler(sink);
 
-    if (connectToPort >= 0) {
-        sink->start(connectToHost.c_str(), connectToPort);
-    } else {
         sink->start(uri.c_str());
+        sinks.push(sink);
+    }
+
+    for (size_t i = 0; i < connectToHosts.size(); ++i) {
+        sp<WifiDisplaySink> sink =
+            new WifiDisplaySink(
+                    session, NULL /* surfaceTex */, sinkFlags,
+                    new AMessage(0, monitor->id()));
+        looper->registerHandler(sink);
+
+        sink->start(connectToHosts.itemAt(i).c_str(), connectToPorts.itemAt(i));
+        sinks.push(sink);
     }
 
     looper->start(true /* runOnCallingThread */);
@@ -0,0 +1,333 @@
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "wfdreplay"
+#include <utils/Log.h>
+
+#include "ANetworkSession.h"
+#include "Metrics.h"
+#include "sink/RTPCapture.h"
+#include "sink/RTPSink.h"
+
+#include <binder/ProcessState.h>
+#include <media/stagefright/foundation/ABuffer.h>
+#include <media/stagefright/foundation/ADebug.h>
+#include <media/stagefright/foundation/AHandler.h>
+#include <media/stagefright/foundation/ALooper.h>
+#include <media/stagefright/foundation/AMessage.h>
+
+#include <sys/resource.h>
+
+namespace android {
+
+// Feeds the packets of a capture file into an RTPSink, either paced by
+// their original arrival times or as fast as the sink takes them. Must
+// run on the sink's looper, injected packets are then processed in the
+// order they're handed over and before we get to inject the next batch.
+struct CaptureReplayer : public AHandler {
+    CaptureReplayer(
+            const sp<RTPCaptureReader> &reader,
+            const sp<RTPSink> &sink,
+            bool realTime);
+
+    void start();
+
+    // Blocks until all packets were processed by the sink.
+    void waitForCompletion();
+
+    size_t numPacketsInjected() const { return mNumPacketsInjected; }
+    size_t numBytesInjected() const { return mNumBytesInjected; }
+
+protected:
+    virtual ~CaptureReplayer();
+
+    virtual void onMessageReceived(const sp<AMessage> &msg);
+
+private:
+    enum {
+        kWhatStart,
+        kWhatFeed,
+        kWhatFinish,
+    };
+
+    static const size_t kMaxBatchSize = 64;
+
+    sp<RTPCaptureReader> mReader;
+    sp<RTPSink> mSink;
+    bool mRealTime;
+
+    // Arrival times are shifted by this much, so that they appear to be
+    // happening now.
+    int64_t mTimeOffsetUs;
+
+    bool mHavePending;
+    RTPCaptureReader::Packet mPending;
+
+    size_t mNumPacketsInjected;
+    size_t mNumBytesInjected;
+
+    Mutex mLock;
+    Condition mCondition;
+    bool mDone;
+
+    void inject(const RTPCaptureReader::Packet &packet);
+    void onFeed();
+
+    DISALLOW_EVIL_CONSTRUCTORS(CaptureReplayer);
+};
+
+CaptureReplayer::CaptureReplayer(
+        const sp<RTPCaptureReader> &reader,
+        const sp<RTPSink> &sink,
+        bool realTime)
+    : mReader(reader),
+      mSink(sink),
+      mRealTime(realTime),
+      mTimeOffsetUs(0ll),
+      mHavePending(false),
+      mNumPacketsInjected(0),
+      mNumBytesInjected(0),
+      mDone(false) {
+}
+
+CaptureReplayer::~CaptureReplayer() {
+}
+
+void CaptureReplayer::start() {
+    (new AMessage(kWhatStart, id()))->post();
+}
+
+void CaptureReplayer::waitForCompletion() {
+    Mutex::Autolock autoLock(mLock);
+    while (!mDone) {
+        mCondition.wait(mLock);
+    }
+}
+
+void CaptureReplayer::onMessageReceived(const sp<AMessage> &msg) {
+    switch (msg->what()) {
+        case kWhatStart:
+        {
+            mTimeOffsetUs =
+                ALooper::GetNowUs() - mReader->firstArrivalTimeUs();
+
+            onFeed();
+            break;
+        }
+
+        case kWhatFeed:
+        {
+            onFeed();
+            break;
+        }
+
+        case kWhatFinish:
+        {
+            Mutex::Autolock autoLock(mLock);
+            mDone = true;
+            mCondition.broadcast();
+            break;
+        }
+
+        default:
+            TRESPASS();
+    }
+}
+
+void CaptureReplayer::inject(const RTPCaptureReader::Packet &packet) {
+    // The data stays in the mapping, which outlives the sink.
+    sp<ABuffer> buffer = new ABuffer(packet.mData, packet.mSize);
+
+    buffer->meta()->setInt64(
+            "arrivalTimeUs", packet.mArrivalTimeUs + mTimeOffsetUs);
+
+    mSink->injectPacket(packet.mIsRTP, buffer);
+
+    ++mNumPacketsInjected;
+    mNumBytesInjected += packet.mSize;
+}
+
+void CaptureReplayer::onFeed() {
+    int64_t nowUs = ALooper::GetNowUs();
+
+    for (size_t i = 0; i < kMaxBatchSize; ++i) {
+        if (!mHavePending) {
+            if (!mReader->next(&mPending)) {
+                // Queued behind the packets injected so far.
+                (new AMessage(kWhatFinish, id()))->post();
+                return;
+            }
+            mHavePending = true;
+        }
+
+        if (mRealTime) {
+            int64_t dueUs = mPending.mArrivalTimeUs + mTimeOffsetUs;
+
+            if (dueUs > nowUs) {
+                (new AMessage(kWhatFeed, id()))->post(dueUs - nowUs);
+                return;
+            }
+        }
+
+        inject(mPending);
+        mHavePending = false;
+    }
+
+    (new AMessage(kWhatFeed, id()))->post();
+}
+
+static int64_t CPUTimeUs(const struct rusage &usage) {
+    return usage.ru_utime.tv_sec * 1000000ll + usage.ru_utime.tv_usec
+        + usage.ru_stime.tv_sec * 1000000ll + usage.ru_stime.tv_usec;
+}
+
+}  // namespace android
+
+static void usage(const char *me) {
+    fprintf(stderr,
+            "usage: %s [-a] [-r] [-f cols[xrows]] [-s secs] capture-file\n"
+            "           -a            \treplay as fast as possible instead "
+            "of in real time\n"
+            "           -r            \trender the stream instead of "
+            "discarding it\n"
+            "           -f cols[xrows]\tthe stream is protected by XOR FEC\n"
+            "           -s secs       \tskip this far into the capture\n",
+            me);
+}
+
+int main(int argc, char **argv) {
+    using namespace android;
+
+    ProcessState::self()->startThreadPool();
+
+    bool realTime = true;
+    uint32_t flags = RTPSink::FLAG_DISCARD_OUTPUT;
+    size_t fecColumns = 0;
+    size_t fecRows = 0;
+    int64_t skipUs = 0ll;
+
+    int res;
+    while ((res = getopt(argc, argv, "harf:s:")) >= 0) {
+        switch (res) {
+            case 'a':
+            {
+                realTime = false;
+                break;
+            }
+
+            case 'r':
+            {
+                flags = RTPSink::FLAG_DIRECT_RENDERING;
+                break;
+            }
+
+            case 'f':
+            {
+                unsigned columns, rows = 1;
+                if (sscanf(optarg, "%ux%u", &columns, &rows) < 1
+                        || columns < 1 || columns > RTPSink::kMaxFECColumns
+                        || rows < 1 || rows > RTPSink::kMaxFECRows) {
+                    fprintf(stderr, "Illegal FEC matrix specified.\n");
+                    exit(1);
+                }
+
+                fecColumns = columns;
+                fecRows = rows;
+                break;
+            }
+
+            case 's':
+            {
+                char *end;
+                long secs = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || end == optarg || secs < 0) {
+                    fprintf(stderr, "Illegal offset specified.\n");
+                    exit(1);
+                }
+
+                skipUs = secs * 1000000ll;
+                break;
+            }
+
+            case '?':
+            case 'h':
+                usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    sp<RTPCaptureReader> reader = new RTPCaptureReader;
+    if (reader->open(argv[optind]) != OK) {
+        fprintf(stderr, "Unable to read capture file '%s'.\n", argv[optind]);
+        exit(1);
+    }
+
+    printf("%d packets, %.2f secs\n",
+           reader->numPackets(),
+           (reader->lastArrivalTimeUs() - reader->firstArrivalTimeUs())
+                / 1E6);
+
+    if (skipUs > 0ll) {
+        reader->seekTo(reader->firstArrivalTimeUs() + skipUs);
+    }
+
+    // Without sockets of its own the sink never uses the network session,
+    // it's just required by the constructor.
+    sp<ANetworkSession> netSession = new ANetworkSession;
+
+    sp<ALooper> looper = new ALooper;
+    looper->setName("wfdreplay");
+    looper->start(
+            false /* runOnCallingThread */,
+            false /* canCallJava */,
+            PRIORITY_AUDIO);
+
+    sp<RTPSink> sink = new RTPSink(netSession, NULL, flags);
+    looper->registerHandler(sink);
+
+    if (fecColumns > 0) {
+        sink->enableFEC(fecColumns, fecRows);
+    }
+
+    CHECK_EQ(sink->init(true /* useTCPInterleaving */), (status_t)OK);
+
+    sp<CaptureReplayer> replayer = new CaptureReplayer(reader, sink, realTime);
+    looper->registerHandler(replayer);
+
+    struct rusage startUsage;
+    getrusage(RUSAGE_SELF, &startUsage);
+    int64_t startUs = ALooper::GetNowUs();
+
+    replayer->start();
+    replayer->waitForCompletion();
+
+    struct rusage endUsage;
+    getrusage(RUSAGE_SELF, &endUsage);
+    double durationSecs = (ALooper::GetNowUs() - startUs) / 1E6;
+
+    size_t numPackets = replayer->numPacketsInjected();
+    int64_t cpuUs = CPUTimeUs(endUsage) - CPUTimeUs(startUsage);
+
+    printf("replayed %d packets (%.2f MB) in %.2f secs, "
+           "%.0f packets/sec, %.2f us cpu per packet\n",
+           numPackets,
+           replayer->numBytesInjected() / 1E6,
+           durationSecs,
+           numPackets / durationSecs,
+           numPackets > 0 ? (double)cpuUs / numPackets : 0.0);
+
+    AString metrics;
+    MetricsRegistry::Get()->snapshot(&metrics);
+    printf("%s", metrics.c_str());
+
+    looper->unregisterHandler(replayer->id());
+    looper->unregisterHandler(sink->id());
+    looper->stop();
+
+    return 0;
+}